@@ -1,11 +1,37 @@
 // swift-tools-version: 5.9
 import PackageDescription
 
+// FreeRDP headers for the shim and for the tools that test its internals
+let freerdpCSettings: [CSetting] = [
+    .define("WINPR_ENABLE_OPENSSL"),
+    // Fallback include paths for Homebrew (pkg-config preferred)
+    .unsafeFlags([
+        "-I/opt/homebrew/include/freerdp3",
+        "-I/opt/homebrew/include/winpr3",
+        "-I/usr/local/include/freerdp3",
+        "-I/usr/local/include/winpr3",
+        "-I/opt/homebrew/include",
+        "-I/usr/local/include"
+    ])
+]
+
+// Tools that exercise the shim's internals include its private header
+let internalCSettings: [CSetting] = freerdpCSettings + [.headerSearchPath("../../Sources/CRDP")]
+
 let package = Package(
     name: "mac-rdp",
     platforms: [.macOS(.v14)],
     products: [
-        .executable(name: "MacRDP", targets: ["MacRDP"])
+        .executable(name: "MacRDP", targets: ["MacRDP"]),
+        .executable(name: "crdp-netem", targets: ["crdp-netem"]),
+        .executable(name: "crdp-replay", targets: ["crdp-replay"]),
+        .executable(name: "crdp-play", targets: ["crdp-play"]),
+        .executable(name: "crdp-utf-check", targets: ["crdp-utf-check"]),
+        .executable(name: "crdp-drive-bench", targets: ["crdp-drive-bench"]),
+        .executable(name: "crdp-clipfile-check", targets: ["crdp-clipfile-check"]),
+        .executable(name: "crdp-mic-bench", targets: ["crdp-mic-bench"]),
+        .executable(name: "crdp-udp-check", targets: ["crdp-udp-check"]),
+        .executable(name: "crdp-stats-bench", targets: ["crdp-stats-bench"])
     ],
     targets: [
         // System library target to pull headers/libs from Homebrew's freerdp via pkg-config
@@ -22,18 +48,7 @@ let package = Package(
             dependencies: ["CFREERDP"],
             path: "Sources/CRDP",
             publicHeadersPath: "include",
-            cSettings: [
-                .define("WINPR_ENABLE_OPENSSL"),
-                // Fallback include paths for Homebrew (pkg-config preferred)
-                .unsafeFlags([
-                    "-I/opt/homebrew/include/freerdp3",
-                    "-I/opt/homebrew/include/winpr3",
-                    "-I/usr/local/include/freerdp3",
-                    "-I/usr/local/include/winpr3",
-                    "-I/opt/homebrew/include",
-                    "-I/usr/local/include"
-                ])
-            ],
+            cSettings: freerdpCSettings,
             linkerSettings: [
                 .unsafeFlags([
                     "-L/opt/homebrew/lib",
@@ -44,7 +59,10 @@ let package = Package(
                 .linkedLibrary("freerdp-client3"),
                 .linkedLibrary("freerdp3"),
                 .linkedLibrary("winpr3"),
-                .linkedFramework("AppKit")
+                .linkedLibrary("z"),
+                .linkedFramework("AppKit"),
+                .linkedFramework("CoreServices"),
+                .linkedFramework("AudioToolbox")
             ]
         ),
         // SwiftUI executable that consumes the shim
@@ -52,6 +70,65 @@ let package = Package(
             name: "MacRDP",
             dependencies: ["CRDP"],
             path: "Sources/MacRDP"
+        ),
+        // Network impairment proxy for performance tests; plain POSIX C
+        .executableTarget(
+            name: "crdp-netem",
+            path: "Tools/crdp-netem"
+        ),
+        // Plays protocol traces through the shim, for profiling decoding
+        .executableTarget(
+            name: "crdp-replay",
+            dependencies: ["CRDP"],
+            path: "Tools/crdp-replay"
+        ),
+        // Inspects session recordings and converts them to video
+        .executableTarget(
+            name: "crdp-play",
+            dependencies: ["CRDP"],
+            path: "Tools/crdp-play"
+        ),
+        // Checks the UTF-8/UTF-16LE transcoder and measures its throughput
+        .executableTarget(
+            name: "crdp-utf-check",
+            dependencies: ["CRDP", "CFREERDP"],
+            path: "Tools/crdp-utf-check",
+            cSettings: internalCSettings
+        ),
+        // Measures the drive redirection device with no server
+        .executableTarget(
+            name: "crdp-drive-bench",
+            dependencies: ["CRDP", "CFREERDP"],
+            path: "Tools/crdp-drive-bench",
+            cSettings: internalCSettings
+        ),
+        // Checks clipboard file downloads against a synthetic server
+        .executableTarget(
+            name: "crdp-clipfile-check",
+            dependencies: ["CRDP", "CFREERDP"],
+            path: "Tools/crdp-clipfile-check",
+            cSettings: internalCSettings
+        ),
+        // Measures the microphone pipeline's latency from a WAV file
+        .executableTarget(
+            name: "crdp-mic-bench",
+            dependencies: ["CRDP", "CFREERDP"],
+            path: "Tools/crdp-mic-bench",
+            cSettings: internalCSettings
+        ),
+        // Checks the RDP-UDP reachability probe against loopback responders
+        .executableTarget(
+            name: "crdp-udp-check",
+            dependencies: ["CRDP", "CFREERDP"],
+            path: "Tools/crdp-udp-check",
+            cSettings: internalCSettings
+        ),
+        // Measures crdp_get_stats snapshots while threads update the registry
+        .executableTarget(
+            name: "crdp-stats-bench",
+            dependencies: ["CRDP", "CFREERDP"],
+            path: "Tools/crdp-stats-bench",
+            cSettings: internalCSettings
         )
     ]
 )
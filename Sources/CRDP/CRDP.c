@@ -1,4 +1,4 @@
-#include "CRDP.h"
+#include "crdp_internal.h"
 
 #include <freerdp/addin.h>
 #include <freerdp/client/channels.h>
@@ -10,52 +10,23 @@
 #include <freerdp/locale/keyboard.h>
 #include <freerdp/channels/channels.h>
 #include <winpr/clipboard.h>
+#include <winpr/synch.h>
 #include <winpr/thread.h>
 #include <winpr/wlog.h>
 
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
-#include <sys/time.h>
-
-// External functions from clipboard_mac.m
-extern char* crdp_clipboard_get_text(void);
-extern int crdp_clipboard_set_text(const char* text);
-extern void crdp_clipboard_start_monitor(void (*callback)(void* ctx), void* ctx);
-extern void crdp_clipboard_stop_monitor(void);
-
-static const char* CRDP_TAG = "CRDP";
-
-typedef struct {
-    rdpContext _p;
-    struct crdp_client* client;
-    pBeginPaint prev_begin_paint;
-    pEndPaint prev_end_paint;
-    CliprdrClientContext* cliprdr;
-    wClipboard* clipboard;
-    UINT32 clipboardCapabilities;
-    BOOL clipboardSync;
-} crdp_context;
-
-struct crdp_client {
-    freerdp* instance;
-    crdp_config_t config;
-    crdp_frame_cb frame_cb;
-    void* frame_user;
-    crdp_disconnected_cb disconnect_cb;
-    void* disconnect_user;
-    crdp_verify_cert_cb cert_cb;
-    void* cert_user;
-    pthread_t thread;
-    bool stop;
-    bool connected;
-    // Frame timing for RTT estimation
-    uint64_t last_frame_time;
-    uint64_t frame_interval_sum;
-    uint32_t frame_count;
-    int32_t last_rtt_ms;  // Cache last known RTT
-};
+#include <time.h>
+
+const char* CRDP_TAG = "CRDP";
+
+// Frame delivery rates for the non-foreground priorities
+#define CRDP_BACKGROUND_FRAME_INTERVAL_MS 250
+#define CRDP_THUMBNAIL_FRAME_INTERVAL_MS 3000
+#define CRDP_THUMBNAIL_WIDTH 256
+// Upper bound on how long the protocol thread sleeps between event checks
+#define CRDP_EVENT_LOOP_TIMEOUT_MS 100
 
 static void crdp_free_config(crdp_config_t* cfg) {
     if (!cfg) return;
@@ -65,67 +36,229 @@ static void crdp_free_config(crdp_config_t* cfg) {
     free((void*)cfg->domain);
     free((void*)cfg->drive_path);
     free((void*)cfg->drive_name);
+    free((void*)cfg->audio_wav_path);
+    free((void*)cfg->mic_file_path);
+    free((void*)cfg->trace_path);
+    free((void*)cfg->replay_path);
+    free((void*)cfg->record_path);
     memset(cfg, 0, sizeof(crdp_config_t));
 }
 
-// Helper to validate drive path exists and is a directory
-static bool crdp_validate_drive_path(const char* path) {
-    if (!path || path[0] == '\0') return false;
-    struct stat st;
-    if (stat(path, &st) != 0) return false;
-    return S_ISDIR(st.st_mode);
-}
-
 static BOOL crdp_begin_paint(rdpContext* context) {
     crdp_context* ctx = (crdp_context*)context;
     BOOL ok = TRUE;
+    // Released in crdp_end_paint; FreeRDP only calls EndPaint if this succeeds
+    if (ctx->client) pthread_mutex_lock(&ctx->client->paint_lock);
     if (ctx->prev_begin_paint) {
         ok = ctx->prev_begin_paint(context);
     }
+    if (!ok) {
+        if (ctx->client) pthread_mutex_unlock(&ctx->client->paint_lock);
+        return ok;
+    }
+
+    // Start a fresh invalid region for this paint; crdp_end_paint reads it back
+    rdpGdi* gdi = context->gdi;
+    if (gdi && gdi->primary && gdi->primary->hdc && gdi->primary->hdc->hwnd) {
+        HGDI_WND hwnd = gdi->primary->hdc->hwnd;
+        if (hwnd->invalid) hwnd->invalid->null = TRUE;
+        hwnd->ninvalid = 0;
+    }
     return ok;
 }
 
-static uint64_t get_time_ms(void) {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return (uint64_t)tv.tv_sec * 1000 + (uint64_t)tv.tv_usec / 1000;
+uint64_t crdp_time_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+uint64_t crdp_time_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void crdp_damage_add(crdp_damage_t* damage, int32_t x, int32_t y, int32_t w, int32_t h) {
+    if (w <= 0 || h <= 0) return;
+    if (!damage->valid) {
+        damage->left = x;
+        damage->top = y;
+        damage->right = x + w;
+        damage->bottom = y + h;
+        damage->valid = true;
+        return;
+    }
+    if (x < damage->left) damage->left = x;
+    if (y < damage->top) damage->top = y;
+    if (x + w > damage->right) damage->right = x + w;
+    if (y + h > damage->bottom) damage->bottom = y + h;
+}
+
+// Fold the GDI invalid region of the current paint into the pending damage
+static void crdp_collect_damage(crdp_client_t* client, rdpGdi* gdi) {
+    HGDI_WND hwnd = (gdi->primary && gdi->primary->hdc) ? gdi->primary->hdc->hwnd : NULL;
+    if (!hwnd || !hwnd->invalid) {
+        // No region tracking available, assume everything changed
+        crdp_damage_add(&client->pending, 0, 0, (int32_t)gdi->width, (int32_t)gdi->height);
+        crdp_thumbnail_mark(client, 0, 0, (int32_t)gdi->width, (int32_t)gdi->height);
+        crdp_record_mark(client, 0, 0, (int32_t)gdi->width, (int32_t)gdi->height);
+        return;
+    }
+
+    if (hwnd->ninvalid > 0 && hwnd->cinvalid) {
+        for (INT32 i = 0; i < hwnd->ninvalid; i++) {
+            const GDI_RGN* rgn = &hwnd->cinvalid[i];
+            crdp_damage_add(&client->pending, rgn->x, rgn->y, rgn->w, rgn->h);
+            crdp_thumbnail_mark(client, rgn->x, rgn->y, rgn->w, rgn->h);
+            crdp_record_mark(client, rgn->x, rgn->y, rgn->w, rgn->h);
+        }
+    } else if (!hwnd->invalid->null) {
+        crdp_damage_add(&client->pending, hwnd->invalid->x, hwnd->invalid->y,
+                        hwnd->invalid->w, hwnd->invalid->h);
+        crdp_thumbnail_mark(client, hwnd->invalid->x, hwnd->invalid->y,
+                            hwnd->invalid->w, hwnd->invalid->h);
+        crdp_record_mark(client, hwnd->invalid->x, hwnd->invalid->y, hwnd->invalid->w, hwnd->invalid->h);
+    }
+}
+
+static uint64_t crdp_frame_interval_ms(crdp_client_t* client) {
+    switch (atomic_load(&client->priority)) {
+        case CRDP_PRIORITY_BACKGROUND: return CRDP_BACKGROUND_FRAME_INTERVAL_MS;
+        case CRDP_PRIORITY_THUMBNAIL: return CRDP_THUMBNAIL_FRAME_INTERVAL_MS;
+        default: return atomic_load(&client->frame_cap_ms);
+    }
+}
+
+// Hand the framebuffer (or a downscaled copy of it) to the host
+static void crdp_deliver_frame(crdp_client_t* client, rdpGdi* gdi, uint64_t now) {
+    int priority = atomic_load(&client->priority);
+    client->pending.valid = false;
+    client->last_delivery = now;
+    if (client->config.max_frames_in_flight > 0) atomic_fetch_add(&client->frames_in_flight, 1);
+    crdp_metrics_frame_delivered(client);
+
+    if (priority == CRDP_PRIORITY_THUMBNAIL && gdi->width > CRDP_THUMBNAIL_WIDTH) {
+        uint32_t tw = CRDP_THUMBNAIL_WIDTH;
+        uint32_t th = (uint32_t)((uint64_t)gdi->height * tw / (uint32_t)gdi->width);
+        if (th == 0) th = 1;
+        size_t needed = (size_t)tw * th * 4;
+        if (client->thumb_buf_size < needed) {
+            uint8_t* buf = realloc(client->thumb_buf, needed);
+            if (!buf) return;
+            client->thumb_buf = buf;
+            client->thumb_buf_size = needed;
+        }
+        crdp_downscale_bgra(gdi->primary_buffer, (uint32_t)gdi->width, (uint32_t)gdi->height, gdi->stride,
+                            client->thumb_buf, tw, th, tw * 4);
+        uint64_t span = crdp_span_begin();
+        client->frame_cb(client->thumb_buf, tw, th, tw * 4, client->frame_user);
+        crdp_span_end(span, "deliver frame", "width", tw);
+        return;
+    }
+
+    uint64_t span = crdp_span_begin();
+    client->frame_cb(gdi->primary_buffer,
+                     (UINT32)gdi->width,
+                     (UINT32)gdi->height,
+                     gdi->stride,
+                     client->frame_user);
+    crdp_span_end(span, "deliver frame", "width", gdi->width);
 }
 
 static BOOL crdp_end_paint(rdpContext* context) {
     crdp_context* ctx = (crdp_context*)context;
     rdpGdi* gdi = context->gdi;
     BOOL ok = TRUE;
+    uint64_t span = crdp_span_begin();
     if (ctx->prev_end_paint) {
         ok = ctx->prev_end_paint(context);
     }
 
-    if (gdi && ctx->client && ctx->client->frame_cb) {
+    crdp_client_t* client = ctx->client;
+    if (gdi && client && client->frame_cb) {
         // Track frame timing for latency estimation
-        uint64_t now = get_time_ms();
-        if (ctx->client->last_frame_time > 0) {
-            uint64_t interval = now - ctx->client->last_frame_time;
+        uint64_t now_us = crdp_time_us();
+        uint64_t now = now_us / 1000;
+        crdp_metrics_add(client, CRDP_COUNTER_FRAMES_PAINTED, 1);
+        if (client->last_frame_time > 0) {
+            uint64_t interval = now_us - client->last_frame_time;
             // Only count intervals under 1 second (ignore idle periods)
-            if (interval < 1000) {
-                ctx->client->frame_interval_sum += interval;
-                ctx->client->frame_count++;
-            }
+            if (interval < 1000000) crdp_metrics_record(client, CRDP_HIST_FRAME_INTERVAL_US, interval);
+        }
+        client->last_frame_time = now_us;
+
+        crdp_collect_damage(client, gdi);
+
+        // Background/thumbnail sessions coalesce damage until their next slot;
+        // crdp_flush_pending_frame delivers it if no further paint arrives
+        uint64_t interval = crdp_frame_interval_ms(client);
+        if (client->pending.valid && now - client->last_delivery >= interval) {
+            crdp_deliver_frame(client, gdi, now);
         }
-        ctx->client->last_frame_time = now;
-        
-        ctx->client->frame_cb(gdi->primary_buffer,
-                              (UINT32)gdi->width,
-                              (UINT32)gdi->height,
-                              gdi->stride,
-                              ctx->client->frame_user);
     }
 
+    if (client) pthread_mutex_unlock(&client->paint_lock);
+    crdp_span_end(span, "EndPaint", NULL, 0);
     return ok;
 }
 
+// Called from the protocol thread between event checks. GFX output is painted
+// from the dynamic channel thread, hence the paint lock.
+static void crdp_flush_pending_frame(crdp_client_t* client) {
+    rdpContext* context = client->instance ? client->instance->context : NULL;
+    rdpGdi* gdi = context ? context->gdi : NULL;
+    if (!gdi || !client->frame_cb) return;
+
+    pthread_mutex_lock(&client->paint_lock);
+    if (gdi->primary_buffer) {
+        // A priority change asks for a complete frame at the new size/rate
+        if (atomic_exchange(&client->repaint, false)) {
+            crdp_damage_add(&client->pending, 0, 0, (int32_t)gdi->width, (int32_t)gdi->height);
+        }
+        uint64_t now = crdp_time_ms();
+        if (client->pending.valid &&
+            now - client->last_delivery >= crdp_frame_interval_ms(client)) {
+            crdp_deliver_frame(client, gdi, now);
+        }
+    }
+    pthread_mutex_unlock(&client->paint_lock);
+
+    // Frames held back by coalescing or a busy host may be acknowledged now
+    crdp_gfx_ack_frames(client);
+}
+
+// How long the protocol thread may sleep before pending damage is due
+static DWORD crdp_event_timeout_ms(crdp_client_t* client) {
+    // A replay has no socket to wake the loop when the next PDU is due
+    DWORD limit = CRDP_EVENT_LOOP_TIMEOUT_MS;
+    if (client->replay) {
+        DWORD next = crdp_replay_timeout_ms(client);
+        if (next < limit) limit = next;
+    }
+    pthread_mutex_lock(&client->paint_lock);
+    bool pending = client->pending.valid;
+    uint64_t last = client->last_delivery;
+    pthread_mutex_unlock(&client->paint_lock);
+    if (!pending) return limit;
+    uint64_t due = last + crdp_frame_interval_ms(client);
+    uint64_t now = crdp_time_ms();
+    if (due <= now) return 0;
+    return due - now < limit ? (DWORD)(due - now) : limit;
+}
+
 static BOOL crdp_desktop_resize(rdpContext* context) {
+    crdp_context* ctx = (crdp_context*)context;
     rdpSettings* settings = context->settings;
     if (!context->gdi || !settings) return FALSE;
-    return gdi_resize(context->gdi, settings->DesktopWidth, settings->DesktopHeight);
+    if (ctx->client) pthread_mutex_lock(&ctx->client->paint_lock);
+    BOOL ok = gdi_resize(context->gdi, settings->DesktopWidth, settings->DesktopHeight);
+    if (ctx->client) pthread_mutex_unlock(&ctx->client->paint_lock);
+    if (ok && ctx->client) {
+        crdp_metrics_set(ctx->client, CRDP_GAUGE_DESKTOP_WIDTH, context->gdi->width);
+        crdp_metrics_set(ctx->client, CRDP_GAUGE_DESKTOP_HEIGHT, context->gdi->height);
+    }
+    return ok;
 }
 
 static BOOL crdp_authenticate(freerdp* instance, char** username, char** password, char** domain) {
@@ -202,247 +335,6 @@ static DWORD crdp_verify_changed_certificate_ex(freerdp* instance,
     return (DWORD)result;
 }
 
-// Clipboard callbacks
-static UINT crdp_cliprdr_send_client_format_list(CliprdrClientContext* cliprdr) {
-    crdp_context* ctx = (crdp_context*)cliprdr->custom;
-    if (!ctx) return ERROR_INTERNAL_ERROR;
-    
-    // Always advertise text formats
-    CLIPRDR_FORMAT formats[2] = { 0 };
-    formats[0].formatId = 13; // CF_UNICODETEXT
-    formats[0].formatName = NULL;
-    formats[1].formatId = 1;  // CF_TEXT
-    formats[1].formatName = NULL;
-    
-    CLIPRDR_FORMAT_LIST formatList = { 0 };
-    formatList.common.msgFlags = 0;
-    formatList.numFormats = 2;
-    formatList.formats = formats;
-    
-    return cliprdr->ClientFormatList(cliprdr, &formatList);
-}
-
-static UINT crdp_cliprdr_send_client_format_list_response(CliprdrClientContext* cliprdr, BOOL status) {
-    CLIPRDR_FORMAT_LIST_RESPONSE response = { 0 };
-    response.common.msgFlags = status ? CB_RESPONSE_OK : CB_RESPONSE_FAIL;
-    return cliprdr->ClientFormatListResponse(cliprdr, &response);
-}
-
-static UINT crdp_cliprdr_send_client_capabilities(CliprdrClientContext* cliprdr) {
-    CLIPRDR_CAPABILITIES capabilities = { 0 };
-    CLIPRDR_GENERAL_CAPABILITY_SET generalCaps = { 0 };
-    
-    capabilities.cCapabilitiesSets = 1;
-    capabilities.capabilitySets = (CLIPRDR_CAPABILITY_SET*)&generalCaps;
-    
-    generalCaps.capabilitySetType = CB_CAPSTYPE_GENERAL;
-    generalCaps.capabilitySetLength = 12;
-    generalCaps.version = CB_CAPS_VERSION_2;
-    generalCaps.generalFlags = CB_USE_LONG_FORMAT_NAMES;
-    
-    return cliprdr->ClientCapabilities(cliprdr, &capabilities);
-}
-
-static UINT crdp_cliprdr_monitor_ready(CliprdrClientContext* cliprdr, const CLIPRDR_MONITOR_READY* ready) {
-    crdp_context* ctx = (crdp_context*)cliprdr->custom;
-    WLog_INFO(CRDP_TAG, "Clipboard monitor ready");
-    ctx->clipboardSync = TRUE;
-    crdp_cliprdr_send_client_capabilities(cliprdr);
-    return crdp_cliprdr_send_client_format_list(cliprdr);
-}
-
-static UINT crdp_cliprdr_server_capabilities(CliprdrClientContext* cliprdr, const CLIPRDR_CAPABILITIES* caps) {
-    crdp_context* ctx = (crdp_context*)cliprdr->custom;
-    for (UINT32 i = 0; i < caps->cCapabilitiesSets; i++) {
-        const CLIPRDR_CAPABILITY_SET* capSet = &caps->capabilitySets[i];
-        if (capSet->capabilitySetType == CB_CAPSTYPE_GENERAL) {
-            const CLIPRDR_GENERAL_CAPABILITY_SET* genCaps = (const CLIPRDR_GENERAL_CAPABILITY_SET*)capSet;
-            ctx->clipboardCapabilities = genCaps->generalFlags;
-        }
-    }
-    return CHANNEL_RC_OK;
-}
-
-static UINT crdp_cliprdr_server_format_list(CliprdrClientContext* cliprdr, const CLIPRDR_FORMAT_LIST* list) {
-    crdp_context* ctx = (crdp_context*)cliprdr->custom;
-    if (!ctx) return ERROR_INTERNAL_ERROR;
-    
-    WLog_DBG(CRDP_TAG, "Server sent format list with %u formats", list->numFormats);
-    
-    // Find a text format we can handle - prefer CF_UNICODETEXT over CF_TEXT
-    UINT32 textFormatId = 0;
-    for (UINT32 i = 0; i < list->numFormats; i++) {
-        const CLIPRDR_FORMAT* format = &list->formats[i];
-        // CF_UNICODETEXT = 13, CF_TEXT = 1 - prefer Unicode
-        if (format->formatId == 13) {
-            textFormatId = 13;
-        } else if (format->formatId == 1 && textFormatId == 0) {
-            textFormatId = 1;
-        }
-    }
-    
-    crdp_cliprdr_send_client_format_list_response(cliprdr, TRUE);
-    
-    // Request the text data from server
-    if (textFormatId != 0) {
-        WLog_DBG(CRDP_TAG, "Requesting clipboard data, format=%u", textFormatId);
-        CLIPRDR_FORMAT_DATA_REQUEST request = { 0 };
-        request.requestedFormatId = textFormatId;
-        cliprdr->ClientFormatDataRequest(cliprdr, &request);
-    }
-    
-    return CHANNEL_RC_OK;
-}
-
-static UINT crdp_cliprdr_server_format_list_response(CliprdrClientContext* cliprdr, const CLIPRDR_FORMAT_LIST_RESPONSE* resp) {
-    return CHANNEL_RC_OK;
-}
-
-static UINT crdp_cliprdr_server_lock_clipboard_data(CliprdrClientContext* cliprdr, const CLIPRDR_LOCK_CLIPBOARD_DATA* lock) {
-    return CHANNEL_RC_OK;
-}
-
-static UINT crdp_cliprdr_server_unlock_clipboard_data(CliprdrClientContext* cliprdr, const CLIPRDR_UNLOCK_CLIPBOARD_DATA* unlock) {
-    return CHANNEL_RC_OK;
-}
-
-static UINT crdp_cliprdr_server_format_data_request(CliprdrClientContext* cliprdr, const CLIPRDR_FORMAT_DATA_REQUEST* req) {
-    crdp_context* ctx = (crdp_context*)cliprdr->custom;
-    if (!ctx) return ERROR_INTERNAL_ERROR;
-    
-    WLog_DBG(CRDP_TAG, "Server requesting clipboard data, format=%u", req->requestedFormatId);
-    
-    CLIPRDR_FORMAT_DATA_RESPONSE response = { 0 };
-    
-    // CF_UNICODETEXT = 13, CF_TEXT = 1
-    if (req->requestedFormatId == 13 || req->requestedFormatId == 1) {
-        char* text = crdp_clipboard_get_text();
-        if (text) {
-            size_t len = strlen(text);
-            // Convert to UTF-16LE for CF_UNICODETEXT
-            if (req->requestedFormatId == 13) {
-                // Simple ASCII to UTF-16LE conversion (works for basic text)
-                size_t utf16_len = (len + 1) * 2;
-                uint8_t* utf16 = calloc(1, utf16_len);
-                if (utf16) {
-                    for (size_t i = 0; i <= len; i++) {
-                        utf16[i * 2] = (uint8_t)text[i];
-                        utf16[i * 2 + 1] = 0;
-                    }
-                    response.common.msgFlags = CB_RESPONSE_OK;
-                    response.common.dataLen = (UINT32)utf16_len;
-                    response.requestedFormatData = utf16;
-                    UINT rc = cliprdr->ClientFormatDataResponse(cliprdr, &response);
-                    free(utf16);
-                    free(text);
-                    return rc;
-                }
-            } else {
-                // CF_TEXT - send as-is with null terminator
-                response.common.msgFlags = CB_RESPONSE_OK;
-                response.common.dataLen = (UINT32)(len + 1);
-                response.requestedFormatData = (uint8_t*)text;
-                UINT rc = cliprdr->ClientFormatDataResponse(cliprdr, &response);
-                free(text);
-                return rc;
-            }
-            free(text);
-        }
-    }
-    
-    // No data available
-    response.common.msgFlags = CB_RESPONSE_FAIL;
-    response.common.dataLen = 0;
-    response.requestedFormatData = NULL;
-    return cliprdr->ClientFormatDataResponse(cliprdr, &response);
-}
-
-static UINT crdp_cliprdr_server_format_data_response(CliprdrClientContext* cliprdr, const CLIPRDR_FORMAT_DATA_RESPONSE* resp) {
-    crdp_context* ctx = (crdp_context*)cliprdr->custom;
-    if (!ctx) return ERROR_INTERNAL_ERROR;
-    
-    if (resp->common.msgFlags & CB_RESPONSE_OK && resp->requestedFormatData && resp->common.dataLen > 0) {
-        WLog_DBG(CRDP_TAG, "Received clipboard data: %u bytes", resp->common.dataLen);
-        
-        const uint8_t* data = resp->requestedFormatData;
-        size_t len = resp->common.dataLen;
-        
-        // UTF-16LE to UTF-8 conversion
-        // Allocate enough space for worst case (4 bytes per character)
-        char* utf8 = calloc(1, len * 2 + 1);
-        if (utf8) {
-            size_t j = 0;
-            for (size_t i = 0; i + 1 < len; i += 2) {
-                uint16_t ch = data[i] | (data[i + 1] << 8);
-                if (ch == 0) break;
-                
-                // Convert UTF-16 code point to UTF-8
-                if (ch < 0x80) {
-                    utf8[j++] = (char)ch;
-                } else if (ch < 0x800) {
-                    utf8[j++] = (char)(0xC0 | (ch >> 6));
-                    utf8[j++] = (char)(0x80 | (ch & 0x3F));
-                } else {
-                    utf8[j++] = (char)(0xE0 | (ch >> 12));
-                    utf8[j++] = (char)(0x80 | ((ch >> 6) & 0x3F));
-                    utf8[j++] = (char)(0x80 | (ch & 0x3F));
-                }
-            }
-            utf8[j] = '\0';
-            
-            if (j > 0) {
-                crdp_clipboard_set_text(utf8);
-                WLog_INFO(CRDP_TAG, "Clipboard synced from server: %zu chars", j);
-            }
-            free(utf8);
-        }
-    }
-    return CHANNEL_RC_OK;
-}
-
-// Callback when local macOS clipboard changes
-static void crdp_local_clipboard_changed(void* context) {
-    crdp_context* ctx = (crdp_context*)context;
-    if (!ctx || !ctx->cliprdr || !ctx->clipboardSync) return;
-    
-    WLog_DBG(CRDP_TAG, "Local clipboard changed, notifying server");
-    crdp_cliprdr_send_client_format_list(ctx->cliprdr);
-}
-
-static void crdp_cliprdr_init(crdp_context* ctx, CliprdrClientContext* cliprdr) {
-    ctx->cliprdr = cliprdr;
-    cliprdr->custom = ctx;
-    
-    ctx->clipboard = ClipboardCreate();
-    ctx->clipboardSync = FALSE;
-    ctx->clipboardCapabilities = 0;
-    
-    cliprdr->MonitorReady = crdp_cliprdr_monitor_ready;
-    cliprdr->ServerCapabilities = crdp_cliprdr_server_capabilities;
-    cliprdr->ServerFormatList = crdp_cliprdr_server_format_list;
-    cliprdr->ServerFormatListResponse = crdp_cliprdr_server_format_list_response;
-    cliprdr->ServerLockClipboardData = crdp_cliprdr_server_lock_clipboard_data;
-    cliprdr->ServerUnlockClipboardData = crdp_cliprdr_server_unlock_clipboard_data;
-    cliprdr->ServerFormatDataRequest = crdp_cliprdr_server_format_data_request;
-    cliprdr->ServerFormatDataResponse = crdp_cliprdr_server_format_data_response;
-    
-    // Start monitoring local clipboard for changes
-    crdp_clipboard_start_monitor(crdp_local_clipboard_changed, ctx);
-    
-    WLog_INFO(CRDP_TAG, "Clipboard channel initialized");
-}
-
-static void crdp_cliprdr_uninit(crdp_context* ctx) {
-    // Stop monitoring local clipboard
-    crdp_clipboard_stop_monitor();
-    
-    if (ctx->clipboard) {
-        ClipboardDestroy(ctx->clipboard);
-        ctx->clipboard = NULL;
-    }
-    ctx->cliprdr = NULL;
-}
-
 static void crdp_OnChannelConnectedEventHandler(void* context, const ChannelConnectedEventArgs* e) {
     crdp_context* ctx = (crdp_context*)context;
     if (!ctx) return;
@@ -451,8 +343,8 @@ static void crdp_OnChannelConnectedEventHandler(void* context, const ChannelConn
     
     if (strcmp(e->name, CLIPRDR_SVC_CHANNEL_NAME) == 0) {
         crdp_cliprdr_init(ctx, (CliprdrClientContext*)e->pInterface);
-    } else if (strcmp(e->name, "rdpgfx") == 0) {
-        WLog_INFO(CRDP_TAG, "GFX Graphics Pipeline channel active");
+    } else if (strcmp(e->name, RDPGFX_DVC_CHANNEL_NAME) == 0) {
+        crdp_gfx_init(ctx, (RdpgfxClientContext*)e->pInterface);
     } else if (strcmp(e->name, "drdynvc") == 0) {
         WLog_INFO(CRDP_TAG, "Dynamic Virtual Channel (required for GFX) active");
     }
@@ -464,9 +356,18 @@ static void crdp_OnChannelDisconnectedEventHandler(void* context, const ChannelD
     
     if (strcmp(e->name, CLIPRDR_SVC_CHANNEL_NAME) == 0) {
         crdp_cliprdr_uninit(ctx);
+    } else if (strcmp(e->name, RDPGFX_DVC_CHANNEL_NAME) == 0) {
+        crdp_gfx_uninit(ctx, (RdpgfxClientContext*)e->pInterface);
     }
 }
 
+static PVIRTUALCHANNELENTRY crdp_addin_provider(LPCSTR name, LPCSTR subsystem, LPCSTR type, DWORD flags) {
+    PVIRTUALCHANNELENTRY entry = crdp_drive_addin_entry(name, type);
+    if (!entry) entry = crdp_audio_addin_entry(name, subsystem);
+    if (!entry) entry = crdp_mic_addin_entry(name, subsystem);
+    return entry ? entry : freerdp_channels_load_static_addin_entry(name, subsystem, type, flags);
+}
+
 static BOOL crdp_pre_connect(freerdp* instance) {
     crdp_context* ctx = (crdp_context*)instance->context;
     if (!ctx || !ctx->client) return FALSE;
@@ -496,6 +397,23 @@ static BOOL crdp_pre_connect(freerdp* instance) {
     const char* cliprdr_params[] = { "cliprdr" };
     freerdp_client_add_static_channel(settings, 1, cliprdr_params);
 
+    // Adaptive quality needs RTT/bandwidth from network auto-detection
+    if (cfg->adaptive_quality) {
+        freerdp_settings_set_bool(settings, FreeRDP_NetworkAutoDetect, TRUE);
+        freerdp_settings_set_uint32(settings, FreeRDP_ConnectionType, CONNECTION_TYPE_AUTODETECT);
+    }
+
+    // Codec and color depth the controller chose on an earlier connection
+    crdp_quality_configure(ctx->client, settings);
+    crdp_compression_configure(ctx->client, settings);
+    crdp_multitransport_configure(ctx->client, settings);
+    // A replay takes the server's PDUs from a trace file instead (trace.c)
+    if (ctx->client->replay && !crdp_replay_configure(ctx, settings)) return FALSE;
+    // Compression and transport statistics, clipboard progress and
+    // multitransport requests are taken from the PDUs on the wire; the
+    // session socket is tuned once it connects (socket.c)
+    crdp_transport_install(ctx);
+
     // Connection timeout (in milliseconds, 0 = system default)
     if (cfg->timeout_seconds > 0) {
         uint32_t timeout_ms = cfg->timeout_seconds * 1000;
@@ -507,38 +425,48 @@ static BOOL crdp_pre_connect(freerdp* instance) {
     if (cfg->password) freerdp_settings_set_string(settings, FreeRDP_Password, cfg->password);
     if (cfg->domain) freerdp_settings_set_string(settings, FreeRDP_Domain, cfg->domain);
 
-    // Drive redirection - share local folder with remote Windows
-    // Appears as \\tsclient\<drive_name> on Windows
-    if (crdp_validate_drive_path(cfg->drive_path)) {
-        const char* drive_name = cfg->drive_name && cfg->drive_name[0] ? cfg->drive_name : "Mac";
-        
-        // Enable device redirection (required for RDPDR channel)
-        freerdp_settings_set_bool(settings, FreeRDP_DeviceRedirection, TRUE);
+    // Drive redirection - share local folders with remote Windows
+    // Each appears as \\tsclient\<name> on Windows
+    for (uint32_t i = 0; i < ctx->client->drive_count; i++) {
+        const crdp_drive_share_t* share = &ctx->client->drives[i];
         
         // Create drive device: args = { name, path } - name first, then path
         // This matches FreeRDP's freerdp_client_add_drive() implementation
-        const char* drive_args[] = { drive_name, cfg->drive_path };
+        const char* drive_args[] = { share->name, share->path };
         RDPDR_DEVICE* device = freerdp_device_new(RDPDR_DTYP_FILESYSTEM, 2, drive_args);
-        
-        if (device) {
-            if (freerdp_device_collection_add(settings, device)) {
-                WLog_INFO(CRDP_TAG, "Drive redirection enabled: %s -> \\\\tsclient\\%s", 
-                          cfg->drive_path, drive_name);
-                
-                // Explicitly add rdpdr static channel to ensure it gets loaded
-                // The rdpdr channel will load the drive device service internally
-                const char* rdpdr_params[] = { "rdpdr" };
-                freerdp_client_add_static_channel(settings, 1, rdpdr_params);
-            } else {
-                WLog_WARN(CRDP_TAG, "Failed to add drive to device collection");
-                freerdp_device_free(device);
-            }
-        } else {
+        if (!device) {
             WLog_WARN(CRDP_TAG, "Failed to create drive device");
+            continue;
+        }
+        if (!freerdp_device_collection_add(settings, device)) {
+            WLog_WARN(CRDP_TAG, "Failed to add drive to device collection");
+            freerdp_device_free(device);
+            continue;
         }
-    } else if (cfg->drive_path && cfg->drive_path[0]) {
-        // Path was specified but invalid
-        WLog_WARN(CRDP_TAG, "Drive path invalid or not a directory: %s", cfg->drive_path);
+        WLog_INFO(CRDP_TAG, "Drive redirection enabled: %s -> \\\\tsclient\\%s%s", share->path, share->name,
+                  share->read_only ? " (read-only)" : "");
+    }
+    if (ctx->client->drive_count > 0) {
+        // Enable device redirection (required for RDPDR channel)
+        freerdp_settings_set_bool(settings, FreeRDP_DeviceRedirection, TRUE);
+        // Explicitly add rdpdr static channel to ensure it gets loaded
+        // The rdpdr channel loads the drive devices through crdp_addin_provider
+        const char* rdpdr_params[] = { "rdpdr" };
+        freerdp_client_add_static_channel(settings, 1, rdpdr_params);
+    }
+
+    // Audio output through rdpsnd, played by CRDP's device (audio.c)
+    if (cfg->audio_output != CRDP_AUDIO_OFF) {
+        freerdp_settings_set_bool(settings, FreeRDP_AudioPlayback, TRUE);
+        const char* rdpsnd_params[] = { "rdpsnd", "sys:crdp" };
+        freerdp_client_add_static_channel(settings, 2, rdpsnd_params);
+    }
+
+    // Microphone through audin, captured by CRDP's device (mic.c)
+    if (cfg->mic_input != CRDP_MIC_OFF) {
+        freerdp_settings_set_bool(settings, FreeRDP_AudioCapture, TRUE);
+        const char* audin_params[] = { "audin", "sys:crdp" };
+        freerdp_client_add_dynamic_channel(settings, 2, audin_params);
     }
 
     // Subscribe to channel events for clipboard support
@@ -559,6 +487,12 @@ static BOOL crdp_post_connect(freerdp* instance) {
 
     if (!gdi_init(instance, PIXEL_FORMAT_BGRA32)) return FALSE;
 
+    pthread_mutex_lock(&ctx->client->paint_lock);
+    ctx->client->gdi_ready = true;
+    pthread_mutex_unlock(&ctx->client->paint_lock);
+    crdp_metrics_set(ctx->client, CRDP_GAUGE_DESKTOP_WIDTH, instance->context->gdi->width);
+    crdp_metrics_set(ctx->client, CRDP_GAUGE_DESKTOP_HEIGHT, instance->context->gdi->height);
+
     rdpUpdate* update = ctx->_p.update;
     ctx->prev_begin_paint = update->BeginPaint;
     ctx->prev_end_paint = update->EndPaint;
@@ -585,6 +519,7 @@ static void crdp_context_free(freerdp* instance, rdpContext* context) {
 
 static void* crdp_thread_start(void* arg) {
     crdp_client_t* client = (crdp_client_t*)arg;
+    crdp_profile_thread_name("protocol");
 
     if (!freerdp_connect(client->instance)) {
         WLog_ERR(CRDP_TAG, "connect failed");
@@ -594,19 +529,49 @@ static void* crdp_thread_start(void* arg) {
     client->connected = true;
 
     rdpContext* context = client->instance->context;
+    HANDLE handles[MAXIMUM_WAIT_OBJECTS] = { 0 };
 
     while (!client->stop) {
         if (freerdp_shall_disconnect_context(context)) break;
-        if (!freerdp_check_event_handles(context)) {
+
+        // Sleep until there is socket/channel activity, a host request or
+        // coalesced damage coming due, instead of spinning on the handles
+        DWORD count = freerdp_get_event_handles(context, handles, ARRAYSIZE(handles) - 1);
+        if (count == 0) {
+            WLog_ERR(CRDP_TAG, "failed to get event handles");
+            break;
+        }
+        handles[count++] = client->wake_event;
+
+        if (WaitForMultipleObjects(count, handles, FALSE, crdp_event_timeout_ms(client)) == WAIT_FAILED) {
+            WLog_ERR(CRDP_TAG, "wait for event handles failed");
+            break;
+        }
+        ResetEvent(client->wake_event);
+
+        uint64_t span = crdp_span_begin();
+        BOOL handled = freerdp_check_event_handles(context);
+        crdp_span_end(span, "decode PDUs", NULL, 0);
+        if (!handled) {
             WLog_ERR(CRDP_TAG, "event handling failed");
             break;
         }
+        crdp_flush_pending_frame(client);
+        crdp_record_tick(client);
+        crdp_quality_tick(client);
     }
 
+    // Framebuffer readers on other threads must stop before GDI goes away
+    pthread_mutex_lock(&client->paint_lock);
+    client->gdi_ready = false;
+    pthread_mutex_unlock(&client->paint_lock);
+
     freerdp_disconnect(client->instance);
     client->connected = false;
 
 finish:
+    crdp_trace_close(client);
+    crdp_replay_close(client);
     if (client->disconnect_cb) client->disconnect_cb(client->disconnect_user);
     return NULL;
 }
@@ -625,6 +590,28 @@ crdp_client_t* crdp_client_new(crdp_frame_cb frame_cb, void* frame_user,
     client->cert_user = cert_user;
     client->stop = false;
     client->connected = false;
+    atomic_init(&client->priority, CRDP_PRIORITY_FOREGROUND);
+    atomic_init(&client->repaint, false);
+
+    client->wake_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!client->wake_event) {
+        free(client);
+        return NULL;
+    }
+
+    // Recursive: FreeRDP may nest BeginPaint/EndPaint pairs
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&client->paint_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    crdp_thumbnail_init(client);
+    crdp_capture_init(client);
+    crdp_quality_init(client);
+    crdp_compression_init(client);
+    crdp_clip_transfer_init(client);
+    crdp_clipfile_init(client);
 
     return client;
 }
@@ -641,9 +628,42 @@ int crdp_client_connect(crdp_client_t* client, const crdp_config_t* config) {
     client->config.domain = config->domain ? strdup(config->domain) : NULL;
     client->config.drive_path = config->drive_path ? strdup(config->drive_path) : NULL;
     client->config.drive_name = config->drive_name ? strdup(config->drive_name) : NULL;
+    client->config.audio_wav_path = config->audio_wav_path ? strdup(config->audio_wav_path) : NULL;
+    client->config.mic_file_path = config->mic_file_path ? strdup(config->mic_file_path) : NULL;
+    client->config.trace_path = config->trace_path ? strdup(config->trace_path) : NULL;
+    client->config.replay_path = config->replay_path ? strdup(config->replay_path) : NULL;
+    client->config.record_path = config->record_path ? strdup(config->record_path) : NULL;
+    // The caller's array isn't kept; client->drives holds copies
+    client->config.drives = NULL;
+    client->config.drive_count = 0;
+    crdp_drive_configure(client, config);
+    // A replay's header decides the desktop size and channels, so it is read
+    // before anything else looks at the config
+    if ((client->config.replay_path && !crdp_replay_open(client)) ||
+        (client->config.trace_path && !crdp_trace_open(client)) ||
+        (client->config.record_path && !crdp_record_open(client))) {
+        crdp_trace_close(client);
+        crdp_replay_close(client);
+        return -5;
+    }
+    atomic_store(&client->frames_in_flight, 0);
+    atomic_store(&client->gfx.suspended, config->suspend_frame_acks);
+    crdp_quality_reset(client);
+    crdp_compression_reset(client);
+    crdp_audio_reset(client);
+    crdp_mic_reset(client);
+    crdp_multitransport_reset(client);
+    crdp_metrics_reset(client);
+    client->rtt_base_intervals = 0;
+    client->rtt_base_interval_us = 0;
 
     freerdp* instance = freerdp_new();
-    if (!instance) return -2;
+    if (!instance) {
+        crdp_trace_close(client);
+        crdp_replay_close(client);
+        crdp_record_close(client);
+        return -2;
+    }
 
     instance->ContextSize = sizeof(crdp_context);
     instance->ContextNew = crdp_context_new;
@@ -651,10 +671,14 @@ int crdp_client_connect(crdp_client_t* client, const crdp_config_t* config) {
 
     // Register static channel addin provider - this enables built-in channels
     // like rdpdr (drive redirection) and cliprdr (clipboard) to be loaded
-    // without requiring separate .dylib plugin files
-    freerdp_register_addin_provider(freerdp_channels_load_static_addin_entry, 0);
+    // without requiring separate .dylib plugin files. The drive device and
+    // the audio devices are CRDP's (drive.c, audio.c, mic.c).
+    freerdp_register_addin_provider(crdp_addin_provider, 0);
 
     if (!freerdp_context_new(instance)) {
+        crdp_trace_close(client);
+        crdp_replay_close(client);
+        crdp_record_close(client);
         freerdp_free(instance);
         return -3;
     }
@@ -673,6 +697,9 @@ int crdp_client_connect(crdp_client_t* client, const crdp_config_t* config) {
     client->stop = false;
 
     if (pthread_create(&client->thread, NULL, crdp_thread_start, client) != 0) {
+        crdp_trace_close(client);
+        crdp_replay_close(client);
+        crdp_record_close(client);
         freerdp_context_free(client->instance);
         freerdp_free(client->instance);
         client->instance = NULL;
@@ -694,6 +721,8 @@ void crdp_client_disconnect(crdp_client_t* client) {
         pthread_join(client->thread, NULL);
         memset(&client->thread, 0, sizeof(pthread_t));
     }
+    crdp_multitransport_stop(client);
+    crdp_record_close(client);
 
     if (client->instance) {
         freerdp_context_free(client->instance);
@@ -702,23 +731,51 @@ void crdp_client_disconnect(crdp_client_t* client) {
     }
 
     client->connected = false;
+    client->pending.valid = false;
+    client->last_delivery = 0;
 }
 
 void crdp_client_free(crdp_client_t* client) {
     if (!client) return;
     crdp_client_disconnect(client);
+    crdp_thumbnail_free(client);
+    crdp_capture_free(client);
+    crdp_quality_free(client);
+    crdp_compression_free(client);
+    crdp_clip_transfer_free(client);
+    crdp_clipfile_free(client);
     crdp_free_config(&client->config);
+    crdp_drive_clear(client);
+    if (client->wake_event) CloseHandle(client->wake_event);
+    pthread_mutex_destroy(&client->paint_lock);
+    free(client->thumb_buf);
     free(client);
 }
 
 int crdp_send_pointer_event(crdp_client_t* client, uint16_t flags, uint16_t x, uint16_t y) {
     if (!client || !client->instance || !client->instance->context || !client->instance->context->input) return -1;
-    return freerdp_input_send_mouse_event(client->instance->context->input, flags, x, y);
+    uint64_t span = crdp_span_begin();
+    BOOL sent = freerdp_input_send_mouse_event(client->instance->context->input, flags, x, y);
+    crdp_span_end(span, "pointer input", "flags", flags);
+    if (sent) {
+        crdp_metrics_add(client, CRDP_COUNTER_INPUT_EVENTS, 1);
+        crdp_metrics_input_sent(client);
+        crdp_record_pointer(client, flags, x, y);
+    }
+    return sent;
 }
 
 int crdp_send_keyboard_event(crdp_client_t* client, uint16_t flags, uint16_t scancode) {
     if (!client || !client->instance || !client->instance->context || !client->instance->context->input) return -1;
-    return freerdp_input_send_keyboard_event(client->instance->context->input, flags, (UINT8)scancode);
+    uint64_t span = crdp_span_begin();
+    BOOL sent = freerdp_input_send_keyboard_event(client->instance->context->input, flags, (UINT8)scancode);
+    crdp_span_end(span, "key input", "scancode", scancode);
+    if (sent) {
+        crdp_metrics_add(client, CRDP_COUNTER_INPUT_EVENTS, 1);
+        crdp_metrics_input_sent(client);
+        crdp_record_key(client, flags, scancode);
+    }
+    return sent;
 }
 
 int32_t crdp_get_rtt_ms(crdp_client_t* client) {
@@ -741,12 +798,15 @@ int32_t crdp_get_rtt_ms(crdp_client_t* client) {
     
     // Fallback: use frame timing as a proxy for responsiveness
     // Need at least 2 frames to calculate interval
-    if (client->frame_count >= 2) {
-        uint32_t avg_interval = (uint32_t)(client->frame_interval_sum / client->frame_count);
+    uint64_t intervals, interval_us;
+    crdp_metrics_totals(client, CRDP_HIST_FRAME_INTERVAL_US, &intervals, &interval_us);
+    uint64_t count = intervals - client->rtt_base_intervals;
+    if (count >= 2) {
+        uint32_t avg_interval = (uint32_t)((interval_us - client->rtt_base_interval_us) / count / 1000);
         // Only reset if we have enough samples for a good measurement
-        if (client->frame_count >= 5) {
-            client->frame_interval_sum = 0;
-            client->frame_count = 0;
+        if (count >= 5) {
+            client->rtt_base_intervals = intervals;
+            client->rtt_base_interval_us = interval_us;
         }
         // Cache and return average frame interval (capped at 500ms)
         client->last_rtt_ms = avg_interval < 500 ? (int32_t)avg_interval : 500;
@@ -755,3 +815,23 @@ int32_t crdp_get_rtt_ms(crdp_client_t* client) {
     // Always return cached value once we have one
     return client->last_rtt_ms > 0 ? client->last_rtt_ms : -1;
 }
+
+int crdp_set_session_priority(crdp_client_t* client, crdp_session_priority_t priority) {
+    if (!client) return -1;
+    if (priority < CRDP_PRIORITY_FOREGROUND || priority > CRDP_PRIORITY_THUMBNAIL) return -1;
+
+    int previous = atomic_exchange(&client->priority, (int)priority);
+    if (previous != (int)priority) {
+        WLog_DBG(CRDP_TAG, "Session priority %d -> %d", previous, (int)priority);
+        // Frame size and cadence change with the priority, so push a complete
+        // frame at the new setting without waiting for the server to repaint
+        atomic_store(&client->repaint, true);
+        if (client->wake_event) SetEvent(client->wake_event);
+    }
+    return 0;
+}
+
+crdp_session_priority_t crdp_get_session_priority(crdp_client_t* client) {
+    if (!client) return CRDP_PRIORITY_FOREGROUND;
+    return (crdp_session_priority_t)atomic_load(&client->priority);
+}
@@ -0,0 +1,415 @@
+#include "crdp_internal.h"
+
+#include <freerdp/client/rdpsnd.h>
+#include <freerdp/codec/audio.h>
+#include <winpr/wlog.h>
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Audio output device for rdpsnd.
+//
+// rdpsnd hands over one wave at a time on its channel thread. 16-bit PCM is
+// taken as is; anything else is decoded to PCM by FreeRDP's DSP first (ADPCM,
+// GSM, AAC and so on, as far as FreeRDP was built with them). Waves go into a
+// lock-free ring, and the sink pulls them out in real time.
+//
+// The jitter buffer lives on the sink side. Playback starts once the ring
+// holds the target depth, or once its oldest frame has waited that long so a
+// sound shorter than the target still plays. Running dry mid-stream is an
+// underrun: silence is played and the target grows. Steady playback shrinks
+// the target again, though never below a few times the measured arrival
+// jitter. A burst that pushes the buffer well past the target is skipped so
+// latency doesn't creep up. A gap too long to be a late wave is the end of a
+// sound, not an underrun.
+
+#define CRDP_AUDIO_MIN_LATENCY_MS 20
+#define CRDP_AUDIO_MAX_LATENCY_MS 300
+#define CRDP_AUDIO_START_LATENCY_MS 60
+// Steady playback needed before each shrink, and the share taken off
+#define CRDP_AUDIO_SHRINK_INTERVAL_MS 2000
+#define CRDP_AUDIO_SHRINK_DIVISOR 8
+// Smallest growth after an underrun
+#define CRDP_AUDIO_GROW_MS 10
+// Excess over the target tolerated before skipping ahead
+#define CRDP_AUDIO_SKIP_SLACK_MS 20
+// Silence longer than this before audio resumes means the sound had ended
+#define CRDP_AUDIO_GAP_MS 500
+// Target floor in multiples of the arrival jitter
+#define CRDP_AUDIO_JITTER_FACTOR 3
+// Waves whose arrival is remembered; more than the deepest buffer holds
+#define CRDP_AUDIO_ARRIVALS 64
+
+// A wave: where it starts in the ring and when it arrived
+typedef struct {
+    uint64_t pos;
+    uint64_t ns;
+} crdp_audio_arrival_t;
+
+struct crdp_audio {
+    rdpsndDevicePlugin device;      // First: rdpsnd hands this back to us
+    crdp_audio_metrics_t* metrics;
+    crdp_audio_sink_t* sink;
+    crdp_audio_format_t format;
+    bool open;
+    uint32_t min_latency_ms;
+    uint32_t max_latency_ms;
+    _Atomic uint32_t volume;        // Left in the low word, right in the high word
+    // Ring of interleaved frames. write_pos is only advanced by the channel
+    // thread and read_pos only by the sink; both count frames ever written
+    // or read, so their difference is what is buffered.
+    int16_t* ring;
+    uint32_t ring_frames;           // Power of two
+    _Atomic uint64_t write_pos;
+    _Atomic uint64_t read_pos;
+    // Arrival times of the waves in the ring, the same way round: the
+    // channel thread appends, the sink drops the ones it has played past
+    crdp_audio_arrival_t arrivals[CRDP_AUDIO_ARRIVALS];
+    _Atomic uint64_t arrivals_written;
+    _Atomic uint64_t arrivals_read;
+    // Jitter buffer, sink thread only
+    uint32_t target;                // Frames
+    bool playing;                   // Target reached, draining the ring
+    bool in_gap;                    // Ran dry, waiting to see for how long
+    uint64_t gap_frames;
+    uint64_t steady_frames;
+    // Arrival jitter, measured on the channel thread
+    uint64_t last_arrival_ns;
+    uint32_t last_wave_frames;
+    double jitter_ns;
+    _Atomic uint32_t jitter_frames;
+};
+
+static uint64_t crdp_audio_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t crdp_audio_frames(const crdp_audio_t* audio, uint32_t ms) {
+    return (uint32_t)((uint64_t)audio->format.rate * ms / 1000);
+}
+
+static uint32_t crdp_audio_ms(const crdp_audio_t* audio, uint64_t frames) {
+    return audio->format.rate ? (uint32_t)(frames * 1000 / audio->format.rate) : 0;
+}
+
+static void crdp_audio_set_target(crdp_audio_t* audio, uint32_t target) {
+    uint32_t lo = crdp_audio_frames(audio, audio->min_latency_ms);
+    uint32_t hi = crdp_audio_frames(audio, audio->max_latency_ms);
+    audio->target = target < lo ? lo : target > hi ? hi : target;
+    atomic_store(&audio->metrics->target_ms, crdp_audio_ms(audio, audio->target));
+}
+
+// Sink thread
+
+// When the frame at read arrived, 0 if none is buffered. Forgets the waves
+// played before it.
+static uint64_t crdp_audio_oldest_arrival(crdp_audio_t* audio, uint64_t read, uint64_t write) {
+    uint64_t written = atomic_load_explicit(&audio->arrivals_written, memory_order_acquire);
+    uint64_t first = atomic_load_explicit(&audio->arrivals_read, memory_order_relaxed);
+    while (first + 1 < written && audio->arrivals[(first + 1) % CRDP_AUDIO_ARRIVALS].pos <= read) first++;
+    atomic_store_explicit(&audio->arrivals_read, first, memory_order_release);
+    if (first == written || read == write) return 0;
+    return audio->arrivals[first % CRDP_AUDIO_ARRIVALS].ns;
+}
+
+void crdp_audio_render(crdp_audio_t* audio, int16_t* out, uint32_t frames) {
+    crdp_audio_metrics_t* m = audio->metrics;
+    uint32_t channels = audio->format.channels;
+    uint64_t read = atomic_load_explicit(&audio->read_pos, memory_order_relaxed);
+    uint64_t write = atomic_load_explicit(&audio->write_pos, memory_order_acquire);
+    uint64_t buffered = write - read;
+
+    if (audio->in_gap && buffered > 0) {
+        // Audio again: a short gap was a wave arriving late
+        if (audio->gap_frames < crdp_audio_frames(audio, CRDP_AUDIO_GAP_MS)) {
+            atomic_fetch_add(&m->underruns, 1);
+            atomic_fetch_add(&m->concealed_frames, audio->gap_frames);
+            uint32_t grow = audio->target / 2;
+            if (grow < crdp_audio_frames(audio, CRDP_AUDIO_GROW_MS)) grow = crdp_audio_frames(audio, CRDP_AUDIO_GROW_MS);
+            crdp_audio_set_target(audio, audio->target + grow);
+        }
+        audio->in_gap = false;
+    }
+    uint64_t oldest = crdp_audio_oldest_arrival(audio, read, write);
+    if (!audio->playing && buffered > 0 &&
+        (buffered >= audio->target ||
+         crdp_audio_now_ns() - oldest >= (uint64_t)crdp_audio_ms(audio, audio->target) * 1000000)) {
+        audio->playing = true;
+        audio->steady_frames = 0;
+    }
+    if (!audio->playing) {
+        memset(out, 0, (size_t)frames * channels * sizeof(int16_t));
+        if (audio->in_gap) audio->gap_frames += frames;
+        atomic_store(&m->buffered_ms, crdp_audio_ms(audio, buffered));
+        return;
+    }
+
+    // Too far behind after a burst: skip ahead to the target
+    if (buffered > audio->target + crdp_audio_frames(audio, CRDP_AUDIO_SKIP_SLACK_MS) + audio->target / 2) {
+        uint64_t skip = buffered - audio->target;
+        read += skip;
+        buffered -= skip;
+        atomic_fetch_add(&m->dropped_frames, skip);
+    }
+
+    uint32_t n = buffered < frames ? (uint32_t)buffered : frames;
+    uint32_t at = (uint32_t)(read & (audio->ring_frames - 1));
+    uint32_t first = audio->ring_frames - at < n ? audio->ring_frames - at : n;
+    memcpy(out, audio->ring + (size_t)at * channels, (size_t)first * channels * sizeof(int16_t));
+    memcpy(out + (size_t)first * channels, audio->ring, (size_t)(n - first) * channels * sizeof(int16_t));
+    atomic_store_explicit(&audio->read_pos, read + n, memory_order_release);
+    atomic_fetch_add(&m->frames_played, n);
+
+    if (n < frames) {
+        // Ran dry; whether that was an underrun shows when audio comes back
+        memset(out + (size_t)n * channels, 0, (size_t)(frames - n) * channels * sizeof(int16_t));
+        audio->playing = false;
+        audio->in_gap = true;
+        audio->gap_frames = frames - n;
+    } else if ((audio->steady_frames += frames) >= crdp_audio_frames(audio, CRDP_AUDIO_SHRINK_INTERVAL_MS)) {
+        audio->steady_frames = 0;
+        uint32_t floor = atomic_load(&audio->jitter_frames) * CRDP_AUDIO_JITTER_FACTOR;
+        uint32_t shrunk = audio->target - audio->target / CRDP_AUDIO_SHRINK_DIVISOR;
+        if (shrunk < floor) shrunk = floor;
+        if (shrunk < audio->target) crdp_audio_set_target(audio, shrunk);
+    }
+    atomic_store(&m->buffered_ms, crdp_audio_ms(audio, buffered - n));
+}
+
+// rdpsnd device, channel thread
+
+static BOOL crdp_audio_format_supported(rdpsndDevicePlugin* device, const AUDIO_FORMAT* format) {
+    (void)device;
+    // Anything else goes through FreeRDP's DSP to PCM first
+    return format->wFormatTag == WAVE_FORMAT_PCM && format->wBitsPerSample == 16 &&
+           (format->nChannels == 1 || format->nChannels == 2) && format->nSamplesPerSec >= 8000 &&
+           format->nSamplesPerSec <= 96000;
+}
+
+static BOOL crdp_audio_default_format(rdpsndDevicePlugin* device, const AUDIO_FORMAT* desired,
+                                      AUDIO_FORMAT* format) {
+    (void)device;
+    *format = (AUDIO_FORMAT){ 0 };
+    format->wFormatTag = WAVE_FORMAT_PCM;
+    format->nChannels = desired && desired->nChannels == 1 ? 1 : 2;
+    format->nSamplesPerSec = desired && desired->nSamplesPerSec >= 8000 && desired->nSamplesPerSec <= 96000
+                                 ? desired->nSamplesPerSec
+                                 : 44100;
+    format->wBitsPerSample = 16;
+    format->nBlockAlign = (UINT16)(format->nChannels * 2);
+    format->nAvgBytesPerSec = format->nSamplesPerSec * format->nBlockAlign;
+    return TRUE;
+}
+
+static void crdp_audio_close(rdpsndDevicePlugin* device) {
+    crdp_audio_t* audio = (crdp_audio_t*)device;
+    if (!audio->open) return;
+    audio->sink->stop(audio->sink);
+    audio->open = false;
+    free(audio->ring);
+    audio->ring = NULL;
+    atomic_store(&audio->metrics->playing, false);
+    atomic_store(&audio->metrics->buffered_ms, 0);
+}
+
+static BOOL crdp_audio_open(rdpsndDevicePlugin* device, const AUDIO_FORMAT* format, UINT32 latency) {
+    crdp_audio_t* audio = (crdp_audio_t*)device;
+    (void)latency;
+    crdp_audio_close(device);
+    if (!format || !crdp_audio_format_supported(device, format)) return FALSE;
+
+    audio->format.rate = format->nSamplesPerSec;
+    audio->format.channels = format->nChannels;
+    // Room for the deepest jitter buffer plus the burst that overfills it
+    uint32_t want = crdp_audio_frames(audio, audio->max_latency_ms * 2 + 500);
+    audio->ring_frames = 1;
+    while (audio->ring_frames < want) audio->ring_frames <<= 1;
+    audio->ring = calloc(audio->ring_frames, (size_t)audio->format.channels * sizeof(int16_t));
+    if (!audio->ring) return FALSE;
+    atomic_store(&audio->write_pos, 0);
+    atomic_store(&audio->read_pos, 0);
+    atomic_store(&audio->arrivals_written, 0);
+    atomic_store(&audio->arrivals_read, 0);
+
+    audio->playing = false;
+    audio->in_gap = false;
+    audio->steady_frames = 0;
+    audio->last_arrival_ns = 0;
+    audio->jitter_ns = 0;
+    atomic_store(&audio->jitter_frames, 0);
+    crdp_audio_set_target(audio, crdp_audio_frames(audio, CRDP_AUDIO_START_LATENCY_MS));
+
+    if (!audio->sink->start(audio->sink, &audio->format)) {
+        WLog_ERR(CRDP_TAG, "Failed to start audio output at %u Hz, %u channels", audio->format.rate,
+                 audio->format.channels);
+        free(audio->ring);
+        audio->ring = NULL;
+        return FALSE;
+    }
+    audio->open = true;
+    atomic_store(&audio->metrics->sample_rate, audio->format.rate);
+    atomic_store(&audio->metrics->channels, audio->format.channels);
+    atomic_store(&audio->metrics->playing, true);
+    WLog_DBG(CRDP_TAG, "Audio output at %u Hz, %u channels", audio->format.rate, audio->format.channels);
+    return TRUE;
+}
+
+static UINT32 crdp_audio_get_volume(rdpsndDevicePlugin* device) {
+    return atomic_load(&((crdp_audio_t*)device)->volume);
+}
+
+static BOOL crdp_audio_set_volume(rdpsndDevicePlugin* device, UINT32 value) {
+    atomic_store(&((crdp_audio_t*)device)->volume, value);
+    return TRUE;
+}
+
+// Copies samples into the ring, scaled by the server's volume for each channel
+static void crdp_audio_copy(int16_t* dst, const int16_t* src, size_t frames, uint16_t channels, UINT32 volume) {
+    if (volume == 0xFFFFFFFF) {
+        memcpy(dst, src, frames * channels * sizeof(int16_t));
+        return;
+    }
+    int32_t gain[2] = { (int32_t)(volume & 0xFFFF), (int32_t)(volume >> 16) };
+    if (channels == 1) gain[0] = (gain[0] + gain[1]) / 2;
+    for (size_t i = 0; i < frames * channels; i++) {
+        dst[i] = (int16_t)(((int32_t)src[i] * gain[i % channels]) / 0xFFFF);
+    }
+}
+
+static void crdp_audio_measure_jitter(crdp_audio_t* audio, uint32_t frames, uint64_t now) {
+    uint64_t since = now - audio->last_arrival_ns;
+    // Compare the spacing of waves with their length, like RFC 3550; the
+    // first wave of a sound has nothing to be compared with
+    if (audio->last_arrival_ns && since < 1000000000ULL) {
+        double expected = (double)audio->last_wave_frames * 1e9 / audio->format.rate;
+        audio->jitter_ns += (fabs((double)since - expected) - audio->jitter_ns) / 16;
+        uint32_t jitter_frames = (uint32_t)(audio->jitter_ns * audio->format.rate / 1e9);
+        atomic_store(&audio->jitter_frames, jitter_frames);
+        atomic_store(&audio->metrics->jitter_ms, (uint32_t)(audio->jitter_ns / 1e6));
+    }
+    audio->last_arrival_ns = now;
+    audio->last_wave_frames = frames;
+}
+
+// Returns the latency rdpsnd reports back to the server with the wave
+static UINT crdp_audio_play(rdpsndDevicePlugin* device, const BYTE* data, size_t size) {
+    crdp_audio_t* audio = (crdp_audio_t*)device;
+    if (!audio->open || !data) return 0;
+    uint16_t channels = audio->format.channels;
+    size_t frames = size / (channels * sizeof(int16_t));
+    uint64_t now = crdp_audio_now_ns();
+    crdp_audio_measure_jitter(audio, (uint32_t)frames, now);
+
+    uint64_t write = atomic_load_explicit(&audio->write_pos, memory_order_relaxed);
+    uint64_t read = atomic_load_explicit(&audio->read_pos, memory_order_acquire);
+    uint64_t room = audio->ring_frames - (write - read);
+    if (frames > room) {
+        atomic_fetch_add(&audio->metrics->dropped_frames, frames - room);
+        frames = (size_t)room;
+    }
+    UINT32 volume = atomic_load(&audio->volume);
+    const int16_t* src = (const int16_t*)data;
+    uint32_t at = (uint32_t)(write & (audio->ring_frames - 1));
+    size_t first = audio->ring_frames - at < frames ? audio->ring_frames - at : frames;
+    crdp_audio_copy(audio->ring + (size_t)at * channels, src, first, channels, volume);
+    crdp_audio_copy(audio->ring, src + first * channels, frames - first, channels, volume);
+
+    // Published before the frames, so the sink never sees frames without
+    // their arrival. With no room left the wave counts as part of the one
+    // before, which only makes it look older.
+    uint64_t arrival = atomic_load_explicit(&audio->arrivals_written, memory_order_relaxed);
+    if (frames > 0 &&
+        arrival - atomic_load_explicit(&audio->arrivals_read, memory_order_acquire) < CRDP_AUDIO_ARRIVALS) {
+        audio->arrivals[arrival % CRDP_AUDIO_ARRIVALS] = (crdp_audio_arrival_t){ write, now };
+        atomic_store_explicit(&audio->arrivals_written, arrival + 1, memory_order_release);
+    }
+    atomic_store_explicit(&audio->write_pos, write + frames, memory_order_release);
+
+    return crdp_audio_ms(audio, write + frames - read) + audio->sink->latency_ms;
+}
+
+static void crdp_audio_free(rdpsndDevicePlugin* device) {
+    crdp_audio_t* audio = (crdp_audio_t*)device;
+    if (!audio) return;
+    crdp_audio_close(device);
+    if (audio->sink) audio->sink->free(audio->sink);
+    free(audio);
+}
+
+// rdpsnd's entry point for the "crdp" subsystem
+static UINT VCAPITYPE crdp_audio_device_entry(PFREERDP_RDPSND_DEVICE_ENTRY_POINTS entry_points) {
+    crdp_context* ctx = (crdp_context*)freerdp_rdpsnd_get_context(entry_points->rdpsnd);
+    if (!ctx || !ctx->client) return ERROR_INVALID_PARAMETER;
+    const crdp_config_t* cfg = &ctx->client->config;
+
+    crdp_audio_t* audio = calloc(1, sizeof(*audio));
+    if (!audio) return CHANNEL_RC_NO_MEMORY;
+    audio->metrics = &ctx->client->audio;
+    atomic_init(&audio->volume, 0xFFFFFFFF);
+    audio->min_latency_ms = cfg->audio_min_latency_ms ? cfg->audio_min_latency_ms : CRDP_AUDIO_MIN_LATENCY_MS;
+    audio->max_latency_ms = cfg->audio_max_latency_ms ? cfg->audio_max_latency_ms : CRDP_AUDIO_MAX_LATENCY_MS;
+    if (audio->max_latency_ms < audio->min_latency_ms) audio->max_latency_ms = audio->min_latency_ms;
+
+    switch (cfg->audio_output) {
+        case CRDP_AUDIO_WAV: audio->sink = crdp_audio_sink_wav_new(audio, cfg->audio_wav_path); break;
+        case CRDP_AUDIO_NULL: audio->sink = crdp_audio_sink_null_new(audio); break;
+        default: audio->sink = crdp_audio_sink_device_new(audio); break;
+    }
+    if (!audio->sink) {
+        free(audio);
+        return CHANNEL_RC_INITIALIZATION_ERROR;
+    }
+
+    audio->device.FormatSupported = crdp_audio_format_supported;
+    audio->device.DefaultFormat = crdp_audio_default_format;
+    audio->device.Open = crdp_audio_open;
+    audio->device.Close = crdp_audio_close;
+    audio->device.Play = crdp_audio_play;
+    audio->device.GetVolume = crdp_audio_get_volume;
+    audio->device.SetVolume = crdp_audio_set_volume;
+    audio->device.Free = crdp_audio_free;
+    return entry_points->pRegisterRdpsndDevice(entry_points->rdpsnd, &audio->device);
+}
+
+PVIRTUALCHANNELENTRY crdp_audio_addin_entry(LPCSTR name, LPCSTR subsystem) {
+    if (name && subsystem && strcmp(name, "rdpsnd") == 0 && strcmp(subsystem, "crdp") == 0) {
+        return (PVIRTUALCHANNELENTRY)crdp_audio_device_entry;
+    }
+    return NULL;
+}
+
+void crdp_audio_reset(crdp_client_t* client) {
+    crdp_audio_metrics_t* m = &client->audio;
+    atomic_store(&m->playing, false);
+    atomic_store(&m->sample_rate, 0);
+    atomic_store(&m->channels, 0);
+    atomic_store(&m->target_ms, 0);
+    atomic_store(&m->buffered_ms, 0);
+    atomic_store(&m->jitter_ms, 0);
+    atomic_store(&m->frames_played, 0);
+    atomic_store(&m->underruns, 0);
+    atomic_store(&m->concealed_frames, 0);
+    atomic_store(&m->dropped_frames, 0);
+}
+
+int crdp_get_audio_stats(crdp_client_t* client, crdp_audio_stats_t* stats) {
+    if (!client || !stats) return -1;
+    if (client->config.audio_output == CRDP_AUDIO_OFF) return -2;
+    crdp_audio_metrics_t* m = &client->audio;
+    memset(stats, 0, sizeof(*stats));
+    stats->playing = atomic_load(&m->playing);
+    stats->sample_rate = atomic_load(&m->sample_rate);
+    stats->channels = (uint16_t)atomic_load(&m->channels);
+    stats->target_ms = atomic_load(&m->target_ms);
+    stats->buffered_ms = atomic_load(&m->buffered_ms);
+    stats->jitter_ms = atomic_load(&m->jitter_ms);
+    stats->frames_played = atomic_load(&m->frames_played);
+    stats->underruns = atomic_load(&m->underruns);
+    stats->concealed_frames = atomic_load(&m->concealed_frames);
+    stats->dropped_frames = atomic_load(&m->dropped_frames);
+    return 0;
+}
@@ -0,0 +1,283 @@
+#include "crdp_internal.h"
+
+#include <winpr/wlog.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __APPLE__
+#include <AudioToolbox/AudioToolbox.h>
+#endif
+
+// Audio sinks. Each pulls audio with crdp_audio_render on its own clock: the
+// output device from its render callback, the WAV and null sinks from a
+// thread that renders a period at a time in step with the wall clock.
+
+#define CRDP_AUDIO_SINK_PERIOD_MS 10
+
+// Paced sinks
+
+typedef struct {
+    crdp_audio_sink_t base;
+    crdp_audio_t* audio;
+    crdp_audio_format_t format;
+    pthread_t thread;
+    bool running;
+    _Atomic bool stop;
+    // WAV only
+    char* path;
+    FILE* file;
+    uint64_t data_bytes;
+} crdp_audio_paced_t;
+
+static uint8_t* crdp_audio_put_le(uint8_t* p, uint32_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) *p++ = (uint8_t)(value >> (8 * i));
+    return p;
+}
+
+// Canonical 44-byte header; rewritten with the real sizes when the stream stops
+static void crdp_audio_wav_header(FILE* file, const crdp_audio_format_t* format, uint64_t data_bytes) {
+    uint32_t data = data_bytes > UINT32_MAX - 36 ? UINT32_MAX - 36 : (uint32_t)data_bytes;
+    uint32_t block = (uint32_t)format->channels * 2;
+    uint8_t header[44];
+    uint8_t* p = header;
+    memcpy(p, "RIFF", 4);
+    p = crdp_audio_put_le(p + 4, 36 + data, 4);
+    memcpy(p, "WAVEfmt ", 8);
+    p = crdp_audio_put_le(p + 8, 16, 4);            // fmt chunk size
+    p = crdp_audio_put_le(p, 1, 2);                 // PCM
+    p = crdp_audio_put_le(p, format->channels, 2);
+    p = crdp_audio_put_le(p, format->rate, 4);
+    p = crdp_audio_put_le(p, format->rate * block, 4);
+    p = crdp_audio_put_le(p, block, 2);
+    p = crdp_audio_put_le(p, 16, 2);                // Bits per sample
+    memcpy(p, "data", 4);
+    crdp_audio_put_le(p + 4, data, 4);
+    fseek(file, 0, SEEK_SET);
+    fwrite(header, 1, sizeof(header), file);
+    fseek(file, 0, SEEK_END);
+}
+
+static void* crdp_audio_paced_run(void* arg) {
+    crdp_audio_paced_t* sink = (crdp_audio_paced_t*)arg;
+    uint32_t frames = sink->format.rate * CRDP_AUDIO_SINK_PERIOD_MS / 1000;
+    int16_t* buf = malloc((size_t)frames * sink->format.channels * sizeof(int16_t));
+    if (!buf) return NULL;
+
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (!atomic_load(&sink->stop)) {
+        crdp_audio_render(sink->audio, buf, frames);
+        if (sink->file) {
+            size_t bytes = (size_t)frames * sink->format.channels * sizeof(int16_t);
+            if (fwrite(buf, 1, bytes, sink->file) == bytes) sink->data_bytes += bytes;
+        }
+        // Absolute deadlines, so time spent rendering doesn't add up
+        next.tv_nsec += CRDP_AUDIO_SINK_PERIOD_MS * 1000000L;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int64_t wait = (int64_t)(next.tv_sec - now.tv_sec) * 1000000000LL + (next.tv_nsec - now.tv_nsec);
+        if (wait > 0) {
+            struct timespec ts = { (time_t)(wait / 1000000000LL), (long)(wait % 1000000000LL) };
+            while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+            }
+        } else if (wait < -100000000LL) {
+            // Fell far behind (suspended); don't try to catch up
+            next = now;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static bool crdp_audio_paced_start(crdp_audio_sink_t* base, const crdp_audio_format_t* format) {
+    crdp_audio_paced_t* sink = (crdp_audio_paced_t*)base;
+    sink->format = *format;
+    if (sink->path) {
+        // Each stream replaces the file; a WAV file has only one format
+        sink->file = fopen(sink->path, "wb");
+        if (!sink->file) {
+            WLog_ERR(CRDP_TAG, "Failed to open %s: %s", sink->path, strerror(errno));
+            return false;
+        }
+        sink->data_bytes = 0;
+        crdp_audio_wav_header(sink->file, format, 0);
+    }
+    atomic_store(&sink->stop, false);
+    if (pthread_create(&sink->thread, NULL, crdp_audio_paced_run, sink) != 0) {
+        if (sink->file) fclose(sink->file);
+        sink->file = NULL;
+        return false;
+    }
+    sink->running = true;
+    return true;
+}
+
+static void crdp_audio_paced_stop(crdp_audio_sink_t* base) {
+    crdp_audio_paced_t* sink = (crdp_audio_paced_t*)base;
+    if (!sink->running) return;
+    atomic_store(&sink->stop, true);
+    pthread_join(sink->thread, NULL);
+    sink->running = false;
+    if (sink->file) {
+        crdp_audio_wav_header(sink->file, &sink->format, sink->data_bytes);
+        fclose(sink->file);
+        sink->file = NULL;
+    }
+}
+
+static void crdp_audio_paced_free(crdp_audio_sink_t* base) {
+    crdp_audio_paced_t* sink = (crdp_audio_paced_t*)base;
+    crdp_audio_paced_stop(base);
+    free(sink->path);
+    free(sink);
+}
+
+static crdp_audio_paced_t* crdp_audio_paced_new(crdp_audio_t* audio) {
+    crdp_audio_paced_t* sink = calloc(1, sizeof(*sink));
+    if (!sink) return NULL;
+    sink->audio = audio;
+    sink->base.start = crdp_audio_paced_start;
+    sink->base.stop = crdp_audio_paced_stop;
+    sink->base.free = crdp_audio_paced_free;
+    sink->base.latency_ms = CRDP_AUDIO_SINK_PERIOD_MS;
+    return sink;
+}
+
+crdp_audio_sink_t* crdp_audio_sink_null_new(crdp_audio_t* audio) {
+    crdp_audio_paced_t* sink = crdp_audio_paced_new(audio);
+    return sink ? &sink->base : NULL;
+}
+
+crdp_audio_sink_t* crdp_audio_sink_wav_new(crdp_audio_t* audio, const char* path) {
+    if (!path || !path[0]) {
+        WLog_ERR(CRDP_TAG, "WAV audio output needs a path");
+        return NULL;
+    }
+    crdp_audio_paced_t* sink = crdp_audio_paced_new(audio);
+    if (!sink) return NULL;
+    sink->path = strdup(path);
+    if (!sink->path) {
+        free(sink);
+        return NULL;
+    }
+    return &sink->base;
+}
+
+// Output device
+
+#ifdef __APPLE__
+
+typedef struct {
+    crdp_audio_sink_t base;
+    crdp_audio_t* audio;
+    AudioComponentInstance unit;
+} crdp_audio_device_t;
+
+// Core Audio's real-time thread: no locks, no allocation
+static OSStatus crdp_audio_device_render(void* ref, AudioUnitRenderActionFlags* flags, const AudioTimeStamp* time,
+                                         UInt32 bus, UInt32 frames, AudioBufferList* data) {
+    crdp_audio_device_t* sink = (crdp_audio_device_t*)ref;
+    (void)flags;
+    (void)time;
+    (void)bus;
+    crdp_audio_render(sink->audio, (int16_t*)data->mBuffers[0].mData, frames);
+    return noErr;
+}
+
+static void crdp_audio_device_stop(crdp_audio_sink_t* base) {
+    crdp_audio_device_t* sink = (crdp_audio_device_t*)base;
+    if (!sink->unit) return;
+    // Synchronous: the render callback has returned for good afterwards
+    AudioOutputUnitStop(sink->unit);
+    AudioUnitUninitialize(sink->unit);
+    AudioComponentInstanceDispose(sink->unit);
+    sink->unit = NULL;
+}
+
+static bool crdp_audio_device_start(crdp_audio_sink_t* base, const crdp_audio_format_t* format) {
+    crdp_audio_device_t* sink = (crdp_audio_device_t*)base;
+    AudioComponentDescription desc = {
+        .componentType = kAudioUnitType_Output,
+        .componentSubType = kAudioUnitSubType_DefaultOutput,
+        .componentManufacturer = kAudioUnitManufacturer_Apple,
+    };
+    AudioComponent component = AudioComponentFindNext(NULL, &desc);
+    if (!component || AudioComponentInstanceNew(component, &sink->unit) != noErr) {
+        sink->unit = NULL;
+        return false;
+    }
+
+    AudioStreamBasicDescription asbd = {
+        .mSampleRate = format->rate,
+        .mFormatID = kAudioFormatLinearPCM,
+        .mFormatFlags = kAudioFormatFlagIsSignedInteger | kAudioFormatFlagIsPacked,
+        .mBytesPerPacket = (UInt32)format->channels * 2,
+        .mFramesPerPacket = 1,
+        .mBytesPerFrame = (UInt32)format->channels * 2,
+        .mChannelsPerFrame = format->channels,
+        .mBitsPerChannel = 16,
+    };
+    AURenderCallbackStruct callback = { crdp_audio_device_render, sink };
+    OSStatus rc = AudioUnitSetProperty(sink->unit, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Input, 0,
+                                       &asbd, sizeof(asbd));
+    if (rc == noErr) {
+        rc = AudioUnitSetProperty(sink->unit, kAudioUnitProperty_SetRenderCallback, kAudioUnitScope_Input, 0,
+                                  &callback, sizeof(callback));
+    }
+    if (rc == noErr) rc = AudioUnitInitialize(sink->unit);
+    if (rc != noErr) {
+        WLog_ERR(CRDP_TAG, "Failed to set up the audio output unit: %d", (int)rc);
+        AudioComponentInstanceDispose(sink->unit);
+        sink->unit = NULL;
+        return false;
+    }
+
+    // Latency of the unit plus one I/O buffer
+    Float64 latency = 0;
+    UInt32 size = sizeof(latency);
+    AudioUnitGetProperty(sink->unit, kAudioUnitProperty_Latency, kAudioUnitScope_Global, 0, &latency, &size);
+    UInt32 buffer_frames = 0;
+    size = sizeof(buffer_frames);
+    AudioUnitGetProperty(sink->unit, kAudioDevicePropertyBufferFrameSize, kAudioUnitScope_Global, 0, &buffer_frames,
+                         &size);
+    sink->base.latency_ms = (uint32_t)(latency * 1000) + buffer_frames * 1000 / format->rate;
+
+    if (AudioOutputUnitStart(sink->unit) != noErr) {
+        crdp_audio_device_stop(base);
+        return false;
+    }
+    return true;
+}
+
+static void crdp_audio_device_free(crdp_audio_sink_t* base) {
+    crdp_audio_device_stop(base);
+    free(base);
+}
+
+crdp_audio_sink_t* crdp_audio_sink_device_new(crdp_audio_t* audio) {
+    crdp_audio_device_t* sink = calloc(1, sizeof(*sink));
+    if (!sink) return NULL;
+    sink->audio = audio;
+    sink->base.start = crdp_audio_device_start;
+    sink->base.stop = crdp_audio_device_stop;
+    sink->base.free = crdp_audio_device_free;
+    return &sink->base;
+}
+
+#else
+
+// No output device support elsewhere; play into nothing
+crdp_audio_sink_t* crdp_audio_sink_device_new(crdp_audio_t* audio) {
+    WLog_WARN(CRDP_TAG, "No audio output device support on this platform, using the null sink");
+    return crdp_audio_sink_null_new(audio);
+}
+
+#endif
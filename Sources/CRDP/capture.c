@@ -0,0 +1,195 @@
+#include "crdp_internal.h"
+
+#include <freerdp/gdi/gdi.h>
+#include <winpr/wlog.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Screenshots. The protocol thread is only held up by the copy taken under
+// paint_lock; encoding and writing happen on the capture thread, one
+// snapshot at a time.
+
+#define CRDP_CAPTURE_DEFAULT_LEVEL 1
+// Each one holds a full framebuffer copy
+#define CRDP_CAPTURE_MAX_QUEUED 4
+
+struct crdp_capture_job {
+    crdp_capture_job_t* next;
+    uint8_t* pixels;
+    uint32_t width;
+    uint32_t height;
+    int level;
+    crdp_png_filter_t filter;
+    char* path;
+    crdp_capture_cb cb;
+    void* user;
+};
+
+static void crdp_capture_job_free(crdp_capture_job_t* job) {
+    free(job->pixels);
+    free(job->path);
+    free(job);
+}
+
+static bool crdp_capture_write(const char* path, const uint8_t* png, size_t len) {
+    size_t path_len = strlen(path);
+    char* tmp = malloc(path_len + 5);
+    if (!tmp) return false;
+    memcpy(tmp, path, path_len);
+    memcpy(tmp + path_len, ".tmp", 5);
+    FILE* file = fopen(tmp, "wb");
+    bool ok = file && fwrite(png, 1, len, file) == len;
+    if (file && fclose(file) != 0) ok = false;
+    if (ok && rename(tmp, path) != 0) ok = false;
+    if (!ok) {
+        WLog_ERR(CRDP_TAG, "Failed to write screenshot %s: %s", path, strerror(errno));
+        if (file) remove(tmp);
+    }
+    free(tmp);
+    return ok;
+}
+
+static void crdp_capture_run_job(crdp_capture_job_t* job) {
+    uint8_t* png = NULL;
+    size_t len = 0;
+    if (crdp_png_encode(job->pixels, job->width, job->height, job->width * 4, job->level, job->filter, &png,
+                        &len) != 0) {
+        WLog_ERR(CRDP_TAG, "Failed to encode a %ux%u screenshot", job->width, job->height);
+        png = NULL;
+    }
+    // The copy is no longer needed; release it before calling out
+    free(job->pixels);
+    job->pixels = NULL;
+    if (png && job->path && !crdp_capture_write(job->path, png, len)) {
+        free(png);
+        png = NULL;
+    }
+    if (job->cb) job->cb(png, png ? len : 0, job->width, job->height, job->user);
+    free(png);
+}
+
+static void* crdp_capture_thread(void* arg) {
+    crdp_capturer_t* c = (crdp_capturer_t*)arg;
+    pthread_mutex_lock(&c->lock);
+    for (;;) {
+        while (!c->head && !c->stop) pthread_cond_wait(&c->cond, &c->lock);
+        crdp_capture_job_t* job = c->head;
+        if (!job) break;
+        c->head = job->next;
+        if (!c->head) c->tail = NULL;
+        pthread_mutex_unlock(&c->lock);
+
+        crdp_capture_run_job(job);
+        crdp_capture_job_free(job);
+
+        pthread_mutex_lock(&c->lock);
+        c->queued--;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+void crdp_capture_init(crdp_client_t* client) {
+    crdp_capturer_t* c = &client->capture;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->cond, NULL);
+}
+
+void crdp_capture_free(crdp_client_t* client) {
+    crdp_capturer_t* c = &client->capture;
+    pthread_mutex_lock(&c->lock);
+    bool running = c->running;
+    c->stop = true;
+    pthread_cond_signal(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+
+    if (running) pthread_join(c->thread, NULL);
+    pthread_cond_destroy(&c->cond);
+    pthread_mutex_destroy(&c->lock);
+}
+
+// Copies the framebuffer; NULL if there is none
+static crdp_capture_job_t* crdp_capture_snapshot(crdp_client_t* client) {
+    crdp_capture_job_t* job = NULL;
+    pthread_mutex_lock(&client->paint_lock);
+    rdpGdi* gdi = (client->gdi_ready && client->instance && client->instance->context)
+                      ? client->instance->context->gdi : NULL;
+    if (gdi && gdi->primary_buffer && gdi->width > 0 && gdi->height > 0) {
+        job = calloc(1, sizeof(*job));
+        if (job) {
+            job->width = (uint32_t)gdi->width;
+            job->height = (uint32_t)gdi->height;
+            job->pixels = malloc((size_t)job->width * job->height * 4);
+        }
+        if (job && job->pixels) {
+            size_t row = (size_t)job->width * 4;
+            if (gdi->stride == row) {
+                memcpy(job->pixels, gdi->primary_buffer, row * job->height);
+            } else {
+                for (uint32_t y = 0; y < job->height; y++) {
+                    memcpy(job->pixels + y * row, gdi->primary_buffer + (size_t)y * gdi->stride, row);
+                }
+            }
+        } else if (job) {
+            crdp_capture_job_free(job);
+            job = NULL;
+        }
+    }
+    pthread_mutex_unlock(&client->paint_lock);
+    return job;
+}
+
+int crdp_capture_png(crdp_client_t* client, const char* path, const crdp_capture_options_t* options,
+                     crdp_capture_cb cb, void* user) {
+    if (!client || (!path && !cb)) return -1;
+    if (options && (options->level < 0 || options->level > 9 || options->filter < CRDP_PNG_FILTER_ADAPTIVE ||
+                    options->filter > CRDP_PNG_FILTER_PAETH)) {
+        return -1;
+    }
+    crdp_capturer_t* c = &client->capture;
+
+    // Checked before copying, so a busy encoder doesn't cost a copy
+    pthread_mutex_lock(&c->lock);
+    bool full = c->stop || c->queued >= CRDP_CAPTURE_MAX_QUEUED;
+    if (!full) c->queued++;
+    pthread_mutex_unlock(&c->lock);
+    if (full) return -3;
+
+    crdp_capture_job_t* job = crdp_capture_snapshot(client);
+    char* path_copy = job && path ? strdup(path) : NULL;
+    if (!job || (path && !path_copy)) {
+        if (job) crdp_capture_job_free(job);
+        pthread_mutex_lock(&c->lock);
+        c->queued--;
+        pthread_mutex_unlock(&c->lock);
+        return -2;
+    }
+    job->path = path_copy;
+    job->level = options && options->level ? options->level : CRDP_CAPTURE_DEFAULT_LEVEL;
+    job->filter = options ? options->filter : CRDP_PNG_FILTER_ADAPTIVE;
+    job->cb = cb;
+    job->user = user;
+
+    pthread_mutex_lock(&c->lock);
+    if (!c->running) {
+        if (pthread_create(&c->thread, NULL, crdp_capture_thread, c) != 0) {
+            c->queued--;
+            pthread_mutex_unlock(&c->lock);
+            crdp_capture_job_free(job);
+            return -2;
+        }
+        c->running = true;
+    }
+    if (c->tail) {
+        c->tail->next = job;
+    } else {
+        c->head = job;
+    }
+    c->tail = job;
+    pthread_cond_signal(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+    return 0;
+}
@@ -1,14 +1,16 @@
 #import <AppKit/AppKit.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 
-// Callback for clipboard changes
-static void (*g_clipboard_change_callback)(void* ctx) = NULL;
-static void* g_clipboard_change_ctx = NULL;
+// Host clipboard watcher state, shared by every session. Guards the
+// subscriber list, g_last_change_count and the monitor's wakeup state.
+static pthread_mutex_t g_monitor_lock = PTHREAD_MUTEX_INITIALIZER;
 static NSInteger g_last_change_count = 0;
-static pthread_t g_monitor_thread;
-static volatile int g_monitor_running = 0;
 
 // Get text from macOS clipboard
 char* crdp_clipboard_get_text(void) {
@@ -23,21 +25,365 @@ char* crdp_clipboard_get_text(void) {
     return NULL;
 }
 
-// Set text to macOS clipboard (without triggering our own callback)
-int crdp_clipboard_set_text(const char* text) {
-    if (!text) return -1;
+// Get text from macOS clipboard as null-terminated UTF-16LE. NSString already
+// holds UTF-16, so the characters are copied chunk by chunk straight into the
+// output buffer; nothing else proportional to the text is allocated.
+#define CRDP_CLIPBOARD_CHUNK_UNITS (64 * 1024)
+
+typedef bool (*crdp_clipboard_chunk_fn)(void* ctx, size_t done_bytes, size_t total_bytes);
+
+int crdp_clipboard_get_utf16(size_t max_bytes, crdp_clipboard_chunk_fn chunk, void* ctx,
+                             uint8_t** out, size_t* out_bytes) {
+    if (!out || !out_bytes) return -4;
+    *out = NULL;
+    *out_bytes = 0;
     @autoreleasepool {
         NSPasteboard *pasteboard = [NSPasteboard generalPasteboard];
-        [pasteboard clearContents];
-        NSString *str = [NSString stringWithUTF8String:text];
-        if (str) {
-            [pasteboard setString:str forType:NSPasteboardTypeString];
-            // Update change count so we don't trigger callback for our own change
-            g_last_change_count = [pasteboard changeCount];
-            return 0;
+        NSString *text = [pasteboard stringForType:NSPasteboardTypeString];
+        if (!text) return -1;
+
+        NSUInteger units = [text length];
+        size_t bytes = ((size_t)units + 1) * sizeof(unichar);
+        if (max_bytes && bytes > max_bytes) return -2;
+
+        unichar* buf = malloc(bytes);
+        if (!buf) return -4;
+        for (NSUInteger pos = 0; pos < units; pos += CRDP_CLIPBOARD_CHUNK_UNITS) {
+            NSUInteger n = MIN((NSUInteger)CRDP_CLIPBOARD_CHUNK_UNITS, units - pos);
+            // unichar is host order, which is little-endian on every Mac
+            [text getCharacters:buf + pos range:NSMakeRange(pos, n)];
+            if (chunk && !chunk(ctx, (pos + n) * sizeof(unichar), bytes)) {
+                free(buf);
+                return -3;
+            }
         }
+        buf[units] = 0;
+        *out = (uint8_t*)buf;
+        *out_bytes = bytes;
     }
-    return -1;
+    return 0;
+}
+
+// File URLs on the clipboard, e.g. files copied in Finder
+static NSArray<NSURL*>* crdp_clipboard_file_urls(NSPasteboard *pasteboard) {
+    return [pasteboard readObjectsForClasses:@[[NSURL class]]
+                                     options:@{NSPasteboardURLReadingFileURLsOnlyKey: @YES}];
+}
+
+bool crdp_clipboard_has_files(void) {
+    @autoreleasepool {
+        return [[NSPasteboard generalPasteboard] canReadObjectForClasses:@[[NSURL class]]
+                                                                 options:@{NSPasteboardURLReadingFileURLsOnlyKey: @YES}];
+    }
+}
+
+int crdp_clipboard_get_file_paths(char*** paths, size_t* count) {
+    if (!paths || !count) return -1;
+    *paths = NULL;
+    *count = 0;
+    @autoreleasepool {
+        NSArray<NSURL*> *urls = crdp_clipboard_file_urls([NSPasteboard generalPasteboard]);
+        if (urls.count == 0) return -1;
+        char** out = calloc(urls.count, sizeof(char*));
+        if (!out) return -1;
+        size_t n = 0;
+        for (NSURL *url in urls) {
+            const char *path = url.fileSystemRepresentation;
+            if (path && (out[n] = strdup(path))) n++;
+        }
+        if (n == 0) {
+            free(out);
+            return -1;
+        }
+        *paths = out;
+        *count = n;
+    }
+    return 0;
+}
+
+// Clipboard types shared with the C side (crdp_clip_type_t in crdp_internal.h,
+// which can't be included here: WinPR's BOOL clashes with Objective-C's)
+typedef enum {
+    CRDP_CLIP_TEXT = 0,
+    CRDP_CLIP_HTML = 1,
+    CRDP_CLIP_RTF = 2,
+    CRDP_CLIP_PNG = 3,
+    CRDP_CLIP_TIFF = 4,
+    CRDP_CLIP_TYPE_COUNT
+} crdp_clip_type_t;
+
+typedef enum {
+    CRDP_IMAGE_PNG = 0,
+    CRDP_IMAGE_TIFF = 1
+} crdp_image_format_t;
+
+// Largest image decoded, in pixels per side
+#define CRDP_CLIPBOARD_IMAGE_MAX_SIDE 32768
+
+static NSPasteboardType crdp_clipboard_pasteboard_type(crdp_clip_type_t type) {
+    switch (type) {
+        case CRDP_CLIP_TEXT: return NSPasteboardTypeString;
+        case CRDP_CLIP_HTML: return NSPasteboardTypeHTML;
+        case CRDP_CLIP_RTF: return NSPasteboardTypeRTF;
+        case CRDP_CLIP_PNG: return NSPasteboardTypePNG;
+        case CRDP_CLIP_TIFF: return NSPasteboardTypeTIFF;
+        default: return nil;
+    }
+}
+
+uint32_t crdp_clipboard_types(void) {
+    uint32_t types = 0;
+    @autoreleasepool {
+        NSArray<NSPasteboardType> *available = [[NSPasteboard generalPasteboard] types];
+        for (int i = 0; i < CRDP_CLIP_TYPE_COUNT; i++) {
+            if ([available containsObject:crdp_clipboard_pasteboard_type(i)]) types |= 1u << i;
+        }
+    }
+    return types;
+}
+
+static int crdp_clipboard_copy_out(const void* bytes, size_t len, uint8_t** out, size_t* out_len) {
+    uint8_t* copy = malloc(len ? len : 1);
+    if (!copy) return -1;
+    memcpy(copy, bytes, len);
+    *out = copy;
+    *out_len = len;
+    return 0;
+}
+
+// Pasteboard data as stored; HTML comes back as UTF-8 whatever its encoding
+int crdp_clipboard_get_data(crdp_clip_type_t type, uint8_t** out, size_t* len) {
+    if (!out || !len) return -1;
+    *out = NULL;
+    *len = 0;
+    NSPasteboardType pbType = crdp_clipboard_pasteboard_type(type);
+    if (!pbType) return -1;
+    @autoreleasepool {
+        NSPasteboard *pasteboard = [NSPasteboard generalPasteboard];
+        if (type == CRDP_CLIP_TEXT || type == CRDP_CLIP_HTML) {
+            NSString *str = [pasteboard stringForType:pbType];
+            const char *utf8 = str ? [str UTF8String] : NULL;
+            return utf8 ? crdp_clipboard_copy_out(utf8, strlen(utf8), out, len) : -1;
+        }
+        NSData *data = [pasteboard dataForType:pbType];
+        if (!data || [data length] == 0) return -1;
+        return crdp_clipboard_copy_out([data bytes], [data length], out, len);
+    }
+}
+
+// Any image format NSBitmapImageRep reads (PNG, TIFF, BMP, ...) as
+// premultiplied RGBA
+int crdp_image_decode_rgba(const uint8_t* data, size_t len, uint8_t** rgba, uint32_t* width, uint32_t* height) {
+    if (!data || !rgba || !width || !height) return -1;
+    *rgba = NULL;
+    @autoreleasepool {
+        NSData *input = [NSData dataWithBytesNoCopy:(void*)data length:len freeWhenDone:NO];
+        NSBitmapImageRep *rep = [NSBitmapImageRep imageRepWithData:input];
+        CGImageRef image = rep ? [rep CGImage] : NULL;
+        if (!image) return -1;
+        size_t w = CGImageGetWidth(image);
+        size_t h = CGImageGetHeight(image);
+        if (w == 0 || h == 0 || w > CRDP_CLIPBOARD_IMAGE_MAX_SIDE || h > CRDP_CLIPBOARD_IMAGE_MAX_SIDE) return -1;
+
+        uint8_t* buf = calloc(w * h, 4);
+        if (!buf) return -1;
+        CGColorSpaceRef space = CGColorSpaceCreateWithName(kCGColorSpaceSRGB);
+        CGContextRef cg = CGBitmapContextCreate(buf, w, h, 8, w * 4, space,
+                                                kCGImageAlphaPremultipliedLast | kCGBitmapByteOrder32Big);
+        CGColorSpaceRelease(space);
+        if (!cg) {
+            free(buf);
+            return -1;
+        }
+        CGContextDrawImage(cg, CGRectMake(0, 0, w, h), image);
+        CGContextRelease(cg);
+        *rgba = buf;
+        *width = (uint32_t)w;
+        *height = (uint32_t)h;
+    }
+    return 0;
+}
+
+// Re-encode an image in any format NSBitmapImageRep reads
+int crdp_image_encode(const uint8_t* data, size_t len, crdp_image_format_t format, uint8_t** out, size_t* out_len) {
+    if (!data || !out || !out_len) return -1;
+    *out = NULL;
+    @autoreleasepool {
+        NSData *input = [NSData dataWithBytesNoCopy:(void*)data length:len freeWhenDone:NO];
+        NSBitmapImageRep *rep = [NSBitmapImageRep imageRepWithData:input];
+        if (!rep) return -1;
+        if (rep.pixelsWide > CRDP_CLIPBOARD_IMAGE_MAX_SIDE || rep.pixelsHigh > CRDP_CLIPBOARD_IMAGE_MAX_SIDE) return -1;
+        NSData *encoded = format == CRDP_IMAGE_PNG
+            ? [rep representationUsingType:NSBitmapImageFileTypePNG properties:@{}]
+            : [rep TIFFRepresentation];
+        if (!encoded) return -1;
+        return crdp_clipboard_copy_out([encoded bytes], [encoded length], out, out_len);
+    }
+}
+
+// Host clipboard change detection.
+//
+// macOS posts no notification when the pasteboard changes, so the monitor
+// polls changeCount - but only while the session can paste. While another
+// app is frontmost it sleeps outright; when this app is activated (the usual
+// way a copy elsewhere reaches the session) it checks immediately. While this
+// app stays frontmost the interval starts short after a change and backs off
+// while nothing happens.
+#define CRDP_CLIPBOARD_POLL_MIN_MS 250
+#define CRDP_CLIPBOARD_POLL_MAX_MS 2000
+
+uint64_t crdp_hash64(const void* data, size_t len, uint64_t seed);
+
+static pthread_cond_t g_monitor_cond = PTHREAD_COND_INITIALIZER;
+static bool g_app_active = false;   // This app is frontmost
+static bool g_check_now = false;    // Check without waiting for the interval
+static id g_activate_observer = nil;
+static id g_deactivate_observer = nil;
+static pthread_t g_monitor_thread;
+static volatile int g_monitor_running = 0;
+
+// Sessions told about host clipboard changes
+#define CRDP_CLIPBOARD_MAX_SUBSCRIBERS 64
+
+typedef struct {
+    void (*callback)(void* ctx, uint64_t content_hash);
+    void* ctx;
+} crdp_clipboard_subscriber_t;
+
+static crdp_clipboard_subscriber_t g_subscribers[CRDP_CLIPBOARD_MAX_SUBSCRIBERS];
+static int g_subscriber_count = 0;
+static int g_dispatching = 0;       // Change callbacks running on the monitor thread
+static pthread_cond_t g_dispatch_cond = PTHREAD_COND_INITIALIZER;
+// Serializes subscribe/unsubscribe, which start and stop the monitor
+static pthread_mutex_t g_subscribe_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The last promise written and the session it came from; that session
+// already knows about the change
+static NSInteger g_promise_change_count = -1;
+static void* g_promise_owner = NULL;
+
+
+// Hash of the content behind g_hash_change_count; guarded by g_monitor_lock
+static NSInteger g_hash_change_count = -1;
+static uint64_t g_hash = 0;
+
+// A session's server data was promised on the clipboard. Every other session
+// is told about it. The content is only fetched on paste, so it is identified
+// by session and generation rather than hashed.
+static void crdp_clipboard_promised(void* ctx, uint32_t generation, NSInteger change_count) {
+    uint64_t id[2] = { (uint64_t)(uintptr_t)ctx, generation };
+    pthread_mutex_lock(&g_monitor_lock);
+    g_promise_change_count = change_count;
+    g_promise_owner = ctx;
+    g_hash_change_count = change_count;
+    g_hash = crdp_hash64(id, sizeof(id), 0);
+    g_check_now = true;
+    pthread_cond_signal(&g_monitor_cond);
+    pthread_mutex_unlock(&g_monitor_lock);
+}
+
+// Provides server clipboard data on demand (delayed rendering)
+typedef uint8_t* (*crdp_clipboard_provide_fn)(void* ctx, uint32_t generation, crdp_clip_type_t type,
+                                              size_t* len);
+
+@interface CRDPClipboardPromise : NSObject <NSPasteboardItemDataProvider>
+@property (nonatomic, assign) crdp_clipboard_provide_fn provide;
+@property (nonatomic, assign) void* ctx;
+@property (nonatomic, assign) uint32_t generation;
+@end
+
+// Guards the ctx of g_promise and counts provide() calls in progress
+static NSCondition* g_promise_lock = nil;
+static CRDPClipboardPromise* g_promise = nil;
+static int g_promise_calls = 0;
+
+static NSCondition* crdp_promise_lock(void) {
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{ g_promise_lock = [[NSCondition alloc] init]; });
+    return g_promise_lock;
+}
+
+@implementation CRDPClipboardPromise
+
+- (void)pasteboard:(NSPasteboard *)pasteboard item:(NSPasteboardItem *)item provideDataForType:(NSPasteboardType)type {
+    int clipType = -1;
+    for (int i = 0; i < CRDP_CLIP_TYPE_COUNT; i++) {
+        if ([type isEqualToString:crdp_clipboard_pasteboard_type(i)]) clipType = i;
+    }
+    if (clipType < 0) return;
+
+    NSCondition* lock = crdp_promise_lock();
+    [lock lock];
+    crdp_clipboard_provide_fn provide = self.provide;
+    void* ctx = self.ctx;
+    if (ctx) g_promise_calls++;
+    [lock unlock];
+    if (!ctx) return;
+
+    size_t len = 0;
+    uint8_t* data = provide(ctx, self.generation, (crdp_clip_type_t)clipType, &len);
+
+    [lock lock];
+    g_promise_calls--;
+    [lock broadcast];
+    [lock unlock];
+
+    if (!data) return;
+    if (clipType == CRDP_CLIP_TEXT || clipType == CRDP_CLIP_HTML) {
+        NSString *str = [[NSString alloc] initWithBytes:data length:len encoding:NSUTF8StringEncoding];
+        if (str) [item setString:str forType:type];
+    } else {
+        [item setData:[NSData dataWithBytes:data length:len] forType:type];
+    }
+    free(data);
+}
+
+@end
+
+// Replace the clipboard with a promise for server data; each type is only
+// asked for when something pastes it
+int crdp_clipboard_promise(crdp_clipboard_provide_fn provide, void* ctx, uint32_t generation, uint32_t types) {
+    if (!provide || !ctx || !types) return -1;
+    @autoreleasepool {
+        CRDPClipboardPromise* promise = [[CRDPClipboardPromise alloc] init];
+        promise.provide = provide;
+        promise.ctx = ctx;
+        promise.generation = generation;
+
+        NSCondition* lock = crdp_promise_lock();
+        [lock lock];
+        // Whatever the previous promise pointed at is no longer on the clipboard
+        g_promise.ctx = NULL;
+        g_promise = promise;
+        [lock unlock];
+
+        NSMutableArray<NSPasteboardType> *pbTypes = [NSMutableArray array];
+        for (int i = 0; i < CRDP_CLIP_TYPE_COUNT; i++) {
+            if (types & (1u << i)) [pbTypes addObject:crdp_clipboard_pasteboard_type(i)];
+        }
+        NSPasteboardItem *item = [[NSPasteboardItem alloc] init];
+        [item setDataProvider:promise forTypes:pbTypes];
+
+        NSPasteboard *pasteboard = [NSPasteboard generalPasteboard];
+        [pasteboard clearContents];
+        if (![pasteboard writeObjects:@[item]]) return -1;
+        crdp_clipboard_promised(ctx, generation, [pasteboard changeCount]);
+    }
+    return 0;
+}
+
+// Detach a session from the clipboard before it goes away
+void crdp_clipboard_revoke_promise(void* ctx) {
+    NSCondition* lock = crdp_promise_lock();
+    [lock lock];
+    if (g_promise && g_promise.ctx == ctx) g_promise.ctx = NULL;
+    // A paste may be resolving the promise right now
+    while (g_promise_calls > 0) [lock wait];
+    [lock unlock];
+
+    pthread_mutex_lock(&g_monitor_lock);
+    if (g_promise_owner == ctx) g_promise_owner = NULL;
+    pthread_mutex_unlock(&g_monitor_lock);
 }
 
 // Get current pasteboard change count
@@ -47,42 +393,205 @@ NSInteger crdp_clipboard_get_change_count(void) {
     }
 }
 
+// Identity of what is on the clipboard: the offered types, the text and any
+// file URLs, so equal text copied twice hashes the same even though
+// changeCount moves. HTML, RTF and image data are never read here: other apps
+// often only promise them, and producing a large TIFF for every copy would
+// be wasted when nothing is pasted into a session. When one of those types
+// is offered, changeCount stands in for their content; the data is only read
+// by crdp_clipformat_acquire, once a server asks for it.
+uint64_t crdp_clipboard_content_hash(void) {
+    @autoreleasepool {
+        NSPasteboard *pasteboard = [NSPasteboard generalPasteboard];
+        NSInteger count = [pasteboard changeCount];
+        pthread_mutex_lock(&g_monitor_lock);
+        bool known = count == g_hash_change_count;
+        uint64_t hash = g_hash;
+        pthread_mutex_unlock(&g_monitor_lock);
+        if (known) return hash;
+
+        NSString *types = [[pasteboard types] componentsJoinedByString:@"\n"];
+        const char *utf8 = types ? [types UTF8String] : "";
+        hash = crdp_hash64(utf8, strlen(utf8), 0);
+        NSData *text = [pasteboard dataForType:crdp_clipboard_pasteboard_type(CRDP_CLIP_TEXT)];
+        if (text) hash = crdp_hash64([text bytes], [text length], hash);
+        for (int i = 0; i < CRDP_CLIP_TYPE_COUNT; i++) {
+            if (i == CRDP_CLIP_TEXT) continue;
+            if ([pasteboard availableTypeFromArray:@[ crdp_clipboard_pasteboard_type(i) ]]) {
+                hash = crdp_hash64(&count, sizeof(count), hash);
+                break;
+            }
+        }
+        for (NSURL *url in crdp_clipboard_file_urls(pasteboard)) {
+            const char *path = url.fileSystemRepresentation;
+            if (path) hash = crdp_hash64(path, strlen(path), hash);
+        }
+
+        pthread_mutex_lock(&g_monitor_lock);
+        g_hash_change_count = count;
+        g_hash = hash;
+        pthread_mutex_unlock(&g_monitor_lock);
+        return hash;
+    }
+}
+
+static void crdp_clipboard_set_active(bool active) {
+    pthread_mutex_lock(&g_monitor_lock);
+    if (active && !g_app_active) g_check_now = true;
+    g_app_active = active;
+    pthread_cond_signal(&g_monitor_cond);
+    pthread_mutex_unlock(&g_monitor_lock);
+}
+
+static bool crdp_clipboard_is_self(NSNotification *note) {
+    NSRunningApplication *app = note.userInfo[NSWorkspaceApplicationKey];
+    return app && app.processIdentifier == getpid();
+}
+
+// Reports a change if changeCount moved since the last check. The content is
+// hashed once and the same hash goes to every subscribed session, except the
+// one whose promise made the change.
+static bool crdp_clipboard_check(void) {
+    NSInteger current = crdp_clipboard_get_change_count();
+    pthread_mutex_lock(&g_monitor_lock);
+    bool changed = current != g_last_change_count;
+    g_last_change_count = current;
+    void* owner = current == g_promise_change_count ? g_promise_owner : NULL;
+    pthread_mutex_unlock(&g_monitor_lock);
+    if (!changed) return false;
+
+    uint64_t hash = crdp_clipboard_content_hash();
+
+    crdp_clipboard_subscriber_t subscribers[CRDP_CLIPBOARD_MAX_SUBSCRIBERS];
+    pthread_mutex_lock(&g_monitor_lock);
+    int count = g_subscriber_count;
+    memcpy(subscribers, g_subscribers, (size_t)count * sizeof(subscribers[0]));
+    g_dispatching++;
+    pthread_mutex_unlock(&g_monitor_lock);
+
+    for (int i = 0; i < count; i++) {
+        if (subscribers[i].ctx != owner) subscribers[i].callback(subscribers[i].ctx, hash);
+    }
+
+    pthread_mutex_lock(&g_monitor_lock);
+    g_dispatching--;
+    pthread_cond_broadcast(&g_dispatch_cond);
+    pthread_mutex_unlock(&g_monitor_lock);
+    return true;
+}
+
 // Monitor thread function
 static void* clipboard_monitor_thread(void* arg) {
+    uint32_t interval_ms = CRDP_CLIPBOARD_POLL_MIN_MS;
+    pthread_mutex_lock(&g_monitor_lock);
     while (g_monitor_running) {
-        @autoreleasepool {
-            NSInteger current = [[NSPasteboard generalPasteboard] changeCount];
-            if (current != g_last_change_count) {
-                g_last_change_count = current;
-                if (g_clipboard_change_callback) {
-                    g_clipboard_change_callback(g_clipboard_change_ctx);
-                }
+        if (!g_check_now) {
+            if (!g_app_active) {
+                // Nothing here can paste into the session; no wakeups at all
+                pthread_cond_wait(&g_monitor_cond, &g_monitor_lock);
+                continue;
             }
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += interval_ms / 1000;
+            deadline.tv_nsec += (long)(interval_ms % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            if (pthread_cond_timedwait(&g_monitor_cond, &g_monitor_lock, &deadline) == 0) continue;
+        }
+        if (g_check_now) interval_ms = CRDP_CLIPBOARD_POLL_MIN_MS;
+        g_check_now = false;
+        pthread_mutex_unlock(&g_monitor_lock);
+
+        bool changed;
+        @autoreleasepool {
+            changed = crdp_clipboard_check();
         }
-        // Poll every 500ms
-        usleep(500000);
+        interval_ms = changed ? CRDP_CLIPBOARD_POLL_MIN_MS : MIN(interval_ms * 2, CRDP_CLIPBOARD_POLL_MAX_MS);
+
+        pthread_mutex_lock(&g_monitor_lock);
     }
+    pthread_mutex_unlock(&g_monitor_lock);
     return NULL;
 }
 
-// Start monitoring clipboard for changes
-void crdp_clipboard_start_monitor(void (*callback)(void* ctx), void* ctx) {
-    if (g_monitor_running) return;
-    
-    g_clipboard_change_callback = callback;
-    g_clipboard_change_ctx = ctx;
-    g_last_change_count = crdp_clipboard_get_change_count();
-    g_monitor_running = 1;
-    
-    pthread_create(&g_monitor_thread, NULL, clipboard_monitor_thread, NULL);
-}
-
-// Stop monitoring clipboard
-void crdp_clipboard_stop_monitor(void) {
-    if (!g_monitor_running) return;
-    
-    g_monitor_running = 0;
-    pthread_join(g_monitor_thread, NULL);
-    g_clipboard_change_callback = NULL;
-    g_clipboard_change_ctx = NULL;
+// Subscribe a session to host clipboard changes. The first subscriber starts
+// the monitor thread.
+int crdp_clipboard_subscribe(void (*callback)(void* ctx, uint64_t content_hash), void* ctx) {
+    if (!callback) return -1;
+    pthread_mutex_lock(&g_subscribe_lock);
+    pthread_mutex_lock(&g_monitor_lock);
+    if (g_subscriber_count == CRDP_CLIPBOARD_MAX_SUBSCRIBERS) {
+        pthread_mutex_unlock(&g_monitor_lock);
+        pthread_mutex_unlock(&g_subscribe_lock);
+        return -1;
+    }
+    g_subscribers[g_subscriber_count].callback = callback;
+    g_subscribers[g_subscriber_count].ctx = ctx;
+    g_subscriber_count++;
+    bool start = !g_monitor_running;
+    pthread_mutex_unlock(&g_monitor_lock);
+
+    if (start) {
+        bool active = [[NSRunningApplication currentApplication] isActive];
+        NSInteger count = crdp_clipboard_get_change_count();
+        pthread_mutex_lock(&g_monitor_lock);
+        g_last_change_count = count;
+        g_app_active = active;
+        g_check_now = false;
+        g_monitor_running = 1;
+        pthread_mutex_unlock(&g_monitor_lock);
+        start = pthread_create(&g_monitor_thread, NULL, clipboard_monitor_thread, NULL) == 0;
+        if (!start) {
+            pthread_mutex_lock(&g_monitor_lock);
+            g_monitor_running = 0;
+            pthread_mutex_unlock(&g_monitor_lock);
+        }
+    }
+    if (start) {
+        NSNotificationCenter *center = [[NSWorkspace sharedWorkspace] notificationCenter];
+        g_activate_observer = [center addObserverForName:NSWorkspaceDidActivateApplicationNotification
+                                                  object:nil queue:nil usingBlock:^(NSNotification *note) {
+            if (crdp_clipboard_is_self(note)) crdp_clipboard_set_active(true);
+        }];
+        g_deactivate_observer = [center addObserverForName:NSWorkspaceDidDeactivateApplicationNotification
+                                                    object:nil queue:nil usingBlock:^(NSNotification *note) {
+            if (crdp_clipboard_is_self(note)) crdp_clipboard_set_active(false);
+        }];
+    }
+    pthread_mutex_unlock(&g_subscribe_lock);
+    return 0;
+}
+
+// Once this returns, ctx's callback is not running and won't be called again.
+// The last subscriber out stops the monitor thread. Must not be called from a
+// change callback.
+void crdp_clipboard_unsubscribe(void* ctx) {
+    pthread_mutex_lock(&g_subscribe_lock);
+    pthread_mutex_lock(&g_monitor_lock);
+    for (int i = 0; i < g_subscriber_count; i++) {
+        if (g_subscribers[i].ctx != ctx) continue;
+        g_subscribers[i] = g_subscribers[--g_subscriber_count];
+        break;
+    }
+    // The monitor may be calling ctx from a snapshot of the list
+    while (g_dispatching > 0) pthread_cond_wait(&g_dispatch_cond, &g_monitor_lock);
+    bool stop = g_monitor_running && g_subscriber_count == 0;
+    if (stop) {
+        g_monitor_running = 0;
+        pthread_cond_signal(&g_monitor_cond);
+    }
+    pthread_mutex_unlock(&g_monitor_lock);
+
+    if (stop) {
+        NSNotificationCenter *center = [[NSWorkspace sharedWorkspace] notificationCenter];
+        if (g_activate_observer) [center removeObserver:g_activate_observer];
+        if (g_deactivate_observer) [center removeObserver:g_deactivate_observer];
+        g_activate_observer = nil;
+        g_deactivate_observer = nil;
+        pthread_join(g_monitor_thread, NULL);
+    }
+    pthread_mutex_unlock(&g_subscribe_lock);
 }
@@ -0,0 +1,823 @@
+#include "crdp_internal.h"
+
+#include <freerdp/channels/cliprdr.h>
+#include <freerdp/utils/cliprdr_utils.h>
+#include <winpr/file.h>
+#include <winpr/shell.h>
+#include <winpr/wlog.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Clipboard files.
+//
+// Host to server: file URLs on the host clipboard are announced as
+// FileGroupDescriptorW. When the server asks for the list, the files (and
+// the contents of copied folders) are snapshotted, and each FileContents
+// range the server then asks for is read with pread() straight from disk.
+// Only a few files are open at a time; each is closed once read to its end.
+//
+// Server to host: crdp_clipboard_save_files keeps several FileContents range
+// requests outstanding, so the server is already reading the next range while
+// the previous one is on the wire. Every answer is written with pwrite() at
+// its offset and dropped, so memory use is bounded by the ranges in flight
+// rather than by the file size. A file is created when its first range is
+// asked for and closed after its last byte, so descriptors are bounded the
+// same way rather than by the number of files.
+
+#define CRDP_CLIPFILE_RANGE_BYTES (1024 * 1024)
+// Largest range served to the server in one response
+#define CRDP_CLIPFILE_MAX_SERVE_BYTES (8 * 1024 * 1024)
+// How long a download waits for the server to answer anything
+#define CRDP_CLIPFILE_TIMEOUT_MS 10000
+#define CRDP_CLIPFILE_WAIT_SLICE_MS 100
+#define CRDP_CLIPFILE_PROGRESS_BYTES (4 * 1024 * 1024)
+#define CRDP_CLIPFILE_MAX_FILES 65536
+#define CRDP_CLIPFILE_MAX_DEPTH 32
+// Host files kept open at once for the server; macOS apps start with 256
+// descriptors in all
+#define CRDP_CLIPFILE_MAX_OPEN 16
+// Windows FILETIME (100 ns since 1601) of the Unix epoch
+#define CRDP_CLIPFILE_FILETIME_EPOCH 116444736000000000ULL
+
+static uint64_t crdp_clipfile_rate(uint64_t bytes, uint64_t started) {
+    uint64_t elapsed = crdp_time_ms() - started;
+    return bytes * 1000 / (elapsed ? elapsed : 1);
+}
+
+static void crdp_clipfile_report(crdp_client_t* client, crdp_clipboard_direction_t direction,
+                                 uint64_t transferred, uint64_t total, uint32_t files_done,
+                                 uint32_t files_total, uint64_t started, bool done, bool failed) {
+    crdp_clipboard_progress_t progress = {
+        .direction = direction,
+        .transferred = transferred,
+        .total = total,
+        .done = done,
+        .failed = failed,
+        .files_done = files_done,
+        .files_total = files_total,
+        .bytes_per_second = crdp_clipfile_rate(transferred, started),
+    };
+    crdp_clip_report_progress(client, &progress);
+}
+
+// Waits on f->cond for a short slice; f->lock held
+static void crdp_clipfile_wait(crdp_clip_files_t* f) {
+    struct timespec slice;
+    crdp_clip_deadline(&slice, CRDP_CLIPFILE_WAIT_SLICE_MS);
+    pthread_cond_timedwait(&f->cond, &f->lock, &slice);
+}
+
+static void crdp_clipfile_close_local(crdp_clip_files_t* f, crdp_clip_local_file_t* file) {
+    if (file->fd < 0) return;
+    close(file->fd);
+    file->fd = -1;
+    f->local_open--;
+}
+
+static void crdp_clipfile_clear_local(crdp_clip_files_t* f) {
+    for (uint32_t i = 0; i < f->local_count; i++) {
+        crdp_clipfile_close_local(f, &f->local[i]);
+        free(f->local[i].path);
+    }
+    free(f->local);
+    f->local = NULL;
+    f->local_count = 0;
+}
+
+void crdp_clipfile_init(crdp_client_t* client) {
+    crdp_clip_files_t* f = &client->clip_files;
+    memset(f, 0, sizeof(*f));
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->cond, NULL);
+    atomic_init(&f->server_format, 0);
+    f->next_stream_id = 1;
+}
+
+void crdp_clipfile_free(crdp_client_t* client) {
+    crdp_clip_files_t* f = &client->clip_files;
+    crdp_clipfile_clear_local(f);
+    free(f->read_buf);
+    f->read_buf = NULL;
+    pthread_cond_destroy(&f->cond);
+    pthread_mutex_destroy(&f->lock);
+}
+
+void crdp_clipfile_attach(crdp_context* ctx, CliprdrClientContext* cliprdr) {
+    crdp_clip_files_t* f = &ctx->client->clip_files;
+    pthread_mutex_lock(&f->lock);
+    f->cliprdr = cliprdr;
+    pthread_mutex_unlock(&f->lock);
+}
+
+void crdp_clipfile_detach(crdp_context* ctx) {
+    crdp_clip_files_t* f = &ctx->client->clip_files;
+    pthread_mutex_lock(&f->lock);
+    f->cliprdr = NULL;
+    atomic_store(&f->server_format, 0);
+    pthread_cond_broadcast(&f->cond);
+    // A download holds on to cliprdr until it notices
+    while (f->users > 0) pthread_cond_wait(&f->cond, &f->lock);
+    crdp_clipfile_clear_local(f);
+    pthread_mutex_unlock(&f->lock);
+}
+
+bool crdp_clipfile_can_offer(crdp_context* ctx) {
+    // Without stream support the server can only ask for files by path
+    return (ctx->clipboardCapabilities & CB_STREAM_FILECLIP_ENABLED) && crdp_clipboard_has_files();
+}
+
+bool crdp_clipboard_server_has_files(crdp_client_t* client) {
+    return client && atomic_load(&client->clip_files.server_format) != 0;
+}
+
+// Host to server
+
+typedef struct {
+    crdp_clip_local_file_t* files;
+    FILEDESCRIPTORW* descriptors;
+    uint32_t count;
+    uint32_t capacity;
+    bool huge;                 // The server accepts files of 4 GB and more
+} crdp_clipfile_list_t;
+
+// Appends one descriptor; false if the list is full or out of memory
+static bool crdp_clipfile_add(crdp_clipfile_list_t* list, const char* path, const char* name,
+                              const struct stat* st) {
+    bool dir = S_ISDIR(st->st_mode);
+    uint64_t size = dir ? 0 : (uint64_t)st->st_size;
+    if (!list->huge && size > UINT32_MAX) {
+        WLog_WARN(CRDP_TAG, "Server does not accept files over 4 GB, skipping %s", name);
+        return true;
+    }
+    size_t name_len = strlen(name);
+    int64_t units = crdp_utf8_to_utf16le_length((const uint8_t*)name, name_len);
+    if (units < 0 || units >= 260) {
+        WLog_WARN(CRDP_TAG, "Clipboard file name is unusable on the server, skipping %s", name);
+        return true;
+    }
+
+    if (list->count == list->capacity) {
+        if (list->count >= CRDP_CLIPFILE_MAX_FILES) return false;
+        uint32_t capacity = list->capacity ? list->capacity * 2 : 16;
+        crdp_clip_local_file_t* files = realloc(list->files, capacity * sizeof(*files));
+        if (!files) return false;
+        list->files = files;
+        FILEDESCRIPTORW* descriptors = realloc(list->descriptors, capacity * sizeof(*descriptors));
+        if (!descriptors) return false;
+        list->descriptors = descriptors;
+        list->capacity = capacity;
+    }
+
+    crdp_clip_local_file_t* file = &list->files[list->count];
+    file->path = strdup(path);
+    if (!file->path) return false;
+    file->size = size;
+    file->fd = -1;
+
+    FILEDESCRIPTORW* d = &list->descriptors[list->count];
+    memset(d, 0, sizeof(*d));
+    crdp_utf8_to_utf16le((const uint8_t*)name, name_len, (uint8_t*)d->cFileName);
+    d->dwFlags = FD_ATTRIBUTES | FD_FILESIZE | FD_WRITESTIME | FD_SHOWPROGRESSUI;
+    d->dwFileAttributes = dir ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_NORMAL;
+    d->nFileSizeHigh = (DWORD)(size >> 32);
+    d->nFileSizeLow = (DWORD)size;
+    uint64_t written = CRDP_CLIPFILE_FILETIME_EPOCH + (uint64_t)st->st_mtime * 10000000ULL;
+    d->ftLastWriteTime.dwHighDateTime = (DWORD)(written >> 32);
+    d->ftLastWriteTime.dwLowDateTime = (DWORD)written;
+    list->count++;
+    return true;
+}
+
+// Adds path under name (server-side, backslash separated), and for a folder
+// everything below it. Things that can't be read are left out.
+static bool crdp_clipfile_walk(crdp_clipfile_list_t* list, const char* path, const char* name, int depth) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))) return true;
+    if (!crdp_clipfile_add(list, path, name, &st)) return false;
+    // The depth limit also stops symlink loops
+    if (!S_ISDIR(st.st_mode) || depth >= CRDP_CLIPFILE_MAX_DEPTH) return true;
+
+    DIR* dir = opendir(path);
+    if (!dir) return true;
+    bool ok = true;
+    struct dirent* entry;
+    while (ok && (entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        char* child_path = NULL;
+        char* child_name = NULL;
+        if (asprintf(&child_path, "%s/%s", path, entry->d_name) < 0) child_path = NULL;
+        if (asprintf(&child_name, "%s\\%s", name, entry->d_name) < 0) child_name = NULL;
+        ok = child_path && child_name && crdp_clipfile_walk(list, child_path, child_name, depth + 1);
+        free(child_path);
+        free(child_name);
+    }
+    closedir(dir);
+    return ok;
+}
+
+// Called on the channel thread when the server asks for the file list
+uint8_t* crdp_clipfile_build_list(crdp_context* ctx, size_t* len) {
+    crdp_clip_files_t* f = &ctx->client->clip_files;
+    char** paths = NULL;
+    size_t path_count = 0;
+    if (crdp_clipboard_get_file_paths(&paths, &path_count) != 0) return NULL;
+
+    crdp_clipfile_list_t list = { 0 };
+    list.huge = (ctx->clipboardCapabilities & CB_HUGE_FILE_SUPPORT_ENABLED) != 0;
+    bool ok = true;
+    for (size_t i = 0; i < path_count; i++) {
+        if (ok) {
+            const char* slash = strrchr(paths[i], '/');
+            const char* base = slash && slash[1] ? slash + 1 : paths[i];
+            ok = crdp_clipfile_walk(&list, paths[i], base, 0);
+        }
+        free(paths[i]);
+    }
+    free(paths);
+
+    uint8_t* data = NULL;
+    UINT32 size = 0;
+    if (!ok) {
+        WLog_WARN(CRDP_TAG, "Too many files on the clipboard, not offering them");
+    } else if (list.count > 0 &&
+               cliprdr_serialize_file_list_ex(ctx->clipboardCapabilities, list.descriptors, list.count,
+                                              &data, &size) == CHANNEL_RC_OK) {
+        uint64_t total = 0;
+        for (uint32_t i = 0; i < list.count; i++) total += list.files[i].size;
+
+        // The server refers to files by their index in this list from now on
+        pthread_mutex_lock(&f->lock);
+        crdp_clipfile_clear_local(f);
+        f->local = list.files;
+        f->local_count = list.count;
+        f->served_bytes = 0;
+        f->served_total = total;
+        f->served_reported = 0;
+        f->served_files = 0;
+        f->served_started = crdp_time_ms();
+        pthread_mutex_unlock(&f->lock);
+        WLog_INFO(CRDP_TAG, "Offering %u clipboard files (%llu bytes) to the server", list.count,
+                  (unsigned long long)total);
+        list.files = NULL;
+        list.count = 0;
+        *len = size;
+    } else {
+        data = NULL;
+    }
+
+    for (uint32_t i = 0; i < list.count; i++) free(list.files[i].path);
+    free(list.files);
+    free(list.descriptors);
+    return data;
+}
+
+static ssize_t crdp_clipfile_pread_full(int fd, uint8_t* buf, size_t len, uint64_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, buf + done, len - done, (off_t)(offset + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        done += (size_t)n;
+    }
+    return (ssize_t)done;
+}
+
+static bool crdp_clipfile_pwrite_full(int fd, const uint8_t* buf, size_t len, uint64_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fd, buf + done, len - done, (off_t)(offset + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += (size_t)n;
+    }
+    return true;
+}
+
+// Descriptor of a listed file, opened if need be. The least recently read
+// file is closed first if too many are open. f->lock held.
+static int crdp_clipfile_open_local(crdp_clip_files_t* f, crdp_clip_local_file_t* file) {
+    file->used = ++f->local_tick;
+    if (file->fd >= 0) return file->fd;
+    if (f->local_open >= CRDP_CLIPFILE_MAX_OPEN) {
+        crdp_clip_local_file_t* oldest = NULL;
+        for (uint32_t i = 0; i < f->local_count; i++) {
+            crdp_clip_local_file_t* other = &f->local[i];
+            if (other->fd >= 0 && (!oldest || other->used < oldest->used)) oldest = other;
+        }
+        if (oldest) crdp_clipfile_close_local(f, oldest);
+    }
+    file->fd = open(file->path, O_RDONLY | O_CLOEXEC);
+    if (file->fd >= 0) f->local_open++;
+    return file->fd;
+}
+
+// Server asks for the size or a range of a file we listed (channel thread)
+UINT crdp_clipfile_contents_request(CliprdrClientContext* cliprdr, const CLIPRDR_FILE_CONTENTS_REQUEST* req) {
+    crdp_context* ctx = (crdp_context*)cliprdr->custom;
+    if (!ctx) return ERROR_INTERNAL_ERROR;
+    crdp_client_t* client = ctx->client;
+    crdp_clip_files_t* f = &client->clip_files;
+
+    CLIPRDR_FILE_CONTENTS_RESPONSE response = { 0 };
+    response.streamId = req->streamId;
+    response.common.msgFlags = CB_RESPONSE_FAIL;
+    uint8_t size_le[8];
+
+    // Held across the send: the response points into read_buf. Requests
+    // arrive one at a time on the channel thread, so nothing waits on it.
+    pthread_mutex_lock(&f->lock);
+    if (req->listIndex < f->local_count) {
+        crdp_clip_local_file_t* file = &f->local[req->listIndex];
+        if (req->dwFlags & FILECONTENTS_SIZE) {
+            for (int i = 0; i < 8; i++) size_le[i] = (uint8_t)(file->size >> (8 * i));
+            response.common.msgFlags = CB_RESPONSE_OK;
+            response.cbRequested = sizeof(size_le);
+            response.requestedData = size_le;
+        } else if (req->dwFlags & FILECONTENTS_RANGE) {
+            uint64_t offset = ((uint64_t)req->nPositionHigh << 32) | req->nPositionLow;
+            size_t want = req->cbRequested < CRDP_CLIPFILE_MAX_SERVE_BYTES ? req->cbRequested
+                                                                            : CRDP_CLIPFILE_MAX_SERVE_BYTES;
+            int fd = crdp_clipfile_open_local(f, file);
+            if (f->read_buf_size < want) {
+                uint8_t* buf = realloc(f->read_buf, want);
+                if (buf) {
+                    f->read_buf = buf;
+                    f->read_buf_size = want;
+                }
+            }
+            ssize_t n = fd >= 0 && f->read_buf_size >= want ? crdp_clipfile_pread_full(fd, f->read_buf, want, offset)
+                                                            : -1;
+            if (n >= 0) {
+                response.common.msgFlags = CB_RESPONSE_OK;
+                response.cbRequested = (UINT32)n;
+                response.requestedData = f->read_buf;
+                f->served_bytes += (uint64_t)n;
+                if (n > 0 && offset + (uint64_t)n >= file->size) f->served_files++;
+                // Read to the end; asked for again, it is simply reopened
+                if ((size_t)n < want || offset + (uint64_t)n >= file->size) crdp_clipfile_close_local(f, file);
+            } else {
+                WLog_WARN(CRDP_TAG, "Cannot read clipboard file %s: %s", file->path, strerror(errno));
+            }
+        }
+    } else {
+        WLog_WARN(CRDP_TAG, "Server asked for unknown clipboard file %u", req->listIndex);
+    }
+    UINT rc = cliprdr->ClientFileContentsResponse(cliprdr, &response);
+    if (rc == CHANNEL_RC_OK && (req->dwFlags & FILECONTENTS_RANGE)) {
+        crdp_metrics_add(client, CRDP_COUNTER_CLIPBOARD_BYTES_SENT, response.cbRequested);
+    }
+
+    // The server reads every file through once, so served bytes tell the progress
+    bool done = f->served_total > 0 && f->served_bytes >= f->served_total;
+    bool report = (req->dwFlags & FILECONTENTS_RANGE) &&
+                  (f->served_bytes - f->served_reported >= CRDP_CLIPFILE_PROGRESS_BYTES ||
+                   (done && f->served_reported < f->served_total));
+    uint64_t served = f->served_bytes;
+    uint64_t total = f->served_total;
+    uint32_t files_done = f->served_files < f->local_count ? f->served_files : f->local_count;
+    uint32_t files_total = f->local_count;
+    uint64_t started = f->served_started;
+    if (report) f->served_reported = served;
+    pthread_mutex_unlock(&f->lock);
+
+    if (report) {
+        crdp_clipfile_report(client, CRDP_CLIPBOARD_TO_SERVER, served, total, files_done, files_total,
+                             started, done, false);
+    }
+    return rc;
+}
+
+// Server to host
+
+// Server answered a FileContents request (channel thread)
+UINT crdp_clipfile_contents_response(CliprdrClientContext* cliprdr, const CLIPRDR_FILE_CONTENTS_RESPONSE* resp) {
+    crdp_context* ctx = (crdp_context*)cliprdr->custom;
+    if (!ctx) return ERROR_INTERNAL_ERROR;
+    crdp_clip_files_t* f = &ctx->client->clip_files;
+    bool ok = (resp->common.msgFlags & CB_RESPONSE_OK) && (resp->requestedData || resp->cbRequested == 0);
+
+    pthread_mutex_lock(&f->lock);
+    if (!f->downloading) {
+        pthread_mutex_unlock(&f->lock);
+        WLog_DBG(CRDP_TAG, "Ignoring unsolicited file contents");
+        return CHANNEL_RC_OK;
+    }
+    f->activity = crdp_time_ms();
+
+    if (f->size_pending && resp->streamId == f->size_stream_id) {
+        const uint8_t* p = resp->requestedData;
+        f->size_answer = UINT64_MAX;
+        if (ok && resp->cbRequested >= 8) {
+            f->size_answer = 0;
+            for (int i = 0; i < 8; i++) f->size_answer |= (uint64_t)p[i] << (8 * i);
+        }
+        f->size_pending = false;
+        pthread_cond_broadcast(&f->cond);
+        pthread_mutex_unlock(&f->lock);
+        return CHANNEL_RC_OK;
+    }
+
+    crdp_clip_range_t* range = NULL;
+    for (int i = 0; i < CRDP_CLIP_MAX_RANGES; i++) {
+        if (f->ranges[i].state == CRDP_CLIP_RANGE_SENT && f->ranges[i].stream_id == resp->streamId) {
+            range = &f->ranges[i];
+            break;
+        }
+    }
+    if (!range) {
+        // Answer to a request from a download that has already given up
+        pthread_mutex_unlock(&f->lock);
+        return CHANNEL_RC_OK;
+    }
+
+    uint32_t n = resp->cbRequested < range->length ? resp->cbRequested : range->length;
+    if (ok) crdp_metrics_add(ctx->client, CRDP_COUNTER_CLIPBOARD_BYTES_RECEIVED, n);
+    if (!ok || n == 0) {
+        // An empty answer means the file is shorter than the server listed it
+        WLog_WARN(CRDP_TAG, "Server could not provide clipboard file %u at offset %llu", range->file,
+                  (unsigned long long)range->offset);
+        if (f->status == 0) f->status = -4;
+        range->state = CRDP_CLIP_RANGE_FREE;
+        pthread_cond_broadcast(&f->cond);
+        pthread_mutex_unlock(&f->lock);
+        return CHANNEL_RC_OK;
+    }
+
+    // Written without the lock so the download thread can keep requests
+    // going; WRITING keeps the descriptor open until this is done
+    int fd = f->fds[range->file];
+    uint64_t offset = range->offset;
+    range->state = CRDP_CLIP_RANGE_WRITING;
+    pthread_mutex_unlock(&f->lock);
+    bool written = crdp_clipfile_pwrite_full(fd, resp->requestedData, n, offset);
+    int err = errno;
+    pthread_mutex_lock(&f->lock);
+
+    if (!written) {
+        WLog_ERR(CRDP_TAG, "Cannot write clipboard file: %s", strerror(err));
+        if (f->status == 0) f->status = -3;
+        range->state = CRDP_CLIP_RANGE_FREE;
+    } else {
+        f->received += n;
+        f->remaining[range->file] -= n;
+        if (f->remaining[range->file] == 0) {
+            // Complete: nothing else of this file is in flight
+            close(f->fds[range->file]);
+            f->fds[range->file] = -1;
+            f->files_done++;
+        }
+        if (n < range->length) {
+            range->offset += n;
+            range->length -= n;
+            range->state = CRDP_CLIP_RANGE_RETRY;
+        } else {
+            range->state = CRDP_CLIP_RANGE_FREE;
+        }
+    }
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+    return CHANNEL_RC_OK;
+}
+
+// Checked between waits; f->lock held. Returns 0 to keep going.
+static int crdp_clipfile_check(crdp_client_t* client, uint32_t cancel_seq) {
+    crdp_clip_files_t* f = &client->clip_files;
+    if (!f->cliprdr) return -4;
+    if (atomic_load(&client->clip_xfer.cancel_seq) != cancel_seq) return -2;
+    if (crdp_time_ms() - f->activity >= CRDP_CLIPFILE_TIMEOUT_MS) {
+        WLog_WARN(CRDP_TAG, "Server stopped answering file contents requests");
+        return -4;
+    }
+    return 0;
+}
+
+// Asks the server how big a file is, for descriptors without FD_FILESIZE;
+// f->lock held
+static int crdp_clipfile_query_size(crdp_client_t* client, CliprdrClientContext* cliprdr, uint32_t index,
+                                    uint32_t cancel_seq, uint64_t* size) {
+    crdp_clip_files_t* f = &client->clip_files;
+    CLIPRDR_FILE_CONTENTS_REQUEST req = { 0 };
+    req.streamId = f->next_stream_id++;
+    req.listIndex = index;
+    req.dwFlags = FILECONTENTS_SIZE;
+    req.cbRequested = 8;
+    f->size_stream_id = req.streamId;
+    f->size_pending = true;
+    f->activity = crdp_time_ms();
+
+    pthread_mutex_unlock(&f->lock);
+    UINT rc = cliprdr->ClientFileContentsRequest(cliprdr, &req);
+    pthread_mutex_lock(&f->lock);
+
+    int status = rc == CHANNEL_RC_OK ? 0 : -4;
+    while (status == 0 && f->size_pending) {
+        status = crdp_clipfile_check(client, cancel_seq);
+        if (status == 0) crdp_clipfile_wait(f);
+    }
+    f->size_pending = false;
+    if (status == 0 && f->size_answer == UINT64_MAX) status = -4;
+    if (status == 0) *size = f->size_answer;
+    return status;
+}
+
+// Creates every missing directory in path
+static bool crdp_clipfile_mkdirs(char* path) {
+    for (char* p = path + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        bool ok = mkdir(path, 0755) == 0 || errno == EEXIST;
+        *p = '/';
+        if (!ok) return false;
+    }
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+// Descriptor name as a path below dir (malloc'd), or NULL if it would
+// escape dir
+static char* crdp_clipfile_local_path(const char* dir, const FILEDESCRIPTORW* d) {
+    size_t units = 0;
+    while (units < 260 && d->cFileName[units]) units++;
+    char* name = crdp_utf16le_to_utf8_alloc((const uint8_t*)d->cFileName, units * 2, NULL);
+    if (!name) return NULL;
+
+    for (char* p = name; *p; p++) {
+        if (*p == '\\') *p = '/';
+    }
+    bool safe = name[0] != '\0' && name[0] != '/';
+    for (char* part = name; safe && part;) {
+        char* next = strchr(part, '/');
+        size_t n = next ? (size_t)(next - part) : strlen(part);
+        if (n == 0 || (n == 1 && part[0] == '.') || (n == 2 && part[0] == '.' && part[1] == '.')) safe = false;
+        part = next ? next + 1 : NULL;
+    }
+
+    char* path = NULL;
+    if (!safe) {
+        WLog_WARN(CRDP_TAG, "Refusing clipboard file name %s", name);
+    } else if (asprintf(&path, "%s/%s", dir, name) < 0) {
+        path = NULL;
+    }
+    free(name);
+    return path;
+}
+
+// Creates a downloaded file; f->lock held
+static int crdp_clipfile_create(const char* path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) WLog_ERR(CRDP_TAG, "Cannot create %s: %s", path, strerror(errno));
+    return fd;
+}
+
+// Creates the folders and empty files of the download and learns every
+// file's size; the others are created as their data arrives. f->lock held.
+static int crdp_clipfile_prepare(crdp_client_t* client, CliprdrClientContext* cliprdr, const char* dir,
+                                 const FILEDESCRIPTORW* descriptors, uint32_t count, uint32_t cancel_seq) {
+    crdp_clip_files_t* f = &client->clip_files;
+    f->paths = calloc(count, sizeof(*f->paths));
+    f->fds = malloc(count * sizeof(*f->fds));
+    f->sizes = calloc(count, sizeof(*f->sizes));
+    f->remaining = calloc(count, sizeof(*f->remaining));
+    if (!f->paths || !f->fds || !f->sizes || !f->remaining) return -3;
+    for (uint32_t i = 0; i < count; i++) f->fds[i] = -1;
+    f->file_count = count;
+
+    for (uint32_t i = 0; i < count; i++) {
+        const FILEDESCRIPTORW* d = &descriptors[i];
+        char* path = crdp_clipfile_local_path(dir, d);
+        if (!path) return -4;
+
+        int status = 0;
+        bool is_dir = (d->dwFlags & FD_ATTRIBUTES) && (d->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY);
+        char* slash = strrchr(path, '/');
+        if (!is_dir) *slash = '\0';
+        bool made = crdp_clipfile_mkdirs(path);
+        if (!is_dir) *slash = '/';
+        if (!made) {
+            WLog_ERR(CRDP_TAG, "Cannot create the folder of %s: %s", path, strerror(errno));
+            status = -3;
+        } else if (!is_dir && (d->dwFlags & FD_FILESIZE)) {
+            f->sizes[i] = ((uint64_t)d->nFileSizeHigh << 32) | d->nFileSizeLow;
+        } else if (!is_dir) {
+            status = crdp_clipfile_query_size(client, cliprdr, i, cancel_seq, &f->sizes[i]);
+        }
+        if (status == 0 && !is_dir && f->sizes[i] == 0) {
+            // No range will ever be asked for
+            int fd = crdp_clipfile_create(path);
+            if (fd < 0) status = -3;
+            else close(fd);
+        }
+        if (status == 0 && !is_dir && f->sizes[i] > 0) {
+            f->paths[i] = path;
+        } else {
+            free(path);
+        }
+        if (status != 0) return status;
+
+        f->remaining[i] = f->sizes[i];
+        if (f->remaining[i] == 0) f->files_done++;
+    }
+    return 0;
+}
+
+// Keeps up to CRDP_CLIP_MAX_RANGES range requests outstanding until every
+// file is written or something fails; f->lock held
+static int crdp_clipfile_pump(crdp_client_t* client, CliprdrClientContext* cliprdr, uint32_t cancel_seq,
+                              uint64_t total, uint64_t started) {
+    crdp_clip_files_t* f = &client->clip_files;
+    uint32_t next_file = 0;
+    uint64_t next_offset = 0;
+    uint64_t reported = 0;
+    f->activity = crdp_time_ms();
+
+    while (f->status == 0 && f->files_done < f->file_count) {
+        int status = crdp_clipfile_check(client, cancel_seq);
+        if (status != 0) {
+            f->status = status;
+            break;
+        }
+
+        for (int i = 0; i < CRDP_CLIP_MAX_RANGES && f->status == 0; i++) {
+            crdp_clip_range_t* range = &f->ranges[i];
+            if (range->state == CRDP_CLIP_RANGE_FREE) {
+                while (next_file < f->file_count && (!f->paths[next_file] || next_offset >= f->sizes[next_file])) {
+                    next_file++;
+                    next_offset = 0;
+                }
+                if (next_file >= f->file_count) continue;
+                if (next_offset == 0 && (f->fds[next_file] = crdp_clipfile_create(f->paths[next_file])) < 0) {
+                    f->status = -3;
+                    continue;
+                }
+                uint64_t left = f->sizes[next_file] - next_offset;
+                range->file = next_file;
+                range->offset = next_offset;
+                range->length = left < CRDP_CLIPFILE_RANGE_BYTES ? (uint32_t)left : CRDP_CLIPFILE_RANGE_BYTES;
+                next_offset += range->length;
+            } else if (range->state != CRDP_CLIP_RANGE_RETRY) {
+                continue;
+            }
+
+            CLIPRDR_FILE_CONTENTS_REQUEST req = { 0 };
+            req.streamId = f->next_stream_id++;
+            req.listIndex = range->file;
+            req.dwFlags = FILECONTENTS_RANGE;
+            req.nPositionLow = (UINT32)range->offset;
+            req.nPositionHigh = (UINT32)(range->offset >> 32);
+            req.cbRequested = range->length;
+            range->stream_id = req.streamId;
+            range->state = CRDP_CLIP_RANGE_SENT;
+
+            pthread_mutex_unlock(&f->lock);
+            UINT rc = cliprdr->ClientFileContentsRequest(cliprdr, &req);
+            pthread_mutex_lock(&f->lock);
+            if (rc != CHANNEL_RC_OK) {
+                WLog_WARN(CRDP_TAG, "File contents request failed: %u", rc);
+                if (f->status == 0) f->status = -4;
+                if (range->state == CRDP_CLIP_RANGE_SENT) range->state = CRDP_CLIP_RANGE_FREE;
+            }
+        }
+
+        if (f->received - reported >= CRDP_CLIPFILE_PROGRESS_BYTES) {
+            uint64_t received = f->received;
+            uint32_t files_done = f->files_done;
+            reported = received;
+            pthread_mutex_unlock(&f->lock);
+            crdp_clipfile_report(client, CRDP_CLIPBOARD_FROM_SERVER, received, total, files_done,
+                                 f->file_count, started, false, false);
+            pthread_mutex_lock(&f->lock);
+        }
+        if (f->status == 0 && f->files_done < f->file_count) crdp_clipfile_wait(f);
+    }
+
+    // Answers still being written use the descriptors
+    for (;;) {
+        bool writing = false;
+        for (int i = 0; i < CRDP_CLIP_MAX_RANGES; i++) {
+            if (f->ranges[i].state == CRDP_CLIP_RANGE_WRITING) writing = true;
+        }
+        if (!writing) break;
+        pthread_cond_wait(&f->cond, &f->lock);
+    }
+    return f->status;
+}
+
+// Takes the download slot and a use of the channel; f->lock held. NULL if
+// the channel is down or another download is running.
+static CliprdrClientContext* crdp_clipfile_begin(crdp_clip_files_t* f) {
+    CliprdrClientContext* cliprdr = f->cliprdr;
+    if (!cliprdr || f->downloading) return NULL;
+    // Keeps cliprdr (and ctx) alive; crdp_clipfile_detach waits for this
+    f->users++;
+    f->downloading = true;
+    f->status = 0;
+    f->files_done = 0;
+    f->received = 0;
+    f->size_pending = false;
+    memset(f->ranges, 0, sizeof(f->ranges));
+    return cliprdr;
+}
+
+// Writes the listed files below dir unless status has already failed, then
+// gives back what crdp_clipfile_begin took
+static int crdp_clipfile_finish(crdp_client_t* client, CliprdrClientContext* cliprdr, const char* dir,
+                                const FILEDESCRIPTORW* descriptors, uint32_t count, uint32_t cancel_seq,
+                                uint64_t started, int status) {
+    crdp_clip_files_t* f = &client->clip_files;
+    uint64_t total = 0;
+    pthread_mutex_lock(&f->lock);
+    if (status == 0) status = crdp_clipfile_prepare(client, cliprdr, dir, descriptors, count, cancel_seq);
+    if (status == 0) {
+        for (uint32_t i = 0; i < f->file_count; i++) total += f->sizes[i];
+        WLog_INFO(CRDP_TAG, "Saving %u clipboard files (%llu bytes) to %s", f->file_count,
+                  (unsigned long long)total, dir);
+        status = crdp_clipfile_pump(client, cliprdr, cancel_seq, total, started);
+    }
+
+    // Late answers find no download and are dropped
+    f->downloading = false;
+    uint64_t received = f->received;
+    uint32_t files_done = f->files_done;
+    uint32_t files_total = f->file_count;
+    for (uint32_t i = 0; i < f->file_count; i++) {
+        // Still open: cut off by the failure, so not left behind truncated
+        if (f->fds && f->fds[i] >= 0) {
+            close(f->fds[i]);
+            unlink(f->paths[i]);
+        }
+        if (f->paths) free(f->paths[i]);
+    }
+    free(f->paths);
+    free(f->fds);
+    free(f->sizes);
+    free(f->remaining);
+    f->paths = NULL;
+    f->fds = NULL;
+    f->sizes = NULL;
+    f->remaining = NULL;
+    f->file_count = 0;
+    f->users--;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+
+    if (status == 0) {
+        WLog_INFO(CRDP_TAG, "Saved %u clipboard files, %llu bytes at %llu bytes/s", files_total,
+                  (unsigned long long)received, (unsigned long long)crdp_clipfile_rate(received, started));
+    } else if (status == -2) {
+        WLog_INFO(CRDP_TAG, "Clipboard file download cancelled");
+    }
+    crdp_clipfile_report(client, CRDP_CLIPBOARD_FROM_SERVER, received, total, files_done, files_total,
+                         started, true, status != 0);
+    return status;
+}
+
+int crdp_clipfile_download(crdp_client_t* client, const char* dir, const FILEDESCRIPTORW* descriptors,
+                           uint32_t count) {
+    if (!client || !dir || !dir[0] || !descriptors || count == 0) return -1;
+    crdp_clip_files_t* f = &client->clip_files;
+    uint32_t cancel_seq = atomic_load(&client->clip_xfer.cancel_seq);
+    uint64_t started = crdp_time_ms();
+
+    pthread_mutex_lock(&f->lock);
+    CliprdrClientContext* cliprdr = crdp_clipfile_begin(f);
+    pthread_mutex_unlock(&f->lock);
+    if (!cliprdr) return -1;
+    return crdp_clipfile_finish(client, cliprdr, dir, descriptors, count, cancel_seq, started, 0);
+}
+
+int crdp_clipboard_save_files(crdp_client_t* client, const char* dir) {
+    if (!client || !dir || !dir[0]) return -1;
+    crdp_clip_files_t* f = &client->clip_files;
+    uint32_t cancel_seq = atomic_load(&client->clip_xfer.cancel_seq);
+    uint64_t started = crdp_time_ms();
+
+    pthread_mutex_lock(&f->lock);
+    CliprdrClientContext* cliprdr = atomic_load(&f->server_format) != 0 ? crdp_clipfile_begin(f) : NULL;
+    pthread_mutex_unlock(&f->lock);
+    if (!cliprdr) return -1;
+    crdp_context* ctx = (crdp_context*)cliprdr->custom;
+
+    size_t len = 0;
+    uint8_t* data = crdp_cliprdr_fetch_file_list(ctx, cancel_seq, &len);
+    FILEDESCRIPTORW* descriptors = NULL;
+    UINT32 count = 0;
+    int status = 0;
+    if (!data) {
+        status = atomic_load(&client->clip_xfer.cancel_seq) != cancel_seq ? -2 : -4;
+    } else if (cliprdr_parse_file_list(data, (UINT32)len, &descriptors, &count) != CHANNEL_RC_OK || count == 0) {
+        WLog_WARN(CRDP_TAG, "Server sent an unusable clipboard file list");
+        status = -4;
+    }
+    free(data);
+
+    status = crdp_clipfile_finish(client, cliprdr, dir, descriptors, count, cancel_seq, started, status);
+    free(descriptors);
+    return status;
+}
@@ -0,0 +1,487 @@
+#include "crdp_internal.h"
+
+#include <freerdp/channels/cliprdr.h>
+#include <winpr/wlog.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Rich clipboard formats: HTML, RTF and images.
+//
+// Nothing is converted up front. Host to server, the formats are announced
+// and the server's request is handed to a worker thread, which converts the
+// host data to that one format and sends the response; the result is cached
+// by content hash and shared with every other session. Server to host,
+// cliprdr.c fetches the one format a paste needs and converts it here, on the
+// pasting thread.
+
+// CF_HTML header with fixed-width offsets, filled in once the sizes are known
+#define CRDP_CF_HTML_HEADER "Version:0.9\r\nStartHTML:%010zu\r\nEndHTML:%010zu\r\n" \
+                            "StartFragment:%010zu\r\nEndFragment:%010zu\r\n"
+
+static uint8_t* crdp_clipformat_dup(const uint8_t* data, size_t len, size_t* out_len) {
+    uint8_t* copy = malloc(len + 1);
+    if (!copy) return NULL;
+    memcpy(copy, data, len);
+    copy[len] = 0;
+    *out_len = len;
+    return copy;
+}
+
+// Case-insensitive search for an ASCII tag prefix; returns an offset or len
+static size_t crdp_clipformat_find(const uint8_t* data, size_t len, size_t from, const char* tag) {
+    size_t n = strlen(tag);
+    for (size_t i = from; i + n <= len; i++) {
+        size_t j = 0;
+        while (j < n && (data[i + j] | 0x20) == (tag[j] | 0x20)) j++;
+        if (j == n) return i;
+    }
+    return len;
+}
+
+uint8_t* crdp_clipformat_html_wrap(const uint8_t* html, size_t len, size_t* out_len) {
+    // The fragment is the body's content, or the whole document without one
+    size_t frag_start = 0;
+    size_t frag_end = len;
+    size_t body = crdp_clipformat_find(html, len, 0, "<body");
+    if (body < len) {
+        const uint8_t* close = memchr(html + body, '>', len - body);
+        size_t body_end = crdp_clipformat_find(html, len, body, "</body");
+        if (close && body_end < len) {
+            frag_start = (size_t)(close - html) + 1;
+            frag_end = body_end;
+        }
+    }
+
+    size_t header = (size_t)snprintf(NULL, 0, CRDP_CF_HTML_HEADER, (size_t)0, (size_t)0, (size_t)0, (size_t)0);
+    size_t total = header + len;
+    char* out = malloc(total + 1);
+    if (!out) return NULL;
+    snprintf(out, header + 1, CRDP_CF_HTML_HEADER, header, total, header + frag_start, header + frag_end);
+    memcpy(out + header, html, len);
+    out[total] = '\0';
+    *out_len = total + 1;
+    return (uint8_t*)out;
+}
+
+// Value of a "Name:123" header line, or -1
+static int64_t crdp_clipformat_html_offset(const uint8_t* data, size_t len, const char* name) {
+    size_t at = crdp_clipformat_find(data, len, 0, name);
+    if (at >= len) return -1;
+    int64_t value = 0;
+    size_t i = at + strlen(name);
+    if (i >= len || data[i] < '0' || data[i] > '9') return -1;
+    for (; i < len && data[i] >= '0' && data[i] <= '9' && value < INT32_MAX; i++) {
+        value = value * 10 + (data[i] - '0');
+    }
+    return value;
+}
+
+uint8_t* crdp_clipformat_html_unwrap(const uint8_t* data, size_t len, size_t* out_len) {
+    len = strnlen((const char*)data, len);
+    int64_t start = crdp_clipformat_html_offset(data, len, "StartHTML:");
+    int64_t end = crdp_clipformat_html_offset(data, len, "EndHTML:");
+    if (start < 0 || end < 0) {
+        start = crdp_clipformat_html_offset(data, len, "StartFragment:");
+        end = crdp_clipformat_html_offset(data, len, "EndFragment:");
+    }
+    // Without a usable header the data is taken to be plain HTML
+    if (start < 0 || end < start || (uint64_t)end > len) {
+        start = 0;
+        end = (int64_t)len;
+    }
+    return crdp_clipformat_dup(data + start, (size_t)(end - start), out_len);
+}
+
+static uint32_t crdp_clipformat_u32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void crdp_clipformat_put_u32(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+// A CF_DIB/CF_DIBV5 is a BMP file without its 14-byte file header
+static uint8_t* crdp_clipformat_dib_to_bmp(const uint8_t* dib, size_t len, size_t* out_len) {
+    if (len < 40 || len > UINT32_MAX - 14) return NULL;
+    uint32_t header = crdp_clipformat_u32(dib);
+    uint16_t bpp = (uint16_t)(dib[14] | (dib[15] << 8));
+    uint32_t compression = crdp_clipformat_u32(dib + 16);
+    uint32_t colors = crdp_clipformat_u32(dib + 32);
+    if (header < 40 || header > len || colors > 256) return NULL;
+
+    // Pixels follow the header, the BI_BITFIELDS masks and the palette
+    uint64_t offset = 14 + (uint64_t)header;
+    if (header == 40 && compression == 3) offset += 12;
+    if (colors == 0 && bpp <= 8) colors = 1u << bpp;
+    offset += (uint64_t)colors * 4;
+    if (offset > 14 + len) return NULL;
+
+    uint8_t* bmp = malloc(14 + len);
+    if (!bmp) return NULL;
+    bmp[0] = 'B';
+    bmp[1] = 'M';
+    crdp_clipformat_put_u32(bmp + 2, (uint32_t)(14 + len));
+    crdp_clipformat_put_u32(bmp + 6, 0);
+    crdp_clipformat_put_u32(bmp + 10, (uint32_t)offset);
+    memcpy(bmp + 14, dib, len);
+    *out_len = 14 + len;
+    return bmp;
+}
+
+// Rounded, and clamped in case a decoder left a channel above its alpha
+static inline uint8_t crdp_clipformat_unpremultiply(uint32_t c, uint32_t a) {
+    uint32_t v = (c * 255 + a / 2) / a;
+    return (uint8_t)(v > 255 ? 255 : v);
+}
+
+// 32-bit bottom-up CF_DIB from premultiplied RGBA. Apps that use a CF_DIB's
+// alpha take the colour as straight, so it is divided back out; Core
+// Graphics only draws into premultiplied buffers, so the decoder can't skip it.
+static uint8_t* crdp_clipformat_rgba_to_dib(const uint8_t* rgba, uint32_t width, uint32_t height, size_t* out_len) {
+    size_t row = (size_t)width * 4;
+    size_t pixels = row * height;
+    if (pixels > UINT32_MAX - 40) return NULL;
+    uint8_t* dib = calloc(1, 40 + pixels);
+    if (!dib) return NULL;
+    crdp_clipformat_put_u32(dib, 40);
+    crdp_clipformat_put_u32(dib + 4, width);
+    crdp_clipformat_put_u32(dib + 8, height);
+    dib[12] = 1;               // Planes
+    dib[14] = 32;              // Bits per pixel, BI_RGB
+    crdp_clipformat_put_u32(dib + 20, (uint32_t)pixels);
+
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t* src = rgba + (size_t)y * row;
+        uint8_t* dst = dib + 40 + (size_t)(height - 1 - y) * row;
+        for (uint32_t x = 0; x < width; x++, src += 4, dst += 4) {
+            uint32_t a = src[3];
+            if (a == 255) {
+                dst[0] = src[2];
+                dst[1] = src[1];
+                dst[2] = src[0];
+            } else if (a > 0) {
+                dst[0] = crdp_clipformat_unpremultiply(src[2], a);
+                dst[1] = crdp_clipformat_unpremultiply(src[1], a);
+                dst[2] = crdp_clipformat_unpremultiply(src[0], a);
+            }
+            dst[3] = (uint8_t)a;
+        }
+    }
+    *out_len = 40 + pixels;
+    return dib;
+}
+
+uint8_t* crdp_clipformat_from_server(crdp_clip_type_t type, UINT32 format, const uint8_t* data,
+                                     size_t len, size_t* out_len) {
+    switch (type) {
+        case CRDP_CLIP_HTML:
+            return crdp_clipformat_html_unwrap(data, len, out_len);
+        case CRDP_CLIP_RTF:
+            return crdp_clipformat_dup(data, strnlen((const char*)data, len), out_len);
+        case CRDP_CLIP_PNG:
+        case CRDP_CLIP_TIFF: {
+            bool dib = format == CRDP_CF_DIB || format == CRDP_CF_DIBV5;
+            if (!dib && type == CRDP_CLIP_PNG) return crdp_clipformat_dup(data, len, out_len);
+            uint8_t* bmp = NULL;
+            size_t bmp_len = 0;
+            if (dib && !(bmp = crdp_clipformat_dib_to_bmp(data, len, &bmp_len))) return NULL;
+            uint8_t* out = NULL;
+            crdp_image_format_t to = type == CRDP_CLIP_PNG ? CRDP_IMAGE_PNG : CRDP_IMAGE_TIFF;
+            if (crdp_image_encode(bmp ? bmp : data, bmp ? bmp_len : len, to, &out, out_len) != 0) out = NULL;
+            free(bmp);
+            return out;
+        }
+        default:
+            return NULL;
+    }
+}
+
+// Host to server
+
+bool crdp_clipformat_is_rich(UINT32 format) {
+    return format == CRDP_CF_HTML || format == CRDP_CF_RTF || format == CRDP_CF_PNG || format == CRDP_CF_DIB;
+}
+
+UINT32 crdp_clipformat_list(CLIPRDR_FORMAT* formats, UINT32 count, UINT32 max) {
+    uint32_t types = crdp_clipboard_types();
+    if ((types & (1u << CRDP_CLIP_HTML)) && count < max) {
+        formats[count].formatId = CRDP_CF_HTML;
+        formats[count++].formatName = CRDP_CF_HTML_NAME;
+    }
+    if ((types & (1u << CRDP_CLIP_RTF)) && count < max) {
+        formats[count].formatId = CRDP_CF_RTF;
+        formats[count++].formatName = CRDP_CF_RTF_NAME;
+    }
+    // PNG for apps that read it, CF_DIB for everything else
+    if ((types & ((1u << CRDP_CLIP_PNG) | (1u << CRDP_CLIP_TIFF))) && count + 2 <= max) {
+        formats[count].formatId = CRDP_CF_PNG;
+        formats[count++].formatName = CRDP_CF_PNG_NAME;
+        formats[count].formatId = CRDP_CF_DIB;
+        formats[count++].formatName = NULL;
+    }
+    return count;
+}
+
+// Host image as stored on the clipboard, PNG preferred
+static int crdp_clipformat_get_image(uint8_t** data, size_t* len) {
+    if (crdp_clipboard_get_data(CRDP_CLIP_PNG, data, len) == 0) return 0;
+    return crdp_clipboard_get_data(CRDP_CLIP_TIFF, data, len);
+}
+
+// Host clipboard data in a server format (malloc'd), or NULL
+static uint8_t* crdp_clipformat_convert(UINT32 format, size_t* out_len) {
+    uint8_t* src = NULL;
+    size_t len = 0;
+    uint8_t* out = NULL;
+
+    switch (format) {
+        case CRDP_CF_HTML:
+            if (crdp_clipboard_get_data(CRDP_CLIP_HTML, &src, &len) == 0) {
+                out = crdp_clipformat_html_wrap(src, len, out_len);
+            }
+            break;
+        case CRDP_CF_RTF:
+            // Null-terminated on the wire
+            if (crdp_clipboard_get_data(CRDP_CLIP_RTF, &src, &len) == 0) {
+                out = crdp_clipformat_dup(src, len, out_len);
+                if (out) (*out_len)++;
+            }
+            break;
+        case CRDP_CF_PNG:
+            if (crdp_clipboard_get_data(CRDP_CLIP_PNG, &src, &len) == 0) {
+                out = src;
+                *out_len = len;
+                src = NULL;
+            } else if (crdp_clipboard_get_data(CRDP_CLIP_TIFF, &src, &len) == 0 &&
+                       crdp_image_encode(src, len, CRDP_IMAGE_PNG, &out, out_len) != 0) {
+                out = NULL;
+            }
+            break;
+        case CRDP_CF_DIB:
+            if (crdp_clipformat_get_image(&src, &len) == 0) {
+                uint8_t* rgba = NULL;
+                uint32_t width = 0;
+                uint32_t height = 0;
+                if (crdp_image_decode_rgba(src, len, &rgba, &width, &height) == 0) {
+                    out = crdp_clipformat_rgba_to_dib(rgba, width, height, out_len);
+                    free(rgba);
+                }
+            }
+            break;
+    }
+    free(src);
+    return out;
+}
+
+// Shared host data cache, one slot per server format. A slot being filled is
+// waited on by other sessions wanting the same content rather than fetched
+// twice. Emptied when the last session stops.
+#define CRDP_CLIP_SHARED_SLOTS 6
+
+typedef struct {
+    UINT32 format;             // 0 = unused
+    uint64_t hash;             // Host clipboard content it was made from
+    bool valid;
+    bool filling;
+    crdp_clip_blob_t* blob;    // NULL if there is no data in this format
+} crdp_clip_shared_t;
+
+static pthread_mutex_t g_shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_shared_cond = PTHREAD_COND_INITIALIZER;
+static crdp_clip_shared_t g_shared[CRDP_CLIP_SHARED_SLOTS];
+static uint32_t g_shared_sessions = 0;
+
+static crdp_clip_shared_t* crdp_clipformat_shared_slot(UINT32 format) {
+    crdp_clip_shared_t* unused = NULL;
+    for (int i = 0; i < CRDP_CLIP_SHARED_SLOTS; i++) {
+        if (g_shared[i].format == format) return &g_shared[i];
+        if (!unused && g_shared[i].format == 0) unused = &g_shared[i];
+    }
+    if (unused) unused->format = format;
+    return unused;
+}
+
+void crdp_clip_blob_release(crdp_clip_blob_t* blob) {
+    if (!blob || atomic_fetch_sub(&blob->refs, 1) != 1) return;
+    free(blob->data);
+    free(blob);
+}
+
+static void crdp_clipformat_shared_reset(crdp_clip_shared_t* s) {
+    crdp_clip_blob_release(s->blob);
+    s->blob = NULL;
+    s->valid = false;
+}
+
+crdp_clip_blob_t* crdp_clipformat_acquire(UINT32 format, crdp_clip_read_fn fetch, void* arg, int* status) {
+    uint64_t hash = crdp_clipboard_content_hash();
+    crdp_clip_blob_t* blob = NULL;
+
+    pthread_mutex_lock(&g_shared_lock);
+    crdp_clip_shared_t* s = crdp_clipformat_shared_slot(format);
+    while (s && s->filling && s->hash == hash) pthread_cond_wait(&g_shared_cond, &g_shared_lock);
+    if (s && s->valid && s->hash == hash) {
+        blob = s->blob;
+        if (blob) atomic_fetch_add(&blob->refs, 1);
+        pthread_mutex_unlock(&g_shared_lock);
+        *status = blob ? 0 : -1;
+        WLog_DBG(CRDP_TAG, "Local clipboard format %u served from the shared cache", format);
+        return blob;
+    }
+    // Another session still converting older content keeps its slot
+    bool fill = s && !s->filling;
+    if (fill) {
+        crdp_clipformat_shared_reset(s);
+        s->hash = hash;
+        s->filling = true;
+    }
+    pthread_mutex_unlock(&g_shared_lock);
+
+    uint8_t* data = NULL;
+    size_t len = 0;
+    int rc = fetch(format, arg, &data, &len);
+    if (rc == 0 && data) {
+        blob = malloc(sizeof(*blob));
+        if (blob) {
+            atomic_init(&blob->refs, 1);
+            blob->data = data;
+            blob->len = len;
+            WLog_DBG(CRDP_TAG, "Read local clipboard in format %u: %zu bytes", format, len);
+        } else {
+            free(data);
+            rc = -4;
+        }
+    } else {
+        free(data);
+        if (rc == 0) rc = -1;
+    }
+
+    if (fill) {
+        // The clipboard may have changed while it was read
+        bool current = crdp_clipboard_content_hash() == hash;
+        pthread_mutex_lock(&g_shared_lock);
+        if (current && (rc == 0 || rc == -1)) {
+            s->blob = blob;
+            if (blob) atomic_fetch_add(&blob->refs, 1);
+            s->valid = true;
+        }
+        s->filling = false;
+        pthread_cond_broadcast(&g_shared_cond);
+        pthread_mutex_unlock(&g_shared_lock);
+    }
+    *status = rc;
+    return blob;
+}
+
+static int crdp_clipformat_read_rich(UINT32 format, void* arg, uint8_t** data, size_t* len) {
+    *data = crdp_clipformat_convert(format, len);
+    return *data ? 0 : -1;
+}
+
+// Worker thread: answers one server request
+static void crdp_clipformat_respond(crdp_context* ctx, UINT32 format) {
+    crdp_client_t* client = ctx->client;
+    size_t max_bytes = client->config.clipboard_max_bytes;
+
+    int status = 0;
+    crdp_clip_blob_t* blob = crdp_clipformat_acquire(format, crdp_clipformat_read_rich, NULL, &status);
+    bool ok = blob && blob->len <= UINT32_MAX;
+    if (ok && max_bytes && blob->len > max_bytes) {
+        WLog_WARN(CRDP_TAG, "Local clipboard data exceeds %zu bytes, not sending it", max_bytes);
+        ok = false;
+    }
+    CLIPRDR_FORMAT_DATA_RESPONSE response = { 0 };
+    response.common.msgFlags = ok ? CB_RESPONSE_OK : CB_RESPONSE_FAIL;
+    response.common.dataLen = ok ? (UINT32)blob->len : 0;
+    response.requestedFormatData = ok ? blob->data : NULL;
+    CliprdrClientContext* cliprdr = ctx->cliprdr;
+    UINT rc = cliprdr ? cliprdr->ClientFormatDataResponse(cliprdr, &response) : ERROR_INTERNAL_ERROR;
+    if (ok && rc == CHANNEL_RC_OK) crdp_metrics_add(client, CRDP_COUNTER_CLIPBOARD_BYTES_SENT, blob->len);
+
+    if (blob) {
+        crdp_clipboard_progress_t progress = {
+            .direction = CRDP_CLIPBOARD_TO_SERVER,
+            .transferred = ok ? blob->len : 0,
+            .total = blob->len,
+            .done = true,
+            .failed = !ok || rc != CHANNEL_RC_OK,
+        };
+        crdp_clip_report_progress(client, &progress);
+    }
+    crdp_clip_blob_release(blob);
+}
+
+static void* crdp_clipformat_thread(void* arg) {
+    crdp_context* ctx = (crdp_context*)arg;
+    crdp_clip_formats_t* q = &ctx->clip_formats;
+
+    pthread_mutex_lock(&q->lock);
+    while (!q->stop) {
+        if (q->count == 0) {
+            pthread_cond_wait(&q->cond, &q->lock);
+            continue;
+        }
+        UINT32 format = q->queue[q->head];
+        q->head = (q->head + 1) % CRDP_CLIP_FORMAT_QUEUE;
+        q->count--;
+        pthread_mutex_unlock(&q->lock);
+        crdp_clipformat_respond(ctx, format);
+        pthread_mutex_lock(&q->lock);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+void crdp_clipformat_start(crdp_context* ctx) {
+    crdp_clip_formats_t* q = &ctx->clip_formats;
+    memset(q, 0, sizeof(*q));
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    q->running = pthread_create(&q->thread, NULL, crdp_clipformat_thread, ctx) == 0;
+    if (!q->running) WLog_WARN(CRDP_TAG, "Failed to start clipboard format worker");
+
+    pthread_mutex_lock(&g_shared_lock);
+    g_shared_sessions++;
+    pthread_mutex_unlock(&g_shared_lock);
+}
+
+bool crdp_clipformat_queue(crdp_context* ctx, UINT32 format) {
+    crdp_clip_formats_t* q = &ctx->clip_formats;
+    pthread_mutex_lock(&q->lock);
+    bool queued = q->running && !q->stop && q->count < CRDP_CLIP_FORMAT_QUEUE;
+    if (queued) {
+        q->queue[(q->head + q->count) % CRDP_CLIP_FORMAT_QUEUE] = format;
+        q->count++;
+        pthread_cond_signal(&q->cond);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return queued;
+}
+
+// Requests still queued are dropped; a conversion in progress finishes first
+void crdp_clipformat_stop(crdp_context* ctx) {
+    crdp_clip_formats_t* q = &ctx->clip_formats;
+    pthread_mutex_lock(&q->lock);
+    q->stop = true;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+    if (q->running) pthread_join(q->thread, NULL);
+    q->running = false;
+
+    // Nobody left to share host data with; a slot still being filled is left
+    // to its reader
+    pthread_mutex_lock(&g_shared_lock);
+    if (--g_shared_sessions == 0) {
+        for (int i = 0; i < CRDP_CLIP_SHARED_SLOTS; i++) {
+            if (!g_shared[i].filling) crdp_clipformat_shared_reset(&g_shared[i]);
+        }
+    }
+    pthread_mutex_unlock(&g_shared_lock);
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->lock);
+}
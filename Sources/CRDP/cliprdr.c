@@ -0,0 +1,725 @@
+#include "crdp_internal.h"
+
+#include <freerdp/channels/channels.h>
+#include <freerdp/client/cliprdr.h>
+#include <winpr/clipboard.h>
+#include <winpr/wlog.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Clipboard channel.
+//
+// Host clipboard changes are announced to the server as a format list and
+// served when the server asks. Server clipboard changes are not transferred
+// up front: the host clipboard gets a promise, and the data is only requested
+// when something pastes it, and only converted to the type that was pasted.
+// The result is cached until the server clipboard changes again, so repeated
+// pastes don't go back to the server. Rich format conversions live in
+// clipformat.c, files in clipfile.c.
+
+// How long a paste waits for server data to start or keep arriving
+#define CRDP_CLIPBOARD_FETCH_TIMEOUT_MS 5000
+#define CRDP_CLIPBOARD_WAIT_SLICE_MS 100
+// Progress is reported at most this often while data is moving
+#define CRDP_CLIPBOARD_PROGRESS_BYTES (256 * 1024)
+
+void crdp_clip_deadline(struct timespec* deadline, uint32_t timeout_ms) {
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+// Server clipboard data as UTF-8 (malloc'd), or NULL
+static char* crdp_cliprdr_decode_text(UINT32 format, const uint8_t* data, size_t len) {
+    if (format == 1) {
+        // CF_TEXT - up to the null terminator
+        size_t n = strnlen((const char*)data, len);
+        char* text = malloc(n + 1);
+        if (!text) return NULL;
+        memcpy(text, data, n);
+        text[n] = '\0';
+        return text;
+    }
+    
+    return crdp_utf16le_to_utf8_alloc(data, len, NULL);
+}
+
+void crdp_clip_report_progress(crdp_client_t* client, const crdp_clipboard_progress_t* progress) {
+    crdp_clip_transfer_t* x = &client->clip_xfer;
+    pthread_mutex_lock(&x->cb_lock);
+    crdp_clipboard_progress_cb cb = x->cb;
+    void* user = x->cb_user;
+    pthread_mutex_unlock(&x->cb_lock);
+    if (cb) cb(progress, user);
+}
+
+static void crdp_clip_report(crdp_client_t* client, crdp_clipboard_direction_t direction,
+                             uint64_t transferred, uint64_t total, bool done, bool failed) {
+    crdp_clipboard_progress_t progress = {
+        .direction = direction,
+        .transferred = transferred,
+        .total = total,
+        .done = done,
+        .failed = failed,
+    };
+    crdp_clip_report_progress(client, &progress);
+}
+
+// Waits for the outstanding format data request; r->lock held. Gives up when
+// no data has arrived for the timeout, so big transfers may take longer.
+// Returns 0 once answered, -1 on timeout, -2 if cancelled or closing.
+static int crdp_cliprdr_wait_response(crdp_context* ctx, uint32_t cancel_seq) {
+    crdp_clip_remote_t* r = &ctx->remote_clip;
+    crdp_clip_transfer_t* x = &ctx->client->clip_xfer;
+    uint64_t started = crdp_time_ms();
+    
+    while (r->request_pending) {
+        if (r->closing || atomic_load(&x->cancel_seq) != cancel_seq || atomic_load(&x->rejected)) return -2;
+        uint64_t active = atomic_load(&x->in_activity);
+        if (active < started) active = started;
+        if (crdp_time_ms() - active >= CRDP_CLIPBOARD_FETCH_TIMEOUT_MS) return -1;
+        
+        // Short slices so cancellation is noticed without a wakeup
+        struct timespec slice;
+        crdp_clip_deadline(&slice, CRDP_CLIPBOARD_WAIT_SLICE_MS);
+        pthread_cond_timedwait(&r->cond, &r->lock, &slice);
+    }
+    return 0;
+}
+
+// Sends a format data request and waits for the answer; r->lock held, and
+// no other request outstanding. Returns 0 once the response handler has run,
+// -1 on timeout, -2 if cancelled or closing, -3 if the request failed.
+static int crdp_cliprdr_request(crdp_context* ctx, uint32_t generation, UINT32 format, uint32_t cancel_seq) {
+    crdp_clip_remote_t* r = &ctx->remote_clip;
+    crdp_clip_transfer_t* x = &ctx->client->clip_xfer;
+    CliprdrClientContext* cliprdr = ctx->cliprdr;
+    if (!cliprdr) return -3;
+    free(r->raw);
+    r->raw = NULL;
+    r->raw_len = 0;
+    r->request_pending = true;
+    r->request_generation = generation;
+    atomic_store(&x->rejected, false);
+    atomic_store(&x->receiving, true);
+    
+    CLIPRDR_FORMAT_DATA_REQUEST request = { 0 };
+    request.requestedFormatId = format;
+    WLog_DBG(CRDP_TAG, "Fetching clipboard data, format=%u", format);
+    pthread_mutex_unlock(&r->lock);
+    UINT rc = cliprdr->ClientFormatDataRequest(cliprdr, &request);
+    pthread_mutex_lock(&r->lock);
+    
+    int status = rc == CHANNEL_RC_OK ? crdp_cliprdr_wait_response(ctx, cancel_seq) : -3;
+    if (status != 0) {
+        if (status == -1) {
+            WLog_WARN(CRDP_TAG, "Timed out waiting for server clipboard data");
+        } else if (status == -2) {
+            WLog_INFO(CRDP_TAG, "Clipboard transfer from server cancelled");
+        } else {
+            WLog_WARN(CRDP_TAG, "Clipboard data request failed: %u", rc);
+        }
+        // A late response is dropped by the response handler
+        r->request_pending = false;
+        pthread_cond_broadcast(&r->cond);
+    }
+    return status;
+}
+
+// Server format a host type is made from; r->lock held
+static UINT32 crdp_cliprdr_source_format(const crdp_clip_remote_t* r, crdp_clip_type_t type) {
+    switch (type) {
+        case CRDP_CLIP_TEXT: return r->text_format;
+        case CRDP_CLIP_HTML: return r->html_format;
+        case CRDP_CLIP_RTF: return r->rtf_format;
+        case CRDP_CLIP_PNG:
+        case CRDP_CLIP_TIFF: return r->image_format;
+        default: return 0;
+    }
+}
+
+static uint8_t* crdp_cliprdr_copy(const uint8_t* data, size_t len) {
+    uint8_t* copy = malloc(len ? len : 1);
+    if (copy) memcpy(copy, data, len);
+    return copy;
+}
+
+// Resolves a clipboard promise. Runs on the host thread doing the paste and
+// blocks until the server has answered (or the transfer fails).
+static uint8_t* crdp_cliprdr_provide(void* arg, uint32_t generation, crdp_clip_type_t type, size_t* len) {
+    crdp_context* ctx = (crdp_context*)arg;
+    crdp_clip_remote_t* r = &ctx->remote_clip;
+    crdp_clip_transfer_t* x = &ctx->client->clip_xfer;
+    uint32_t cancel_seq = atomic_load(&x->cancel_seq);
+    uint8_t* data = NULL;
+    bool fetched = false;
+    UINT32 format = 0;
+    if (type < 0 || type >= CRDP_CLIP_TYPE_COUNT) return NULL;
+    
+    pthread_mutex_lock(&r->lock);
+    // Only one format data request may be outstanding at a time
+    if (crdp_cliprdr_wait_response(ctx, cancel_seq) != 0) goto out;
+    format = crdp_cliprdr_source_format(r, type);
+    if (r->closing || generation != r->generation || format == 0) goto out;
+    
+    if (!r->cache[type]) {
+        if (!ctx->cliprdr) goto out;
+        fetched = true;
+        WLog_DBG(CRDP_TAG, "Paste requested, type=%d", type);
+        if (crdp_cliprdr_request(ctx, generation, format, cancel_seq) != 0 || !r->raw) goto out;
+        uint8_t* raw = r->raw;
+        size_t raw_len = r->raw_len;
+        r->raw = NULL;
+        
+        // Converted to the pasted type only, without holding up the channel
+        pthread_mutex_unlock(&r->lock);
+        size_t converted_len = 0;
+        uint8_t* converted = NULL;
+        if (type == CRDP_CLIP_TEXT) {
+            converted = (uint8_t*)crdp_cliprdr_decode_text(format, raw, raw_len);
+            if (converted) converted_len = strlen((char*)converted);
+        } else {
+            converted = crdp_clipformat_from_server(type, format, raw, raw_len, &converted_len);
+        }
+        free(raw);
+        pthread_mutex_lock(&r->lock);
+        
+        if (!converted) {
+            WLog_WARN(CRDP_TAG, "Cannot convert server clipboard data, format=%u type=%d", format, type);
+            goto out;
+        }
+        WLog_INFO(CRDP_TAG, "Clipboard fetched from server: %zu bytes", converted_len);
+        if (generation == r->generation && !r->cache[type]) {
+            r->cache[type] = converted;
+            r->cache_len[type] = converted_len;
+        } else {
+            *len = converted_len;
+            data = converted;
+            goto out;
+        }
+    }
+    
+    data = crdp_cliprdr_copy(r->cache[type], r->cache_len[type]);
+    if (data) *len = r->cache_len[type];
+    
+out:
+    pthread_mutex_unlock(&r->lock);
+    if (fetched) {
+        atomic_store(&x->receiving, false);
+        crdp_clip_report(ctx->client, CRDP_CLIPBOARD_FROM_SERVER, atomic_load(&x->in_received),
+                         atomic_load(&x->in_total), true, !data);
+    }
+    return data;
+}
+
+static void crdp_cliprdr_clear_cache(crdp_clip_remote_t* r) {
+    for (int i = 0; i < CRDP_CLIP_TYPE_COUNT; i++) {
+        free(r->cache[i]);
+        r->cache[i] = NULL;
+        r->cache_len[i] = 0;
+    }
+}
+
+uint8_t* crdp_cliprdr_fetch_file_list(crdp_context* ctx, uint32_t cancel_seq, size_t* len) {
+    crdp_clip_remote_t* r = &ctx->remote_clip;
+    crdp_clip_transfer_t* x = &ctx->client->clip_xfer;
+    UINT32 format = atomic_load(&ctx->client->clip_files.server_format);
+    uint8_t* data = NULL;
+    if (format == 0) return NULL;
+    
+    pthread_mutex_lock(&r->lock);
+    if (crdp_cliprdr_wait_response(ctx, cancel_seq) == 0 && !r->closing) {
+        if (crdp_cliprdr_request(ctx, r->generation, format, cancel_seq) == 0 && r->raw) {
+            data = r->raw;
+            *len = r->raw_len;
+            r->raw = NULL;
+        }
+        atomic_store(&x->receiving, false);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return data;
+}
+
+static UINT crdp_cliprdr_send_client_format_list(CliprdrClientContext* cliprdr) {
+    crdp_context* ctx = (crdp_context*)cliprdr->custom;
+    if (!ctx) return ERROR_INTERNAL_ERROR;
+    
+    // Always advertise text formats
+    CLIPRDR_FORMAT formats[8] = { 0 };
+    UINT32 count = 0;
+    formats[count].formatId = 13; // CF_UNICODETEXT
+    formats[count++].formatName = NULL;
+    formats[count].formatId = 1;  // CF_TEXT
+    formats[count++].formatName = NULL;
+    // Only announced; converted when the server asks for one
+    count = crdp_clipformat_list(formats, count, 7);
+    if (crdp_clipfile_can_offer(ctx)) {
+        formats[count].formatId = CRDP_CF_FILE_GROUP_DESCRIPTOR_W;
+        formats[count++].formatName = CRDP_CF_FILE_GROUP_DESCRIPTOR_W_NAME;
+    }
+    
+    CLIPRDR_FORMAT_LIST formatList = { 0 };
+    formatList.common.msgFlags = 0;
+    formatList.numFormats = count;
+    formatList.formats = formats;
+    
+    return cliprdr->ClientFormatList(cliprdr, &formatList);
+}
+
+static UINT crdp_cliprdr_send_client_format_list_response(CliprdrClientContext* cliprdr, BOOL status) {
+    CLIPRDR_FORMAT_LIST_RESPONSE response = { 0 };
+    response.common.msgFlags = status ? CB_RESPONSE_OK : CB_RESPONSE_FAIL;
+    return cliprdr->ClientFormatListResponse(cliprdr, &response);
+}
+
+static UINT crdp_cliprdr_send_client_capabilities(CliprdrClientContext* cliprdr) {
+    CLIPRDR_CAPABILITIES capabilities = { 0 };
+    CLIPRDR_GENERAL_CAPABILITY_SET generalCaps = { 0 };
+    
+    capabilities.cCapabilitiesSets = 1;
+    capabilities.capabilitySets = (CLIPRDR_CAPABILITY_SET*)&generalCaps;
+    
+    generalCaps.capabilitySetType = CB_CAPSTYPE_GENERAL;
+    generalCaps.capabilitySetLength = 12;
+    generalCaps.version = CB_CAPS_VERSION_2;
+    // Files are streamed with FileContents requests, never by path
+    generalCaps.generalFlags = CB_USE_LONG_FORMAT_NAMES | CB_STREAM_FILECLIP_ENABLED |
+                               CB_FILECLIP_NO_FILE_PATHS | CB_HUGE_FILE_SUPPORT_ENABLED;
+    
+    return cliprdr->ClientCapabilities(cliprdr, &capabilities);
+}
+
+static UINT crdp_cliprdr_monitor_ready(CliprdrClientContext* cliprdr, const CLIPRDR_MONITOR_READY* ready) {
+    crdp_context* ctx = (crdp_context*)cliprdr->custom;
+    WLog_INFO(CRDP_TAG, "Clipboard monitor ready");
+    ctx->clipboardSync = TRUE;
+    crdp_cliprdr_send_client_capabilities(cliprdr);
+    atomic_store(&ctx->local_sent_hash, crdp_clipboard_content_hash());
+    atomic_store(&ctx->local_sent_valid, true);
+    return crdp_cliprdr_send_client_format_list(cliprdr);
+}
+
+static UINT crdp_cliprdr_server_capabilities(CliprdrClientContext* cliprdr, const CLIPRDR_CAPABILITIES* caps) {
+    crdp_context* ctx = (crdp_context*)cliprdr->custom;
+    for (UINT32 i = 0; i < caps->cCapabilitiesSets; i++) {
+        const CLIPRDR_CAPABILITY_SET* capSet = &caps->capabilitySets[i];
+        if (capSet->capabilitySetType == CB_CAPSTYPE_GENERAL) {
+            const CLIPRDR_GENERAL_CAPABILITY_SET* genCaps = (const CLIPRDR_GENERAL_CAPABILITY_SET*)capSet;
+            ctx->clipboardCapabilities = genCaps->generalFlags;
+        }
+    }
+    return CHANNEL_RC_OK;
+}
+
+static UINT crdp_cliprdr_server_format_list(CliprdrClientContext* cliprdr, const CLIPRDR_FORMAT_LIST* list) {
+    crdp_context* ctx = (crdp_context*)cliprdr->custom;
+    if (!ctx) return ERROR_INTERNAL_ERROR;
+    crdp_clip_remote_t* r = &ctx->remote_clip;
+    
+    WLog_DBG(CRDP_TAG, "Server sent format list with %u formats", list->numFormats);
+    
+    // Find the formats we can handle - prefer CF_UNICODETEXT over CF_TEXT
+    UINT32 textFormatId = 0;
+    UINT32 fileFormatId = 0;
+    UINT32 htmlFormatId = 0;
+    UINT32 rtfFormatId = 0;
+    UINT32 pngFormatId = 0;
+    UINT32 dibFormatId = 0;
+    for (UINT32 i = 0; i < list->numFormats; i++) {
+        const CLIPRDR_FORMAT* format = &list->formats[i];
+        const char* name = format->formatName;
+        // CF_UNICODETEXT = 13, CF_TEXT = 1 - prefer Unicode
+        if (format->formatId == 13) {
+            textFormatId = 13;
+        } else if (format->formatId == 1 && textFormatId == 0) {
+            textFormatId = 1;
+        } else if (format->formatId == CRDP_CF_DIB) {
+            dibFormatId = CRDP_CF_DIB;
+        } else if (format->formatId == CRDP_CF_DIBV5 && dibFormatId == 0) {
+            dibFormatId = CRDP_CF_DIBV5;
+        } else if (!name) {
+            continue;
+        } else if (strcmp(name, CRDP_CF_FILE_GROUP_DESCRIPTOR_W_NAME) == 0) {
+            fileFormatId = format->formatId;
+        } else if (strcmp(name, CRDP_CF_HTML_NAME) == 0) {
+            htmlFormatId = format->formatId;
+        } else if (strcmp(name, CRDP_CF_RTF_NAME) == 0) {
+            rtfFormatId = format->formatId;
+        } else if (strcmp(name, CRDP_CF_PNG_NAME) == 0) {
+            pngFormatId = format->formatId;
+        }
+    }
+    atomic_store(&ctx->client->clip_files.server_format, fileFormatId);
+    // PNG keeps transparency and is usually smaller on the wire than a DIB
+    UINT32 imageFormatId = pngFormatId ? pngFormatId : dibFormatId;
+    
+    uint32_t types = 0;
+    if (textFormatId) types |= 1u << CRDP_CLIP_TEXT;
+    if (htmlFormatId) types |= 1u << CRDP_CLIP_HTML;
+    if (rtfFormatId) types |= 1u << CRDP_CLIP_RTF;
+    if (imageFormatId) types |= (1u << CRDP_CLIP_PNG) | (1u << CRDP_CLIP_TIFF);
+    
+    // The previous server clipboard is gone; anything cached for it is stale
+    pthread_mutex_lock(&r->lock);
+    uint32_t generation = ++r->generation;
+    r->text_format = textFormatId;
+    r->html_format = htmlFormatId;
+    r->rtf_format = rtfFormatId;
+    r->image_format = imageFormatId;
+    crdp_cliprdr_clear_cache(r);
+    pthread_mutex_unlock(&r->lock);
+    // The server no longer holds what we last sent it, so the same host
+    // content has to be announced again
+    atomic_store(&ctx->local_sent_valid, false);
+    
+    crdp_cliprdr_send_client_format_list_response(cliprdr, TRUE);
+    
+    // Nothing is transferred yet: the host clipboard gets a promise that is
+    // only resolved if something actually pastes it
+    if (types != 0) {
+        WLog_DBG(CRDP_TAG, "Promising server clipboard, types=0x%x generation=%u", types, generation);
+        crdp_clipboard_promise(crdp_cliprdr_provide, ctx, generation, types);
+    }
+    
+    return CHANNEL_RC_OK;
+}
+
+static UINT crdp_cliprdr_server_format_list_response(CliprdrClientContext* cliprdr, const CLIPRDR_FORMAT_LIST_RESPONSE* resp) {
+    return CHANNEL_RC_OK;
+}
+
+static UINT crdp_cliprdr_server_lock_clipboard_data(CliprdrClientContext* cliprdr, const CLIPRDR_LOCK_CLIPBOARD_DATA* lock) {
+    return CHANNEL_RC_OK;
+}
+
+static UINT crdp_cliprdr_server_unlock_clipboard_data(CliprdrClientContext* cliprdr, const CLIPRDR_UNLOCK_CLIPBOARD_DATA* unlock) {
+    return CHANNEL_RC_OK;
+}
+
+typedef struct {
+    crdp_client_t* client;
+    uint32_t cancel_seq;
+    size_t reported;
+} crdp_clip_outbound_t;
+
+// Pasteboard copy progress; false aborts the copy
+static bool crdp_cliprdr_outbound_chunk(void* arg, size_t done_bytes, size_t total_bytes) {
+    crdp_clip_outbound_t* out = (crdp_clip_outbound_t*)arg;
+    if (atomic_load(&out->client->clip_xfer.cancel_seq) != out->cancel_seq) return false;
+    if (done_bytes - out->reported >= CRDP_CLIPBOARD_PROGRESS_BYTES) {
+        crdp_clip_report(out->client, CRDP_CLIPBOARD_TO_SERVER, done_bytes, total_bytes, false, false);
+        out->reported = done_bytes;
+    }
+    return true;
+}
+
+// Host text for the shared cache (crdp_clipformat_acquire), within the limit
+// of the session that asked first
+static int crdp_cliprdr_read_text(UINT32 format, void* arg, uint8_t** data, size_t* len) {
+    crdp_clip_outbound_t* out = (crdp_clip_outbound_t*)arg;
+    size_t max_bytes = out->client->config.clipboard_max_bytes;
+    if (format == 13) {
+        // Copied out of the pasteboard straight into the response buffer,
+        // without an intermediate UTF-8 copy
+        return crdp_clipboard_get_utf16(max_bytes, crdp_cliprdr_outbound_chunk, out, data, len);
+    }
+    // CF_TEXT - sent as-is with null terminator
+    char* text = crdp_clipboard_get_text();
+    if (!text) return -1;
+    size_t n = strlen(text) + 1;
+    if (max_bytes && n > max_bytes) {
+        free(text);
+        return -2;
+    }
+    *data = (uint8_t*)text;
+    *len = n;
+    return 0;
+}
+
+static UINT crdp_cliprdr_answer_format_data_request(CliprdrClientContext* cliprdr, const CLIPRDR_FORMAT_DATA_REQUEST* req) {
+    crdp_context* ctx = (crdp_context*)cliprdr->custom;
+    if (!ctx) return ERROR_INTERNAL_ERROR;
+    crdp_client_t* client = ctx->client;
+    size_t max_bytes = client->config.clipboard_max_bytes;
+    
+    WLog_DBG(CRDP_TAG, "Server requesting clipboard data, format=%u", req->requestedFormatId);
+    
+    CLIPRDR_FORMAT_DATA_RESPONSE response = { 0 };
+    uint8_t* data = NULL;
+    size_t size = 0;
+    crdp_clip_blob_t* blob = NULL;   // Owns data when set
+    
+    // CF_UNICODETEXT = 13, CF_TEXT = 1
+    if (crdp_clipformat_is_rich(req->requestedFormatId)) {
+        // Converted and answered on the clipboard format worker
+        if (crdp_clipformat_queue(ctx, req->requestedFormatId)) return CHANNEL_RC_OK;
+        WLog_WARN(CRDP_TAG, "Too many clipboard requests queued, failing format %u", req->requestedFormatId);
+    } else if (req->requestedFormatId == CRDP_CF_FILE_GROUP_DESCRIPTOR_W) {
+        data = crdp_clipfile_build_list(ctx, &size);
+    } else if (req->requestedFormatId == 13 || req->requestedFormatId == 1) {
+        // Read once per content and shared with the other sessions
+        crdp_clip_outbound_t out = { client, atomic_load(&client->clip_xfer.cancel_seq), 0 };
+        int rc = 0;
+        blob = crdp_clipformat_acquire(req->requestedFormatId, crdp_cliprdr_read_text, &out, &rc);
+        if (blob && max_bytes && blob->len > max_bytes) {
+            // Cached for a session with a higher limit
+            crdp_clip_blob_release(blob);
+            blob = NULL;
+            rc = -2;
+        }
+        if (rc == -2) {
+            WLog_WARN(CRDP_TAG, "Local clipboard text exceeds %zu bytes, not sending it", max_bytes);
+        } else if (rc == -3) {
+            WLog_INFO(CRDP_TAG, "Clipboard transfer to server cancelled");
+        } else if (rc != 0 && rc != -1) {
+            WLog_WARN(CRDP_TAG, "Failed to copy local clipboard text: %d", rc);
+        }
+        if (rc != 0 && rc != -1) crdp_clip_report(client, CRDP_CLIPBOARD_TO_SERVER, 0, 0, true, true);
+        if (blob) {
+            data = blob->data;
+            size = blob->len;
+        }
+    }
+    
+    if (data && size <= UINT32_MAX) {
+        // Sent as one message, so cancelling no longer reaches it
+        response.common.msgFlags = CB_RESPONSE_OK;
+        response.common.dataLen = (UINT32)size;
+        response.requestedFormatData = data;
+        UINT rc = cliprdr->ClientFormatDataResponse(cliprdr, &response);
+        if (rc == CHANNEL_RC_OK) crdp_metrics_add(client, CRDP_COUNTER_CLIPBOARD_BYTES_SENT, size);
+        if (blob) crdp_clip_blob_release(blob);
+        else free(data);
+        crdp_clip_report(client, CRDP_CLIPBOARD_TO_SERVER, size, size, true, rc != CHANNEL_RC_OK);
+        return rc;
+    }
+    if (blob) crdp_clip_blob_release(blob);
+    else free(data);
+    
+    // No data available
+    response.common.msgFlags = CB_RESPONSE_FAIL;
+    response.common.dataLen = 0;
+    response.requestedFormatData = NULL;
+    return cliprdr->ClientFormatDataResponse(cliprdr, &response);
+}
+
+static UINT crdp_cliprdr_server_format_data_request(CliprdrClientContext* cliprdr, const CLIPRDR_FORMAT_DATA_REQUEST* req) {
+    uint64_t span = crdp_span_begin();
+    UINT rc = crdp_cliprdr_answer_format_data_request(cliprdr, req);
+    crdp_span_end(span, "clipboard request", "format", req->requestedFormatId);
+    return rc;
+}
+
+static UINT crdp_cliprdr_take_format_data_response(CliprdrClientContext* cliprdr, const CLIPRDR_FORMAT_DATA_RESPONSE* resp) {
+    crdp_context* ctx = (crdp_context*)cliprdr->custom;
+    if (!ctx) return ERROR_INTERNAL_ERROR;
+    crdp_clip_remote_t* r = &ctx->remote_clip;
+    
+    pthread_mutex_lock(&r->lock);
+    if (!r->request_pending) {
+        // Late answer to a request that already timed out
+        pthread_mutex_unlock(&r->lock);
+        WLog_DBG(CRDP_TAG, "Ignoring unsolicited clipboard data");
+        return CHANNEL_RC_OK;
+    }
+    
+    if (resp->common.msgFlags & CB_RESPONSE_OK && resp->requestedFormatData && resp->common.dataLen > 0) {
+        WLog_DBG(CRDP_TAG, "Received clipboard data: %u bytes", resp->common.dataLen);
+        
+        // Only keep it if the server clipboard hasn't changed in the meantime.
+        // The requester converts it, off the channel thread.
+        size_t max_bytes = ctx->client->config.clipboard_max_bytes;
+        if (max_bytes && resp->common.dataLen > max_bytes) {
+            WLog_WARN(CRDP_TAG, "Server clipboard data exceeds %zu bytes, dropping it", max_bytes);
+        } else if (r->request_generation == r->generation) {
+            free(r->raw);
+            r->raw = crdp_cliprdr_copy(resp->requestedFormatData, resp->common.dataLen);
+            r->raw_len = r->raw ? resp->common.dataLen : 0;
+        }
+    } else {
+        WLog_WARN(CRDP_TAG, "Server could not provide clipboard data");
+    }
+    r->request_pending = false;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    return CHANNEL_RC_OK;
+}
+
+static UINT crdp_cliprdr_server_format_data_response(CliprdrClientContext* cliprdr, const CLIPRDR_FORMAT_DATA_RESPONSE* resp) {
+    uint64_t span = crdp_span_begin();
+    UINT rc = crdp_cliprdr_take_format_data_response(cliprdr, resp);
+    crdp_span_end(span, "clipboard data", "bytes", resp->common.dataLen);
+    crdp_context* ctx = (crdp_context*)cliprdr->custom;
+    if (ctx && (resp->common.msgFlags & CB_RESPONSE_OK)) {
+        crdp_metrics_add(ctx->client, CRDP_COUNTER_CLIPBOARD_BYTES_RECEIVED, resp->common.dataLen);
+    }
+    return rc;
+}
+
+// Protocol thread: follows the server's format data response while it is
+// still being reassembled, to report progress and enforce the size cap before
+// the whole payload has arrived. Compressed chunks can't be read here: one
+// that starts a message leaves it unfollowed, and later ones only count as
+// activity, since their size isn't what they add to the total.
+void crdp_cliprdr_observe(crdp_client_t* client, uint16_t channel_id, const uint8_t* payload, size_t len) {
+    crdp_clip_transfer_t* x = &client->clip_xfer;
+    if (channel_id == 0 || channel_id != atomic_load(&x->channel_id) || len < 8) return;
+    
+    // CHANNEL_PDU_HEADER: total message length, then chunk flags
+    uint32_t total = (uint32_t)payload[0] | ((uint32_t)payload[1] << 8) |
+                     ((uint32_t)payload[2] << 16) | ((uint32_t)payload[3] << 24);
+    uint32_t flags = (uint32_t)payload[4] | ((uint32_t)payload[5] << 8) |
+                     ((uint32_t)payload[6] << 16) | ((uint32_t)payload[7] << 24);
+    bool compressed = (flags & CHANNEL_FLAG_PACKET_COMPRESSED) != 0;
+    const uint8_t* data = payload + 8;
+    size_t size = compressed ? 0 : len - 8;
+    
+    if (flags & CHANNEL_FLAG_FIRST) {
+        uint16_t msg_type = size >= 2 ? (uint16_t)(data[0] | (data[1] << 8)) : 0;
+        x->in_tracking = msg_type == CB_FORMAT_DATA_RESPONSE;
+        if (!x->in_tracking) return;
+        atomic_store(&x->in_total, total);
+        atomic_store(&x->in_received, 0);
+        x->in_reported = 0;
+        
+        size_t max_bytes = client->config.clipboard_max_bytes;
+        if (max_bytes && total > max_bytes) {
+            WLog_WARN(CRDP_TAG, "Server clipboard data is %u bytes, over the %zu byte limit", total, max_bytes);
+            atomic_store(&x->rejected, true);
+        }
+    }
+    if (!x->in_tracking) return;
+    
+    uint64_t received = atomic_fetch_add(&x->in_received, size) + size;
+    atomic_store(&x->in_activity, crdp_time_ms());
+    if (flags & CHANNEL_FLAG_LAST) {
+        x->in_tracking = false;
+    } else if (received - x->in_reported >= CRDP_CLIPBOARD_PROGRESS_BYTES) {
+        crdp_clip_report(client, CRDP_CLIPBOARD_FROM_SERVER, received, total, false, false);
+        x->in_reported = received;
+    }
+}
+
+void crdp_clip_transfer_init(crdp_client_t* client) {
+    crdp_clip_transfer_t* x = &client->clip_xfer;
+    pthread_mutex_init(&x->cb_lock, NULL);
+    atomic_init(&x->cancel_seq, 0);
+    atomic_init(&x->receiving, false);
+    atomic_init(&x->rejected, false);
+    atomic_init(&x->channel_id, 0);
+    atomic_init(&x->in_activity, 0);
+    atomic_init(&x->in_total, 0);
+    atomic_init(&x->in_received, 0);
+}
+
+void crdp_clip_transfer_free(crdp_client_t* client) {
+    pthread_mutex_destroy(&client->clip_xfer.cb_lock);
+}
+
+void crdp_set_clipboard_progress_callback(crdp_client_t* client, crdp_clipboard_progress_cb cb, void* user) {
+    if (!client) return;
+    pthread_mutex_lock(&client->clip_xfer.cb_lock);
+    client->clip_xfer.cb = cb;
+    client->clip_xfer.cb_user = user;
+    pthread_mutex_unlock(&client->clip_xfer.cb_lock);
+}
+
+void crdp_clipboard_cancel(crdp_client_t* client) {
+    if (!client) return;
+    // Transfers compare against the value they started with
+    atomic_fetch_add(&client->clip_xfer.cancel_seq, 1);
+}
+
+// Callback when local macOS clipboard changes (monitor thread)
+static void crdp_local_clipboard_changed(void* context, uint64_t content_hash) {
+    crdp_context* ctx = (crdp_context*)context;
+    if (!ctx || !ctx->cliprdr || !ctx->clipboardSync) return;
+    
+    // Copying the same thing again changes nothing on the server
+    if (atomic_load(&ctx->local_sent_valid) && atomic_load(&ctx->local_sent_hash) == content_hash) {
+        WLog_DBG(CRDP_TAG, "Local clipboard content unchanged, not notifying server");
+        return;
+    }
+    atomic_store(&ctx->local_sent_hash, content_hash);
+    atomic_store(&ctx->local_sent_valid, true);
+    
+    WLog_DBG(CRDP_TAG, "Local clipboard changed, notifying server");
+    crdp_cliprdr_send_client_format_list(ctx->cliprdr);
+}
+
+void crdp_cliprdr_init(crdp_context* ctx, CliprdrClientContext* cliprdr) {
+    ctx->cliprdr = cliprdr;
+    cliprdr->custom = ctx;
+    
+    ctx->clipboard = ClipboardCreate();
+    ctx->clipboardSync = FALSE;
+    ctx->clipboardCapabilities = 0;
+    
+    // Lets the transport hook pick out clipboard traffic
+    UINT16 channel_id = freerdp_channels_get_id_by_name(ctx->_p.instance, CLIPRDR_SVC_CHANNEL_NAME);
+    atomic_store(&ctx->client->clip_xfer.channel_id, channel_id);
+    
+    crdp_clip_remote_t* r = &ctx->remote_clip;
+    memset(r, 0, sizeof(*r));
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    atomic_store(&ctx->local_sent_valid, false);
+    crdp_clipformat_start(ctx);
+    
+    cliprdr->MonitorReady = crdp_cliprdr_monitor_ready;
+    cliprdr->ServerCapabilities = crdp_cliprdr_server_capabilities;
+    cliprdr->ServerFormatList = crdp_cliprdr_server_format_list;
+    cliprdr->ServerFormatListResponse = crdp_cliprdr_server_format_list_response;
+    cliprdr->ServerLockClipboardData = crdp_cliprdr_server_lock_clipboard_data;
+    cliprdr->ServerUnlockClipboardData = crdp_cliprdr_server_unlock_clipboard_data;
+    cliprdr->ServerFormatDataRequest = crdp_cliprdr_server_format_data_request;
+    cliprdr->ServerFormatDataResponse = crdp_cliprdr_server_format_data_response;
+    cliprdr->ServerFileContentsRequest = crdp_clipfile_contents_request;
+    cliprdr->ServerFileContentsResponse = crdp_clipfile_contents_response;
+    crdp_clipfile_attach(ctx, cliprdr);
+    
+    // Hear about host clipboard changes from the shared watcher
+    if (crdp_clipboard_subscribe(crdp_local_clipboard_changed, ctx) != 0) {
+        WLog_WARN(CRDP_TAG, "Too many sessions watching the host clipboard");
+    }
+    
+    WLog_INFO(CRDP_TAG, "Clipboard channel initialized");
+}
+
+void crdp_cliprdr_uninit(crdp_context* ctx) {
+    crdp_clip_remote_t* r = &ctx->remote_clip;
+    
+    // No more change callbacks; other sessions keep the watcher running
+    crdp_clipboard_unsubscribe(ctx);
+    
+    // Fail any paste waiting for server data, then make sure the host
+    // clipboard can't call back into this context
+    pthread_mutex_lock(&r->lock);
+    r->closing = true;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    crdp_clipboard_revoke_promise(ctx);
+    // Waits for a file download to notice, and for a conversion to finish
+    crdp_clipfile_detach(ctx);
+    crdp_clipformat_stop(ctx);
+    atomic_store(&ctx->client->clip_xfer.channel_id, 0);
+    
+    if (ctx->clipboard) {
+        ClipboardDestroy(ctx->clipboard);
+        ctx->clipboard = NULL;
+    }
+    ctx->cliprdr = NULL;
+    
+    crdp_cliprdr_clear_cache(r);
+    free(r->raw);
+    r->raw = NULL;
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->lock);
+}
@@ -0,0 +1,329 @@
+#include "crdp_internal.h"
+
+#include <freerdp/channels/channels.h>
+#include <freerdp/freerdp.h>
+#include <winpr/wlog.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Bulk compression statistics.
+//
+// FreeRDP decompresses inside its own PDU parsing and keeps no numbers, so
+// CRDP looks at every received PDU itself (transport.c), attributes it to a
+// channel and feeds compressed payloads to a second set of decompressors that
+// shadow FreeRDP's history. That yields the decompressed size and the CPU time
+// each payload costs. Encrypted PDUs (standard RDP security) can't be parsed
+// and are only counted as unparsed.
+
+// Compression flags (MS-RDPBCGR 2.2.8.1.1.1.2 / 3.1.8.2)
+#define CRDP_COMPR_TYPE_MASK 0x0F
+#define CRDP_COMPR_TYPE_8K 0x00
+#define CRDP_COMPR_TYPE_64K 0x01
+#define CRDP_COMPR_TYPE_RDP6 0x02
+#define CRDP_COMPR_TYPE_RDP61 0x03
+#define CRDP_COMPR_FLAGS_MASK 0xE0
+#define CRDP_COMPR_COMPRESSED 0x20
+
+// Slow-path payloads
+#define CRDP_MCS_IO_CHANNEL_ID 1003  // MCS_GLOBAL_CHANNEL_ID
+#define CRDP_SEC_ENCRYPT 0x0008
+#define CRDP_PDUTYPE_DATAPDU 0x7
+#define CRDP_SHARE_DATA_HEADER_LEN 18
+#define CRDP_CHANNEL_PDU_HEADER_LEN 8
+
+// Fast-path framing
+#define CRDP_FASTPATH_OUTPUT_ENCRYPTED 0x2
+#define CRDP_FASTPATH_COMPRESSION_USED 0x2
+
+static inline uint16_t crdp_read_u16_le(const uint8_t* p) { return (uint16_t)(p[0] | (p[1] << 8)); }
+static inline uint32_t crdp_read_u32_le(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t crdp_thread_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static crdp_compression_t crdp_compression_from_type(uint32_t type) {
+    switch (type) {
+        case CRDP_COMPR_TYPE_8K: return CRDP_COMPRESSION_MPPC_8K;
+        case CRDP_COMPR_TYPE_64K: return CRDP_COMPRESSION_MPPC_64K;
+        case CRDP_COMPR_TYPE_RDP6: return CRDP_COMPRESSION_NCRUSH;
+        default: return CRDP_COMPRESSION_XCRUSH;
+    }
+}
+
+static void crdp_bulk_history_free(crdp_bulk_history_t* h) {
+    if (h->mppc) mppc_context_free(h->mppc);
+    if (h->ncrush) ncrush_context_free(h->ncrush);
+    if (h->xcrush) xcrush_context_free(h->xcrush);
+    memset(h, 0, sizeof(*h));
+}
+
+// Mirrors bulk_decompress: payloads without any compression flags leave the
+// history alone. Returns the decompressed size, or -1 on error.
+static int64_t crdp_bulk_decompress(crdp_bulk_history_t* h, const uint8_t* src, uint32_t size, uint32_t flags) {
+    if (!(flags & CRDP_COMPR_FLAGS_MASK)) return size;
+
+    const BYTE* out = NULL;
+    UINT32 out_size = 0;
+    int status = -1;
+    switch (flags & CRDP_COMPR_TYPE_MASK) {
+        case CRDP_COMPR_TYPE_8K:
+        case CRDP_COMPR_TYPE_64K:
+            if (!h->mppc && !(h->mppc = mppc_context_new(1, FALSE))) return -1;
+            mppc_set_compression_level(h->mppc, (flags & CRDP_COMPR_TYPE_MASK) == CRDP_COMPR_TYPE_64K);
+            status = mppc_decompress(h->mppc, src, size, &out, &out_size, flags);
+            break;
+        case CRDP_COMPR_TYPE_RDP6:
+            if (!h->ncrush && !(h->ncrush = ncrush_context_new(FALSE))) return -1;
+            status = ncrush_decompress(h->ncrush, src, size, &out, &out_size, flags);
+            break;
+        case CRDP_COMPR_TYPE_RDP61:
+            if (!h->xcrush && !(h->xcrush = xcrush_context_new(FALSE))) return -1;
+            status = xcrush_decompress(h->xcrush, src, size, &out, &out_size, flags);
+            break;
+        default:
+            break;
+    }
+    return status < 0 ? -1 : (int64_t)out_size;
+}
+
+// Counters for a channel, created on first use; lock held
+static crdp_channel_compression_stats_t* crdp_channel_stats(crdp_client_t* client, uint16_t channel_id) {
+    crdp_compression_stats_t* st = &client->compression.stats;
+    for (uint32_t i = 0; i < st->channel_count; i++) {
+        if (st->channels[i].channel_id == channel_id) return &st->channels[i];
+    }
+    if (st->channel_count == CRDP_MAX_CHANNEL_STATS) return NULL;
+
+    crdp_channel_compression_stats_t* ch = &st->channels[st->channel_count++];
+    memset(ch, 0, sizeof(*ch));
+    ch->channel_id = channel_id;
+    const char* name = channel_id == CRDP_MCS_IO_CHANNEL_ID
+                           ? "io" : freerdp_channels_get_name_by_id(client->instance, channel_id);
+    if (name) {
+        snprintf(ch->name, sizeof(ch->name), "%s", name);
+    } else {
+        snprintf(ch->name, sizeof(ch->name), "mcs:%u", channel_id);
+    }
+    return ch;
+}
+
+// Per-PDU tally, added to the channel counters in one go
+typedef struct {
+    uint64_t compressed_pdus;
+    uint64_t compressed_bytes;
+    uint64_t decompressed_bytes;
+    uint64_t decompress_ns;
+    uint64_t errors;
+    crdp_compression_t active;
+} crdp_bulk_tally_t;
+
+static void crdp_bulk_payload(crdp_bulk_history_t* h, const uint8_t* src, uint32_t size, uint32_t flags,
+                              crdp_bulk_tally_t* tally) {
+    if (!(flags & CRDP_COMPR_FLAGS_MASK)) return;
+
+    uint64_t start = crdp_thread_cpu_ns();
+    int64_t out = crdp_bulk_decompress(h, src, size, flags);
+    uint64_t elapsed = crdp_thread_cpu_ns() - start;
+
+    // Flush/at-front markers on uncompressed payloads only reset the history
+    if (!(flags & CRDP_COMPR_COMPRESSED)) return;
+    tally->compressed_pdus++;
+    tally->compressed_bytes += size;
+    tally->decompress_ns += elapsed;
+    tally->active = crdp_compression_from_type(flags & CRDP_COMPR_TYPE_MASK);
+    if (out < 0) {
+        tally->errors++;
+    } else {
+        tally->decompressed_bytes += (uint64_t)out;
+    }
+}
+
+static void crdp_compression_account(crdp_client_t* client, uint16_t channel_id, size_t wire_bytes,
+                                     const crdp_bulk_tally_t* tally) {
+    crdp_compression_state_t* c = &client->compression;
+    pthread_mutex_lock(&c->lock);
+    crdp_channel_compression_stats_t* ch = crdp_channel_stats(client, channel_id);
+    if (!ch) {
+        c->stats.unparsed_bytes += wire_bytes;
+    } else {
+        ch->pdus++;
+        ch->wire_bytes += wire_bytes;
+        ch->compressed_pdus += tally->compressed_pdus;
+        ch->compressed_bytes += tally->compressed_bytes;
+        ch->decompressed_bytes += tally->decompressed_bytes;
+        ch->decompress_ns += tally->decompress_ns;
+        ch->errors += tally->errors;
+    }
+    if (tally->compressed_pdus > 0) c->stats.active = tally->active;
+    pthread_mutex_unlock(&c->lock);
+}
+
+static void crdp_compression_unparsed(crdp_client_t* client, size_t len) {
+    pthread_mutex_lock(&client->compression.lock);
+    client->compression.stats.unparsed_bytes += len;
+    pthread_mutex_unlock(&client->compression.lock);
+}
+
+// Share Control PDUs on the I/O channel. Returns false if the payload doesn't
+// look like unencrypted share PDUs.
+static bool crdp_parse_share_pdus(crdp_client_t* client, const uint8_t* p, size_t len, crdp_bulk_tally_t* tally) {
+    // Under standard RDP security a basic security header comes first. Tell it
+    // apart by the share control length and give up if the data is encrypted.
+    if (len >= 6 && crdp_read_u16_le(p) != len && crdp_read_u16_le(p + 4) == len - 4) {
+        if (crdp_read_u16_le(p) & CRDP_SEC_ENCRYPT) return false;
+        p += 4;
+        len -= 4;
+    }
+
+    // A single MCS payload may carry several share PDUs back to back
+    while (len >= 6) {
+        uint16_t total = crdp_read_u16_le(p);
+        if (total == 0x8000) return true;  // Flow PDU, nothing else follows
+        if (total < 6 || total > len) return false;
+
+        uint16_t type = crdp_read_u16_le(p + 2) & 0x0F;
+        if (type == CRDP_PDUTYPE_DATAPDU && total >= CRDP_SHARE_DATA_HEADER_LEN) {
+            uint8_t flags = p[15];
+            crdp_bulk_payload(&client->compression.io_history, p + CRDP_SHARE_DATA_HEADER_LEN,
+                              total - CRDP_SHARE_DATA_HEADER_LEN, flags, tally);
+        }
+        p += total;
+        len -= total;
+    }
+    return true;
+}
+
+static void crdp_parse_slow_path(crdp_client_t* client, const uint8_t* data, size_t len) {
+    uint16_t channel_id;
+    const uint8_t* payload;
+    size_t payload_len;
+    if (!crdp_transport_channel_payload(data, len, &channel_id, &payload, &payload_len)) {
+        crdp_compression_unparsed(client, len);
+        return;
+    }
+
+    crdp_bulk_tally_t tally = { 0 };
+    if (channel_id == CRDP_MCS_IO_CHANNEL_ID) {
+        if (!crdp_parse_share_pdus(client, payload, payload_len, &tally)) {
+            crdp_compression_unparsed(client, len);
+            return;
+        }
+    } else if (payload_len >= CRDP_CHANNEL_PDU_HEADER_LEN) {
+        // CHANNEL_PDU_HEADER keeps the compression flags in bits 16-23
+        uint32_t flags = (crdp_read_u32_le(payload + 4) >> 16) & 0xFF;
+        crdp_bulk_payload(&client->compression.vc_history, payload + CRDP_CHANNEL_PDU_HEADER_LEN,
+                          (uint32_t)(payload_len - CRDP_CHANNEL_PDU_HEADER_LEN), flags, &tally);
+    }
+    crdp_compression_account(client, channel_id, len, &tally);
+}
+
+static void crdp_parse_fast_path(crdp_client_t* client, const uint8_t* data, size_t len) {
+    if (len < 2 || ((data[0] >> 6) & CRDP_FASTPATH_OUTPUT_ENCRYPTED)) {
+        crdp_compression_unparsed(client, len);
+        return;
+    }
+
+    size_t off = 1;
+    size_t total = data[off++];
+    if (total & 0x80) {
+        if (len < 3) {
+            crdp_compression_unparsed(client, len);
+            return;
+        }
+        total = ((total & 0x7F) << 8) | data[off++];
+    }
+    if (total != len) {
+        crdp_compression_unparsed(client, len);
+        return;
+    }
+
+    crdp_bulk_tally_t tally = { 0 };
+    while (off < len) {
+        uint8_t header = data[off++];
+        uint32_t flags = 0;
+        if ((header >> 6) & CRDP_FASTPATH_COMPRESSION_USED) {
+            if (off >= len) break;
+            flags = data[off++];
+        }
+        if (off + 2 > len) break;
+        uint16_t size = crdp_read_u16_le(data + off);
+        off += 2;
+        if (off + size > len) break;
+        crdp_bulk_payload(&client->compression.io_history, data + off, size, flags, &tally);
+        off += size;
+    }
+    crdp_compression_account(client, CRDP_MCS_IO_CHANNEL_ID, len, &tally);
+}
+
+// Protocol thread, for every complete PDU received
+void crdp_compression_inspect(crdp_client_t* client, const uint8_t* data, size_t len) {
+    if (!data || len == 0) return;
+    if (data[0] == CRDP_TPKT_VERSION) {
+        crdp_parse_slow_path(client, data, len);
+    } else if ((data[0] & 0x03) == 0) {
+        crdp_parse_fast_path(client, data, len);
+    } else {
+        crdp_compression_unparsed(client, len);
+    }
+}
+
+// Called from PreConnect
+void crdp_compression_configure(crdp_client_t* client, rdpSettings* settings) {
+    crdp_compression_t level = client->config.compression;
+    UINT32 type;
+    switch (level) {
+        case CRDP_COMPRESSION_DEFAULT:
+            return;
+        case CRDP_COMPRESSION_NONE:
+            freerdp_settings_set_bool(settings, FreeRDP_CompressionEnabled, FALSE);
+            WLog_INFO(CRDP_TAG, "Bulk compression disabled");
+            return;
+        case CRDP_COMPRESSION_MPPC_8K: type = CRDP_COMPR_TYPE_8K; break;
+        case CRDP_COMPRESSION_MPPC_64K: type = CRDP_COMPR_TYPE_64K; break;
+        case CRDP_COMPRESSION_NCRUSH: type = CRDP_COMPR_TYPE_RDP6; break;
+        case CRDP_COMPRESSION_XCRUSH: type = CRDP_COMPR_TYPE_RDP61; break;
+        default:
+            WLog_WARN(CRDP_TAG, "Unknown compression level %d, keeping the default", (int)level);
+            return;
+    }
+    freerdp_settings_set_bool(settings, FreeRDP_CompressionEnabled, TRUE);
+    freerdp_settings_set_uint32(settings, FreeRDP_CompressionLevel, type);
+    WLog_INFO(CRDP_TAG, "Bulk compression level: %u", type);
+}
+
+// Called before each connection, while the protocol thread is not running
+void crdp_compression_reset(crdp_client_t* client) {
+    crdp_compression_state_t* c = &client->compression;
+    crdp_bulk_history_free(&c->io_history);
+    crdp_bulk_history_free(&c->vc_history);
+    pthread_mutex_lock(&c->lock);
+    memset(&c->stats, 0, sizeof(c->stats));
+    c->stats.requested = client->config.compression;
+    pthread_mutex_unlock(&c->lock);
+}
+
+void crdp_compression_init(crdp_client_t* client) {
+    pthread_mutex_init(&client->compression.lock, NULL);
+}
+
+void crdp_compression_free(crdp_client_t* client) {
+    crdp_bulk_history_free(&client->compression.io_history);
+    crdp_bulk_history_free(&client->compression.vc_history);
+    pthread_mutex_destroy(&client->compression.lock);
+}
+
+int crdp_get_compression_stats(crdp_client_t* client, crdp_compression_stats_t* stats) {
+    if (!client || !stats) return -1;
+    if (!client->config.compression_stats) return -2;
+    pthread_mutex_lock(&client->compression.lock);
+    *stats = client->compression.stats;
+    pthread_mutex_unlock(&client->compression.lock);
+    return 0;
+}
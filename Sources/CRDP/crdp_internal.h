@@ -0,0 +1,812 @@
+#pragma once
+
+// Private declarations shared between the CRDP translation units.
+// Nothing in here is part of the public API (see include/CRDP.h).
+
+#include "CRDP.h"
+
+#include <freerdp/addin.h>
+#include <freerdp/client/cliprdr.h>
+#include <freerdp/client/rdpgfx.h>
+#include <freerdp/codec/mppc.h>
+#include <freerdp/codec/ncrush.h>
+#include <freerdp/codec/xcrush.h>
+#include <freerdp/gdi/gdi.h>
+#include <freerdp/transport_io.h>
+#include <winpr/clipboard.h>
+#include <winpr/shell.h>
+#include <winpr/synch.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+extern const char* CRDP_TAG;
+
+// Host clipboard types CRDP converts to and from (clipformat.c);
+// clipboard_mac.m mirrors this enum
+typedef enum {
+    CRDP_CLIP_TEXT = 0,        // UTF-8
+    CRDP_CLIP_HTML = 1,        // UTF-8 HTML document
+    CRDP_CLIP_RTF = 2,
+    CRDP_CLIP_PNG = 3,
+    CRDP_CLIP_TIFF = 4,
+    CRDP_CLIP_TYPE_COUNT
+} crdp_clip_type_t;
+
+// Server clipboard offered to the host as a promise (cliprdr.c). The data is
+// only requested from the server when something on the host pastes it, and
+// only converted to the type that was pasted.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t generation;       // Bumped for every server format list
+    UINT32 text_format;        // Best text format the server offered, 0 if none
+    UINT32 html_format;
+    UINT32 rtf_format;
+    UINT32 image_format;       // PNG if offered, else a DIB
+    bool request_pending;      // Format data request sent, response outstanding
+    uint32_t request_generation;
+    uint8_t* raw;              // Answer to the last request, as received
+    size_t raw_len;
+    // Converted data for the current generation, per host type
+    uint8_t* cache[CRDP_CLIP_TYPE_COUNT];
+    size_t cache_len[CRDP_CLIP_TYPE_COUNT];
+    bool closing;              // Channel going away; wake and fail fetches
+} crdp_clip_remote_t;
+
+// Host clipboard data in one server format (clipformat.c). Converted once per
+// content and shared by every session that sends it; freed with the last
+// reference.
+typedef struct {
+    _Atomic uint32_t refs;
+    uint8_t* data;
+    size_t len;
+} crdp_clip_blob_t;
+
+#define CRDP_CLIP_FORMAT_QUEUE 4
+
+// Worker that answers server requests for rich host formats (clipformat.c),
+// so image encoding never runs on the thread that received the request
+typedef struct {
+    pthread_t thread;
+    bool running;
+    bool stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    UINT32 queue[CRDP_CLIP_FORMAT_QUEUE];   // Requested format ids, oldest first
+    uint32_t head;
+    uint32_t count;
+} crdp_clip_formats_t;
+
+typedef struct {
+    rdpContext _p;
+    struct crdp_client* client;
+    pBeginPaint prev_begin_paint;
+    pEndPaint prev_end_paint;
+    CliprdrClientContext* cliprdr;
+    wClipboard* clipboard;
+    UINT32 clipboardCapabilities;
+    BOOL clipboardSync;
+    crdp_clip_remote_t remote_clip;
+    crdp_clip_formats_t clip_formats;
+    // Host clipboard content the server was last told about (cliprdr.c)
+    _Atomic uint64_t local_sent_hash;
+    _Atomic bool local_sent_valid;
+} crdp_context;
+
+// Damage accumulated while frame delivery is being held back
+typedef struct {
+    bool valid;
+    int32_t left;
+    int32_t top;
+    int32_t right;
+    int32_t bottom;
+} crdp_damage_t;
+
+// Live thumbnail generator (thumbnail.c). Buffer, sizes and dirty bits are
+// only touched with the client's paint_lock held.
+typedef struct {
+    pthread_t thread;
+    bool running;
+    bool stop;
+    pthread_mutex_t lock;      // Guards the fields down to interval_ms
+    pthread_cond_t cond;
+    crdp_thumbnail_cb cb;
+    void* user;
+    uint32_t width;            // Requested thumbnail width
+    uint32_t interval_ms;
+    _Atomic bool active;       // Protocol thread only marks damage while set
+    uint8_t* buf;
+    uint32_t w, h;             // Current thumbnail size
+    uint32_t src_w, src_h;     // Framebuffer size the thumbnail was built from
+    uint64_t* dirty;           // One bit per tile
+    uint32_t tiles_x, tiles_y;
+    bool all_dirty;
+} crdp_thumbnailer_t;
+
+// Screenshot encoder (capture.c). Snapshots are queued for a thread that is
+// started with the first one and runs until the client is freed.
+typedef struct crdp_capture_job crdp_capture_job_t;
+typedef struct {
+    pthread_t thread;
+    bool running;
+    bool stop;
+    pthread_mutex_t lock;      // Guards everything here
+    pthread_cond_t cond;
+    crdp_capture_job_t* head;
+    crdp_capture_job_t* tail;
+    uint32_t queued;
+} crdp_capturer_t;
+
+// RDPGFX frame acknowledgement state (gfx.c), guarded by paint_lock
+#define CRDP_GFX_MAX_UNACKED 64
+typedef struct {
+    RdpgfxClientContext* context;
+    pcRdpgfxOnOpen prev_on_open;
+    pcRdpgfxEndFrame prev_end_frame;
+    pcRdpgfxSurfaceCommand prev_surface_command;
+    uint32_t total_decoded;
+    uint32_t unacked[CRDP_GFX_MAX_UNACKED];  // Decoded frame ids, oldest first
+    uint32_t unacked_head;
+    uint32_t unacked_count;
+    bool saturated;            // Acks withheld because the host is behind
+    _Atomic bool suspended;    // Server told not to wait for acks
+    bool suspend_sent;
+} crdp_gfx_t;
+
+// Adaptive quality controller (quality.c); protocol thread except cb fields
+typedef struct {
+    bool started;
+    crdp_link_tier_t tier;     // Kept across reconnects
+    uint64_t tier_since;
+    uint64_t last_sample;
+    uint64_t last_in_bytes;
+    uint32_t rtt_ms;
+    uint32_t bandwidth_kbps;
+    uint32_t receive_kbps;
+    uint32_t queue_depth;
+    uint32_t worse_samples;    // Consecutive samples below the current tier
+    uint32_t better_samples;   // Consecutive samples comfortably above it
+    pthread_mutex_t cb_lock;
+    crdp_quality_cb cb;
+    void* cb_user;
+} crdp_quality_t;
+
+// Shadow decompressor history for one compressed stream
+typedef struct {
+    MPPC_CONTEXT* mppc;
+    NCRUSH_CONTEXT* ncrush;
+    XCRUSH_CONTEXT* xcrush;
+} crdp_bulk_history_t;
+
+// Bulk compression statistics (compression.c). Histories are protocol thread
+// only; the counters are guarded by lock.
+typedef struct {
+    crdp_bulk_history_t io_history;  // I/O channel, slow and fast path
+    crdp_bulk_history_t vc_history;  // Virtual channels
+    pthread_mutex_t lock;
+    crdp_compression_stats_t stats;
+} crdp_compression_state_t;
+
+// Clipboard transfer progress and cancellation (cliprdr.c)
+typedef struct {
+    pthread_mutex_t cb_lock;
+    crdp_clipboard_progress_cb cb;
+    void* cb_user;
+    _Atomic uint32_t cancel_seq;   // Bumped by crdp_clipboard_cancel
+    _Atomic bool receiving;        // A paste is waiting for server data
+    _Atomic bool rejected;         // The server's answer exceeds the size cap
+    _Atomic uint16_t channel_id;   // cliprdr's MCS channel, 0 until connected
+    _Atomic uint64_t in_activity;  // When server clipboard data last arrived
+    // Incoming format data response being reassembled (written by the
+    // protocol thread)
+    bool in_tracking;
+    _Atomic uint64_t in_total;
+    _Atomic uint64_t in_received;
+    uint64_t in_reported;
+} crdp_clip_transfer_t;
+
+// Host file offered to the server (clipfile.c)
+typedef struct {
+    char* path;
+    uint64_t size;
+    int fd;                    // Open while the server reads the file, -1 otherwise
+    uint64_t used;             // When a range was last read, to close the least recent
+} crdp_clip_local_file_t;
+
+// One FileContents range requested from the server (clipfile.c)
+typedef enum {
+    CRDP_CLIP_RANGE_FREE = 0,
+    CRDP_CLIP_RANGE_SENT,      // Waiting for the server
+    CRDP_CLIP_RANGE_WRITING,   // Answer being written to disk, lock released
+    CRDP_CLIP_RANGE_RETRY      // Short answer; the rest has to be asked for again
+} crdp_clip_range_state_t;
+
+typedef struct {
+    crdp_clip_range_state_t state;
+    uint32_t stream_id;
+    uint32_t file;
+    uint64_t offset;
+    uint32_t length;
+} crdp_clip_range_t;
+
+#define CRDP_CLIP_MAX_RANGES 8
+
+// Clipboard file transfers in both directions (clipfile.c), guarded by lock
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    CliprdrClientContext* cliprdr;  // NULL while the channel is down
+    uint32_t users;                 // Threads that may be using cliprdr
+    _Atomic uint32_t server_format; // FileGroupDescriptorW id the server offered, 0 if none
+    // Upload: host files last listed for the server
+    crdp_clip_local_file_t* local;
+    uint32_t local_count;
+    uint32_t local_open;            // Local files with a descriptor open
+    uint64_t local_tick;
+    uint8_t* read_buf;
+    size_t read_buf_size;
+    uint64_t served_bytes;
+    uint64_t served_total;
+    uint64_t served_reported;
+    uint32_t served_files;          // Files whose last byte has been sent
+    uint64_t served_started;
+    // Download into a host directory
+    bool downloading;
+    int status;                     // First failure of the download, 0 if none
+    uint32_t next_stream_id;
+    crdp_clip_range_t ranges[CRDP_CLIP_MAX_RANGES];
+    uint32_t file_count;
+    char** paths;                   // Where each file goes, NULL for folders
+    int* fds;                       // Open from a file's first range to its last byte
+    uint64_t* sizes;
+    uint64_t* remaining;            // Bytes of each file not written yet
+    uint32_t files_done;
+    uint64_t received;
+    uint64_t activity;              // When the server last answered
+    bool size_pending;              // FILECONTENTS_SIZE request outstanding
+    uint32_t size_stream_id;
+    uint64_t size_answer;
+} crdp_clip_files_t;
+
+// A redirected drive of the current connection (drive.c). Its device finds
+// it by name and path when rdpdr loads the drive.
+typedef struct {
+    char* path;
+    char* name;
+    bool read_only;
+    uint64_t max_bytes_per_second;
+    uint32_t max_ops_per_second;
+    _Atomic uint64_t requests;
+    _Atomic uint64_t reads;
+    _Atomic uint64_t writes;
+    _Atomic uint64_t bytes_read;
+    _Atomic uint64_t bytes_written;
+    _Atomic uint64_t denied;
+    _Atomic uint64_t throttled;
+    _Atomic uint64_t throttled_ms;
+} crdp_drive_share_t;
+
+// Audio output counters (audio.c), read by crdp_get_audio_stats
+typedef struct {
+    _Atomic bool playing;
+    _Atomic uint32_t sample_rate;
+    _Atomic uint32_t channels;
+    _Atomic uint32_t target_ms;
+    _Atomic uint32_t buffered_ms;
+    _Atomic uint32_t jitter_ms;
+    _Atomic uint64_t frames_played;
+    _Atomic uint64_t underruns;
+    _Atomic uint64_t concealed_frames;
+    _Atomic uint64_t dropped_frames;
+} crdp_audio_metrics_t;
+
+// Microphone counters (mic.c), read by crdp_get_mic_stats
+typedef struct {
+    _Atomic bool capturing;
+    _Atomic uint32_t format_tag;
+    _Atomic uint32_t sample_rate;
+    _Atomic uint32_t channels;
+    _Atomic uint32_t latency_ms;
+    _Atomic uint32_t max_latency_ms;
+    _Atomic uint64_t packets_sent;
+    _Atomic uint64_t bytes_sent;
+    _Atomic uint64_t dropped_frames;
+} crdp_mic_metrics_t;
+
+// One UDP transport offered by the server (multitransport.c)
+typedef struct {
+    crdp_client_t* client;
+    bool lossy;
+    _Atomic int state;            // crdp_udp_state_t
+    _Atomic uint32_t syns_sent;
+    _Atomic uint32_t rtt_ms;
+    pthread_t thread;
+    bool started;                 // Protocol thread only
+} crdp_udp_probe_t;
+
+// Per-transport counters, read by crdp_get_transport_stats; PDU and byte
+// counts are in the metrics registry
+typedef struct {
+    _Atomic uint32_t udp_requests;
+    _Atomic uint32_t connect_rtt_ms;
+    _Atomic int connect_tier;     // crdp_link_tier_t
+    _Atomic bool stop;            // Ends the probes
+    crdp_udp_probe_t reliable;
+    crdp_udp_probe_t lossy;
+} crdp_multitransport_t;
+
+// Protocol traces (trace.c)
+typedef struct crdp_trace crdp_trace_t;
+typedef struct crdp_replay crdp_replay_t;
+// Session recording (record.c)
+typedef struct crdp_recorder crdp_recorder_t;
+
+// Metrics registry (metrics.c), read by crdp_get_stats
+typedef enum {
+    CRDP_COUNTER_FRAMES_PAINTED,
+    CRDP_COUNTER_FRAMES_DELIVERED,
+    CRDP_COUNTER_PDUS_RECEIVED,
+    CRDP_COUNTER_BYTES_RECEIVED,
+    CRDP_COUNTER_PDUS_SENT,
+    CRDP_COUNTER_BYTES_SENT,
+    CRDP_COUNTER_INPUT_EVENTS,
+    CRDP_COUNTER_CLIPBOARD_BYTES_SENT,
+    CRDP_COUNTER_CLIPBOARD_BYTES_RECEIVED,
+    CRDP_COUNTER_COUNT
+} crdp_counter_t;
+
+// Recorded in microseconds
+typedef enum {
+    CRDP_HIST_FRAME_INTERVAL_US,
+    CRDP_HIST_DECODE_US,
+    CRDP_HIST_INPUT_LATENCY_US,
+    CRDP_HIST_DRIVE_US,
+    CRDP_HIST_COUNT
+} crdp_histogram_t;
+
+typedef enum {
+    CRDP_GAUGE_DESKTOP_WIDTH,
+    CRDP_GAUGE_DESKTOP_HEIGHT,
+    CRDP_GAUGE_COUNT
+} crdp_gauge_t;
+
+#define CRDP_METRICS_SHARDS 8
+#define CRDP_HIST_SUB_BITS 3
+#define CRDP_HIST_MAX_BITS 27     // Larger values (over two minutes) count as the largest
+#define CRDP_HIST_MAX_VALUE (1ull << CRDP_HIST_MAX_BITS)
+#define CRDP_HIST_BUCKETS ((CRDP_HIST_MAX_BITS - CRDP_HIST_SUB_BITS + 1) << CRDP_HIST_SUB_BITS)
+
+typedef struct {
+    _Atomic uint64_t counters[CRDP_COUNTER_COUNT];
+    _Atomic uint64_t sums[CRDP_HIST_COUNT];
+    _Atomic uint64_t max[CRDP_HIST_COUNT];
+    _Atomic uint64_t buckets[CRDP_HIST_COUNT][CRDP_HIST_BUCKETS];
+    uint8_t pad[64];              // Keeps neighbouring shards off each other's cache lines
+} crdp_metrics_shard_t;
+
+typedef struct {
+    crdp_metrics_shard_t shards[CRDP_METRICS_SHARDS];
+    _Atomic int64_t gauges[CRDP_GAUGE_COUNT];
+    _Atomic uint64_t input_pending_us;  // When the oldest input not yet followed by a frame was sent
+} crdp_metrics_t;
+
+struct crdp_client {
+    freerdp* instance;
+    crdp_config_t config;
+    crdp_frame_cb frame_cb;
+    void* frame_user;
+    crdp_disconnected_cb disconnect_cb;
+    void* disconnect_user;
+    crdp_verify_cert_cb cert_cb;
+    void* cert_user;
+    pthread_t thread;
+    bool stop;
+    bool connected;
+    // Frame timing for RTT estimation
+    uint64_t last_frame_time;      // Microseconds; guarded by paint_lock
+    uint64_t rtt_base_intervals;   // Frame-interval totals when crdp_get_rtt_ms last reset its average
+    uint64_t rtt_base_interval_us;
+    int32_t last_rtt_ms;  // Cache last known RTT
+    // Frame delivery policy (written by the host, read by the protocol thread)
+    _Atomic int priority;
+    _Atomic bool repaint;     // Deliver a full frame on the next loop iteration
+    HANDLE wake_event;        // Wakes the protocol thread early (e.g. priority change)
+    crdp_damage_t pending;    // Damage not yet delivered to frame_cb
+    uint64_t last_delivery;   // Time of the last frame_cb call
+    uint8_t* thumb_buf;       // Scratch for CRDP_PRIORITY_THUMBNAIL frames
+    size_t thumb_buf_size;
+    // Held by the protocol thread from BeginPaint to EndPaint (and around
+    // resizes) so other threads can read a consistent framebuffer
+    pthread_mutex_t paint_lock;
+    bool gdi_ready;           // Framebuffer valid; guarded by paint_lock
+    crdp_thumbnailer_t thumbs;
+    crdp_capturer_t capture;
+    // Frames handed to frame_cb and not yet returned with crdp_frame_release
+    _Atomic int frames_in_flight;
+    crdp_gfx_t gfx;
+    // Foreground frame-rate cap chosen by the quality controller (0 = none)
+    _Atomic uint32_t frame_cap_ms;
+    crdp_quality_t quality;
+    // Transport callbacks CRDP wraps (transport.c)
+    rdpTransportIo prev_io;
+    crdp_compression_state_t compression;
+    crdp_clip_transfer_t clip_xfer;
+    crdp_clip_files_t clip_files;
+    // Redirected drives, copied from the config at connect
+    crdp_drive_share_t drives[CRDP_MAX_DRIVES];
+    uint32_t drive_count;
+    crdp_audio_metrics_t audio;
+    crdp_mic_metrics_t mic;
+    crdp_multitransport_t multitransport;
+    // Protocol trace being recorded or replayed (trace.c); protocol thread
+    crdp_trace_t* trace;
+    crdp_replay_t* replay;
+    // Session recording (record.c)
+    crdp_recorder_t* recorder;
+    crdp_metrics_t metrics;
+};
+
+// Time helpers
+uint64_t crdp_time_ms(void);
+uint64_t crdp_time_us(void);
+
+// Metrics registry (metrics.c). Any thread may write; each write is one
+// uncontended atomic add to the calling thread's shard.
+void crdp_metrics_reset(crdp_client_t* client);
+void crdp_metrics_add(crdp_client_t* client, crdp_counter_t counter, uint64_t n);
+void crdp_metrics_record(crdp_client_t* client, crdp_histogram_t hist, uint64_t value);
+void crdp_metrics_set(crdp_client_t* client, crdp_gauge_t gauge, int64_t value);
+// Input latency: from the first input sent after a frame to the next frame
+void crdp_metrics_input_sent(crdp_client_t* client);
+void crdp_metrics_frame_delivered(crdp_client_t* client);
+uint64_t crdp_metrics_counter(crdp_client_t* client, crdp_counter_t counter);
+void crdp_metrics_totals(crdp_client_t* client, crdp_histogram_t hist, uint64_t* count, uint64_t* sum);
+
+// Image scaling (scale.c)
+// Box-filter downscale of a BGRA32 image into dst (dst_w <= src_w, dst_h <= src_h).
+void crdp_downscale_bgra(const uint8_t* src, uint32_t src_w, uint32_t src_h, uint32_t src_stride,
+                         uint8_t* dst, uint32_t dst_w, uint32_t dst_h, uint32_t dst_stride);
+
+void crdp_downscale_bgra_rect(const uint8_t* src, uint32_t src_w, uint32_t src_h, uint32_t src_stride,
+                              uint8_t* dst, uint32_t dst_w, uint32_t dst_h, uint32_t dst_stride,
+                              uint32_t rect_x, uint32_t rect_y, uint32_t rect_w, uint32_t rect_h);
+
+// LZ4 block format (lz4.c). Both return the output length, 0 on failure;
+// compression needs cap >= crdp_lz4_bound(len).
+size_t crdp_lz4_bound(size_t len);
+size_t crdp_lz4_compress(const uint8_t* src, size_t len, uint8_t* dst, size_t cap);
+size_t crdp_lz4_decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t cap);
+
+// Span profiler (profile.c). While profiling is off, crdp_span_begin costs
+// one predictable branch and crdp_span_end one more on its result.
+extern _Atomic bool crdp_profiling;
+uint64_t crdp_profile_now(void);
+void crdp_profile_span(const char* name, uint64_t start_ns, const char* arg_name, int64_t arg);
+// Names the calling thread in profiles; name must outlive the thread
+void crdp_profile_thread_name(const char* name);
+
+static inline uint64_t crdp_span_begin(void) {
+    if (__builtin_expect(atomic_load_explicit(&crdp_profiling, memory_order_relaxed), 0)) return crdp_profile_now();
+    return 0;
+}
+
+// name and arg_name are string literals; arg_name NULL for no argument
+static inline void crdp_span_end(uint64_t start, const char* name, const char* arg_name, int64_t arg) {
+    if (__builtin_expect(start != 0, 0)) crdp_profile_span(name, start, arg_name, arg);
+}
+
+// Content hash (hash.c); 64-bit XXH64, not cryptographic
+uint64_t crdp_hash64(const void* data, size_t len, uint64_t seed);
+
+// PNG encoding of BGRX framebuffers (png.c); level is zlib's. Returns 0
+// with a malloc'd PNG, -1 on errors.
+int crdp_png_encode(const uint8_t* bgra, uint32_t width, uint32_t height, uint32_t stride, int level,
+                    crdp_png_filter_t filter, uint8_t** out, size_t* out_len);
+
+// UTF-8 <-> UTF-16LE transcoding (utf.c)
+// UTF-8 input is validated (-1 if malformed); unpaired UTF-16 surrogates
+// decode as U+FFFD. Lengths are in code units of the output encoding.
+int64_t crdp_utf8_to_utf16le_length(const uint8_t* src, size_t len);
+size_t crdp_utf8_to_utf16le(const uint8_t* src, size_t len, uint8_t* dst);
+size_t crdp_utf16le_to_utf8_length(const uint8_t* src, size_t units);
+size_t crdp_utf16le_to_utf8(const uint8_t* src, size_t units, uint8_t* dst);
+// Null-terminated results in an exactly sized malloc'd buffer
+uint8_t* crdp_utf8_to_utf16le_alloc(const char* text, size_t len, size_t* out_bytes);
+char* crdp_utf16le_to_utf8_alloc(const uint8_t* data, size_t bytes, size_t* out_len);
+
+// Live thumbnails (thumbnail.c)
+void crdp_thumbnail_init(crdp_client_t* client);
+void crdp_thumbnail_mark(crdp_client_t* client, int32_t x, int32_t y, int32_t w, int32_t h);
+void crdp_thumbnail_stop(crdp_client_t* client);
+void crdp_thumbnail_free(crdp_client_t* client);
+
+// Screenshots (capture.c)
+void crdp_capture_init(crdp_client_t* client);
+// Finishes queued captures and stops the encoder thread
+void crdp_capture_free(crdp_client_t* client);
+
+// GFX frame acknowledgement (gfx.c)
+void crdp_gfx_init(crdp_context* ctx, RdpgfxClientContext* gfx);
+void crdp_gfx_uninit(crdp_context* ctx, RdpgfxClientContext* gfx);
+void crdp_gfx_ack_frames(crdp_client_t* client);
+void crdp_gfx_set_ack_suspended(crdp_client_t* client, bool suspended);
+
+// Adaptive quality (quality.c)
+void crdp_quality_init(crdp_client_t* client);
+void crdp_quality_reset(crdp_client_t* client);
+void crdp_quality_configure(crdp_client_t* client, rdpSettings* settings);
+void crdp_quality_tick(crdp_client_t* client);
+void crdp_quality_free(crdp_client_t* client);
+// Tier of a link from its RTT alone, before there is a bandwidth measurement
+crdp_link_tier_t crdp_quality_tier_for_rtt(uint32_t rtt_ms);
+const char* crdp_quality_tier_name(crdp_link_tier_t tier);
+
+// Transport hooks (transport.c)
+#define CRDP_TPKT_VERSION 3
+bool crdp_transport_install(crdp_context* ctx);
+// Splits a received slow-path PDU into its MCS channel and payload; false for
+// fast-path, connection-sequence and malformed PDUs
+bool crdp_transport_channel_payload(const uint8_t* data, size_t len, uint16_t* channel_id,
+                                    const uint8_t** payload, size_t* payload_len);
+
+// Session socket tuning (socket.c). Applies the crdp_config_t socket options
+// to a freshly connected socket, with defaults for the link it measures.
+void crdp_socket_tune(crdp_client_t* client, int fd, uint32_t connect_ms);
+
+// Bulk compression (compression.c)
+void crdp_compression_init(crdp_client_t* client);
+void crdp_compression_configure(crdp_client_t* client, rdpSettings* settings);
+void crdp_compression_reset(crdp_client_t* client);
+void crdp_compression_inspect(crdp_client_t* client, const uint8_t* data, size_t len);
+void crdp_compression_free(crdp_client_t* client);
+
+// Clipboard channel (cliprdr.c)
+void crdp_cliprdr_init(crdp_context* ctx, CliprdrClientContext* cliprdr);
+void crdp_cliprdr_uninit(crdp_context* ctx);
+void crdp_cliprdr_observe(crdp_client_t* client, uint16_t channel_id, const uint8_t* payload, size_t len);
+void crdp_clip_transfer_init(crdp_client_t* client);
+void crdp_clip_transfer_free(crdp_client_t* client);
+// Absolute CLOCK_REALTIME deadline for pthread_cond_timedwait
+void crdp_clip_deadline(struct timespec* deadline, uint32_t timeout_ms);
+void crdp_clip_report_progress(crdp_client_t* client, const crdp_clipboard_progress_t* progress);
+// Fetch the server's FileGroupDescriptorW data for clipfile.c (malloc'd, or
+// NULL); blocks like a paste
+uint8_t* crdp_cliprdr_fetch_file_list(crdp_context* ctx, uint32_t cancel_seq, size_t* len);
+
+// Clipboard formats. Registered formats are announced by name; the ids are
+// ours to pick.
+#define CRDP_CF_DIB 8
+#define CRDP_CF_DIBV5 17
+#define CRDP_CF_FILE_GROUP_DESCRIPTOR_W 0xC0F0
+#define CRDP_CF_FILE_GROUP_DESCRIPTOR_W_NAME "FileGroupDescriptorW"
+#define CRDP_CF_HTML 0xC0F1
+#define CRDP_CF_HTML_NAME "HTML Format"
+#define CRDP_CF_RTF 0xC0F2
+#define CRDP_CF_RTF_NAME "Rich Text Format"
+#define CRDP_CF_PNG 0xC0F3
+#define CRDP_CF_PNG_NAME "PNG"
+
+// Rich clipboard formats (clipformat.c)
+void crdp_clipformat_start(crdp_context* ctx);
+void crdp_clipformat_stop(crdp_context* ctx);
+// Adds the rich formats the host clipboard can provide; returns the new count
+UINT32 crdp_clipformat_list(CLIPRDR_FORMAT* formats, UINT32 count, UINT32 max);
+bool crdp_clipformat_is_rich(UINT32 format);
+// Hands a server request for a rich format to the worker, which answers it
+bool crdp_clipformat_queue(crdp_context* ctx, UINT32 format);
+// Host clipboard data in a server format, from the shared cache when another
+// session already fetched the same content, otherwise via fetch() (which gets a
+// malloc'd buffer and returns 0, -1 if there is no such data, or any other
+// code for a failure that is not cached). Returns a reference or NULL and
+// stores fetch()'s result in *status.
+typedef int (*crdp_clip_read_fn)(UINT32 format, void* arg, uint8_t** data, size_t* len);
+crdp_clip_blob_t* crdp_clipformat_acquire(UINT32 format, crdp_clip_read_fn fetch, void* arg, int* status);
+void crdp_clip_blob_release(crdp_clip_blob_t* blob);
+// Server data in a rich format converted to a host type (malloc'd), or NULL
+uint8_t* crdp_clipformat_from_server(crdp_clip_type_t type, UINT32 format, const uint8_t* data,
+                                     size_t len, size_t* out_len);
+// CF_HTML clipboard header handling
+uint8_t* crdp_clipformat_html_wrap(const uint8_t* html, size_t len, size_t* out_len);
+uint8_t* crdp_clipformat_html_unwrap(const uint8_t* data, size_t len, size_t* out_len);
+
+// Clipboard files (clipfile.c)
+void crdp_clipfile_init(crdp_client_t* client);
+void crdp_clipfile_free(crdp_client_t* client);
+void crdp_clipfile_attach(crdp_context* ctx, CliprdrClientContext* cliprdr);
+void crdp_clipfile_detach(crdp_context* ctx);
+// Whether to advertise files in the next client format list
+bool crdp_clipfile_can_offer(crdp_context* ctx);
+// Snapshot the host's files and serialize their descriptors (malloc'd)
+uint8_t* crdp_clipfile_build_list(crdp_context* ctx, size_t* len);
+UINT crdp_clipfile_contents_request(CliprdrClientContext* cliprdr, const CLIPRDR_FILE_CONTENTS_REQUEST* req);
+UINT crdp_clipfile_contents_response(CliprdrClientContext* cliprdr, const CLIPRDR_FILE_CONTENTS_RESPONSE* resp);
+// The download half of crdp_clipboard_save_files: fetches what descriptors
+// lists from the attached channel into dir. Same return values.
+int crdp_clipfile_download(crdp_client_t* client, const char* dir, const FILEDESCRIPTORW* descriptors,
+                           uint32_t count);
+
+// Drive redirection (drive.c)
+// CRDP's own "drive" device service for the addin provider, NULL for any
+// other addin
+PVIRTUALCHANNELENTRY crdp_drive_addin_entry(LPCSTR name, LPCSTR type);
+// Copy the drives from the config into client->drives, skipping missing
+// folders; returns how many there are
+uint32_t crdp_drive_configure(crdp_client_t* client, const crdp_config_t* config);
+void crdp_drive_clear(crdp_client_t* client);
+
+// Drive metadata cache (drivecache.c), keyed by host path under a real
+// (symlink-free) root
+typedef struct crdp_drive_cache crdp_drive_cache_t;
+
+typedef struct {
+    const char* name;
+    struct stat st;
+} crdp_drive_dirent_t;
+
+// A directory's entries sorted by name, shared by the handles enumerating it
+typedef struct {
+    _Atomic uint32_t refs;
+    uint32_t count;
+    crdp_drive_dirent_t* entries;
+    char* names;
+} crdp_drive_listing_t;
+
+crdp_drive_cache_t* crdp_drivecache_new(const char* root);
+void crdp_drivecache_free(crdp_drive_cache_t* cache);
+// stat() through the cache; returns 0 or an errno
+int crdp_drivecache_stat(crdp_drive_cache_t* cache, const char* path, struct stat* st);
+// Directory contents (a reference), or NULL with an errno in *err
+crdp_drive_listing_t* crdp_drivecache_list(crdp_drive_cache_t* cache, const char* dir, int* err);
+void crdp_drive_listing_release(crdp_drive_listing_t* listing);
+// Forget path and its parent's listing; subtree also forgets everything below it
+void crdp_drivecache_invalidate(crdp_drive_cache_t* cache, const char* path, bool subtree);
+
+// Audio output (audio.c). The rdpsnd channel thread writes 16-bit PCM into
+// a single-producer single-consumer ring; the sink pulls it out on its own
+// clock with crdp_audio_render, which runs the jitter buffer.
+typedef struct crdp_audio crdp_audio_t;
+
+typedef struct {
+    uint32_t rate;
+    uint16_t channels;              // Interleaved signed 16-bit samples
+} crdp_audio_format_t;
+
+typedef struct crdp_audio_sink {
+    bool (*start)(struct crdp_audio_sink* sink, const crdp_audio_format_t* format);
+    // No crdp_audio_render calls once this returns
+    void (*stop)(struct crdp_audio_sink* sink);
+    void (*free)(struct crdp_audio_sink* sink);
+    uint32_t latency_ms;            // Between render and the listener, set by start
+} crdp_audio_sink_t;
+
+// The rdpsnd device for the addin provider, NULL for any other addin
+PVIRTUALCHANNELENTRY crdp_audio_addin_entry(LPCSTR name, LPCSTR subsystem);
+void crdp_audio_reset(crdp_client_t* client);
+// Fills out with frames of audio, silence where there is none; sink thread only
+void crdp_audio_render(crdp_audio_t* audio, int16_t* out, uint32_t frames);
+
+// Audio sinks (audiosink.c)
+crdp_audio_sink_t* crdp_audio_sink_device_new(crdp_audio_t* audio);
+crdp_audio_sink_t* crdp_audio_sink_wav_new(crdp_audio_t* audio, const char* path);
+crdp_audio_sink_t* crdp_audio_sink_null_new(crdp_audio_t* audio);
+
+// Microphone (mic.c). Captured audio goes through fixed pools of chunks and
+// packets and bounded queues: source, resample, encode and send, a thread
+// each.
+typedef struct crdp_mic crdp_mic_t;
+
+typedef struct crdp_mic_source {
+    crdp_audio_format_t format;     // What the source delivers, set when created
+    bool (*start)(struct crdp_mic_source* source);
+    // No crdp_mic_capture calls once this returns; safe if never started
+    void (*stop)(struct crdp_mic_source* source);
+    void (*free)(struct crdp_mic_source* source);
+} crdp_mic_source_t;
+
+// The audin device for the addin provider, NULL for any other addin
+PVIRTUALCHANNELENTRY crdp_mic_addin_entry(LPCSTR name, LPCSTR subsystem);
+void crdp_mic_reset(crdp_client_t* client);
+// Hands captured samples to the pipeline; source thread, never blocks
+void crdp_mic_capture(crdp_mic_t* mic, const int16_t* samples, uint32_t frames);
+
+// Microphone sources (micsource.c)
+crdp_mic_source_t* crdp_mic_source_device_new(crdp_mic_t* mic);
+crdp_mic_source_t* crdp_mic_source_file_new(crdp_mic_t* mic, const char* path);
+
+// RDP-UDP multitransport (multitransport.c)
+void crdp_multitransport_configure(crdp_client_t* client, rdpSettings* settings);
+void crdp_multitransport_reset(crdp_client_t* client);
+// Ends the UDP probes; any thread but the protocol thread
+void crdp_multitransport_stop(crdp_client_t* client);
+// Looks at a received slow-path payload for an Initiate Multitransport Request
+void crdp_multitransport_observe(crdp_client_t* client, const uint8_t* payload, size_t len);
+
+// Protocol traces (trace.c). open/close run outside the protocol thread's
+// lifetime; replay_open also makes client->config match the recording.
+bool crdp_trace_open(crdp_client_t* client);
+void crdp_trace_record(crdp_trace_t* trace, const uint8_t* data, size_t len);
+void crdp_trace_close(crdp_client_t* client);
+bool crdp_replay_open(crdp_client_t* client);
+bool crdp_replay_configure(crdp_context* ctx, rdpSettings* settings);
+DWORD crdp_replay_timeout_ms(crdp_client_t* client);
+void crdp_replay_close(crdp_client_t* client);
+
+// Session recordings (record.c writes them, player.c reads them)
+//
+// A file holds one or more sessions, appended. Each starts with a header:
+// CRDP_RECORDING_MAGIC, u32 version, u32 tile size, u64 start (Unix ms).
+// Chunks follow: u32 raw length, u32 stored length (| CRDP_RECORDING_STORED
+// if not compressed), u32 ms since the session start, u32 flags, then the
+// LZ4 block. A session's chunks concatenate into a stream of records; a
+// chunk flagged CRDP_RECORDING_SEGMENT starts a segment at a record
+// boundary, and nothing in a segment refers to anything before it.
+// All integers are little-endian.
+#define CRDP_RECORDING_MAGIC "CRDPREC1"
+#define CRDP_RECORDING_VERSION 1
+#define CRDP_RECORDING_HEADER_SIZE 24
+#define CRDP_RECORDING_CHUNK_HEADER_SIZE 16
+#define CRDP_RECORDING_CHUNK_SIZE (1024 * 1024)
+#define CRDP_RECORDING_STORED 0x80000000u
+#define CRDP_RECORDING_SEGMENT 0x1
+#define CRDP_RECORDING_TILE 64
+
+typedef enum {
+    CRDP_REC_SIZE = 1,      // u16 width, u16 height: a blank screen of that size
+    CRDP_REC_TILE = 2,      // u16 column, u16 row, u8 w, u8 h, u64 hash, BGRA32 pixels
+    CRDP_REC_TILE_REF = 3,  // u16 column, u16 row, u64 hash of a tile stored earlier in the segment
+    CRDP_REC_FRAME = 4,     // u32 ms, u32 n: the screen then, after the n tile records that follow
+    CRDP_REC_POINTER = 5,   // u32 ms, u16 flags, u16 x, u16 y
+    CRDP_REC_KEY = 6        // u32 ms, u16 flags, u16 scancode
+} crdp_rec_type_t;
+
+bool crdp_record_open(crdp_client_t* client);
+// paint_lock held, for every damaged rect
+void crdp_record_mark(crdp_client_t* client, int32_t x, int32_t y, int32_t w, int32_t h);
+// Protocol thread: samples the damaged tiles when one is due
+void crdp_record_tick(crdp_client_t* client);
+void crdp_record_pointer(crdp_client_t* client, uint16_t flags, uint16_t x, uint16_t y);
+void crdp_record_key(crdp_client_t* client, uint16_t flags, uint16_t scancode);
+void crdp_record_close(crdp_client_t* client);
+
+// macOS clipboard bridge (clipboard_mac.m)
+char* crdp_clipboard_get_text(void);
+// Copy the clipboard text as null-terminated UTF-16LE into an exactly sized
+// buffer, in chunks. chunk() is told the progress after every chunk and aborts
+// the copy by returning false. Returns 0, -1 if there is no text, -2 if it is
+// larger than max_bytes (0 = no limit), -3 if aborted, -4 if out of memory.
+typedef bool (*crdp_clipboard_chunk_fn)(void* ctx, size_t done_bytes, size_t total_bytes);
+int crdp_clipboard_get_utf16(size_t max_bytes, crdp_clipboard_chunk_fn chunk, void* ctx,
+                             uint8_t** out, size_t* out_bytes);
+// Replace the host clipboard with a promise of the types in the mask (bits
+// of crdp_clip_type_t). provide() is called (on the thread doing the paste)
+// when one of them is first needed and returns malloc'd data or NULL.
+typedef uint8_t* (*crdp_clipboard_provide_fn)(void* ctx, uint32_t generation, crdp_clip_type_t type,
+                                              size_t* len);
+int crdp_clipboard_promise(crdp_clipboard_provide_fn provide, void* ctx, uint32_t generation, uint32_t types);
+// Types on the host clipboard, as a mask of crdp_clip_type_t bits
+uint32_t crdp_clipboard_types(void);
+// Host clipboard data of a type, as stored (malloc'd); -1 if there is none
+int crdp_clipboard_get_data(crdp_clip_type_t type, uint8_t** out, size_t* len);
+// Image codecs. decode gives premultiplied RGBA, top row first.
+typedef enum {
+    CRDP_IMAGE_PNG = 0,
+    CRDP_IMAGE_TIFF = 1
+} crdp_image_format_t;
+int crdp_image_decode_rgba(const uint8_t* data, size_t len, uint8_t** rgba, uint32_t* width, uint32_t* height);
+int crdp_image_encode(const uint8_t* data, size_t len, crdp_image_format_t format, uint8_t** out, size_t* out_len);
+// Detach ctx from any outstanding promise; waits for running provide() calls
+void crdp_clipboard_revoke_promise(void* ctx);
+// File URLs on the host clipboard as malloc'd POSIX paths (free each and the
+// array); -1 if there are none
+int crdp_clipboard_get_file_paths(char*** paths, size_t* count);
+bool crdp_clipboard_has_files(void);
+// Identity of the current host clipboard content (types, text, file URLs;
+// changeCount for rich and image data); computed once per change
+uint64_t crdp_clipboard_content_hash(void);
+// One watcher serves every session: callback() runs on its thread when the
+// host clipboard changes, unless ctx's own promise changed it. unsubscribe
+// waits for a running callback; the last one out stops the watcher.
+int crdp_clipboard_subscribe(void (*callback)(void* ctx, uint64_t content_hash), void* ctx);
+void crdp_clipboard_unsubscribe(void* ctx);
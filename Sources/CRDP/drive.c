@@ -0,0 +1,1299 @@
+#include "crdp_internal.h"
+
+#include <freerdp/addin.h>
+#include <freerdp/channels/rdpdr.h>
+#include <freerdp/client/channels.h>
+#include <winpr/file.h>
+#include <winpr/stream.h>
+#include <winpr/wlog.h>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <time.h>
+#include <unistd.h>
+
+// Drive redirection device.
+//
+// Stands in for FreeRDP's "drive" device service, which services every IRP
+// in turn on one thread. Here IRPs are queued to a pool of workers so many
+// are in flight at once, and reads and writes go straight between the file
+// (pread/pwrite at the IRP's offset) and the PDU buffer. Metadata is served
+// from drivecache.c, and sequential reads ask the kernel to read ahead.
+// Each drive can be read-only and have its request and data rates capped;
+// a capped drive holds back its own workers only.
+
+#define CRDP_DRIVE_WORKERS 8
+#define CRDP_DRIVE_FILE_BUCKETS 256
+// Largest read or path accepted from the server
+#define CRDP_DRIVE_MAX_IO (16 * 1024 * 1024)
+#define CRDP_DRIVE_MAX_PATH_BYTES (32 * 1024)
+// Seconds between 1601 (FILETIME) and 1970
+#define CRDP_DRIVE_EPOCH_DIFF 11644473600ULL
+
+// Read-ahead window for sequential reads: starts small, doubles while reads
+// keep following each other, and resets on a seek
+#define CRDP_DRIVE_READAHEAD_MIN (256 * 1024)
+#define CRDP_DRIVE_READAHEAD_MAX (8 * 1024 * 1024)
+
+// How much a rate limit lets through at once, in seconds of its rate
+#define CRDP_DRIVE_BURST_SECONDS 0.25
+#define CRDP_DRIVE_MIN_BURST_BYTES (64 * 1024)
+
+#define CRDP_DRIVE_WRITE_ACCESS (GENERIC_WRITE | GENERIC_ALL | FILE_WRITE_DATA | FILE_APPEND_DATA)
+
+// An open file or directory handle on the server
+typedef struct crdp_drive_file {
+    struct crdp_drive_file* next;   // Hash chain
+    uint32_t id;
+    uint32_t refs;                  // Table reference plus IRPs using it; guarded by files_lock
+    int fd;                         // -1 for directories
+    bool is_dir;
+    bool delete_on_close;
+    _Atomic bool written;           // Size and times changed since opened
+    pthread_mutex_t lock;           // Guards everything below
+    char* path;                     // Host path
+    crdp_drive_listing_t* listing;  // Directory enumeration in progress
+    uint32_t next_entry;
+    char* pattern;                  // Its search pattern, UTF-8
+    // Sequential read detection
+    uint64_t read_next;             // Where a sequential read would start
+    uint64_t readahead_end;         // Advised up to here
+    uint32_t readahead_window;
+} crdp_drive_file_t;
+
+// Token bucket. Tokens may go negative, so a request bigger than the burst
+// still goes through and the ones after it pay off the debt.
+typedef struct {
+    double rate;                    // Tokens per second, 0 = no limit
+    double burst;
+    double tokens;
+    uint64_t last_ns;
+} crdp_drive_bucket_t;
+
+typedef struct crdp_drive_work {
+    struct crdp_drive_work* next;
+    IRP* irp;
+} crdp_drive_work_t;
+
+typedef struct {
+    DEVICE device;                  // First: FreeRDP hands this back to us
+    char* root;                     // Host directory, real path
+    char* label;
+    crdp_drive_cache_t* cache;
+    // Options and counters; the client's entry for this drive, or own_share
+    // for a drive CRDP wasn't configured with
+    crdp_drive_share_t* share;
+    crdp_drive_share_t own_share;
+    crdp_client_t* client;          // Request timings go to its metrics; NULL without one
+    // Rate limits, guarded by lock; throttle_cond wakes held workers at stop
+    crdp_drive_bucket_t ops;
+    crdp_drive_bucket_t bytes;
+    pthread_cond_t throttle_cond;
+    // IRPs waiting for a worker, oldest first
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    crdp_drive_work_t* head;
+    crdp_drive_work_t* tail;
+    bool stop;
+    pthread_t workers[CRDP_DRIVE_WORKERS];
+    uint32_t worker_count;
+    // Open handles by FileId
+    pthread_mutex_t files_lock;
+    crdp_drive_file_t* files[CRDP_DRIVE_FILE_BUCKETS];
+    uint32_t next_file_id;
+} crdp_drive_t;
+
+static UINT32 crdp_drive_status(int err) {
+    switch (err) {
+        case 0: return STATUS_SUCCESS;
+        case ENOENT: return STATUS_OBJECT_NAME_NOT_FOUND;
+        case EEXIST: return STATUS_OBJECT_NAME_COLLISION;
+        case EACCES:
+        case EPERM: return STATUS_ACCESS_DENIED;
+        case EROFS: return STATUS_MEDIA_WRITE_PROTECTED;
+        case ENOTDIR: return STATUS_NOT_A_DIRECTORY;
+        case EISDIR: return STATUS_FILE_IS_A_DIRECTORY;
+        case ENOTEMPTY: return STATUS_DIRECTORY_NOT_EMPTY;
+        case ENOSPC:
+        case EDQUOT: return STATUS_DISK_FULL;
+        case ENAMETOOLONG: return STATUS_OBJECT_NAME_INVALID;
+        case EMFILE:
+        case ENFILE: return STATUS_TOO_MANY_OPENED_FILES;
+        case ENOMEM: return STATUS_NO_MEMORY;
+        default: return STATUS_UNSUCCESSFUL;
+    }
+}
+
+static uint64_t crdp_drive_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void crdp_drive_bucket_init(crdp_drive_bucket_t* bucket, double rate, double min_burst) {
+    bucket->rate = rate;
+    bucket->burst = rate * CRDP_DRIVE_BURST_SECONDS;
+    if (bucket->burst < min_burst) bucket->burst = min_burst;
+    bucket->tokens = bucket->burst;
+    bucket->last_ns = crdp_drive_now_ns();
+}
+
+// Takes n tokens and returns how long the caller must wait for them, in ns.
+// Called with drive->lock held.
+static uint64_t crdp_drive_bucket_take(crdp_drive_bucket_t* bucket, double n, uint64_t now) {
+    if (bucket->rate <= 0) return 0;
+    bucket->tokens += (double)(now - bucket->last_ns) * bucket->rate / 1e9;
+    if (bucket->tokens > bucket->burst) bucket->tokens = bucket->burst;
+    bucket->last_ns = now;
+    bucket->tokens -= n;
+    return bucket->tokens < 0 ? (uint64_t)(-bucket->tokens / bucket->rate * 1e9) : 0;
+}
+
+// Holds a worker until the drive's limits allow one more request moving
+// bytes of data. Returns early when the drive is stopping.
+static void crdp_drive_throttle(crdp_drive_t* drive, uint64_t bytes) {
+    if (drive->ops.rate <= 0 && (drive->bytes.rate <= 0 || bytes == 0)) return;
+    pthread_mutex_lock(&drive->lock);
+    uint64_t now = crdp_drive_now_ns();
+    uint64_t wait = crdp_drive_bucket_take(&drive->ops, 1, now);
+    if (bytes > 0) {
+        uint64_t wait_bytes = crdp_drive_bucket_take(&drive->bytes, (double)bytes, now);
+        if (wait_bytes > wait) wait = wait_bytes;
+    }
+    if (wait > 0) {
+        atomic_fetch_add(&drive->share->throttled, 1);
+        atomic_fetch_add(&drive->share->throttled_ms, wait / 1000000);
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        uint64_t ns = (uint64_t)deadline.tv_nsec + wait;
+        deadline.tv_sec += (time_t)(ns / 1000000000ULL);
+        deadline.tv_nsec = (long)(ns % 1000000000ULL);
+        while (!drive->stop &&
+               pthread_cond_timedwait(&drive->throttle_cond, &drive->lock, &deadline) != ETIMEDOUT) {
+        }
+    }
+    pthread_mutex_unlock(&drive->lock);
+}
+
+static UINT64 crdp_drive_filetime(const struct timespec* ts) {
+    return ((UINT64)ts->tv_sec + CRDP_DRIVE_EPOCH_DIFF) * 10000000ULL + (UINT64)ts->tv_nsec / 100;
+}
+
+static struct timespec crdp_drive_timespec(UINT64 filetime) {
+    struct timespec ts;
+    UINT64 secs = filetime / 10000000ULL;
+    ts.tv_sec = secs > CRDP_DRIVE_EPOCH_DIFF ? (time_t)(secs - CRDP_DRIVE_EPOCH_DIFF) : 0;
+    ts.tv_nsec = (long)(filetime % 10000000ULL) * 100;
+    return ts;
+}
+
+static const char* crdp_drive_basename(const char* path) {
+    const char* slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+static UINT32 crdp_drive_attributes(const char* name, const struct stat* st) {
+    UINT32 attr = S_ISDIR(st->st_mode) ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_ARCHIVE;
+    if (!(st->st_mode & S_IWUSR)) attr |= FILE_ATTRIBUTE_READONLY;
+    if (name[0] == '.' && strcmp(name, ".") != 0 && strcmp(name, "..") != 0) attr |= FILE_ATTRIBUTE_HIDDEN;
+    return attr;
+}
+
+// Host path for a server path ("\dir\file"), or NULL if it would leave the drive
+static char* crdp_drive_host_path(crdp_drive_t* drive, const uint8_t* utf16, size_t bytes) {
+    char* rel = crdp_utf16le_to_utf8_alloc(utf16, bytes, NULL);
+    if (!rel) return NULL;
+    for (char* p = rel; *p; p++) {
+        if (*p == '\\') *p = '/';
+    }
+    for (char* c = rel; *c;) {
+        char* end = strchr(c, '/');
+        size_t n = end ? (size_t)(end - c) : strlen(c);
+        if (n == 2 && c[0] == '.' && c[1] == '.') {
+            free(rel);
+            return NULL;
+        }
+        c += n;
+        if (*c) c++;
+    }
+    size_t len = strlen(rel);
+    while (len > 0 && rel[len - 1] == '/') rel[--len] = '\0';
+    const char* start = rel;
+    while (*start == '/') start++;
+
+    size_t size = strlen(drive->root) + 1 + strlen(start) + 1;
+    char* path = malloc(size);
+    if (path) {
+        if (*start) snprintf(path, size, "%s/%s", drive->root, start);
+        else snprintf(path, size, "%s", drive->root);
+    }
+    free(rel);
+    return path;
+}
+
+// Windows wildcard match, ASCII case-insensitive. '<', '>' and '"' are the
+// DOS forms of '*', '?' and '.'.
+static bool crdp_drive_match(const char* pattern, const char* name) {
+    if (strcmp(pattern, "*") == 0 || strcmp(pattern, "*.*") == 0) return true;
+    const char* star = NULL;
+    const char* resume = NULL;
+    while (*name) {
+        char p = *pattern;
+        if (p == '*' || p == '<') {
+            star = ++pattern;
+            resume = name;
+            continue;
+        }
+        if (p && (p == '?' || p == '>' || (p == '"' && *name == '.') ||
+                  tolower((unsigned char)p) == tolower((unsigned char)*name))) {
+            pattern++;
+            name++;
+            continue;
+        }
+        if (!star) return false;
+        pattern = star;
+        name = ++resume;
+    }
+    while (*pattern == '*' || *pattern == '<') pattern++;
+    return *pattern == '\0';
+}
+
+// Handle table
+
+static crdp_drive_file_t* crdp_drive_file_get(crdp_drive_t* drive, uint32_t id) {
+    pthread_mutex_lock(&drive->files_lock);
+    crdp_drive_file_t* file = drive->files[id % CRDP_DRIVE_FILE_BUCKETS];
+    while (file && file->id != id) file = file->next;
+    if (file) file->refs++;
+    pthread_mutex_unlock(&drive->files_lock);
+    return file;
+}
+
+static void crdp_drive_file_destroy(crdp_drive_t* drive, crdp_drive_file_t* file) {
+    if (file->fd >= 0) close(file->fd);
+    crdp_drive_listing_release(file->listing);
+    if (file->delete_on_close) {
+        if ((file->is_dir ? rmdir(file->path) : unlink(file->path)) != 0) {
+            WLog_WARN(CRDP_TAG, "Failed to delete %s: %s", file->path, strerror(errno));
+        }
+    }
+    if (file->delete_on_close || atomic_load(&file->written)) {
+        crdp_drivecache_invalidate(drive->cache, file->path, file->is_dir);
+    }
+    pthread_mutex_destroy(&file->lock);
+    free(file->pattern);
+    free(file->path);
+    free(file);
+}
+
+static void crdp_drive_file_put(crdp_drive_t* drive, crdp_drive_file_t* file) {
+    if (!file) return;
+    pthread_mutex_lock(&drive->files_lock);
+    bool last = --file->refs == 0;
+    pthread_mutex_unlock(&drive->files_lock);
+    // Closed on the server and no IRP still using it
+    if (last) crdp_drive_file_destroy(drive, file);
+}
+
+static crdp_drive_file_t* crdp_drive_file_add(crdp_drive_t* drive, char* path, int fd, bool is_dir) {
+    crdp_drive_file_t* file = calloc(1, sizeof(*file));
+    if (!file) return NULL;
+    pthread_mutex_init(&file->lock, NULL);
+    file->path = path;
+    file->fd = fd;
+    file->is_dir = is_dir;
+    file->refs = 1;
+
+    pthread_mutex_lock(&drive->files_lock);
+    // 0 is never handed out
+    do {
+        file->id = ++drive->next_file_id;
+    } while (file->id == 0);
+    crdp_drive_file_t** bucket = &drive->files[file->id % CRDP_DRIVE_FILE_BUCKETS];
+    file->next = *bucket;
+    *bucket = file;
+    pthread_mutex_unlock(&drive->files_lock);
+    return file;
+}
+
+// Takes the handle out of the table; the caller's reference keeps it alive
+static bool crdp_drive_file_remove(crdp_drive_t* drive, crdp_drive_file_t* file) {
+    bool removed = false;
+    pthread_mutex_lock(&drive->files_lock);
+    for (crdp_drive_file_t** p = &drive->files[file->id % CRDP_DRIVE_FILE_BUCKETS]; *p; p = &(*p)->next) {
+        if (*p != file) continue;
+        *p = file->next;
+        file->refs--;
+        removed = true;
+        break;
+    }
+    pthread_mutex_unlock(&drive->files_lock);
+    return removed;
+}
+
+// IRP handlers. Each writes its response body and returns the IoStatus.
+
+static UINT32 crdp_drive_open(crdp_drive_t* drive, char* path, UINT32 access, UINT32 disposition,
+                              UINT32 options, uint32_t* file_id, uint8_t* information) {
+    struct stat st;
+    bool exists = crdp_drivecache_stat(drive->cache, path, &st) == 0;
+    bool is_dir = exists && S_ISDIR(st.st_mode);
+    int fd = -1;
+
+    if (exists && disposition == FILE_CREATE) {
+        free(path);
+        return STATUS_OBJECT_NAME_COLLISION;
+    }
+    if (is_dir && (options & FILE_NON_DIRECTORY_FILE)) {
+        free(path);
+        return STATUS_FILE_IS_A_DIRECTORY;
+    }
+    if (exists && !is_dir && (options & FILE_DIRECTORY_FILE)) {
+        free(path);
+        return STATUS_NOT_A_DIRECTORY;
+    }
+
+    if (!exists && (disposition == FILE_OPEN || disposition == FILE_OVERWRITE)) {
+        // Tell a missing file from a missing folder on the way to it
+        char* slash = strrchr(path, '/');
+        bool parent = true;
+        if (slash) {
+            *slash = '\0';
+            parent = crdp_drivecache_stat(drive->cache, path, &st) == 0 && S_ISDIR(st.st_mode);
+        }
+        free(path);
+        return parent ? STATUS_OBJECT_NAME_NOT_FOUND : STATUS_OBJECT_PATH_NOT_FOUND;
+    }
+
+    if (drive->share->read_only) {
+        // Everything from here on creates, truncates or opens for a change;
+        // generic write access is settled for reading below
+        bool truncating = exists && (disposition == FILE_SUPERSEDE || disposition == FILE_OVERWRITE ||
+                                     disposition == FILE_OVERWRITE_IF);
+        if (!exists || truncating || (access & (FILE_WRITE_DATA | FILE_APPEND_DATA)) ||
+            (options & FILE_DELETE_ON_CLOSE)) {
+            atomic_fetch_add(&drive->share->denied, 1);
+            free(path);
+            return STATUS_MEDIA_WRITE_PROTECTED;
+        }
+        access &= ~(UINT32)CRDP_DRIVE_WRITE_ACCESS;
+    }
+
+    if (!exists && (options & FILE_DIRECTORY_FILE)) {
+        if (mkdir(path, 0755) != 0) {
+            int err = errno;
+            free(path);
+            return crdp_drive_status(err);
+        }
+        crdp_drivecache_invalidate(drive->cache, path, false);
+        is_dir = true;
+        *information = FILE_CREATED;
+    } else if (is_dir) {
+        *information = FILE_OPENED;
+    } else {
+        bool truncate = exists && (disposition == FILE_SUPERSEDE || disposition == FILE_OVERWRITE ||
+                                   disposition == FILE_OVERWRITE_IF);
+        bool write = (access & CRDP_DRIVE_WRITE_ACCESS) || truncate || !exists;
+        int flags = (write ? O_RDWR : O_RDONLY) | O_CLOEXEC;
+        if (!exists) flags |= O_CREAT | O_EXCL;
+        if (truncate) flags |= O_TRUNC;
+        fd = open(path, flags, 0644);
+        // Generic access asks for write without needing it; settle for reading
+        if (fd < 0 && (errno == EACCES || errno == EROFS) && exists && !truncate &&
+            !(access & (FILE_WRITE_DATA | FILE_APPEND_DATA))) {
+            fd = open(path, O_RDONLY | O_CLOEXEC);
+        }
+        if (fd < 0) {
+            int err = errno;
+            free(path);
+            return crdp_drive_status(err);
+        }
+        if (!exists || truncate) crdp_drivecache_invalidate(drive->cache, path, false);
+        if (!exists) *information = FILE_CREATED;
+        else if (truncate) *information = disposition == FILE_SUPERSEDE ? FILE_SUPERSEDED : FILE_OVERWRITTEN;
+        else *information = FILE_OPENED;
+    }
+
+    crdp_drive_file_t* file = crdp_drive_file_add(drive, path, fd, is_dir);
+    if (!file) {
+        if (fd >= 0) close(fd);
+        free(path);
+        return STATUS_NO_MEMORY;
+    }
+    file->delete_on_close = (options & FILE_DELETE_ON_CLOSE) != 0;
+    *file_id = file->id;
+    return STATUS_SUCCESS;
+}
+
+static UINT32 crdp_drive_create(crdp_drive_t* drive, IRP* irp) {
+    wStream* s = irp->input;
+    uint32_t file_id = 0;
+    uint8_t information = 0;
+    UINT32 status = STATUS_INVALID_PARAMETER;
+
+    if (Stream_CheckAndLogRequiredLength(CRDP_TAG, s, 32)) {
+        UINT32 access, attributes, shared, disposition, options, path_len;
+        UINT64 allocation;
+        Stream_Read_UINT32(s, access);
+        Stream_Read_UINT64(s, allocation);
+        Stream_Read_UINT32(s, attributes);
+        Stream_Read_UINT32(s, shared);
+        Stream_Read_UINT32(s, disposition);
+        Stream_Read_UINT32(s, options);
+        Stream_Read_UINT32(s, path_len);
+        (void)allocation;
+        (void)attributes;
+        (void)shared;
+        if (path_len <= CRDP_DRIVE_MAX_PATH_BYTES && Stream_CheckAndLogRequiredLength(CRDP_TAG, s, path_len)) {
+            char* path = crdp_drive_host_path(drive, Stream_Pointer(s), path_len);
+            status = path ? crdp_drive_open(drive, path, access, disposition, options, &file_id, &information)
+                          : STATUS_OBJECT_NAME_INVALID;
+        }
+    }
+
+    if (!Stream_EnsureRemainingCapacity(irp->output, 5)) return STATUS_NO_MEMORY;
+    Stream_Write_UINT32(irp->output, file_id);
+    Stream_Write_UINT8(irp->output, information);
+    return status;
+}
+
+static UINT32 crdp_drive_close(crdp_drive_t* drive, IRP* irp) {
+    crdp_drive_file_t* file = crdp_drive_file_get(drive, irp->FileId);
+    UINT32 status = STATUS_INVALID_HANDLE;
+    if (file) {
+        if (crdp_drive_file_remove(drive, file)) status = STATUS_SUCCESS;
+        crdp_drive_file_put(drive, file);
+    }
+    if (!Stream_EnsureRemainingCapacity(irp->output, 5)) return STATUS_NO_MEMORY;
+    Stream_Zero(irp->output, 5);
+    return status;
+}
+
+// Reads that pick up where the last one stopped grow the window advised to
+// the kernel past the end of this one; anything else starts over
+static void crdp_drive_readahead(crdp_drive_file_t* file, UINT64 offset, UINT32 length) {
+    pthread_mutex_lock(&file->lock);
+    bool sequential = offset == file->read_next;
+    if (!sequential) {
+        file->readahead_window = CRDP_DRIVE_READAHEAD_MIN;
+        file->readahead_end = 0;
+    } else if (file->readahead_window < CRDP_DRIVE_READAHEAD_MAX) {
+        file->readahead_window *= 2;
+    }
+    file->read_next = offset + length;
+    UINT64 from = file->read_next > file->readahead_end ? file->read_next : file->readahead_end;
+    UINT64 to = file->read_next + file->readahead_window;
+    bool advise = sequential && to > from;
+    if (advise) file->readahead_end = to;
+    pthread_mutex_unlock(&file->lock);
+
+    if (!advise) return;
+    struct radvisory ra = { .ra_offset = (off_t)from, .ra_count = (int)(to - from) };
+    // Only a hint; a failure just means no read-ahead
+    (void)fcntl(file->fd, F_RDADVISE, &ra);
+}
+
+static UINT32 crdp_drive_read(crdp_drive_t* drive, IRP* irp) {
+    wStream* s = irp->input;
+    wStream* out = irp->output;
+    if (!Stream_EnsureRemainingCapacity(out, 4)) return STATUS_NO_MEMORY;
+    size_t length_pos = Stream_GetPosition(out);
+    Stream_Write_UINT32(out, 0);
+
+    if (!Stream_CheckAndLogRequiredLength(CRDP_TAG, s, 12)) return STATUS_INVALID_PARAMETER;
+    UINT32 length;
+    UINT64 offset;
+    Stream_Read_UINT32(s, length);
+    Stream_Read_UINT64(s, offset);
+    if (length > CRDP_DRIVE_MAX_IO) length = CRDP_DRIVE_MAX_IO;
+    crdp_drive_throttle(drive, length);
+
+    crdp_drive_file_t* file = crdp_drive_file_get(drive, irp->FileId);
+    if (!file) return STATUS_INVALID_HANDLE;
+    UINT32 status = STATUS_SUCCESS;
+    size_t done = 0;
+    if (file->is_dir) {
+        status = STATUS_INVALID_DEVICE_REQUEST;
+    } else if (!Stream_EnsureRemainingCapacity(out, length)) {
+        status = STATUS_NO_MEMORY;
+    } else {
+        crdp_drive_readahead(file, offset, length);
+        // Straight into the response
+        uint8_t* dst = Stream_Pointer(out);
+        while (done < length) {
+            ssize_t n = pread(file->fd, dst + done, length - done, (off_t)(offset + done));
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) {
+                status = crdp_drive_status(errno);
+                done = 0;
+                break;
+            }
+            if (n == 0) break;
+            done += (size_t)n;
+        }
+    }
+    crdp_drive_file_put(drive, file);
+    if (status == STATUS_SUCCESS) {
+        atomic_fetch_add(&drive->share->reads, 1);
+        atomic_fetch_add(&drive->share->bytes_read, done);
+    }
+
+    Stream_Seek(out, done);
+    size_t end = Stream_GetPosition(out);
+    Stream_SetPosition(out, length_pos);
+    Stream_Write_UINT32(out, (UINT32)done);
+    Stream_SetPosition(out, end);
+    return status;
+}
+
+static UINT32 crdp_drive_write(crdp_drive_t* drive, IRP* irp) {
+    wStream* s = irp->input;
+    UINT32 status = STATUS_INVALID_PARAMETER;
+    size_t done = 0;
+
+    if (Stream_CheckAndLogRequiredLength(CRDP_TAG, s, 32)) {
+        UINT32 length;
+        UINT64 offset;
+        Stream_Read_UINT32(s, length);
+        Stream_Read_UINT64(s, offset);
+        Stream_Seek(s, 20); // Padding
+        crdp_drive_throttle(drive, length);
+        crdp_drive_file_t* file = crdp_drive_file_get(drive, irp->FileId);
+        if (!file) {
+            status = STATUS_INVALID_HANDLE;
+        } else if (drive->share->read_only) {
+            atomic_fetch_add(&drive->share->denied, 1);
+            status = STATUS_MEDIA_WRITE_PROTECTED;
+        } else if (file->is_dir) {
+            status = STATUS_INVALID_DEVICE_REQUEST;
+        } else if (Stream_CheckAndLogRequiredLength(CRDP_TAG, s, length)) {
+            // Straight from the request
+            const uint8_t* src = Stream_Pointer(s);
+            status = STATUS_SUCCESS;
+            while (done < length) {
+                ssize_t n = pwrite(file->fd, src + done, length - done, (off_t)(offset + done));
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                    status = crdp_drive_status(n < 0 ? errno : ENOSPC);
+                    break;
+                }
+                done += (size_t)n;
+            }
+            atomic_fetch_add(&drive->share->writes, 1);
+            atomic_fetch_add(&drive->share->bytes_written, done);
+            // The cached size and times are stale from the first write on;
+            // closing the handle drops them once more
+            if (done > 0 && !atomic_exchange(&file->written, true)) {
+                pthread_mutex_lock(&file->lock);
+                crdp_drivecache_invalidate(drive->cache, file->path, false);
+                pthread_mutex_unlock(&file->lock);
+            }
+        }
+        crdp_drive_file_put(drive, file);
+    }
+
+    if (!Stream_EnsureRemainingCapacity(irp->output, 5)) return STATUS_NO_MEMORY;
+    Stream_Write_UINT32(irp->output, (UINT32)done);
+    Stream_Write_UINT8(irp->output, 0); // Padding
+    return status;
+}
+
+static UINT32 crdp_drive_query_volume(crdp_drive_t* drive, IRP* irp) {
+    wStream* s = irp->input;
+    wStream* out = irp->output;
+    if (!Stream_CheckAndLogRequiredLength(CRDP_TAG, s, 4)) return STATUS_INVALID_PARAMETER;
+    UINT32 info_class;
+    Stream_Read_UINT32(s, info_class);
+
+    struct statvfs vfs;
+    struct stat st;
+    if (statvfs(drive->root, &vfs) != 0 || stat(drive->root, &st) != 0) {
+        int err = errno;
+        if (!Stream_EnsureRemainingCapacity(out, 4)) return STATUS_NO_MEMORY;
+        Stream_Write_UINT32(out, 0);
+        return crdp_drive_status(err);
+    }
+    UINT64 unit = vfs.f_frsize ? vfs.f_frsize : vfs.f_bsize;
+    UINT32 bytes_per_sector = unit >= 512 ? 512 : (UINT32)unit;
+    UINT32 sectors_per_unit = (UINT32)(unit / bytes_per_sector);
+
+    size_t label_bytes = 0;
+    uint8_t* label = crdp_utf8_to_utf16le_alloc(drive->label, strlen(drive->label), &label_bytes);
+    if (!label) return STATUS_NO_MEMORY;
+    static const uint8_t fs_name[] = { 'A', 0, 'P', 0, 'F', 0, 'S', 0, 0, 0 };
+
+    UINT32 status = STATUS_SUCCESS;
+    if (!Stream_EnsureRemainingCapacity(out, 64 + label_bytes)) {
+        free(label);
+        return STATUS_NO_MEMORY;
+    }
+    switch (info_class) {
+        case FileFsVolumeInformation:
+            Stream_Write_UINT32(out, (UINT32)(17 + label_bytes));
+            Stream_Write_UINT64(out, crdp_drive_filetime(&st.st_birthtimespec));
+            Stream_Write_UINT32(out, (UINT32)vfs.f_fsid);        // VolumeSerialNumber
+            Stream_Write_UINT32(out, (UINT32)label_bytes);
+            Stream_Write_UINT8(out, 0);                          // SupportsObjects
+            Stream_Write(out, label, label_bytes);
+            break;
+        case FileFsSizeInformation:
+            Stream_Write_UINT32(out, 24);
+            Stream_Write_UINT64(out, vfs.f_blocks);
+            Stream_Write_UINT64(out, vfs.f_bavail);
+            Stream_Write_UINT32(out, sectors_per_unit);
+            Stream_Write_UINT32(out, bytes_per_sector);
+            break;
+        case FileFsAttributeInformation:
+            Stream_Write_UINT32(out, (UINT32)(12 + sizeof(fs_name)));
+            Stream_Write_UINT32(out, FILE_CASE_PRESERVED_NAMES | FILE_UNICODE_ON_DISK |
+                                         (drive->share->read_only ? FILE_READ_ONLY_VOLUME : 0));
+            Stream_Write_UINT32(out, 255);                       // MaximumComponentNameLength
+            Stream_Write_UINT32(out, (UINT32)sizeof(fs_name));
+            Stream_Write(out, fs_name, sizeof(fs_name));
+            break;
+        case FileFsFullSizeInformation:
+            Stream_Write_UINT32(out, 32);
+            Stream_Write_UINT64(out, vfs.f_blocks);
+            Stream_Write_UINT64(out, vfs.f_bavail);              // Caller available
+            Stream_Write_UINT64(out, vfs.f_bfree);               // Actual available
+            Stream_Write_UINT32(out, sectors_per_unit);
+            Stream_Write_UINT32(out, bytes_per_sector);
+            break;
+        case FileFsDeviceInformation:
+            Stream_Write_UINT32(out, 8);
+            Stream_Write_UINT32(out, FILE_DEVICE_DISK);
+            Stream_Write_UINT32(out, 0x00000020);                // Characteristics
+            break;
+        default:
+            Stream_Write_UINT32(out, 0);
+            status = STATUS_NOT_SUPPORTED;
+            break;
+    }
+    free(label);
+    return status;
+}
+
+// Open files are asked directly; directories go through the cache
+static UINT32 crdp_drive_file_stat(crdp_drive_t* drive, crdp_drive_file_t* file, struct stat* st) {
+    if (file->fd < 0) return crdp_drive_status(crdp_drivecache_stat(drive->cache, file->path, st));
+    return fstat(file->fd, st) == 0 ? STATUS_SUCCESS : crdp_drive_status(errno);
+}
+
+static UINT32 crdp_drive_query_info(crdp_drive_t* drive, IRP* irp) {
+    wStream* s = irp->input;
+    wStream* out = irp->output;
+    if (!Stream_EnsureRemainingCapacity(out, 4 + 36)) return STATUS_NO_MEMORY;
+    if (!Stream_CheckAndLogRequiredLength(CRDP_TAG, s, 4)) {
+        Stream_Write_UINT32(out, 0);
+        return STATUS_INVALID_PARAMETER;
+    }
+    UINT32 info_class;
+    Stream_Read_UINT32(s, info_class);
+
+    crdp_drive_file_t* file = crdp_drive_file_get(drive, irp->FileId);
+    if (!file) {
+        Stream_Write_UINT32(out, 0);
+        return STATUS_INVALID_HANDLE;
+    }
+    struct stat st;
+    pthread_mutex_lock(&file->lock);
+    UINT32 status = crdp_drive_file_stat(drive, file, &st);
+    UINT32 attr = status == STATUS_SUCCESS ? crdp_drive_attributes(crdp_drive_basename(file->path), &st) : 0;
+    bool delete_pending = file->delete_on_close;
+    pthread_mutex_unlock(&file->lock);
+    crdp_drive_file_put(drive, file);
+
+    if (status != STATUS_SUCCESS) {
+        Stream_Write_UINT32(out, 0);
+        return status;
+    }
+    switch (info_class) {
+        case FileBasicInformation:
+            Stream_Write_UINT32(out, 36);
+            Stream_Write_UINT64(out, crdp_drive_filetime(&st.st_birthtimespec));
+            Stream_Write_UINT64(out, crdp_drive_filetime(&st.st_atimespec));
+            Stream_Write_UINT64(out, crdp_drive_filetime(&st.st_mtimespec));
+            Stream_Write_UINT64(out, crdp_drive_filetime(&st.st_ctimespec));
+            Stream_Write_UINT32(out, attr);
+            break;
+        case FileStandardInformation:
+            Stream_Write_UINT32(out, 22);
+            Stream_Write_UINT64(out, (UINT64)st.st_blocks * 512);  // AllocationSize
+            Stream_Write_UINT64(out, (UINT64)st.st_size);          // EndOfFile
+            Stream_Write_UINT32(out, (UINT32)st.st_nlink);
+            Stream_Write_UINT8(out, delete_pending ? 1 : 0);
+            Stream_Write_UINT8(out, S_ISDIR(st.st_mode) ? 1 : 0);
+            break;
+        case FileAttributeTagInformation:
+            Stream_Write_UINT32(out, 8);
+            Stream_Write_UINT32(out, attr);
+            Stream_Write_UINT32(out, 0);                           // ReparseTag
+            break;
+        default:
+            Stream_Write_UINT32(out, 0);
+            return STATUS_NOT_SUPPORTED;
+    }
+    return STATUS_SUCCESS;
+}
+
+static bool crdp_drive_dir_empty(const char* path) {
+    DIR* dir = opendir(path);
+    if (!dir) return false;
+    bool empty = true;
+    struct dirent* entry;
+    while (empty && (entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) empty = false;
+    }
+    closedir(dir);
+    return empty;
+}
+
+static UINT32 crdp_drive_rename(crdp_drive_t* drive, crdp_drive_file_t* file, wStream* s) {
+    if (!Stream_CheckAndLogRequiredLength(CRDP_TAG, s, 6)) return STATUS_INVALID_PARAMETER;
+    UINT8 replace, root_dir;
+    UINT32 name_len;
+    Stream_Read_UINT8(s, replace);
+    Stream_Read_UINT8(s, root_dir);
+    Stream_Read_UINT32(s, name_len);
+    (void)root_dir;
+    if (name_len > CRDP_DRIVE_MAX_PATH_BYTES || !Stream_CheckAndLogRequiredLength(CRDP_TAG, s, name_len)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    char* target = crdp_drive_host_path(drive, Stream_Pointer(s), name_len);
+    if (!target) return STATUS_OBJECT_NAME_INVALID;
+
+    struct stat from_st;
+    struct stat to_st;
+    UINT32 status = STATUS_SUCCESS;
+    // A case-only rename finds the file itself at the target
+    if (!replace && lstat(target, &to_st) == 0 &&
+        !(lstat(file->path, &from_st) == 0 && from_st.st_ino == to_st.st_ino && from_st.st_dev == to_st.st_dev)) {
+        status = STATUS_OBJECT_NAME_COLLISION;
+    } else if (rename(file->path, target) != 0) {
+        status = crdp_drive_status(errno);
+    }
+    if (status == STATUS_SUCCESS) {
+        crdp_drivecache_invalidate(drive->cache, file->path, file->is_dir);
+        crdp_drivecache_invalidate(drive->cache, target, file->is_dir);
+        free(file->path);
+        file->path = target;
+    } else {
+        free(target);
+    }
+    return status;
+}
+
+static UINT32 crdp_drive_set_info(crdp_drive_t* drive, IRP* irp) {
+    wStream* s = irp->input;
+    if (!Stream_EnsureRemainingCapacity(irp->output, 4)) return STATUS_NO_MEMORY;
+    if (!Stream_CheckAndLogRequiredLength(CRDP_TAG, s, 32)) {
+        Stream_Write_UINT32(irp->output, 0);
+        return STATUS_INVALID_PARAMETER;
+    }
+    UINT32 info_class, length;
+    Stream_Read_UINT32(s, info_class);
+    Stream_Read_UINT32(s, length);
+    Stream_Seek(s, 24); // Padding
+
+    crdp_drive_file_t* file = crdp_drive_file_get(drive, irp->FileId);
+    if (!file) {
+        Stream_Write_UINT32(irp->output, 0);
+        return STATUS_INVALID_HANDLE;
+    }
+    if (drive->share->read_only) {
+        atomic_fetch_add(&drive->share->denied, 1);
+        crdp_drive_file_put(drive, file);
+        Stream_Write_UINT32(irp->output, 0);
+        return STATUS_MEDIA_WRITE_PROTECTED;
+    }
+    UINT32 status = STATUS_INVALID_PARAMETER;
+    pthread_mutex_lock(&file->lock);
+    switch (info_class) {
+        case FileBasicInformation:
+            if (Stream_CheckAndLogRequiredLength(CRDP_TAG, s, 36)) {
+                UINT64 creation, access_time, write_time, change_time;
+                UINT32 attr;
+                Stream_Read_UINT64(s, creation);
+                Stream_Read_UINT64(s, access_time);
+                Stream_Read_UINT64(s, write_time);
+                Stream_Read_UINT64(s, change_time);
+                Stream_Read_UINT32(s, attr);
+                (void)creation;
+                (void)change_time;
+                // 0 and -1 leave a time alone
+                struct timespec times[2] = { { 0, UTIME_OMIT }, { 0, UTIME_OMIT } };
+                if (access_time && access_time != UINT64_MAX) times[0] = crdp_drive_timespec(access_time);
+                if (write_time && write_time != UINT64_MAX) times[1] = crdp_drive_timespec(write_time);
+                int rc = file->fd >= 0 ? futimens(file->fd, times) : utimensat(AT_FDCWD, file->path, times, 0);
+                status = rc == 0 ? STATUS_SUCCESS : crdp_drive_status(errno);
+                struct stat st;
+                if (status == STATUS_SUCCESS && attr && crdp_drive_file_stat(drive, file, &st) == STATUS_SUCCESS) {
+                    mode_t mode = (attr & FILE_ATTRIBUTE_READONLY) ? (st.st_mode & ~(mode_t)0222)
+                                                                   : (st.st_mode | S_IWUSR);
+                    if (mode != st.st_mode && chmod(file->path, mode & 07777) != 0) status = crdp_drive_status(errno);
+                }
+            }
+            break;
+        case FileEndOfFileInformation:
+        case FileAllocationInformation:
+            if (Stream_CheckAndLogRequiredLength(CRDP_TAG, s, 8)) {
+                UINT64 size;
+                Stream_Read_UINT64(s, size);
+                struct stat st;
+                if (file->fd < 0) {
+                    status = STATUS_INVALID_DEVICE_REQUEST;
+                } else if ((status = crdp_drive_file_stat(drive, file, &st)) == STATUS_SUCCESS) {
+                    // Allocation only ever shrinks the file
+                    bool resize = info_class == FileEndOfFileInformation || size < (UINT64)st.st_size;
+                    if (resize && ftruncate(file->fd, (off_t)size) != 0) status = crdp_drive_status(errno);
+                }
+            }
+            break;
+        case FileDispositionInformation: {
+            UINT8 pending = 1;
+            if (length > 0 && Stream_CheckAndLogRequiredLength(CRDP_TAG, s, 1)) Stream_Read_UINT8(s, pending);
+            status = STATUS_SUCCESS;
+            if (pending && file->is_dir && !crdp_drive_dir_empty(file->path)) {
+                status = STATUS_DIRECTORY_NOT_EMPTY;
+            } else {
+                file->delete_on_close = pending != 0;
+            }
+            break;
+        }
+        case FileRenameInformation:
+            status = crdp_drive_rename(drive, file, s);
+            break;
+        default:
+            status = STATUS_NOT_SUPPORTED;
+            break;
+    }
+    // Renames drop their own paths; a pending delete changes nothing yet
+    bool changed = info_class != FileRenameInformation && info_class != FileDispositionInformation;
+    if (status == STATUS_SUCCESS && changed) crdp_drivecache_invalidate(drive->cache, file->path, false);
+    pthread_mutex_unlock(&file->lock);
+    crdp_drive_file_put(drive, file);
+
+    Stream_Write_UINT32(irp->output, status == STATUS_SUCCESS ? length : 0);
+    return status;
+}
+
+// One directory entry in the requested information class
+static UINT32 crdp_drive_write_entry(wStream* out, UINT32 info_class, const char* name, const struct stat* st) {
+    size_t name_len = strlen(name);
+    int64_t units = crdp_utf8_to_utf16le_length((const uint8_t*)name, name_len);
+    if (units < 0) return STATUS_OBJECT_NAME_INVALID;
+    UINT32 name_bytes = (UINT32)units * 2;
+
+    size_t fixed;
+    switch (info_class) {
+        case FileDirectoryInformation: fixed = 64; break;
+        case FileFullDirectoryInformation: fixed = 68; break;
+        case FileBothDirectoryInformation: fixed = 93; break;
+        case FileNamesInformation: fixed = 12; break;
+        default: return STATUS_NOT_SUPPORTED;
+    }
+    if (!Stream_EnsureRemainingCapacity(out, 4 + fixed + name_bytes)) return STATUS_NO_MEMORY;
+
+    Stream_Write_UINT32(out, (UINT32)(fixed + name_bytes));
+    Stream_Write_UINT32(out, 0); // NextEntryOffset
+    Stream_Write_UINT32(out, 0); // FileIndex
+    if (info_class != FileNamesInformation) {
+        Stream_Write_UINT64(out, crdp_drive_filetime(&st->st_birthtimespec));
+        Stream_Write_UINT64(out, crdp_drive_filetime(&st->st_atimespec));
+        Stream_Write_UINT64(out, crdp_drive_filetime(&st->st_mtimespec));
+        Stream_Write_UINT64(out, crdp_drive_filetime(&st->st_ctimespec));
+        Stream_Write_UINT64(out, (UINT64)st->st_size);
+        Stream_Write_UINT64(out, (UINT64)st->st_blocks * 512);
+        Stream_Write_UINT32(out, crdp_drive_attributes(name, st));
+    }
+    Stream_Write_UINT32(out, name_bytes);
+    if (info_class == FileFullDirectoryInformation || info_class == FileBothDirectoryInformation) {
+        Stream_Write_UINT32(out, 0); // EaSize
+    }
+    if (info_class == FileBothDirectoryInformation) {
+        Stream_Write_UINT8(out, 0);  // ShortNameLength
+        Stream_Write_UINT8(out, 0);  // Reserved
+        Stream_Zero(out, 24);        // ShortName
+    }
+    crdp_utf8_to_utf16le((const uint8_t*)name, name_len, Stream_Pointer(out));
+    Stream_Seek(out, name_bytes);
+    return STATUS_SUCCESS;
+}
+
+// One entry per IRP, as Windows asks for them
+static UINT32 crdp_drive_query_directory(crdp_drive_t* drive, IRP* irp) {
+    wStream* s = irp->input;
+    wStream* out = irp->output;
+    UINT32 status = STATUS_INVALID_PARAMETER;
+    size_t start = Stream_GetPosition(out);
+
+    crdp_drive_file_t* file = NULL;
+    if (Stream_CheckAndLogRequiredLength(CRDP_TAG, s, 32)) {
+        UINT32 info_class, path_len;
+        UINT8 initial;
+        Stream_Read_UINT32(s, info_class);
+        Stream_Read_UINT8(s, initial);
+        Stream_Read_UINT32(s, path_len);
+        Stream_Seek(s, 23); // Padding
+        file = crdp_drive_file_get(drive, irp->FileId);
+        if (!file) {
+            status = STATUS_INVALID_HANDLE;
+        } else if (!file->is_dir) {
+            status = STATUS_INVALID_DEVICE_REQUEST;
+        } else if (path_len <= CRDP_DRIVE_MAX_PATH_BYTES && Stream_CheckAndLogRequiredLength(CRDP_TAG, s, path_len)) {
+            pthread_mutex_lock(&file->lock);
+            status = STATUS_SUCCESS;
+            if (initial || !file->listing) {
+                // The pattern is the last component of the path
+                char* search = crdp_utf16le_to_utf8_alloc(Stream_Pointer(s), path_len, NULL);
+                const char* sep = search ? strrchr(search, '\\') : NULL;
+                free(file->pattern);
+                file->pattern = search ? strdup(sep ? sep + 1 : search) : NULL;
+                free(search);
+                // A snapshot of the folder, shared with other handles listing it
+                crdp_drive_listing_release(file->listing);
+                int err = 0;
+                file->listing = crdp_drivecache_list(drive->cache, file->path, &err);
+                file->next_entry = 0;
+                if (!file->pattern) status = STATUS_NO_MEMORY;
+                else if (!file->listing) status = crdp_drive_status(err);
+            }
+            bool found = false;
+            while (status == STATUS_SUCCESS && !found && file->next_entry < file->listing->count) {
+                const crdp_drive_dirent_t* entry = &file->listing->entries[file->next_entry++];
+                if (file->pattern[0] && !crdp_drive_match(file->pattern, entry->name)) continue;
+                UINT32 rc = crdp_drive_write_entry(out, info_class, entry->name, &entry->st);
+                if (rc == STATUS_OBJECT_NAME_INVALID) continue;
+                status = rc;
+                found = true;
+            }
+            if (status == STATUS_SUCCESS && !found) status = initial ? STATUS_NO_SUCH_FILE : STATUS_NO_MORE_FILES;
+            pthread_mutex_unlock(&file->lock);
+        }
+    }
+    crdp_drive_file_put(drive, file);
+
+    if (status != STATUS_SUCCESS) {
+        Stream_SetPosition(out, start);
+        if (!Stream_EnsureRemainingCapacity(out, 5)) return STATUS_NO_MEMORY;
+        Stream_Write_UINT32(out, 0);
+        Stream_Write_UINT8(out, 0); // Padding
+    }
+    return status;
+}
+
+// Runs on a worker; every IRP is completed or discarded exactly once
+static void crdp_drive_process(crdp_drive_t* drive, IRP* irp) {
+    UINT32 status;
+    atomic_fetch_add(&drive->share->requests, 1);
+    // Reads and writes are charged along with their data once it is known
+    if (irp->MajorFunction != IRP_MJ_READ && irp->MajorFunction != IRP_MJ_WRITE) crdp_drive_throttle(drive, 0);
+    switch (irp->MajorFunction) {
+        case IRP_MJ_CREATE: status = crdp_drive_create(drive, irp); break;
+        case IRP_MJ_CLOSE: status = crdp_drive_close(drive, irp); break;
+        case IRP_MJ_READ: status = crdp_drive_read(drive, irp); break;
+        case IRP_MJ_WRITE: status = crdp_drive_write(drive, irp); break;
+        case IRP_MJ_QUERY_VOLUME_INFORMATION: status = crdp_drive_query_volume(drive, irp); break;
+        case IRP_MJ_QUERY_INFORMATION: status = crdp_drive_query_info(drive, irp); break;
+        case IRP_MJ_SET_INFORMATION: status = crdp_drive_set_info(drive, irp); break;
+        case IRP_MJ_DIRECTORY_CONTROL:
+            if (irp->MinorFunction == IRP_MN_NOTIFY_CHANGE_DIRECTORY) {
+                // Never answered, like FreeRDP's own drive
+                irp->Discard(irp);
+                return;
+            }
+            if (irp->MinorFunction == IRP_MN_QUERY_DIRECTORY) {
+                status = crdp_drive_query_directory(drive, irp);
+            } else {
+                status = STATUS_NOT_SUPPORTED;
+                if (Stream_EnsureRemainingCapacity(irp->output, 5)) {
+                    Stream_Write_UINT32(irp->output, 0);
+                    Stream_Write_UINT8(irp->output, 0);
+                }
+            }
+            break;
+        case IRP_MJ_DEVICE_CONTROL:
+            // No IOCTLs supported; OutputBufferLength 0
+            status = STATUS_SUCCESS;
+            if (Stream_EnsureRemainingCapacity(irp->output, 4)) Stream_Write_UINT32(irp->output, 0);
+            break;
+        case IRP_MJ_LOCK_CONTROL:
+            status = STATUS_SUCCESS;
+            if (Stream_EnsureRemainingCapacity(irp->output, 5)) Stream_Zero(irp->output, 5);
+            break;
+        case IRP_MJ_SET_VOLUME_INFORMATION:
+            status = STATUS_NOT_SUPPORTED;
+            if (Stream_EnsureRemainingCapacity(irp->output, 4)) Stream_Write_UINT32(irp->output, 0);
+            break;
+        default:
+            WLog_DBG(CRDP_TAG, "Unsupported drive IRP 0x%08X", irp->MajorFunction);
+            status = STATUS_NOT_SUPPORTED;
+            break;
+    }
+    irp->IoStatus = status;
+    UINT rc = irp->Complete(irp);
+    if (rc != CHANNEL_RC_OK) WLog_WARN(CRDP_TAG, "Failed to complete drive IRP: %u", rc);
+}
+
+static void* crdp_drive_worker(void* arg) {
+    crdp_drive_t* drive = (crdp_drive_t*)arg;
+    crdp_profile_thread_name("drive worker");
+    pthread_mutex_lock(&drive->lock);
+    while (!drive->stop) {
+        crdp_drive_work_t* work = drive->head;
+        if (!work) {
+            pthread_cond_wait(&drive->cond, &drive->lock);
+            continue;
+        }
+        drive->head = work->next;
+        if (!drive->head) drive->tail = NULL;
+        pthread_mutex_unlock(&drive->lock);
+
+        uint64_t start = crdp_time_us();
+        uint64_t span = crdp_span_begin();
+        uint32_t major = work->irp->MajorFunction;
+        crdp_drive_process(drive, work->irp);
+        crdp_span_end(span, "drive IRP", "major", major);
+        if (drive->client) crdp_metrics_record(drive->client, CRDP_HIST_DRIVE_US, crdp_time_us() - start);
+        free(work);
+
+        pthread_mutex_lock(&drive->lock);
+    }
+    pthread_mutex_unlock(&drive->lock);
+    return NULL;
+}
+
+// rdpdr thread: queue the IRP and return at once
+static UINT crdp_drive_irp_request(DEVICE* device, IRP* irp) {
+    crdp_drive_t* drive = (crdp_drive_t*)device;
+    if (!drive || !irp) return ERROR_INVALID_PARAMETER;
+    crdp_drive_work_t* work = malloc(sizeof(*work));
+    if (!work) return CHANNEL_RC_NO_MEMORY;
+    work->irp = irp;
+    work->next = NULL;
+
+    pthread_mutex_lock(&drive->lock);
+    if (drive->stop) {
+        pthread_mutex_unlock(&drive->lock);
+        free(work);
+        return irp->Discard(irp);
+    }
+    if (drive->tail) drive->tail->next = work;
+    else drive->head = work;
+    drive->tail = work;
+    pthread_cond_signal(&drive->cond);
+    pthread_mutex_unlock(&drive->lock);
+    return CHANNEL_RC_OK;
+}
+
+// IRPs still queued are dropped; the ones being serviced finish first
+static UINT crdp_drive_free(DEVICE* device) {
+    crdp_drive_t* drive = (crdp_drive_t*)device;
+    if (!drive) return CHANNEL_RC_OK;
+
+    pthread_mutex_lock(&drive->lock);
+    drive->stop = true;
+    pthread_cond_broadcast(&drive->cond);
+    pthread_cond_broadcast(&drive->throttle_cond);
+    pthread_mutex_unlock(&drive->lock);
+    for (uint32_t i = 0; i < drive->worker_count; i++) pthread_join(drive->workers[i], NULL);
+
+    while (drive->head) {
+        crdp_drive_work_t* work = drive->head;
+        drive->head = work->next;
+        work->irp->Discard(work->irp);
+        free(work);
+    }
+    for (int i = 0; i < CRDP_DRIVE_FILE_BUCKETS; i++) {
+        while (drive->files[i]) {
+            crdp_drive_file_t* file = drive->files[i];
+            drive->files[i] = file->next;
+            crdp_drive_file_destroy(drive, file);
+        }
+    }
+
+    crdp_drivecache_free(drive->cache);
+    Stream_Free(drive->device.data, TRUE);
+    free((void*)drive->device.name);
+    free(drive->label);
+    free(drive->root);
+    pthread_cond_destroy(&drive->cond);
+    pthread_cond_destroy(&drive->throttle_cond);
+    pthread_mutex_destroy(&drive->lock);
+    pthread_mutex_destroy(&drive->files_lock);
+    free(drive);
+    return CHANNEL_RC_OK;
+}
+
+static crdp_drive_t* crdp_drive_new(const char* name, const char* path, crdp_drive_share_t* share,
+                                    crdp_client_t* client) {
+    crdp_drive_t* drive = calloc(1, sizeof(*drive));
+    if (!drive) return NULL;
+    drive->client = client;
+    pthread_mutex_init(&drive->lock, NULL);
+    pthread_cond_init(&drive->cond, NULL);
+    pthread_cond_init(&drive->throttle_cond, NULL);
+    drive->share = share ? share : &drive->own_share;
+    crdp_drive_bucket_init(&drive->ops, (double)drive->share->max_ops_per_second, 1);
+    crdp_drive_bucket_init(&drive->bytes, (double)drive->share->max_bytes_per_second, CRDP_DRIVE_MIN_BURST_BYTES);
+    pthread_mutex_init(&drive->files_lock, NULL);
+
+    // Resolved, so paths match the ones FSEvents reports
+    drive->root = realpath(path, NULL);
+    if (!drive->root) drive->root = strdup(path);
+    drive->label = strdup(name);
+    drive->device.name = strdup(name);
+    size_t len = strlen(name);
+    drive->device.data = Stream_New(NULL, len + 1);
+    if (!drive->root || !drive->label || !drive->device.name || !drive->device.data) {
+        crdp_drive_free(&drive->device);
+        return NULL;
+    }
+    size_t root_len = strlen(drive->root);
+    while (root_len > 1 && drive->root[root_len - 1] == '/') drive->root[--root_len] = '\0';
+    drive->cache = crdp_drivecache_new(drive->root);
+    if (!drive->cache) {
+        crdp_drive_free(&drive->device);
+        return NULL;
+    }
+
+    // Device announce data: the name, without the characters it forbids
+    for (size_t i = 0; i < len; i++) {
+        char c = name[i];
+        bool bad = strchr(":<>\"/\\|", c) != NULL;
+        Stream_Write_UINT8(drive->device.data, bad ? '_' : (BYTE)c);
+    }
+    Stream_Write_UINT8(drive->device.data, '\0');
+
+    drive->device.type = RDPDR_DTYP_FILESYSTEM;
+    drive->device.IRPRequest = crdp_drive_irp_request;
+    drive->device.Free = crdp_drive_free;
+
+    for (int i = 0; i < CRDP_DRIVE_WORKERS; i++) {
+        if (pthread_create(&drive->workers[i], NULL, crdp_drive_worker, drive) != 0) break;
+        drive->worker_count++;
+    }
+    if (drive->worker_count == 0) {
+        WLog_ERR(CRDP_TAG, "Failed to start drive I/O workers");
+        crdp_drive_free(&drive->device);
+        return NULL;
+    }
+    return drive;
+}
+
+// rdpdr's entry point for RDPDR_DTYP_FILESYSTEM devices
+static UINT VCAPITYPE crdp_drive_service_entry(PDEVICE_SERVICE_ENTRY_POINTS entry_points) {
+    const RDPDR_DRIVE* cfg = (const RDPDR_DRIVE*)entry_points->device;
+    if (!cfg || !cfg->Path || !cfg->device.Name) return ERROR_INVALID_PARAMETER;
+
+    // Options and counters from the client that configured this drive
+    crdp_context* ctx = (crdp_context*)entry_points->rdpcontext;
+    crdp_drive_share_t* share = NULL;
+    if (ctx && ctx->client) {
+        for (uint32_t i = 0; i < ctx->client->drive_count && !share; i++) {
+            crdp_drive_share_t* candidate = &ctx->client->drives[i];
+            if (strcmp(candidate->name, cfg->device.Name) == 0 && strcmp(candidate->path, cfg->Path) == 0) {
+                share = candidate;
+            }
+        }
+    }
+
+    crdp_drive_t* drive = crdp_drive_new(cfg->device.Name, cfg->Path, share, ctx ? ctx->client : NULL);
+    if (!drive) return CHANNEL_RC_NO_MEMORY;
+    UINT rc = entry_points->RegisterDevice(entry_points->devman, &drive->device);
+    if (rc != CHANNEL_RC_OK) {
+        crdp_drive_free(&drive->device);
+        return rc;
+    }
+    WLog_INFO(CRDP_TAG, "Drive %s served from %s by %u I/O workers", cfg->device.Name, drive->root,
+              drive->worker_count);
+    return CHANNEL_RC_OK;
+}
+
+PVIRTUALCHANNELENTRY crdp_drive_addin_entry(LPCSTR name, LPCSTR type) {
+    if (name && type && strcmp(name, "drive") == 0 && strcmp(type, "DeviceServiceEntry") == 0) {
+        return (PVIRTUALCHANNELENTRY)crdp_drive_service_entry;
+    }
+    return NULL;
+}
+
+static bool crdp_drive_add_share(crdp_client_t* client, const char* path, const char* name, bool read_only,
+                                 uint64_t max_bytes_per_second, uint32_t max_ops_per_second) {
+    if (!path || !path[0]) return false;
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        WLog_WARN(CRDP_TAG, "Drive path invalid or not a directory: %s", path);
+        return false;
+    }
+    if (client->drive_count >= CRDP_MAX_DRIVES) {
+        WLog_WARN(CRDP_TAG, "More than %d drives, not sharing %s", CRDP_MAX_DRIVES, path);
+        return false;
+    }
+    if (!name || !name[0]) name = "Mac";
+    // The device finds its entry by name and path, so those pairs are unique
+    for (uint32_t i = 0; i < client->drive_count; i++) {
+        if (strcmp(client->drives[i].name, name) == 0 && strcmp(client->drives[i].path, path) == 0) return false;
+    }
+
+    crdp_drive_share_t* share = &client->drives[client->drive_count];
+    memset(share, 0, sizeof(*share));
+    share->path = strdup(path);
+    share->name = strdup(name);
+    if (!share->path || !share->name) {
+        free(share->path);
+        free(share->name);
+        return false;
+    }
+    share->read_only = read_only;
+    share->max_bytes_per_second = max_bytes_per_second;
+    share->max_ops_per_second = max_ops_per_second;
+    client->drive_count++;
+    return true;
+}
+
+uint32_t crdp_drive_configure(crdp_client_t* client, const crdp_config_t* config) {
+    crdp_drive_clear(client);
+    crdp_drive_add_share(client, config->drive_path, config->drive_name, false, 0, 0);
+    for (uint32_t i = 0; config->drives && i < config->drive_count; i++) {
+        const crdp_drive_config_t* drive = &config->drives[i];
+        crdp_drive_add_share(client, drive->path, drive->name, drive->read_only, drive->max_bytes_per_second,
+                             drive->max_ops_per_second);
+    }
+    return client->drive_count;
+}
+
+void crdp_drive_clear(crdp_client_t* client) {
+    for (uint32_t i = 0; i < client->drive_count; i++) {
+        free(client->drives[i].path);
+        free(client->drives[i].name);
+    }
+    memset(client->drives, 0, sizeof(client->drives));
+    client->drive_count = 0;
+}
+
+int crdp_get_drive_stats(crdp_client_t* client, crdp_drive_stats_t* stats, uint32_t max_drives) {
+    if (!client || (!stats && max_drives > 0)) return -1;
+    for (uint32_t i = 0; i < client->drive_count && i < max_drives; i++) {
+        crdp_drive_share_t* share = &client->drives[i];
+        crdp_drive_stats_t* out = &stats[i];
+        memset(out, 0, sizeof(*out));
+        snprintf(out->name, sizeof(out->name), "%s", share->name);
+        out->read_only = share->read_only;
+        out->requests = atomic_load(&share->requests);
+        out->reads = atomic_load(&share->reads);
+        out->writes = atomic_load(&share->writes);
+        out->bytes_read = atomic_load(&share->bytes_read);
+        out->bytes_written = atomic_load(&share->bytes_written);
+        out->denied = atomic_load(&share->denied);
+        out->throttled = atomic_load(&share->throttled);
+        out->throttled_ms = atomic_load(&share->throttled_ms);
+    }
+    return (int)client->drive_count;
+}
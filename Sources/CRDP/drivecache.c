@@ -0,0 +1,407 @@
+#include "crdp_internal.h"
+
+#include <winpr/wlog.h>
+
+#include <CoreServices/CoreServices.h>
+#include <dirent.h>
+#include <dispatch/dispatch.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Metadata cache for a redirected drive.
+//
+// Explorer asks about the same paths over and over: every refresh lists the
+// folder again and opens or queries most of what is in it. Results of stat()
+// (including "no such file") and whole directory listings are kept per host
+// path. An FSEvents stream on the drive drops entries as soon as something
+// changes them on the host, so they can live for a while; if the stream
+// can't be started they expire quickly instead. The drive device drops what
+// its own operations change. A lookup runs without the lock, so one that
+// overlapped a drop may have seen the old state and is not stored.
+
+#define CRDP_DRIVECACHE_BUCKETS 4096
+#define CRDP_DRIVECACHE_MAX_ENTRIES 65536
+#define CRDP_DRIVECACHE_MAX_LISTINGS 64
+#define CRDP_DRIVECACHE_TTL_WATCHED_MS 30000
+#define CRDP_DRIVECACHE_TTL_UNWATCHED_MS 1000
+// How long FSEvents coalesces changes before reporting them
+#define CRDP_DRIVECACHE_EVENT_LATENCY 0.05
+
+typedef struct crdp_drivecache_entry {
+    struct crdp_drivecache_entry* next;
+    uint64_t hash;
+    uint64_t expires;               // 0 = no stat result cached
+    int err;                        // errno of the stat, 0 if st is valid
+    struct stat st;
+    crdp_drive_listing_t* listing;  // Directory contents, if listed
+    uint64_t listing_expires;
+    char path[];
+} crdp_drivecache_entry_t;
+
+struct crdp_drive_cache {
+    pthread_mutex_t lock;
+    crdp_drivecache_entry_t* buckets[CRDP_DRIVECACHE_BUCKETS];
+    uint32_t entries;
+    uint32_t listings;
+    uint64_t ttl_ms;
+    uint64_t generation;            // Bumped by every drop; a lookup that spans one isn't stored
+    char* root;                     // Real path (as FSEvents reports it), like every key
+    FSEventStreamRef stream;
+    dispatch_queue_t queue;
+};
+
+void crdp_drive_listing_release(crdp_drive_listing_t* listing) {
+    if (!listing || atomic_fetch_sub(&listing->refs, 1) != 1) return;
+    free(listing->entries);
+    free(listing->names);
+    free(listing);
+}
+
+static void crdp_drivecache_drop_listing(crdp_drive_cache_t* cache, crdp_drivecache_entry_t* e) {
+    if (!e->listing) return;
+    crdp_drive_listing_release(e->listing);
+    e->listing = NULL;
+    cache->listings--;
+}
+
+static void crdp_drivecache_remove(crdp_drive_cache_t* cache, crdp_drivecache_entry_t** link) {
+    crdp_drivecache_entry_t* e = *link;
+    *link = e->next;
+    crdp_drivecache_drop_listing(cache, e);
+    cache->entries--;
+    free(e);
+}
+
+// Locked
+static crdp_drivecache_entry_t** crdp_drivecache_find(crdp_drive_cache_t* cache, const char* path, uint64_t hash) {
+    crdp_drivecache_entry_t** link = &cache->buckets[hash % CRDP_DRIVECACHE_BUCKETS];
+    while (*link && ((*link)->hash != hash || strcmp((*link)->path, path) != 0)) link = &(*link)->next;
+    return link;
+}
+
+// Removes every entry pred() selects
+static void crdp_drivecache_sweep(crdp_drive_cache_t* cache,
+                                  bool (*pred)(crdp_drivecache_entry_t* e, const void* arg, uint64_t now),
+                                  const void* arg) {
+    uint64_t now = crdp_time_ms();
+    for (int i = 0; i < CRDP_DRIVECACHE_BUCKETS; i++) {
+        crdp_drivecache_entry_t** link = &cache->buckets[i];
+        while (*link) {
+            if (pred(*link, arg, now)) crdp_drivecache_remove(cache, link);
+            else link = &(*link)->next;
+        }
+    }
+}
+
+static bool crdp_drivecache_is_expired(crdp_drivecache_entry_t* e, const void* arg, uint64_t now) {
+    if (e->listing && e->listing_expires <= now) {
+        crdp_drive_listing_release(e->listing);
+        e->listing = NULL;
+        ((crdp_drive_cache_t*)arg)->listings--;
+    }
+    return !e->listing && e->expires <= now;
+}
+
+static bool crdp_drivecache_is_any(crdp_drivecache_entry_t* e, const void* arg, uint64_t now) {
+    return true;
+}
+
+static bool crdp_drivecache_is_plain(crdp_drivecache_entry_t* e, const void* arg, uint64_t now) {
+    return !e->listing;
+}
+
+// Locked. Entry for path, created if missing; NULL if out of memory.
+static crdp_drivecache_entry_t* crdp_drivecache_entry(crdp_drive_cache_t* cache, const char* path) {
+    uint64_t hash = crdp_hash64(path, strlen(path), 0);
+    crdp_drivecache_entry_t** link = crdp_drivecache_find(cache, path, hash);
+    if (*link) return *link;
+
+    if (cache->entries >= CRDP_DRIVECACHE_MAX_ENTRIES) {
+        crdp_drivecache_sweep(cache, crdp_drivecache_is_expired, cache);
+        // Still full of live entries: start over, keeping the listings
+        if (cache->entries >= CRDP_DRIVECACHE_MAX_ENTRIES) crdp_drivecache_sweep(cache, crdp_drivecache_is_plain, NULL);
+        link = crdp_drivecache_find(cache, path, hash);
+    }
+    size_t len = strlen(path);
+    crdp_drivecache_entry_t* e = calloc(1, sizeof(*e) + len + 1);
+    if (!e) return NULL;
+    e->hash = hash;
+    memcpy(e->path, path, len + 1);
+    *link = e;
+    cache->entries++;
+    return e;
+}
+
+static void crdp_drivecache_put_stat(crdp_drive_cache_t* cache, const char* path, int err,
+                                     const struct stat* st, uint64_t now) {
+    crdp_drivecache_entry_t* e = crdp_drivecache_entry(cache, path);
+    if (!e) return;
+    e->err = err;
+    if (!err) e->st = *st;
+    e->expires = now + cache->ttl_ms;
+}
+
+int crdp_drivecache_stat(crdp_drive_cache_t* cache, const char* path, struct stat* st) {
+    uint64_t now = crdp_time_ms();
+    pthread_mutex_lock(&cache->lock);
+    crdp_drivecache_entry_t** link = crdp_drivecache_find(cache, path, crdp_hash64(path, strlen(path), 0));
+    if (*link && (*link)->expires > now) {
+        int err = (*link)->err;
+        if (!err) *st = (*link)->st;
+        pthread_mutex_unlock(&cache->lock);
+        return err;
+    }
+    uint64_t generation = cache->generation;
+    pthread_mutex_unlock(&cache->lock);
+
+    int err = stat(path, st) == 0 ? 0 : errno;
+    // Only results worth repeating: found, or not there
+    if (err == 0 || err == ENOENT || err == ENOTDIR) {
+        pthread_mutex_lock(&cache->lock);
+        if (cache->generation == generation) crdp_drivecache_put_stat(cache, path, err, st, now);
+        pthread_mutex_unlock(&cache->lock);
+    }
+    return err;
+}
+
+static int crdp_drivecache_compare(const void* a, const void* b) {
+    return strcmp(((const crdp_drive_dirent_t*)a)->name, ((const crdp_drive_dirent_t*)b)->name);
+}
+
+static crdp_drive_listing_t* crdp_drivecache_read_dir(const char* dir_path, int* err) {
+    DIR* dir = opendir(dir_path);
+    if (!dir) {
+        *err = errno;
+        return NULL;
+    }
+    crdp_drive_listing_t* listing = calloc(1, sizeof(*listing));
+    if (listing) atomic_init(&listing->refs, 1);
+    uint32_t cap = 0;
+    size_t names_len = 0;
+    size_t names_cap = 0;
+    struct dirent* d;
+    *err = listing ? 0 : ENOMEM;
+    while (!*err && (d = readdir(dir))) {
+        struct stat st;
+        if (fstatat(dirfd(dir), d->d_name, &st, 0) != 0 &&
+            fstatat(dirfd(dir), d->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            continue;
+        }
+        size_t n = strlen(d->d_name) + 1;
+        if (listing->count == cap) {
+            uint32_t grow = cap ? cap * 2 : 64;
+            crdp_drive_dirent_t* entries = realloc(listing->entries, grow * sizeof(*entries));
+            if (!entries) {
+                *err = ENOMEM;
+                break;
+            }
+            listing->entries = entries;
+            cap = grow;
+        }
+        if (names_len + n > names_cap) {
+            size_t grow = names_cap ? names_cap * 2 : 4096;
+            while (grow < names_len + n) grow *= 2;
+            char* names = realloc(listing->names, grow);
+            if (!names) {
+                *err = ENOMEM;
+                break;
+            }
+            listing->names = names;
+            names_cap = grow;
+        }
+        memcpy(listing->names + names_len, d->d_name, n);
+        // Offset for now; names may still move
+        listing->entries[listing->count].name = (char*)(uintptr_t)names_len;
+        listing->entries[listing->count].st = st;
+        listing->count++;
+        names_len += n;
+    }
+    closedir(dir);
+    if (*err) {
+        crdp_drive_listing_release(listing);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < listing->count; i++) {
+        listing->entries[i].name = listing->names + (uintptr_t)listing->entries[i].name;
+    }
+    // Same order on every refresh
+    if (listing->count > 1) qsort(listing->entries, listing->count, sizeof(*listing->entries), crdp_drivecache_compare);
+    return listing;
+}
+
+crdp_drive_listing_t* crdp_drivecache_list(crdp_drive_cache_t* cache, const char* dir_path, int* err) {
+    uint64_t now = crdp_time_ms();
+    pthread_mutex_lock(&cache->lock);
+    crdp_drivecache_entry_t** link = crdp_drivecache_find(cache, dir_path, crdp_hash64(dir_path, strlen(dir_path), 0));
+    if (*link && (*link)->listing && (*link)->listing_expires > now) {
+        crdp_drive_listing_t* listing = (*link)->listing;
+        atomic_fetch_add(&listing->refs, 1);
+        pthread_mutex_unlock(&cache->lock);
+        *err = 0;
+        return listing;
+    }
+    uint64_t generation = cache->generation;
+    pthread_mutex_unlock(&cache->lock);
+
+    crdp_drive_listing_t* listing = crdp_drivecache_read_dir(dir_path, err);
+    if (!listing) return NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache->generation != generation) {
+        // Good enough for this caller, maybe not for the next
+        pthread_mutex_unlock(&cache->lock);
+        return listing;
+    }
+    if (cache->listings >= CRDP_DRIVECACHE_MAX_LISTINGS) crdp_drivecache_sweep(cache, crdp_drivecache_is_expired, cache);
+    if (cache->listings >= CRDP_DRIVECACHE_MAX_LISTINGS) crdp_drivecache_sweep(cache, crdp_drivecache_is_any, NULL);
+    crdp_drivecache_entry_t* e = crdp_drivecache_entry(cache, dir_path);
+    if (e) {
+        crdp_drivecache_drop_listing(cache, e);
+        atomic_fetch_add(&listing->refs, 1);
+        e->listing = listing;
+        e->listing_expires = now + cache->ttl_ms;
+        cache->listings++;
+    }
+    // Opening or querying the entries next is what Explorer does
+    size_t dir_len = strlen(dir_path);
+    char* child = malloc(dir_len + 2 + NAME_MAX);
+    for (uint32_t i = 0; child && i < listing->count && cache->entries < CRDP_DRIVECACHE_MAX_ENTRIES; i++) {
+        const char* name = listing->entries[i].name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strlen(name) > NAME_MAX) continue;
+        memcpy(child, dir_path, dir_len);
+        child[dir_len] = '/';
+        strcpy(child + dir_len + 1, name);
+        crdp_drivecache_put_stat(cache, child, 0, &listing->entries[i].st, now);
+    }
+    free(child);
+    pthread_mutex_unlock(&cache->lock);
+    return listing;
+}
+
+static bool crdp_drivecache_in_subtree(crdp_drivecache_entry_t* e, const void* arg, uint64_t now) {
+    const char* dir = (const char*)arg;
+    size_t len = strlen(dir);
+    return strncmp(e->path, dir, len) == 0 && e->path[len] == '/';
+}
+
+// A direct child of dir (or dir itself)
+static bool crdp_drivecache_in_dir(crdp_drivecache_entry_t* e, const void* arg, uint64_t now) {
+    const char* dir = (const char*)arg;
+    size_t len = strlen(dir);
+    if (strncmp(e->path, dir, len) != 0) return false;
+    if (e->path[len] == '\0') return true;
+    return e->path[len] == '/' && !strchr(e->path + len + 1, '/');
+}
+
+// Locked
+static void crdp_drivecache_forget(crdp_drive_cache_t* cache, const char* path) {
+    crdp_drivecache_entry_t** link = crdp_drivecache_find(cache, path, crdp_hash64(path, strlen(path), 0));
+    if (*link) crdp_drivecache_remove(cache, link);
+}
+
+void crdp_drivecache_invalidate(crdp_drive_cache_t* cache, const char* path, bool subtree) {
+    if (!cache || !path) return;
+    pthread_mutex_lock(&cache->lock);
+    cache->generation++;
+    crdp_drivecache_forget(cache, path);
+    if (subtree) crdp_drivecache_sweep(cache, crdp_drivecache_in_subtree, path);
+    // The parent's listing and times changed with it
+    const char* slash = strrchr(path, '/');
+    if (slash && slash != path) {
+        size_t len = (size_t)(slash - path);
+        char* parent = malloc(len + 1);
+        if (parent) {
+            memcpy(parent, path, len);
+            parent[len] = '\0';
+            crdp_drivecache_forget(cache, parent);
+            free(parent);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// FSEvents queue. Events name directories whose contents changed.
+static void crdp_drivecache_events(ConstFSEventStreamRef stream, void* info, size_t count, void* paths,
+                                   const FSEventStreamEventFlags flags[], const FSEventStreamEventId ids[]) {
+    crdp_drive_cache_t* cache = (crdp_drive_cache_t*)info;
+    char** event_paths = (char**)paths;
+    size_t root_len = strlen(cache->root);
+
+    pthread_mutex_lock(&cache->lock);
+    cache->generation++;
+    for (size_t i = 0; i < count; i++) {
+        if (flags[i] & (kFSEventStreamEventFlagMustScanSubDirs | kFSEventStreamEventFlagRootChanged |
+                        kFSEventStreamEventFlagUserDropped | kFSEventStreamEventFlagKernelDropped)) {
+            crdp_drivecache_sweep(cache, crdp_drivecache_is_any, NULL);
+            break;
+        }
+        const char* p = event_paths[i];
+        if (strncmp(p, cache->root, root_len) != 0) continue;
+        size_t len = strlen(p);
+        while (len > root_len && p[len - 1] == '/') len--;
+        char* dir = strndup(p, len);
+        if (!dir) continue;
+        crdp_drivecache_sweep(cache, crdp_drivecache_in_dir, dir);
+        free(dir);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static void crdp_drivecache_watch(crdp_drive_cache_t* cache) {
+    CFStringRef root = CFStringCreateWithCString(NULL, cache->root, kCFStringEncodingUTF8);
+    CFArrayRef paths = root ? CFArrayCreate(NULL, (const void**)&root, 1, &kCFTypeArrayCallBacks) : NULL;
+    FSEventStreamContext context = { 0, cache, NULL, NULL, NULL };
+    if (paths) {
+        cache->stream = FSEventStreamCreate(NULL, crdp_drivecache_events, &context, paths, kFSEventStreamEventIdSinceNow,
+                                            CRDP_DRIVECACHE_EVENT_LATENCY, kFSEventStreamCreateFlagNoDefer);
+    }
+    if (paths) CFRelease(paths);
+    if (root) CFRelease(root);
+    if (!cache->stream) return;
+
+    cache->queue = dispatch_queue_create("crdp.drivecache", DISPATCH_QUEUE_SERIAL);
+    FSEventStreamSetDispatchQueue(cache->stream, cache->queue);
+    if (!FSEventStreamStart(cache->stream)) {
+        FSEventStreamInvalidate(cache->stream);
+        FSEventStreamRelease(cache->stream);
+        cache->stream = NULL;
+        dispatch_release(cache->queue);
+        cache->queue = NULL;
+    }
+}
+
+crdp_drive_cache_t* crdp_drivecache_new(const char* root) {
+    crdp_drive_cache_t* cache = calloc(1, sizeof(*cache));
+    if (!cache) return NULL;
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->root = strdup(root);
+    if (!cache->root) {
+        crdp_drivecache_free(cache);
+        return NULL;
+    }
+    crdp_drivecache_watch(cache);
+    cache->ttl_ms = cache->stream ? CRDP_DRIVECACHE_TTL_WATCHED_MS : CRDP_DRIVECACHE_TTL_UNWATCHED_MS;
+    if (!cache->stream) WLog_WARN(CRDP_TAG, "No change notifications for %s, metadata cached briefly", root);
+    return cache;
+}
+
+void crdp_drivecache_free(crdp_drive_cache_t* cache) {
+    if (!cache) return;
+    if (cache->stream) {
+        FSEventStreamStop(cache->stream);
+        FSEventStreamInvalidate(cache->stream);
+        FSEventStreamRelease(cache->stream);
+        // Wait out a callback in progress
+        dispatch_sync(cache->queue, ^{});
+        dispatch_release(cache->queue);
+    }
+    pthread_mutex_lock(&cache->lock);
+    crdp_drivecache_sweep(cache, crdp_drivecache_is_any, NULL);
+    pthread_mutex_unlock(&cache->lock);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->root);
+    free(cache);
+}
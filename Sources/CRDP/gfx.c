@@ -0,0 +1,225 @@
+#include "crdp_internal.h"
+
+#include <freerdp/client/rdpgfx.h>
+#include <freerdp/gdi/gfx.h>
+#include <winpr/wlog.h>
+
+#include <string.h>
+
+// RDPGFX frame acknowledgement.
+//
+// FreeRDP acknowledges every frame as soon as it is decoded and reports the
+// queue depth as unavailable, so the server never learns that the host is
+// falling behind. CRDP turns those automatic acks off and sends its own:
+// a frame is only acknowledged once its pixels were handed to frame_cb (not
+// while background damage is being coalesced) and while the host holds fewer
+// than max_frames_in_flight frames. Withheld acks close the server's window of
+// unacknowledged frames, which makes it lower its encode rate.
+
+static crdp_context* crdp_gfx_context(RdpgfxClientContext* gfx) {
+    // gdi_graphics_pipeline_init owns gfx->custom (it points at the rdpGdi)
+    rdpGdi* gdi = gfx ? (rdpGdi*)gfx->custom : NULL;
+    return gdi ? (crdp_context*)gdi->context : NULL;
+}
+
+static void crdp_gfx_send_ack(crdp_client_t* client, uint32_t frame_id, uint32_t queue_depth) {
+    crdp_gfx_t* g = &client->gfx;
+    RDPGFX_FRAME_ACKNOWLEDGE_PDU ack = { 0 };
+    ack.frameId = frame_id;
+    ack.totalFramesDecoded = g->total_decoded;
+    ack.queueDepth = queue_depth;
+
+    UINT rc = g->context->FrameAcknowledge(g->context, &ack);
+    if (rc != CHANNEL_RC_OK) {
+        WLog_WARN(CRDP_TAG, "GFX frame acknowledge failed: %u", rc);
+    }
+}
+
+// Frames the host has been given but not released, plus coalesced damage
+// that has not been delivered yet
+static uint32_t crdp_gfx_queue_depth(crdp_client_t* client) {
+    int held = atomic_load(&client->frames_in_flight);
+    return (uint32_t)(held > 0 ? held : 0) + (client->pending.valid ? 1 : 0);
+}
+
+// Acknowledge every decoded frame the host has caught up with. Called from the
+// GFX channel thread after each frame and from the protocol thread when the
+// host releases frames or coalesced damage gets delivered; paint_lock held.
+static void crdp_gfx_ack_frames_locked(crdp_client_t* client) {
+    crdp_gfx_t* g = &client->gfx;
+    if (!g->context || !g->context->FrameAcknowledge || g->unacked_count == 0) return;
+
+    if (atomic_load(&g->suspended)) {
+        if (!g->suspend_sent) {
+            // Tells the server to stop waiting for acks altogether
+            crdp_gfx_send_ack(client, g->unacked[g->unacked_head], SUSPEND_FRAME_ACKNOWLEDGEMENT);
+            g->suspend_sent = true;
+        }
+        g->unacked_head = (g->unacked_head + g->unacked_count) % CRDP_GFX_MAX_UNACKED;
+        g->unacked_count = 0;
+        return;
+    }
+
+    // Damage still being coalesced: those frames have not been shown yet
+    if (client->pending.valid) return;
+
+    uint32_t limit = client->config.max_frames_in_flight;
+    int held = atomic_load(&client->frames_in_flight);
+    if (limit > 0 && held >= (int)limit) {
+        if (!g->saturated) {
+            WLog_DBG(CRDP_TAG, "Frame consumer saturated (%d held), withholding GFX acks", held);
+            g->saturated = true;
+        }
+        return;
+    }
+    g->saturated = false;
+    g->suspend_sent = false;
+
+    uint32_t depth = crdp_gfx_queue_depth(client);
+    while (g->unacked_count > 0) {
+        crdp_gfx_send_ack(client, g->unacked[g->unacked_head], depth);
+        g->unacked_head = (g->unacked_head + 1) % CRDP_GFX_MAX_UNACKED;
+        g->unacked_count--;
+    }
+}
+
+void crdp_gfx_ack_frames(crdp_client_t* client) {
+    pthread_mutex_lock(&client->paint_lock);
+    crdp_gfx_ack_frames_locked(client);
+    pthread_mutex_unlock(&client->paint_lock);
+}
+
+static UINT crdp_gfx_on_open(RdpgfxClientContext* gfx, BOOL* do_caps_advertise, BOOL* do_frame_acks) {
+    crdp_context* ctx = crdp_gfx_context(gfx);
+    UINT rc = CHANNEL_RC_OK;
+    if (ctx && ctx->client && ctx->client->gfx.prev_on_open) {
+        rc = ctx->client->gfx.prev_on_open(gfx, do_caps_advertise, do_frame_acks);
+    }
+    // CRDP acknowledges frames itself once they are delivered
+    if (do_frame_acks) *do_frame_acks = FALSE;
+    return rc;
+}
+
+static UINT crdp_gfx_end_frame(RdpgfxClientContext* gfx, const RDPGFX_END_FRAME_PDU* pdu) {
+    crdp_context* ctx = crdp_gfx_context(gfx);
+    if (!ctx || !ctx->client) return ERROR_INTERNAL_ERROR;
+    crdp_client_t* client = ctx->client;
+    crdp_gfx_t* g = &client->gfx;
+
+    // gdi_EndFrame flushes surfaces to the primary buffer (BeginPaint/EndPaint)
+    UINT rc = CHANNEL_RC_OK;
+    if (g->prev_end_frame) rc = g->prev_end_frame(gfx, pdu);
+    if (rc != CHANNEL_RC_OK) return rc;
+
+    pthread_mutex_lock(&client->paint_lock);
+    g->total_decoded++;
+    if (g->unacked_count == CRDP_GFX_MAX_UNACKED) {
+        // The server never lets this many frames go unacknowledged; drop the oldest
+        g->unacked_head = (g->unacked_head + 1) % CRDP_GFX_MAX_UNACKED;
+        g->unacked_count--;
+    }
+    g->unacked[(g->unacked_head + g->unacked_count) % CRDP_GFX_MAX_UNACKED] = pdu->frameId;
+    g->unacked_count++;
+
+    crdp_gfx_ack_frames_locked(client);
+    pthread_mutex_unlock(&client->paint_lock);
+    return CHANNEL_RC_OK;
+}
+
+static const char* crdp_gfx_codec_span(UINT32 codec_id) {
+    switch (codec_id) {
+        case RDPGFX_CODECID_UNCOMPRESSED: return "decode uncompressed";
+        case RDPGFX_CODECID_CAVIDEO: return "decode RemoteFX";
+        case RDPGFX_CODECID_CLEARCODEC: return "decode ClearCodec";
+        case RDPGFX_CODECID_CAPROGRESSIVE: return "decode progressive";
+        case RDPGFX_CODECID_PLANAR: return "decode planar";
+        case RDPGFX_CODECID_AVC420: return "decode AVC420";
+        case RDPGFX_CODECID_ALPHA: return "decode alpha";
+        case RDPGFX_CODECID_AVC444: return "decode AVC444";
+        case RDPGFX_CODECID_AVC444v2: return "decode AVC444v2";
+        default: return "decode other";
+    }
+}
+
+// Only there to time the codecs, per surface
+static UINT crdp_gfx_surface_command(RdpgfxClientContext* gfx, const RDPGFX_SURFACE_COMMAND* cmd) {
+    crdp_context* ctx = crdp_gfx_context(gfx);
+    if (!ctx || !ctx->client || !ctx->client->gfx.prev_surface_command) return ERROR_INTERNAL_ERROR;
+    uint64_t start = crdp_time_us();
+    uint64_t span = crdp_span_begin();
+    UINT rc = ctx->client->gfx.prev_surface_command(gfx, cmd);
+    crdp_span_end(span, crdp_gfx_codec_span(cmd->codecId), "surface", cmd->surfaceId);
+    crdp_metrics_record(ctx->client, CRDP_HIST_DECODE_US, crdp_time_us() - start);
+    return rc;
+}
+
+void crdp_gfx_init(crdp_context* ctx, RdpgfxClientContext* gfx) {
+    crdp_client_t* client = ctx->client;
+    crdp_gfx_t* g = &client->gfx;
+
+    if (!gdi_graphics_pipeline_init(ctx->_p.gdi, gfx)) {
+        WLog_ERR(CRDP_TAG, "Failed to initialize GFX graphics pipeline");
+        return;
+    }
+
+    g->context = gfx;
+    g->total_decoded = 0;
+    g->unacked_head = 0;
+    g->unacked_count = 0;
+    g->saturated = false;
+    g->suspend_sent = false;
+
+    if (gfx->SurfaceCommand) {
+        g->prev_surface_command = gfx->SurfaceCommand;
+        gfx->SurfaceCommand = crdp_gfx_surface_command;
+    }
+    if (gfx->FrameAcknowledge) {
+        g->prev_on_open = gfx->OnOpen;
+        g->prev_end_frame = gfx->EndFrame;
+        gfx->OnOpen = crdp_gfx_on_open;
+        gfx->EndFrame = crdp_gfx_end_frame;
+    } else {
+        WLog_WARN(CRDP_TAG, "GFX channel cannot send frame acks, leaving them to FreeRDP");
+    }
+
+    WLog_INFO(CRDP_TAG, "GFX Graphics Pipeline channel active (frame acks: %s)",
+              atomic_load(&g->suspended) ? "suspended" :
+              client->config.max_frames_in_flight ? "flow controlled" : "on delivery");
+}
+
+void crdp_gfx_uninit(crdp_context* ctx, RdpgfxClientContext* gfx) {
+    crdp_gfx_t* g = &ctx->client->gfx;
+    if (g->context != gfx) return;
+
+    if (gfx->EndFrame == crdp_gfx_end_frame) {
+        gfx->OnOpen = g->prev_on_open;
+        gfx->EndFrame = g->prev_end_frame;
+    }
+    if (gfx->SurfaceCommand == crdp_gfx_surface_command) gfx->SurfaceCommand = g->prev_surface_command;
+    gdi_graphics_pipeline_uninit(ctx->_p.gdi, gfx);
+
+    pthread_mutex_lock(&ctx->client->paint_lock);
+    g->context = NULL;
+    g->prev_on_open = NULL;
+    g->prev_end_frame = NULL;
+    g->prev_surface_command = NULL;
+    g->unacked_count = 0;
+    pthread_mutex_unlock(&ctx->client->paint_lock);
+}
+
+void crdp_gfx_set_ack_suspended(crdp_client_t* client, bool suspended) {
+    atomic_store(&client->gfx.suspended, suspended);
+    if (client->wake_event) SetEvent(client->wake_event);
+}
+
+void crdp_frame_release(crdp_client_t* client) {
+    if (!client) return;
+    int held = atomic_fetch_sub(&client->frames_in_flight, 1);
+    if (held <= 0) {
+        // Unbalanced release; keep the count from going negative
+        atomic_fetch_add(&client->frames_in_flight, 1);
+        return;
+    }
+    // Let the protocol thread send any acks that were held back
+    if (client->config.max_frames_in_flight > 0 && client->wake_event) SetEvent(client->wake_event);
+}
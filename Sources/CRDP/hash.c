@@ -0,0 +1,95 @@
+#include "crdp_internal.h"
+
+#include <string.h>
+
+// 64-bit content hash (the XXH64 algorithm). Used to recognise content CRDP
+// has already seen without keeping a copy of it; not cryptographic.
+
+#define CRDP_PRIME64_1 0x9E3779B185EBCA87ULL
+#define CRDP_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define CRDP_PRIME64_3 0x165667B19E3779F9ULL
+#define CRDP_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define CRDP_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t crdp_rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static inline uint64_t crdp_read64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline uint32_t crdp_read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+static inline uint64_t crdp_hash_round(uint64_t acc, uint64_t input) {
+    acc += input * CRDP_PRIME64_2;
+    acc = crdp_rotl64(acc, 31);
+    return acc * CRDP_PRIME64_1;
+}
+
+static inline uint64_t crdp_hash_merge(uint64_t acc, uint64_t val) {
+    acc ^= crdp_hash_round(0, val);
+    return acc * CRDP_PRIME64_1 + CRDP_PRIME64_4;
+}
+
+uint64_t crdp_hash64(const void* data, size_t len, uint64_t seed) {
+    const uint8_t* p = (const uint8_t*)data;
+    const uint8_t* end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        // Four independent lanes keep the multipliers busy
+        uint64_t v1 = seed + CRDP_PRIME64_1 + CRDP_PRIME64_2;
+        uint64_t v2 = seed + CRDP_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - CRDP_PRIME64_1;
+        const uint8_t* limit = end - 32;
+        do {
+            v1 = crdp_hash_round(v1, crdp_read64(p));
+            v2 = crdp_hash_round(v2, crdp_read64(p + 8));
+            v3 = crdp_hash_round(v3, crdp_read64(p + 16));
+            v4 = crdp_hash_round(v4, crdp_read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h = crdp_rotl64(v1, 1) + crdp_rotl64(v2, 7) + crdp_rotl64(v3, 12) + crdp_rotl64(v4, 18);
+        h = crdp_hash_merge(h, v1);
+        h = crdp_hash_merge(h, v2);
+        h = crdp_hash_merge(h, v3);
+        h = crdp_hash_merge(h, v4);
+    } else {
+        h = seed + CRDP_PRIME64_5;
+    }
+    h += (uint64_t)len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= crdp_hash_round(0, crdp_read64(p));
+        h = crdp_rotl64(h, 27) * CRDP_PRIME64_1 + CRDP_PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)crdp_read32(p) * CRDP_PRIME64_1;
+        h = crdp_rotl64(h, 23) * CRDP_PRIME64_2 + CRDP_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= (*p) * CRDP_PRIME64_5;
+        h = crdp_rotl64(h, 11) * CRDP_PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= CRDP_PRIME64_2;
+    h ^= h >> 29;
+    h *= CRDP_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
@@ -29,6 +29,51 @@ typedef struct {
 
 typedef int (*crdp_verify_cert_cb)(const crdp_cert_info_t* cert, void* user);
 
+// Bulk compression of server-to-client traffic. The level is the most capable
+// compressor CRDP advertises; the server may pick a lower one.
+typedef enum {
+    CRDP_COMPRESSION_DEFAULT = 0,  // FreeRDP's default (currently RDP 6.1)
+    CRDP_COMPRESSION_NONE = 1,
+    CRDP_COMPRESSION_MPPC_8K = 2,  // RDP 4.0
+    CRDP_COMPRESSION_MPPC_64K = 3, // RDP 5.0
+    CRDP_COMPRESSION_NCRUSH = 4,   // RDP 6.0
+    CRDP_COMPRESSION_XCRUSH = 5    // RDP 6.1
+} crdp_compression_t;
+
+// Drive redirection
+// A local folder shown on Windows as \\tsclient\<name>. The limits apply to
+// what the server asks of this drive alone, so a bulk copy on one drive
+// leaves room on the link for graphics and input.
+#define CRDP_MAX_DRIVES 8
+
+typedef struct {
+    const char* path;               // Local folder path
+    const char* name;               // Name shown on Windows ("Mac" if NULL)
+    bool read_only;                 // Server may not create, change or delete anything
+    uint64_t max_bytes_per_second;  // Data read plus written (0 = no limit)
+    uint32_t max_ops_per_second;    // File system requests of any kind (0 = no limit)
+} crdp_drive_config_t;
+
+// Audio output
+// Where sound played on the server goes. The null sink consumes audio in
+// real time and discards it, for testing without an output device.
+typedef enum {
+    CRDP_AUDIO_OFF = 0,      // Not redirected
+    CRDP_AUDIO_DEVICE = 1,   // Default output device
+    CRDP_AUDIO_WAV = 2,      // Written to audio_wav_path
+    CRDP_AUDIO_NULL = 3
+} crdp_audio_output_t;
+
+// Microphone
+// Where audio sent to the server comes from. The file source plays a
+// 16-bit PCM WAV file in a loop in real time, for testing without a
+// microphone.
+typedef enum {
+    CRDP_MIC_OFF = 0,        // Not redirected
+    CRDP_MIC_DEVICE = 1,     // Default input device
+    CRDP_MIC_FILE = 2        // mic_file_path
+} crdp_mic_input_t;
+
 typedef struct {
     const char* host;
     uint16_t port;
@@ -43,8 +88,79 @@ typedef struct {
     // If set, folder appears as \\tsclient\<drive_name> on Windows
     const char* drive_path;  // Local folder path (e.g., "/Users/user/Downloads")
     const char* drive_name;  // Name shown on Windows (e.g., "Mac")
+    // Further drives with their own options, up to CRDP_MAX_DRIVES in all
+    // (drive_path counts as one). Copied by crdp_client_connect.
+    const crdp_drive_config_t* drives;
+    uint32_t drive_count;
     // Connection timeout in seconds (0 = no timeout)
     uint32_t timeout_seconds;
+    // GFX flow control: how many delivered frames the host may hold before
+    // CRDP stops acknowledging frames, which makes the server slow down.
+    // Frames are returned with crdp_frame_release(). 0 = a frame counts as
+    // consumed once frame_cb returns.
+    uint32_t max_frames_in_flight;
+    // Tell the server not to wait for frame acknowledgements at all
+    // (lowest latency on fast links, but no flow control)
+    bool suspend_frame_acks;
+    // Adapt frame rate, codec and color depth to measured link quality
+    // (see crdp_set_quality_callback)
+    bool adaptive_quality;
+    // Bulk compression level, and whether to collect per-channel compression
+    // statistics (see crdp_get_compression_stats)
+    crdp_compression_t compression;
+    bool compression_stats;
+    // Largest clipboard payload accepted in either direction, in bytes (0 =
+    // no limit). A bigger host copy is not sent. A bigger server copy fails
+    // the paste as soon as its size arrives, but the server still sends it
+    // and the channel receives it in full before it is dropped.
+    uint32_t clipboard_max_bytes;
+    // Audio output. Playback is held back by a jitter buffer that grows
+    // after underruns and shrinks again while playback is steady, within
+    // these bounds in ms (0 = 20 and 300).
+    crdp_audio_output_t audio_output;
+    const char* audio_wav_path;
+    uint32_t audio_min_latency_ms;
+    uint32_t audio_max_latency_ms;
+    // Microphone redirection (audin)
+    crdp_mic_input_t mic_input;
+    const char* mic_file_path;
+    // Session socket. 0 picks a default for the link type, classified from
+    // the round trip of the TCP handshake (see crdp_get_transport_stats).
+    // Nagle's algorithm is off unless tcp_nagle is set, so input isn't held
+    // back on high-RTT links. A peer that stops answering is dropped after
+    // tcp_ack_timeout_ms with data outstanding, or after keepalive_count
+    // unanswered keepalives when the connection is idle. Buffer sizes of 0
+    // leave the kernel's automatic sizing on.
+    bool tcp_nagle;
+    uint32_t tcp_keepalive_interval_s;
+    uint32_t tcp_keepalive_count;
+    uint32_t tcp_ack_timeout_ms;
+    uint32_t tcp_send_buffer;
+    uint32_t tcp_receive_buffer;
+    // Advertise RDP-UDP multitransport and probe UDP when the server offers
+    // it (see crdp_get_transport_stats)
+    bool udp_transport;
+    // Protocol traces. With trace_path set, every PDU the server sends is
+    // written, decrypted and with its arrival time, to an LZ4-compressed
+    // trace file. With replay_path set, crdp_client_connect plays such a
+    // trace back instead of connecting: its PDUs go through the same
+    // decoding and frame delivery as a live session, at the recorded pace
+    // unless replay_fast is set, and the session ends with the trace. The
+    // desktop size and channels come from the trace; redirected drives and
+    // the microphone aren't used. Sessions on standard RDP security (no
+    // TLS) can be recorded but not replayed. A trace holds everything the
+    // server showed, typed passwords echoed on screen included.
+    // crdp_client_connect returns -5 if the file can't be created or read.
+    const char* trace_path;
+    const char* replay_path;
+    bool replay_fast;
+    // Session recording for audit. CRDP appends what the screen showed and
+    // the pointer and keyboard input sent through it to record_path (see
+    // crdp_recording_open). The screen is sampled ten times a second; only
+    // changed 64x64 tiles are stored, and tiles seen before are stored once.
+    // Keystrokes are recorded as scancodes, typed passwords included.
+    // crdp_client_connect returns -5 if the file can't be opened.
+    const char* record_path;
 } crdp_config_t;
 
 crdp_client_t* crdp_client_new(crdp_frame_cb frame_cb, void* frame_user, 
@@ -58,6 +174,372 @@ void crdp_client_free(crdp_client_t* client);
 int crdp_send_pointer_event(crdp_client_t* client, uint16_t flags, uint16_t x, uint16_t y);
 int crdp_send_keyboard_event(crdp_client_t* client, uint16_t flags, uint16_t scancode);
 
+// Frame flow control
+// Return a frame delivered through crdp_frame_cb once the host has presented it.
+// Only meaningful when crdp_config_t.max_frames_in_flight is non-zero.
+void crdp_frame_release(crdp_client_t* client);
+
+// Session priority
+// Lets a host with many open sessions spend frame delivery on the one the user
+// is looking at. Can be changed at any time, including before connecting.
+typedef enum {
+    CRDP_PRIORITY_FOREGROUND = 0, // Every paint is delivered at full size
+    CRDP_PRIORITY_BACKGROUND = 1, // Damage is coalesced and delivered a few times per second
+    CRDP_PRIORITY_THUMBNAIL = 2   // A small downscaled frame every few seconds
+} crdp_session_priority_t;
+
+int crdp_set_session_priority(crdp_client_t* client, crdp_session_priority_t priority);
+crdp_session_priority_t crdp_get_session_priority(crdp_client_t* client);
+
+// Live thumbnails
+// Delivers a small box-filtered copy of the session (e.g. for a connection
+// list) on a background thread, at most every interval_ms and only when
+// something changed. Only damaged tiles are re-filtered between refreshes.
+// width/interval_ms of 0 pick the defaults (256 px, 2 s); cb NULL stops it.
+// The buffer is only valid for the duration of the callback.
+typedef void (*crdp_thumbnail_cb)(const uint8_t* data, uint32_t width, uint32_t height, uint32_t stride, void* user);
+
+int crdp_set_thumbnail_callback(crdp_client_t* client, uint32_t width, uint32_t interval_ms,
+                                crdp_thumbnail_cb cb, void* user);
+
+// Screenshots
+// crdp_capture_png copies the framebuffer, which is all the session waits
+// for, and encodes the copy as PNG on a background thread. With path set the
+// PNG is written there, through a temporary file so a reader never sees half
+// of one. cb, if set, is then called on that thread with the PNG, or with
+// NULL if encoding or writing failed; the data is only valid during the call.
+// Captures still queued when the client is freed are finished first.
+typedef enum {
+    CRDP_PNG_FILTER_ADAPTIVE = 0, // Per row, whichever filter suits it best
+    CRDP_PNG_FILTER_NONE = 1,     // Fastest; fine for flat desktops
+    CRDP_PNG_FILTER_SUB = 2,
+    CRDP_PNG_FILTER_UP = 3,
+    CRDP_PNG_FILTER_AVERAGE = 4,
+    CRDP_PNG_FILTER_PAETH = 5
+} crdp_png_filter_t;
+
+typedef struct {
+    int level;                    // zlib level 1-9; 0 = 1, the fastest
+    crdp_png_filter_t filter;
+} crdp_capture_options_t;
+
+typedef void (*crdp_capture_cb)(const uint8_t* png, size_t len, uint32_t width, uint32_t height, void* user);
+
+// options NULL = the defaults. Returns 0 once queued, -1 on bad arguments, -2
+// if there is no framebuffer to copy (or no memory for the copy), -3 if too
+// many captures are still waiting.
+int crdp_capture_png(crdp_client_t* client, const char* path, const crdp_capture_options_t* options,
+                     crdp_capture_cb cb, void* user);
+
+// Adaptive quality
+// With crdp_config_t.adaptive_quality set, CRDP classifies the link from RTT,
+// bandwidth and frame queue depth and reports every tier change. The frame-rate
+// cap applies immediately. Codec and color depth are negotiated at connect, so
+// they apply from the next crdp_client_connect on the same client, which also
+// starts from the tier the session was in (requires_reconnect tells whether
+// they changed). A new client starts from CRDP_LINK_LAN unless seeded with
+// crdp_set_link_tier.
+typedef enum {
+    CRDP_LINK_LAN = 0,
+    CRDP_LINK_BROADBAND = 1,
+    CRDP_LINK_WAN = 2,
+    CRDP_LINK_CONSTRAINED = 3
+} crdp_link_tier_t;
+
+typedef struct {
+    crdp_link_tier_t previous_tier;
+    crdp_link_tier_t tier;
+    // Measurements behind the decision
+    uint32_t rtt_ms;
+    uint32_t bandwidth_kbps;     // Server bandwidth measurement, 0 if unknown
+    uint32_t receive_kbps;       // Observed receive rate over the last sample
+    uint32_t queue_depth;        // Frames held by the host
+    // Resulting policy
+    uint32_t frame_interval_ms;  // Foreground frame-rate cap (0 = uncapped)
+    uint32_t color_depth;
+    bool prefer_h264;
+    bool progressive;
+    bool requires_reconnect;
+    const char* reason;
+} crdp_quality_event_t;
+
+typedef void (*crdp_quality_cb)(const crdp_quality_event_t* event, void* user);
+
+// Called on the protocol thread
+void crdp_set_quality_callback(crdp_client_t* client, crdp_quality_cb cb, void* user);
+
+// Tier the next crdp_client_connect starts from, e.g. the last one reported
+// for the same host by an earlier client. Returns 0, -1 on bad arguments, -2
+// while connected.
+int crdp_set_link_tier(crdp_client_t* client, crdp_link_tier_t tier);
+
+// Clipboard transfers
+// Progress of clipboard data going to the server (a remote paste of host
+// content) or coming from it (a host paste of remote content). Text, HTML,
+// RTF and images are supported. Reported from CRDP's threads every few
+// hundred KB and once more when the transfer ends. Toward the server,
+// progress covers reading the host clipboard; the data then goes out in one
+// message, reported when it has been handed to the channel.
+typedef enum {
+    CRDP_CLIPBOARD_TO_SERVER = 0,
+    CRDP_CLIPBOARD_FROM_SERVER = 1
+} crdp_clipboard_direction_t;
+
+typedef struct {
+    crdp_clipboard_direction_t direction;
+    uint64_t transferred;        // Bytes so far
+    uint64_t total;              // Expected bytes, 0 if not known yet
+    bool done;
+    bool failed;                 // Cancelled, over clipboard_max_bytes or timed out
+    // File transfers only
+    uint32_t files_done;
+    uint32_t files_total;
+    uint64_t bytes_per_second;   // Average since the transfer started
+} crdp_clipboard_progress_t;
+
+typedef void (*crdp_clipboard_progress_cb)(const crdp_clipboard_progress_t* progress, void* user);
+
+void crdp_set_clipboard_progress_callback(crdp_client_t* client, crdp_clipboard_progress_cb cb, void* user);
+// Abort the clipboard transfers in progress; the paste or server request fails.
+// Toward the server only the host clipboard read can be stopped, not the
+// message already being sent.
+void crdp_clipboard_cancel(crdp_client_t* client);
+
+// Clipboard files
+// Files copied on the host (file URLs on the pasteboard) are offered to the
+// server and read from disk as it asks for them. Files copied on the server
+// are not put on the host clipboard; the host saves them into a directory of
+// its choosing. File transfers are not limited by clipboard_max_bytes.
+bool crdp_clipboard_server_has_files(crdp_client_t* client);
+// Download the files on the server clipboard into dir, recreating their
+// folder structure; existing files with the same names are replaced. Blocks
+// until done, reporting progress (CRDP_CLIPBOARD_FROM_SERVER) along the way;
+// crdp_clipboard_cancel aborts it. Returns 0 on success, -1 on bad arguments
+// or if there are no files, -2 if cancelled, -3 on a local I/O error, -4 if
+// the server failed or stopped answering.
+int crdp_clipboard_save_files(crdp_client_t* client, const char* dir);
+
+// Compression statistics
+// With crdp_config_t.compression_stats set, CRDP inspects every received PDU
+// and runs the compressed ones through a second decompressor so the ratio and
+// CPU cost can be measured. That roughly doubles decompression work, so only
+// turn it on while evaluating compression levels.
+#define CRDP_MAX_CHANNEL_STATS 16
+
+typedef struct {
+    char name[16];                // Virtual channel name, "io" for the I/O channel
+    uint16_t channel_id;
+    uint64_t pdus;
+    uint64_t wire_bytes;          // Bytes as received, headers included
+    uint64_t compressed_pdus;
+    uint64_t compressed_bytes;    // Payload bytes of the compressed PDUs
+    uint64_t decompressed_bytes;  // The same payloads after decompression
+    uint64_t decompress_ns;       // Thread CPU time spent decompressing them
+    uint64_t errors;              // Payloads the decompressor rejected
+} crdp_channel_compression_stats_t;
+
+typedef struct {
+    crdp_compression_t requested;
+    crdp_compression_t active;    // Level of the last compressed PDU (DEFAULT if none yet)
+    uint64_t unparsed_bytes;      // Received bytes that could not be attributed to a channel
+    uint32_t channel_count;
+    crdp_channel_compression_stats_t channels[CRDP_MAX_CHANNEL_STATS];
+} crdp_compression_stats_t;
+
+// Snapshot of the counters for the current connection.
+// Returns 0 on success, -1 on bad arguments, -2 if statistics are off.
+int crdp_get_compression_stats(crdp_client_t* client, crdp_compression_stats_t* stats);
+
+// Drive statistics
+// Counters for each redirected drive of the current connection, in the
+// order they were configured (drive_path first)
+typedef struct {
+    char name[32];
+    bool read_only;
+    uint64_t requests;            // File system requests served
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t denied;              // Changes refused on a read-only drive
+    uint64_t throttled;           // Requests held back by a limit
+    uint64_t throttled_ms;        // Total time they were held
+} crdp_drive_stats_t;
+
+// Fills up to max_drives entries and returns how many drives there are,
+// or -1 on bad arguments
+int crdp_get_drive_stats(crdp_client_t* client, crdp_drive_stats_t* stats, uint32_t max_drives);
+
+// Audio statistics
+typedef struct {
+    bool playing;
+    uint32_t sample_rate;
+    uint16_t channels;
+    uint32_t target_ms;           // Current jitter buffer depth
+    uint32_t buffered_ms;         // Audio waiting to be played
+    uint32_t jitter_ms;           // Arrival jitter estimate
+    uint64_t frames_played;
+    uint64_t underruns;           // Times playback ran dry mid-stream
+    uint64_t concealed_frames;    // Silence played in their place
+    uint64_t dropped_frames;      // Skipped to bring latency back down, or lost to a full buffer
+} crdp_audio_stats_t;
+
+// Returns 0 on success, -1 on bad arguments, -2 if audio is off
+int crdp_get_audio_stats(crdp_client_t* client, crdp_audio_stats_t* stats);
+
+// Microphone statistics
+typedef struct {
+    bool capturing;
+    uint16_t format_tag;          // Format sent to the server (1 = PCM)
+    uint32_t sample_rate;
+    uint16_t channels;
+    uint32_t latency_ms;          // Capture to send, last packet
+    uint32_t max_latency_ms;
+    uint64_t packets_sent;
+    uint64_t bytes_sent;
+    uint64_t dropped_frames;      // Captured audio lost to a full pipeline or a failed send
+} crdp_mic_stats_t;
+
+// Returns 0 on success, -1 on bad arguments, -2 if the microphone is off
+int crdp_get_mic_stats(crdp_client_t* client, crdp_mic_stats_t* stats);
+
+// Transport statistics
+// Everything is carried over TCP. With crdp_config_t.udp_transport set, CRDP
+// also advertises RDP-UDP, reliable and lossy, and when the server offers
+// either one it runs the RDP-UDP handshake against the server's UDP port to
+// find out whether UDP gets through and at what round trip. FreeRDP's client
+// has no RDP-UDP transport to carry the session, so the offer is declined
+// and the server keeps the session on TCP, whether or not UDP answered.
+typedef enum {
+    CRDP_UDP_NOT_OFFERED = 0,
+    CRDP_UDP_PROBING = 1,
+    CRDP_UDP_BLOCKED = 2,         // No answer, or the port is closed
+    CRDP_UDP_REACHABLE = 3        // The server answered the handshake
+} crdp_udp_state_t;
+
+typedef struct {
+    crdp_udp_state_t state;
+    uint32_t syns_sent;           // Handshake attempts, retransmissions included
+    uint32_t rtt_ms;              // Last attempt to answer, 0 without one
+} crdp_udp_transport_stats_t;
+
+typedef struct {
+    // TCP, which carries the session
+    uint64_t pdus_received;
+    uint64_t bytes_received;
+    uint64_t pdus_sent;
+    uint64_t bytes_sent;
+    uint32_t tcp_rtt_ms;          // Server's measurement, 0 if unknown
+    uint32_t connect_rtt_ms;      // TCP handshake
+    crdp_link_tier_t connect_tier;  // What the socket defaults were chosen for
+    // UDP
+    uint32_t udp_requests;        // Multitransport requests from the server
+    crdp_udp_transport_stats_t udp_reliable;
+    crdp_udp_transport_stats_t udp_lossy;
+} crdp_transport_stats_t;
+
+// Counters for the current connection. Returns 0 on success, -1 on bad arguments.
+int crdp_get_transport_stats(crdp_client_t* client, crdp_transport_stats_t* stats);
+
+// Session recordings
+// A recording file holds the sessions recorded into it, one after the
+// other, on a timeline that starts with the first. A recording that was
+// still being written, or was cut short, plays up to where it ends.
+typedef struct crdp_recording crdp_recording_t;
+
+typedef struct {
+    uint64_t duration_ms;         // Start of the last stretch of data, roughly the end
+    uint32_t sessions;
+    uint32_t segments;            // Points a seek lands on
+} crdp_recording_info_t;
+
+typedef enum {
+    CRDP_RECORDING_FRAME = 0,     // The screen changed
+    CRDP_RECORDING_POINTER = 1,   // Input sent with crdp_send_pointer_event
+    CRDP_RECORDING_KEY = 2        // Input sent with crdp_send_keyboard_event
+} crdp_recording_item_type_t;
+
+typedef struct {
+    crdp_recording_item_type_t type;
+    uint64_t time_ms;
+    // Whole screen (BGRA32), owned by the recording and valid until the next
+    // call on it; for input items, the screen as it was then
+    const uint8_t* data;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    int32_t pointer_x;            // Last pointer position sent, -1 before any
+    int32_t pointer_y;
+    // Input items: flags and coordinates or scancode as sent
+    uint16_t flags;
+    uint16_t scancode;
+} crdp_recording_item_t;
+
+crdp_recording_t* crdp_recording_open(const char* path);
+void crdp_recording_close(crdp_recording_t* recording);
+int crdp_recording_get_info(crdp_recording_t* recording, crdp_recording_info_t* info);
+// Positions playback at time_ms and puts the screen as it was then in item
+// (a FRAME). Returns 1, 0 if nothing had been shown by then, -1 on errors.
+int crdp_recording_seek(crdp_recording_t* recording, uint64_t time_ms, crdp_recording_item_t* item);
+// Next item in time order. Returns 1, 0 at the end, -1 if the file is damaged.
+int crdp_recording_next(crdp_recording_t* recording, crdp_recording_item_t* item);
+
+// Session statistics
+// Latencies are in microseconds. Percentiles are accurate to within 1/8 of
+// their value and never exceed max_us.
+typedef struct {
+    uint64_t count;
+    uint64_t mean_us;
+    uint64_t p50_us;
+    uint64_t p90_us;
+    uint64_t p99_us;
+    uint64_t max_us;
+} crdp_latency_stats_t;
+
+typedef struct {
+    uint32_t width;               // Desktop size
+    uint32_t height;
+    uint64_t frames_painted;      // Server updates drawn into the framebuffer
+    uint64_t frames_delivered;    // frame_cb calls
+    uint32_t frames_in_flight;    // Not yet returned with crdp_frame_release
+    uint64_t pdus_received;
+    uint64_t bytes_received;
+    uint64_t pdus_sent;
+    uint64_t bytes_sent;
+    uint64_t input_events;        // Pointer and keyboard events sent
+    uint64_t clipboard_bytes_sent;      // Clipboard data and file contents
+    uint64_t clipboard_bytes_received;
+    uint64_t drive_requests;      // All redirected drives
+    uint64_t drive_bytes_read;
+    uint64_t drive_bytes_written;
+    crdp_latency_stats_t frame_interval;  // Between paints, pauses of a second or more left out
+    crdp_latency_stats_t decode;          // GFX surface commands
+    crdp_latency_stats_t input_latency;   // Input sent to the next frame delivered
+    crdp_latency_stats_t drive_request;   // Drive requests, start to completion
+} crdp_stats_t;
+
+// Snapshot of the current connection's metrics. Threads update them without
+// locks and each field is read on its own, so the snapshot isn't of one
+// instant: fields that move together, such as bytes_received and
+// pdus_received, may be a few events apart, and a latency's mean_us and
+// max_us may take in a sample its count doesn't yet. A latency's count and
+// percentiles come from one pass and always agree. No counter goes back
+// between snapshots of a connection. crdp-stats-bench measures what a
+// snapshot costs. Returns 0 on success, -1 on bad arguments.
+int crdp_get_stats(crdp_client_t* client, crdp_stats_t* stats);
+
+// Profiling
+// While profiling runs, CRDP records timed spans of its own work in every
+// session: socket reads, PDU decoding, codec decoding per GFX surface,
+// painting, frame delivery, clipboard and drive requests, and input. Each
+// thread keeps its most recent 16384 spans. crdp_profile_stop writes them to
+// path as Chrome trace-event JSON, which chrome://tracing and
+// ui.perfetto.dev open (NULL discards them). Off, profiling costs a branch
+// per span. Both return 0, or -1 if profiling was already running (start) or
+// not running or the file can't be written (stop).
+int crdp_profile_start(void);
+int crdp_profile_stop(const char* path);
+
 // Connection health
 // Returns round-trip time in milliseconds, or -1 if not available
 int32_t crdp_get_rtt_ms(crdp_client_t* client);
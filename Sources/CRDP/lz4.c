@@ -0,0 +1,132 @@
+#include "crdp_internal.h"
+
+#include <string.h>
+
+// LZ4 block format (compatible with liblz4's LZ4_compress_default and
+// LZ4_decompress_safe). A greedy single-probe compressor: it doesn't chase
+// the best ratio, it has to keep up with a recording session.
+
+#define CRDP_LZ4_HASH_LOG 12
+#define CRDP_LZ4_MIN_MATCH 4
+#define CRDP_LZ4_MAX_OFFSET 65535
+// The last match starts this far from the end at the latest, and the last
+// bytes are always literals
+#define CRDP_LZ4_MF_LIMIT 12
+#define CRDP_LZ4_LAST_LITERALS 5
+
+static inline uint32_t crdp_lz4_read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t crdp_lz4_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - CRDP_LZ4_HASH_LOG);
+}
+
+size_t crdp_lz4_bound(size_t len) { return len + len / 255 + 16; }
+
+static uint8_t* crdp_lz4_put_length(uint8_t* op, size_t n) {
+    for (; n >= 255; n -= 255) *op++ = 255;
+    *op++ = (uint8_t)n;
+    return op;
+}
+
+static uint8_t* crdp_lz4_put_sequence(uint8_t* op, const uint8_t* literals, size_t literal_len, uint16_t offset,
+                                      size_t match_len) {
+    uint8_t* token = op++;
+    *token = (uint8_t)((literal_len >= 15 ? 15 : literal_len) << 4);
+    if (literal_len >= 15) op = crdp_lz4_put_length(op, literal_len - 15);
+    memcpy(op, literals, literal_len);
+    op += literal_len;
+    if (match_len == 0) return op;  // Last literals
+
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    size_t ml = match_len - CRDP_LZ4_MIN_MATCH;
+    *token |= (uint8_t)(ml >= 15 ? 15 : ml);
+    if (ml >= 15) op = crdp_lz4_put_length(op, ml - 15);
+    return op;
+}
+
+size_t crdp_lz4_compress(const uint8_t* src, size_t len, uint8_t* dst, size_t cap) {
+    if (cap < crdp_lz4_bound(len) || len > UINT32_MAX) return 0;
+    uint32_t table[1u << CRDP_LZ4_HASH_LOG] = { 0 };
+    const uint8_t* end = src + len;
+    const uint8_t* anchor = src;
+    uint8_t* op = dst;
+
+    if (len > CRDP_LZ4_MF_LIMIT) {
+        const uint8_t* mf_limit = end - CRDP_LZ4_MF_LIMIT;
+        const uint8_t* match_limit = end - CRDP_LZ4_LAST_LITERALS;
+        const uint8_t* ip = src + 1;
+        while (ip < mf_limit) {
+            uint32_t h = crdp_lz4_hash(crdp_lz4_read32(ip));
+            const uint8_t* ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+            if (ref >= ip || ip - ref > CRDP_LZ4_MAX_OFFSET || crdp_lz4_read32(ref) != crdp_lz4_read32(ip)) {
+                ip++;
+                continue;
+            }
+            // Take in equal bytes before the match, then extend it forward
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            size_t match_len = CRDP_LZ4_MIN_MATCH;
+            while (ip + match_len < match_limit && ip[match_len] == ref[match_len]) match_len++;
+
+            op = crdp_lz4_put_sequence(op, anchor, (size_t)(ip - anchor), (uint16_t)(ip - ref), match_len);
+            ip += match_len;
+            anchor = ip;
+        }
+    }
+    op = crdp_lz4_put_sequence(op, anchor, (size_t)(end - anchor), 0, 0);
+    return (size_t)(op - dst);
+}
+
+size_t crdp_lz4_decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t cap) {
+    const uint8_t* ip = src;
+    const uint8_t* iend = src + len;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t literal_len = token >> 4;
+        if (literal_len == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return 0;
+                b = *ip++;
+                literal_len += b;
+            } while (b == 255);
+        }
+        if (literal_len > (size_t)(iend - ip) || literal_len > (size_t)(oend - op)) return 0;
+        memcpy(op, ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return 0;
+        size_t offset = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) return 0;
+        size_t match_len = token & 15;
+        if (match_len == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return 0;
+                b = *ip++;
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += CRDP_LZ4_MIN_MATCH;
+        if (match_len > (size_t)(oend - op)) return 0;
+        // Byte by byte: the match may overlap what it produces
+        const uint8_t* ref = op - offset;
+        for (size_t i = 0; i < match_len; i++) op[i] = ref[i];
+        op += match_len;
+    }
+    return (size_t)(op - dst);
+}
@@ -0,0 +1,176 @@
+#include "crdp_internal.h"
+
+#include <string.h>
+
+// Metrics registry. Each thread adds to one shard of the client's registry,
+// picked once per thread, so threads counting the same event don't fight
+// over a cache line; crdp_get_stats adds the shards up. Gauges hold a single
+// value and aren't sharded.
+
+static _Atomic uint32_t crdp_metrics_threads;
+static _Thread_local uint32_t crdp_metrics_thread_shard;  // 1-based, 0 until first use
+
+static crdp_metrics_shard_t* crdp_metrics_shard(crdp_client_t* client) {
+    uint32_t shard = crdp_metrics_thread_shard;
+    if (!shard) {
+        shard = atomic_fetch_add_explicit(&crdp_metrics_threads, 1, memory_order_relaxed) % CRDP_METRICS_SHARDS + 1;
+        crdp_metrics_thread_shard = shard;
+    }
+    return &client->metrics.shards[shard - 1];
+}
+
+// Buckets are exact below 2^CRDP_HIST_SUB_BITS and then split every power of
+// two into 2^CRDP_HIST_SUB_BITS steps, so a bucket is at most 1/8 of its value wide
+static uint32_t crdp_hist_bucket(uint64_t value) {
+    if (value >= CRDP_HIST_MAX_VALUE) value = CRDP_HIST_MAX_VALUE - 1;
+    if (value < (1u << CRDP_HIST_SUB_BITS)) return (uint32_t)value;
+    uint32_t e = 63 - (uint32_t)__builtin_clzll(value);
+    uint32_t sub = (uint32_t)(value >> (e - CRDP_HIST_SUB_BITS)) & ((1u << CRDP_HIST_SUB_BITS) - 1);
+    return ((e - CRDP_HIST_SUB_BITS + 1) << CRDP_HIST_SUB_BITS) | sub;
+}
+
+// Largest value that lands in bucket
+static uint64_t crdp_hist_bucket_top(uint32_t bucket) {
+    if (bucket < (1u << CRDP_HIST_SUB_BITS)) return bucket;
+    uint32_t e = (bucket >> CRDP_HIST_SUB_BITS) + CRDP_HIST_SUB_BITS - 1;
+    uint64_t step = 1ull << (e - CRDP_HIST_SUB_BITS);
+    uint64_t low = (uint64_t)((1u << CRDP_HIST_SUB_BITS) | (bucket & ((1u << CRDP_HIST_SUB_BITS) - 1))) * step;
+    return low + step - 1;
+}
+
+void crdp_metrics_add(crdp_client_t* client, crdp_counter_t counter, uint64_t n) {
+    atomic_fetch_add_explicit(&crdp_metrics_shard(client)->counters[counter], n, memory_order_relaxed);
+}
+
+void crdp_metrics_record(crdp_client_t* client, crdp_histogram_t hist, uint64_t value) {
+    crdp_metrics_shard_t* shard = crdp_metrics_shard(client);
+    atomic_fetch_add_explicit(&shard->buckets[hist][crdp_hist_bucket(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shard->sums[hist], value, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&shard->max[hist], memory_order_relaxed);
+    while (value > max &&
+           !atomic_compare_exchange_weak_explicit(&shard->max[hist], &max, value, memory_order_relaxed,
+                                                  memory_order_relaxed)) {}
+}
+
+void crdp_metrics_set(crdp_client_t* client, crdp_gauge_t gauge, int64_t value) {
+    atomic_store_explicit(&client->metrics.gauges[gauge], value, memory_order_relaxed);
+}
+
+void crdp_metrics_input_sent(crdp_client_t* client) {
+    // Only the oldest input waiting for a frame is timed
+    if (atomic_load_explicit(&client->metrics.input_pending_us, memory_order_relaxed)) return;
+    uint64_t expected = 0;
+    atomic_compare_exchange_strong(&client->metrics.input_pending_us, &expected, crdp_time_us());
+}
+
+void crdp_metrics_frame_delivered(crdp_client_t* client) {
+    crdp_metrics_add(client, CRDP_COUNTER_FRAMES_DELIVERED, 1);
+    if (!atomic_load_explicit(&client->metrics.input_pending_us, memory_order_relaxed)) return;
+    uint64_t sent = atomic_exchange(&client->metrics.input_pending_us, 0);
+    if (sent) crdp_metrics_record(client, CRDP_HIST_INPUT_LATENCY_US, crdp_time_us() - sent);
+}
+
+// Called at connect, before any thread of the connection writes
+void crdp_metrics_reset(crdp_client_t* client) {
+    crdp_metrics_t* m = &client->metrics;
+    for (uint32_t s = 0; s < CRDP_METRICS_SHARDS; s++) {
+        crdp_metrics_shard_t* shard = &m->shards[s];
+        for (int c = 0; c < CRDP_COUNTER_COUNT; c++) atomic_store(&shard->counters[c], 0);
+        for (int h = 0; h < CRDP_HIST_COUNT; h++) {
+            for (uint32_t b = 0; b < CRDP_HIST_BUCKETS; b++) atomic_store(&shard->buckets[h][b], 0);
+            atomic_store(&shard->sums[h], 0);
+            atomic_store(&shard->max[h], 0);
+        }
+    }
+    for (int g = 0; g < CRDP_GAUGE_COUNT; g++) atomic_store(&m->gauges[g], 0);
+    atomic_store(&m->input_pending_us, 0);
+}
+
+uint64_t crdp_metrics_counter(crdp_client_t* client, crdp_counter_t counter) {
+    uint64_t total = 0;
+    for (uint32_t s = 0; s < CRDP_METRICS_SHARDS; s++) {
+        total += atomic_load_explicit(&client->metrics.shards[s].counters[counter], memory_order_relaxed);
+    }
+    return total;
+}
+
+void crdp_metrics_totals(crdp_client_t* client, crdp_histogram_t hist, uint64_t* count, uint64_t* sum) {
+    *count = 0;
+    *sum = 0;
+    for (uint32_t s = 0; s < CRDP_METRICS_SHARDS; s++) {
+        crdp_metrics_shard_t* shard = &client->metrics.shards[s];
+        for (uint32_t b = 0; b < CRDP_HIST_BUCKETS; b++) {
+            *count += atomic_load_explicit(&shard->buckets[hist][b], memory_order_relaxed);
+        }
+        *sum += atomic_load_explicit(&shard->sums[hist], memory_order_relaxed);
+    }
+}
+
+// Percentiles come from one pass over the buckets, so they always agree
+// with count
+static void crdp_metrics_latency(crdp_client_t* client, crdp_histogram_t hist, crdp_latency_stats_t* out) {
+    uint64_t buckets[CRDP_HIST_BUCKETS] = { 0 };
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+    for (uint32_t s = 0; s < CRDP_METRICS_SHARDS; s++) {
+        crdp_metrics_shard_t* shard = &client->metrics.shards[s];
+        for (uint32_t b = 0; b < CRDP_HIST_BUCKETS; b++) {
+            uint64_t n = atomic_load_explicit(&shard->buckets[hist][b], memory_order_relaxed);
+            buckets[b] += n;
+            count += n;
+        }
+        sum += atomic_load_explicit(&shard->sums[hist], memory_order_relaxed);
+        uint64_t shard_max = atomic_load_explicit(&shard->max[hist], memory_order_relaxed);
+        if (shard_max > max) max = shard_max;
+    }
+
+    memset(out, 0, sizeof(*out));
+    out->count = count;
+    if (!count) return;
+    out->mean_us = sum / count;
+    out->max_us = max;
+
+    // Nearest rank; each reports the top of its bucket, capped at the maximum
+    const uint64_t ranks[3] = { (count * 50 + 99) / 100, (count * 90 + 99) / 100, (count * 99 + 99) / 100 };
+    uint64_t* values[3] = { &out->p50_us, &out->p90_us, &out->p99_us };
+    uint64_t seen = 0;
+    int next = 0;
+    for (uint32_t b = 0; b < CRDP_HIST_BUCKETS && next < 3; b++) {
+        seen += buckets[b];
+        while (next < 3 && seen >= ranks[next]) {
+            uint64_t top = crdp_hist_bucket_top(b);
+            *values[next++] = top < max ? top : max;
+        }
+    }
+}
+
+int crdp_get_stats(crdp_client_t* client, crdp_stats_t* stats) {
+    if (!client || !stats) return -1;
+    memset(stats, 0, sizeof(*stats));
+    crdp_metrics_t* m = &client->metrics;
+    stats->width = (uint32_t)atomic_load_explicit(&m->gauges[CRDP_GAUGE_DESKTOP_WIDTH], memory_order_relaxed);
+    stats->height = (uint32_t)atomic_load_explicit(&m->gauges[CRDP_GAUGE_DESKTOP_HEIGHT], memory_order_relaxed);
+    stats->frames_painted = crdp_metrics_counter(client, CRDP_COUNTER_FRAMES_PAINTED);
+    stats->frames_delivered = crdp_metrics_counter(client, CRDP_COUNTER_FRAMES_DELIVERED);
+    int in_flight = atomic_load(&client->frames_in_flight);
+    stats->frames_in_flight = in_flight > 0 ? (uint32_t)in_flight : 0;
+    stats->pdus_received = crdp_metrics_counter(client, CRDP_COUNTER_PDUS_RECEIVED);
+    stats->bytes_received = crdp_metrics_counter(client, CRDP_COUNTER_BYTES_RECEIVED);
+    stats->pdus_sent = crdp_metrics_counter(client, CRDP_COUNTER_PDUS_SENT);
+    stats->bytes_sent = crdp_metrics_counter(client, CRDP_COUNTER_BYTES_SENT);
+    stats->input_events = crdp_metrics_counter(client, CRDP_COUNTER_INPUT_EVENTS);
+    stats->clipboard_bytes_sent = crdp_metrics_counter(client, CRDP_COUNTER_CLIPBOARD_BYTES_SENT);
+    stats->clipboard_bytes_received = crdp_metrics_counter(client, CRDP_COUNTER_CLIPBOARD_BYTES_RECEIVED);
+    for (uint32_t i = 0; i < client->drive_count; i++) {
+        crdp_drive_share_t* share = &client->drives[i];
+        stats->drive_requests += atomic_load(&share->requests);
+        stats->drive_bytes_read += atomic_load(&share->bytes_read);
+        stats->drive_bytes_written += atomic_load(&share->bytes_written);
+    }
+    crdp_metrics_latency(client, CRDP_HIST_FRAME_INTERVAL_US, &stats->frame_interval);
+    crdp_metrics_latency(client, CRDP_HIST_DECODE_US, &stats->decode);
+    crdp_metrics_latency(client, CRDP_HIST_INPUT_LATENCY_US, &stats->input_latency);
+    crdp_metrics_latency(client, CRDP_HIST_DRIVE_US, &stats->drive_request);
+    return 0;
+}
@@ -0,0 +1,475 @@
+#include "crdp_internal.h"
+
+#include <freerdp/client/audin.h>
+#include <freerdp/codec/audio.h>
+#include <freerdp/codec/dsp.h>
+#include <winpr/stream.h>
+#include <winpr/wlog.h>
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Microphone device for audin.
+//
+// Captured audio runs through four stages, each on its own thread:
+//
+//   source -> resample -> encode -> send
+//
+// The source delivers PCM in its own format. The resampler converts it to
+// the server's rate and channel count and cuts it into packets of the size
+// the server asked for. The encoder compresses them unless the server took
+// PCM, and the sender hands them to audin. Source chunks and packets come
+// from two fixed pools and go back to them, so nothing is allocated per
+// packet. The source never waits: with no free chunk, captured audio is
+// dropped rather than queued, which keeps latency bounded. The resampler
+// waits for packets, which only the stages after it hold; sharing a pool,
+// the source could take every buffer and leave it waiting for good.
+
+#define CRDP_MIC_POOL_CHUNKS 8
+#define CRDP_MIC_POOL_PACKETS 8
+// Holds either pool whole
+#define CRDP_MIC_QUEUE_SIZE 8
+// Largest chunk a source hands over at once; longer ones are split
+#define CRDP_MIC_CHUNK_MS 20
+#define CRDP_MIC_MAX_RATE 48000
+
+typedef struct {
+    uint64_t captured_ns;           // When its oldest sample was captured
+    uint32_t frames;
+    int16_t* pcm;
+    wStream* encoded;               // NULL for source chunks
+} crdp_mic_packet_t;
+
+// Bounded FIFO of chunks or packets; never full, as it can hold a whole pool
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    crdp_mic_packet_t* items[CRDP_MIC_QUEUE_SIZE];
+    uint32_t head;
+    uint32_t count;
+    bool stop;
+} crdp_mic_queue_t;
+
+struct crdp_mic {
+    IAudinDevice device;            // First: audin hands this back to us
+    crdp_mic_metrics_t* metrics;
+    crdp_mic_source_t* source;
+    AUDIO_FORMAT format;            // What the server gets
+    uint32_t frames_per_packet;
+    AudinReceive receive;
+    void* receive_user;
+    bool open;
+    FREERDP_DSP_CONTEXT* dsp;
+    bool passthrough;               // Server takes 16-bit PCM as resampled
+    // Buffers and the queues between the stages
+    crdp_mic_packet_t chunks[CRDP_MIC_POOL_CHUNKS];
+    crdp_mic_packet_t packets[CRDP_MIC_POOL_PACKETS];
+    uint32_t chunk_frames;          // Capacity of a source chunk
+    crdp_mic_queue_t free_chunks;
+    crdp_mic_queue_t free_packets;
+    crdp_mic_queue_t captured;
+    crdp_mic_queue_t resampled;
+    crdp_mic_queue_t encoded;
+    pthread_t threads[3];
+    uint32_t thread_count;
+    // Resampler state, resample thread only
+    double position;                // Source position of the next output frame; -1 is prev
+    int16_t prev[2];                // Last frame of the previous chunk
+    crdp_mic_packet_t* out;         // Packet being filled
+};
+
+static uint64_t crdp_mic_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void crdp_mic_queue_init(crdp_mic_queue_t* q) {
+    memset(q, 0, sizeof(*q));
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+}
+
+static void crdp_mic_queue_destroy(crdp_mic_queue_t* q) {
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->lock);
+}
+
+static void crdp_mic_queue_push(crdp_mic_queue_t* q, crdp_mic_packet_t* packet) {
+    pthread_mutex_lock(&q->lock);
+    q->items[(q->head + q->count) % CRDP_MIC_QUEUE_SIZE] = packet;
+    q->count++;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// NULL once the queue is stopped, or right away if empty and not waiting
+static crdp_mic_packet_t* crdp_mic_queue_pop(crdp_mic_queue_t* q, bool wait) {
+    pthread_mutex_lock(&q->lock);
+    while (wait && !q->stop && q->count == 0) pthread_cond_wait(&q->cond, &q->lock);
+    crdp_mic_packet_t* packet = NULL;
+    if (!q->stop && q->count > 0) {
+        packet = q->items[q->head];
+        q->head = (q->head + 1) % CRDP_MIC_QUEUE_SIZE;
+        q->count--;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return packet;
+}
+
+static void crdp_mic_queue_stop(crdp_mic_queue_t* q) {
+    pthread_mutex_lock(&q->lock);
+    q->stop = true;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Source stage: any thread the source uses; never blocks
+void crdp_mic_capture(crdp_mic_t* mic, const int16_t* samples, uint32_t frames) {
+    uint32_t channels = mic->source->format.channels;
+    uint64_t now = crdp_mic_now_ns();
+    uint64_t first_ns = now - (uint64_t)frames * 1000000000ULL / mic->source->format.rate;
+    uint32_t done = 0;
+    while (done < frames) {
+        crdp_mic_packet_t* chunk = crdp_mic_queue_pop(&mic->free_chunks, false);
+        if (!chunk) {
+            atomic_fetch_add(&mic->metrics->dropped_frames, frames - done);
+            return;
+        }
+        uint32_t n = frames - done < mic->chunk_frames ? frames - done : mic->chunk_frames;
+        memcpy(chunk->pcm, samples + (size_t)done * channels, (size_t)n * channels * sizeof(int16_t));
+        chunk->frames = n;
+        chunk->captured_ns = first_ns + (uint64_t)done * 1000000000ULL / mic->source->format.rate;
+        crdp_mic_queue_push(&mic->captured, chunk);
+        done += n;
+    }
+}
+
+// Resample stage
+
+static inline int16_t crdp_mic_sample(const crdp_mic_t* mic, const crdp_mic_packet_t* in, long frame, uint32_t ch) {
+    uint32_t in_channels = mic->source->format.channels;
+    const int16_t* f = frame < 0 ? mic->prev : in->pcm + (size_t)frame * in_channels;
+    if (in_channels == mic->format.nChannels) return f[ch];
+    if (in_channels == 1) return f[0];
+    return (int16_t)(((int32_t)f[0] + f[1]) / 2);
+}
+
+// Appends one frame to the packet being filled and passes it on once full.
+// Waits for a free packet, which the encode and send stages give back.
+static bool crdp_mic_emit(crdp_mic_t* mic, const int16_t* frame, uint64_t captured_ns) {
+    if (!mic->out) {
+        mic->out = crdp_mic_queue_pop(&mic->free_packets, true);
+        if (!mic->out) return false;
+        mic->out->frames = 0;
+        mic->out->captured_ns = captured_ns;
+    }
+    uint32_t channels = mic->format.nChannels;
+    memcpy(mic->out->pcm + (size_t)mic->out->frames * channels, frame, channels * sizeof(int16_t));
+    if (++mic->out->frames == mic->frames_per_packet) {
+        crdp_mic_queue_push(&mic->resampled, mic->out);
+        mic->out = NULL;
+    }
+    return true;
+}
+
+static void* crdp_mic_resample_run(void* arg) {
+    crdp_mic_t* mic = (crdp_mic_t*)arg;
+    uint32_t in_rate = mic->source->format.rate;
+    uint32_t out_channels = mic->format.nChannels;
+    double step = (double)in_rate / mic->format.nSamplesPerSec;
+    bool same_rate = in_rate == mic->format.nSamplesPerSec;
+    crdp_mic_packet_t* in;
+    while ((in = crdp_mic_queue_pop(&mic->captured, true))) {
+        bool ok = true;
+        int16_t frame[2];
+        if (same_rate) {
+            for (uint32_t i = 0; ok && i < in->frames; i++) {
+                for (uint32_t c = 0; c < out_channels; c++) frame[c] = crdp_mic_sample(mic, in, (long)i, c);
+                ok = crdp_mic_emit(mic, frame, in->captured_ns);
+            }
+        } else {
+            // Linear interpolation; the last frame of the previous chunk
+            // bridges the gap between chunks
+            double t = mic->position;
+            while (ok && t < (double)in->frames - 1) {
+                long i0 = (long)floor(t);
+                double f = t - (double)i0;
+                for (uint32_t c = 0; c < out_channels; c++) {
+                    double a = crdp_mic_sample(mic, in, i0, c);
+                    double b = crdp_mic_sample(mic, in, i0 + 1, c);
+                    frame[c] = (int16_t)lrint(a + (b - a) * f);
+                }
+                ok = crdp_mic_emit(mic, frame, in->captured_ns);
+                t += step;
+            }
+            mic->position = t - in->frames;
+        }
+        if (in->frames > 0) {
+            const int16_t* last = in->pcm + (size_t)(in->frames - 1) * mic->source->format.channels;
+            mic->prev[0] = last[0];
+            mic->prev[1] = mic->source->format.channels > 1 ? last[1] : last[0];
+        }
+        crdp_mic_queue_push(&mic->free_chunks, in);
+        if (!ok) break;
+    }
+    return NULL;
+}
+
+// Encode stage
+
+static void* crdp_mic_encode_run(void* arg) {
+    crdp_mic_t* mic = (crdp_mic_t*)arg;
+    AUDIO_FORMAT pcm = { 0 };
+    pcm.wFormatTag = WAVE_FORMAT_PCM;
+    pcm.nChannels = mic->format.nChannels;
+    pcm.nSamplesPerSec = mic->format.nSamplesPerSec;
+    pcm.wBitsPerSample = 16;
+    pcm.nBlockAlign = (UINT16)(pcm.nChannels * 2);
+    pcm.nAvgBytesPerSec = pcm.nSamplesPerSec * pcm.nBlockAlign;
+
+    crdp_mic_packet_t* packet;
+    while ((packet = crdp_mic_queue_pop(&mic->resampled, true))) {
+        size_t bytes = (size_t)packet->frames * pcm.nBlockAlign;
+        Stream_SetPosition(packet->encoded, 0);
+        bool ok;
+        if (mic->passthrough) {
+            ok = Stream_EnsureRemainingCapacity(packet->encoded, bytes);
+            if (ok) Stream_Write(packet->encoded, packet->pcm, bytes);
+        } else {
+            ok = freerdp_dsp_encode(mic->dsp, &pcm, (const BYTE*)packet->pcm, bytes, packet->encoded);
+        }
+        if (!ok) {
+            atomic_fetch_add(&mic->metrics->dropped_frames, packet->frames);
+            crdp_mic_queue_push(&mic->free_packets, packet);
+            continue;
+        }
+        crdp_mic_queue_push(&mic->encoded, packet);
+    }
+    return NULL;
+}
+
+// Send stage
+
+static void* crdp_mic_send_run(void* arg) {
+    crdp_mic_t* mic = (crdp_mic_t*)arg;
+    crdp_mic_metrics_t* m = mic->metrics;
+    crdp_mic_packet_t* packet;
+    while ((packet = crdp_mic_queue_pop(&mic->encoded, true))) {
+        size_t len = Stream_GetPosition(packet->encoded);
+        // Some codecs hold samples back until they have a whole block
+        if (len > 0) {
+            UINT rc = mic->receive(&mic->format, Stream_Buffer(packet->encoded), len, mic->receive_user);
+            if (rc == CHANNEL_RC_OK) {
+                uint32_t latency = (uint32_t)((crdp_mic_now_ns() - packet->captured_ns) / 1000000);
+                atomic_fetch_add(&m->packets_sent, 1);
+                atomic_fetch_add(&m->bytes_sent, len);
+                atomic_store(&m->latency_ms, latency);
+                uint32_t max = atomic_load(&m->max_latency_ms);
+                while (latency > max && !atomic_compare_exchange_weak(&m->max_latency_ms, &max, latency)) {
+                }
+            } else {
+                WLog_DBG(CRDP_TAG, "Failed to send microphone data: %u", rc);
+                atomic_fetch_add(&m->dropped_frames, packet->frames);
+            }
+        }
+        crdp_mic_queue_push(&mic->free_packets, packet);
+    }
+    return NULL;
+}
+
+// audin device, channel thread
+
+static BOOL crdp_mic_format_supported(IAudinDevice* device, const AUDIO_FORMAT* format) {
+    (void)device;
+    if (!format || format->nChannels < 1 || format->nChannels > 2 || format->nSamplesPerSec < 8000 ||
+        format->nSamplesPerSec > CRDP_MIC_MAX_RATE) {
+        return FALSE;
+    }
+    if (format->wFormatTag == WAVE_FORMAT_PCM) return format->wBitsPerSample == 16;
+    // Compressed formats as far as FreeRDP's DSP can encode them
+    return freerdp_dsp_supports_format(format, TRUE);
+}
+
+static UINT crdp_mic_set_format(IAudinDevice* device, const AUDIO_FORMAT* format, UINT32 frames_per_packet) {
+    crdp_mic_t* mic = (crdp_mic_t*)device;
+    if (!crdp_mic_format_supported(device, format)) return ERROR_INVALID_PARAMETER;
+    mic->format = *format;
+    mic->format.data = NULL;
+    mic->format.cbSize = 0;
+    // Servers tend to ask for 10-40 ms; fall back to 20 ms
+    mic->frames_per_packet = frames_per_packet ? frames_per_packet : format->nSamplesPerSec / 50;
+    mic->passthrough = format->wFormatTag == WAVE_FORMAT_PCM;
+    if (!mic->passthrough) {
+        if (!mic->dsp) mic->dsp = freerdp_dsp_context_new(TRUE);
+        if (!mic->dsp || !freerdp_dsp_context_reset(mic->dsp, format, mic->frames_per_packet)) {
+            return ERROR_INTERNAL_ERROR;
+        }
+    }
+    return CHANNEL_RC_OK;
+}
+
+static void crdp_mic_free_buffers(crdp_mic_t* mic) {
+    for (int i = 0; i < CRDP_MIC_POOL_CHUNKS; i++) {
+        free(mic->chunks[i].pcm);
+        memset(&mic->chunks[i], 0, sizeof(mic->chunks[i]));
+    }
+    for (int i = 0; i < CRDP_MIC_POOL_PACKETS; i++) {
+        free(mic->packets[i].pcm);
+        Stream_Free(mic->packets[i].encoded, TRUE);
+        memset(&mic->packets[i], 0, sizeof(mic->packets[i]));
+    }
+}
+
+static UINT crdp_mic_close(IAudinDevice* device) {
+    crdp_mic_t* mic = (crdp_mic_t*)device;
+    if (!mic->open) return CHANNEL_RC_OK;
+    mic->source->stop(mic->source);
+    crdp_mic_queue_stop(&mic->free_chunks);
+    crdp_mic_queue_stop(&mic->free_packets);
+    crdp_mic_queue_stop(&mic->captured);
+    crdp_mic_queue_stop(&mic->resampled);
+    crdp_mic_queue_stop(&mic->encoded);
+    for (uint32_t i = 0; i < mic->thread_count; i++) pthread_join(mic->threads[i], NULL);
+    mic->thread_count = 0;
+
+    crdp_mic_queue_destroy(&mic->free_chunks);
+    crdp_mic_queue_destroy(&mic->free_packets);
+    crdp_mic_queue_destroy(&mic->captured);
+    crdp_mic_queue_destroy(&mic->resampled);
+    crdp_mic_queue_destroy(&mic->encoded);
+    crdp_mic_free_buffers(mic);
+    mic->out = NULL;
+    mic->open = false;
+    atomic_store(&mic->metrics->capturing, false);
+    return CHANNEL_RC_OK;
+}
+
+static UINT crdp_mic_open(IAudinDevice* device, AudinReceive receive, void* user) {
+    crdp_mic_t* mic = (crdp_mic_t*)device;
+    if (mic->open) crdp_mic_close(device);
+    if (!receive || !mic->format.nSamplesPerSec) return ERROR_INVALID_PARAMETER;
+    mic->receive = receive;
+    mic->receive_user = user;
+
+    const crdp_audio_format_t* in = &mic->source->format;
+    mic->chunk_frames = in->rate * CRDP_MIC_CHUNK_MS / 1000;
+    size_t chunk_samples = (size_t)mic->chunk_frames * in->channels;
+    size_t packet_samples = (size_t)mic->frames_per_packet * mic->format.nChannels;
+    bool ok = true;
+    for (int i = 0; i < CRDP_MIC_POOL_CHUNKS; i++) {
+        mic->chunks[i].pcm = malloc(chunk_samples * sizeof(int16_t));
+        ok = ok && mic->chunks[i].pcm;
+    }
+    for (int i = 0; i < CRDP_MIC_POOL_PACKETS; i++) {
+        mic->packets[i].pcm = malloc(packet_samples * sizeof(int16_t));
+        mic->packets[i].encoded = Stream_New(NULL, packet_samples * sizeof(int16_t) + 1024);
+        ok = ok && mic->packets[i].pcm && mic->packets[i].encoded;
+    }
+    if (!ok) {
+        crdp_mic_free_buffers(mic);
+        return CHANNEL_RC_NO_MEMORY;
+    }
+    crdp_mic_queue_init(&mic->free_chunks);
+    crdp_mic_queue_init(&mic->free_packets);
+    crdp_mic_queue_init(&mic->captured);
+    crdp_mic_queue_init(&mic->resampled);
+    crdp_mic_queue_init(&mic->encoded);
+    for (int i = 0; i < CRDP_MIC_POOL_CHUNKS; i++) crdp_mic_queue_push(&mic->free_chunks, &mic->chunks[i]);
+    for (int i = 0; i < CRDP_MIC_POOL_PACKETS; i++) crdp_mic_queue_push(&mic->free_packets, &mic->packets[i]);
+    mic->position = 0;
+    mic->prev[0] = mic->prev[1] = 0;
+    mic->out = NULL;
+    mic->open = true;
+
+    void* (*stages[])(void*) = { crdp_mic_resample_run, crdp_mic_encode_run, crdp_mic_send_run };
+    for (int i = 0; i < 3; i++) {
+        if (pthread_create(&mic->threads[i], NULL, stages[i], mic) != 0) break;
+        mic->thread_count++;
+    }
+    if (mic->thread_count < 3 || !mic->source->start(mic->source)) {
+        WLog_ERR(CRDP_TAG, "Failed to start microphone capture");
+        crdp_mic_close(device);
+        return ERROR_INTERNAL_ERROR;
+    }
+    atomic_store(&mic->metrics->format_tag, mic->format.wFormatTag);
+    atomic_store(&mic->metrics->sample_rate, mic->format.nSamplesPerSec);
+    atomic_store(&mic->metrics->channels, mic->format.nChannels);
+    atomic_store(&mic->metrics->capturing, true);
+    WLog_DBG(CRDP_TAG, "Microphone: %u Hz, %u channels captured, sent as format 0x%04X at %u Hz, %u channels",
+             in->rate, in->channels, mic->format.wFormatTag, mic->format.nSamplesPerSec, mic->format.nChannels);
+    return CHANNEL_RC_OK;
+}
+
+static UINT crdp_mic_free(IAudinDevice* device) {
+    crdp_mic_t* mic = (crdp_mic_t*)device;
+    if (!mic) return CHANNEL_RC_OK;
+    crdp_mic_close(device);
+    if (mic->source) mic->source->free(mic->source);
+    if (mic->dsp) freerdp_dsp_context_free(mic->dsp);
+    free(mic);
+    return CHANNEL_RC_OK;
+}
+
+// audin's entry point for the "crdp" subsystem
+static UINT VCAPITYPE crdp_mic_device_entry(PFREERDP_AUDIN_DEVICE_ENTRY_POINTS entry_points) {
+    crdp_context* ctx = (crdp_context*)entry_points->rdpcontext;
+    if (!ctx || !ctx->client) return ERROR_INVALID_PARAMETER;
+    const crdp_config_t* cfg = &ctx->client->config;
+
+    crdp_mic_t* mic = calloc(1, sizeof(*mic));
+    if (!mic) return CHANNEL_RC_NO_MEMORY;
+    mic->metrics = &ctx->client->mic;
+    mic->source = cfg->mic_input == CRDP_MIC_FILE ? crdp_mic_source_file_new(mic, cfg->mic_file_path)
+                                                  : crdp_mic_source_device_new(mic);
+    if (!mic->source) {
+        free(mic);
+        return CHANNEL_RC_INITIALIZATION_ERROR;
+    }
+
+    mic->device.FormatSupported = crdp_mic_format_supported;
+    mic->device.SetFormat = crdp_mic_set_format;
+    mic->device.Open = crdp_mic_open;
+    mic->device.Close = crdp_mic_close;
+    mic->device.Free = crdp_mic_free;
+    return entry_points->pRegisterAudinDevice(entry_points->plugin, &mic->device);
+}
+
+PVIRTUALCHANNELENTRY crdp_mic_addin_entry(LPCSTR name, LPCSTR subsystem) {
+    if (name && subsystem && strcmp(name, "audin") == 0 && strcmp(subsystem, "crdp") == 0) {
+        return (PVIRTUALCHANNELENTRY)crdp_mic_device_entry;
+    }
+    return NULL;
+}
+
+void crdp_mic_reset(crdp_client_t* client) {
+    crdp_mic_metrics_t* m = &client->mic;
+    atomic_store(&m->capturing, false);
+    atomic_store(&m->format_tag, 0);
+    atomic_store(&m->sample_rate, 0);
+    atomic_store(&m->channels, 0);
+    atomic_store(&m->latency_ms, 0);
+    atomic_store(&m->max_latency_ms, 0);
+    atomic_store(&m->packets_sent, 0);
+    atomic_store(&m->bytes_sent, 0);
+    atomic_store(&m->dropped_frames, 0);
+}
+
+int crdp_get_mic_stats(crdp_client_t* client, crdp_mic_stats_t* stats) {
+    if (!client || !stats) return -1;
+    if (client->config.mic_input == CRDP_MIC_OFF) return -2;
+    crdp_mic_metrics_t* m = &client->mic;
+    memset(stats, 0, sizeof(*stats));
+    stats->capturing = atomic_load(&m->capturing);
+    stats->format_tag = (uint16_t)atomic_load(&m->format_tag);
+    stats->sample_rate = atomic_load(&m->sample_rate);
+    stats->channels = (uint16_t)atomic_load(&m->channels);
+    stats->latency_ms = atomic_load(&m->latency_ms);
+    stats->max_latency_ms = atomic_load(&m->max_latency_ms);
+    stats->packets_sent = atomic_load(&m->packets_sent);
+    stats->bytes_sent = atomic_load(&m->bytes_sent);
+    stats->dropped_frames = atomic_load(&m->dropped_frames);
+    return 0;
+}
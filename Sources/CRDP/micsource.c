@@ -0,0 +1,259 @@
+#include "crdp_internal.h"
+
+#include <winpr/wlog.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __APPLE__
+#include <AudioToolbox/AudioToolbox.h>
+#endif
+
+// Microphone sources. Each hands captured PCM to crdp_mic_capture in chunks
+// of about CRDP_MIC_SOURCE_PERIOD_MS, from its own thread.
+
+#define CRDP_MIC_SOURCE_PERIOD_MS 10
+// Longest recording the file source loads
+#define CRDP_MIC_SOURCE_MAX_FILE (256 * 1024 * 1024)
+
+// File source: a 16-bit PCM WAV file played in a loop in real time, for
+// running the pipeline without a microphone
+
+typedef struct {
+    crdp_mic_source_t base;
+    crdp_mic_t* mic;
+    int16_t* samples;
+    uint32_t frames;
+    pthread_t thread;
+    bool running;
+    _Atomic bool stop;
+} crdp_mic_file_t;
+
+static uint32_t crdp_mic_get_le(const uint8_t* p, int bytes) {
+    uint32_t value = 0;
+    for (int i = 0; i < bytes; i++) value |= (uint32_t)p[i] << (8 * i);
+    return value;
+}
+
+// Loads the samples of a RIFF/WAVE file with 16-bit PCM data
+static bool crdp_mic_file_load(crdp_mic_file_t* source, const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        WLog_ERR(CRDP_TAG, "Failed to open %s: %s", path, strerror(errno));
+        return false;
+    }
+    uint8_t riff[12];
+    bool ok = fread(riff, 1, sizeof(riff), file) == sizeof(riff) && memcmp(riff, "RIFF", 4) == 0 &&
+              memcmp(riff + 8, "WAVE", 4) == 0;
+    bool have_format = false;
+    while (ok && !source->samples) {
+        uint8_t chunk[8];
+        if (fread(chunk, 1, sizeof(chunk), file) != sizeof(chunk)) break;
+        uint32_t size = crdp_mic_get_le(chunk + 4, 4);
+        if (memcmp(chunk, "fmt ", 4) == 0 && size >= 16 && size <= 64) {
+            uint8_t fmt[64];
+            ok = fread(fmt, 1, size, file) == size;
+            uint32_t tag = crdp_mic_get_le(fmt, 2);
+            source->base.format.channels = (uint16_t)crdp_mic_get_le(fmt + 2, 2);
+            source->base.format.rate = crdp_mic_get_le(fmt + 4, 4);
+            ok = ok && tag == 1 && crdp_mic_get_le(fmt + 14, 2) == 16 && source->base.format.channels >= 1 &&
+                 source->base.format.channels <= 2 && source->base.format.rate >= 8000 &&
+                 source->base.format.rate <= 192000;
+            have_format = ok;
+            if (size & 1) fseek(file, 1, SEEK_CUR);
+        } else if (memcmp(chunk, "data", 4) == 0 && have_format) {
+            uint32_t block = source->base.format.channels * 2u;
+            if (size > CRDP_MIC_SOURCE_MAX_FILE) size = CRDP_MIC_SOURCE_MAX_FILE;
+            size -= size % block;
+            source->samples = malloc(size ? size : 1);
+            ok = source->samples && size > 0 && fread(source->samples, 1, size, file) == size;
+            source->frames = size / block;
+        } else {
+            ok = fseek(file, (long)size + (size & 1), SEEK_CUR) == 0;
+        }
+    }
+    fclose(file);
+    if (!ok || !source->samples) {
+        WLog_ERR(CRDP_TAG, "%s is not a 16-bit PCM WAV file", path);
+        return false;
+    }
+    return true;
+}
+
+static void* crdp_mic_file_run(void* arg) {
+    crdp_mic_file_t* source = (crdp_mic_file_t*)arg;
+    uint32_t channels = source->base.format.channels;
+    uint32_t period = source->base.format.rate * CRDP_MIC_SOURCE_PERIOD_MS / 1000;
+    uint32_t at = 0;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (!atomic_load(&source->stop)) {
+        // Absolute deadlines: the chunk is "captured" once its time has passed
+        next.tv_nsec += CRDP_MIC_SOURCE_PERIOD_MS * 1000000L;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int64_t wait = (int64_t)(next.tv_sec - now.tv_sec) * 1000000000LL + (next.tv_nsec - now.tv_nsec);
+        if (wait > 0) {
+            struct timespec ts = { (time_t)(wait / 1000000000LL), (long)(wait % 1000000000LL) };
+            while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+            }
+        } else if (wait < -100000000LL) {
+            next = now;
+        }
+        uint32_t n = source->frames - at < period ? source->frames - at : period;
+        crdp_mic_capture(source->mic, source->samples + (size_t)at * channels, n);
+        at = (at + n) % source->frames;
+    }
+    return NULL;
+}
+
+static bool crdp_mic_file_start(crdp_mic_source_t* base) {
+    crdp_mic_file_t* source = (crdp_mic_file_t*)base;
+    atomic_store(&source->stop, false);
+    source->running = pthread_create(&source->thread, NULL, crdp_mic_file_run, source) == 0;
+    return source->running;
+}
+
+static void crdp_mic_file_stop(crdp_mic_source_t* base) {
+    crdp_mic_file_t* source = (crdp_mic_file_t*)base;
+    if (!source->running) return;
+    atomic_store(&source->stop, true);
+    pthread_join(source->thread, NULL);
+    source->running = false;
+}
+
+static void crdp_mic_file_free(crdp_mic_source_t* base) {
+    crdp_mic_file_t* source = (crdp_mic_file_t*)base;
+    crdp_mic_file_stop(base);
+    free(source->samples);
+    free(source);
+}
+
+crdp_mic_source_t* crdp_mic_source_file_new(crdp_mic_t* mic, const char* path) {
+    if (!path || !path[0]) {
+        WLog_ERR(CRDP_TAG, "File microphone input needs a path");
+        return NULL;
+    }
+    crdp_mic_file_t* source = calloc(1, sizeof(*source));
+    if (!source) return NULL;
+    source->mic = mic;
+    if (!crdp_mic_file_load(source, path)) {
+        free(source->samples);
+        free(source);
+        return NULL;
+    }
+    source->base.start = crdp_mic_file_start;
+    source->base.stop = crdp_mic_file_stop;
+    source->base.free = crdp_mic_file_free;
+    return &source->base;
+}
+
+// Input device
+
+#ifdef __APPLE__
+
+#define CRDP_MIC_DEVICE_BUFFERS 3
+#define CRDP_MIC_DEVICE_RATE 48000
+
+typedef struct {
+    crdp_mic_source_t base;
+    crdp_mic_t* mic;
+    AudioQueueRef queue;
+    _Atomic bool running;
+} crdp_mic_device_t;
+
+// Audio queue's thread
+static void crdp_mic_device_input(void* ref, AudioQueueRef queue, AudioQueueBufferRef buffer,
+                                  const AudioTimeStamp* start, UInt32 packets,
+                                  const AudioStreamPacketDescription* desc) {
+    crdp_mic_device_t* source = (crdp_mic_device_t*)ref;
+    (void)start;
+    (void)packets;
+    (void)desc;
+    if (!atomic_load(&source->running)) return;
+    crdp_mic_capture(source->mic, (const int16_t*)buffer->mAudioData,
+                     buffer->mAudioDataByteSize / (source->base.format.channels * 2u));
+    AudioQueueEnqueueBuffer(queue, buffer, 0, NULL);
+}
+
+static void crdp_mic_device_stop(crdp_mic_source_t* base) {
+    crdp_mic_device_t* source = (crdp_mic_device_t*)base;
+    if (!source->queue) return;
+    atomic_store(&source->running, false);
+    // Synchronous: no callback runs after this
+    AudioQueueStop(source->queue, true);
+    AudioQueueDispose(source->queue, true);
+    source->queue = NULL;
+}
+
+static bool crdp_mic_device_start(crdp_mic_source_t* base) {
+    crdp_mic_device_t* source = (crdp_mic_device_t*)base;
+    const crdp_audio_format_t* format = &base->format;
+    // The audio queue converts from whatever the device delivers
+    AudioStreamBasicDescription asbd = {
+        .mSampleRate = format->rate,
+        .mFormatID = kAudioFormatLinearPCM,
+        .mFormatFlags = kAudioFormatFlagIsSignedInteger | kAudioFormatFlagIsPacked,
+        .mBytesPerPacket = (UInt32)format->channels * 2,
+        .mFramesPerPacket = 1,
+        .mBytesPerFrame = (UInt32)format->channels * 2,
+        .mChannelsPerFrame = format->channels,
+        .mBitsPerChannel = 16,
+    };
+    // No run loop: callbacks come on the queue's own thread
+    OSStatus rc = AudioQueueNewInput(&asbd, crdp_mic_device_input, source, NULL, NULL, 0, &source->queue);
+    if (rc != noErr) {
+        WLog_ERR(CRDP_TAG, "Failed to open the audio input: %d", (int)rc);
+        source->queue = NULL;
+        return false;
+    }
+    UInt32 bytes = format->rate * CRDP_MIC_SOURCE_PERIOD_MS / 1000 * asbd.mBytesPerFrame;
+    for (int i = 0; i < CRDP_MIC_DEVICE_BUFFERS && rc == noErr; i++) {
+        AudioQueueBufferRef buffer;
+        rc = AudioQueueAllocateBuffer(source->queue, bytes, &buffer);
+        if (rc == noErr) rc = AudioQueueEnqueueBuffer(source->queue, buffer, 0, NULL);
+    }
+    atomic_store(&source->running, true);
+    if (rc == noErr) rc = AudioQueueStart(source->queue, NULL);
+    if (rc != noErr) {
+        // Also what a missing microphone permission looks like
+        WLog_ERR(CRDP_TAG, "Failed to start the audio input: %d", (int)rc);
+        crdp_mic_device_stop(base);
+        return false;
+    }
+    return true;
+}
+
+static void crdp_mic_device_free(crdp_mic_source_t* base) {
+    crdp_mic_device_stop(base);
+    free(base);
+}
+
+crdp_mic_source_t* crdp_mic_source_device_new(crdp_mic_t* mic) {
+    crdp_mic_device_t* source = calloc(1, sizeof(*source));
+    if (!source) return NULL;
+    source->mic = mic;
+    source->base.format.rate = CRDP_MIC_DEVICE_RATE;
+    source->base.format.channels = 1;
+    source->base.start = crdp_mic_device_start;
+    source->base.stop = crdp_mic_device_stop;
+    source->base.free = crdp_mic_device_free;
+    return &source->base;
+}
+
+#else
+
+crdp_mic_source_t* crdp_mic_source_device_new(crdp_mic_t* mic) {
+    (void)mic;
+    WLog_ERR(CRDP_TAG, "No audio input device support on this platform; use a file source");
+    return NULL;
+}
+
+#endif
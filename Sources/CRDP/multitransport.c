@@ -0,0 +1,233 @@
+#include "crdp_internal.h"
+
+#include <freerdp/freerdp.h>
+#include <winpr/wlog.h>
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// RDP-UDP multitransport.
+//
+// The server offers each UDP transport with an Initiate Multitransport Request
+// on the TCP connection (MS-RDPBCGR 2.2.15.1). FreeRDP's client core answers
+// the requests itself and, having no RDP-UDP (MS-RDPEUDP) implementation,
+// declines them, which tells the server to keep everything on TCP. CRDP
+// watches for the requests (transport.c) and runs the RDP-UDP SYN handshake
+// for each offered transport on a thread of its own, so the statistics show
+// whether UDP would get through and how its round trip compares. Nothing
+// follows the SYN; the server drops the half-open connection by itself.
+
+// Initiate Multitransport Request: basic security header, requestId,
+// requestedProtocol, reserved and the security cookie
+#define CRDP_SEC_TRANSPORT_REQ 0x0002
+#define CRDP_MT_REQUEST_LEN 28
+#define CRDP_MT_PROTOCOL_UDP_FECR 0x01
+#define CRDP_MT_PROTOCOL_UDP_FECL 0x02
+
+// RDP-UDP SYN (MS-RDPEUDP 2.2.2.1, 2.2.2.5)
+#define CRDP_UDP_FLAG_SYN 0x0001
+#define CRDP_UDP_FLAG_ACK 0x0004
+#define CRDP_UDP_FLAG_SYNLOSSY 0x0200
+#define CRDP_UDP_MTU 1232             // The SYN datagram is padded to this size
+#define CRDP_UDP_RECEIVE_WINDOW 64
+#define CRDP_UDP_SYN_ATTEMPTS 4
+#define CRDP_UDP_SYN_TIMEOUT_MS 500   // Doubles with every retransmission
+#define CRDP_UDP_POLL_MS 100          // How soon a probe notices a disconnect
+
+static inline uint16_t crdp_read_u16_le(const uint8_t* p) { return (uint16_t)(p[0] | (p[1] << 8)); }
+static inline uint16_t crdp_read_u16_be(const uint8_t* p) { return (uint16_t)((p[0] << 8) | p[1]); }
+static inline uint32_t crdp_read_u32_be(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint8_t* crdp_put_be(uint8_t* p, uint32_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) *p++ = (uint8_t)(value >> (8 * i));
+    return p;
+}
+
+void crdp_multitransport_configure(crdp_client_t* client, rdpSettings* settings) {
+    bool udp = client->config.udp_transport;
+    freerdp_settings_set_bool(settings, FreeRDP_SupportMultitransport, udp);
+    freerdp_settings_set_uint32(settings, FreeRDP_MultitransportFlags,
+                                udp ? TRANSPORT_TYPE_UDP_FECR | TRANSPORT_TYPE_UDP_FECL : 0);
+    if (udp) WLog_INFO(CRDP_TAG, "Advertising RDP-UDP multitransport (reliable and lossy)");
+}
+
+// Connected UDP socket to the server's RDP port, or -1
+static int crdp_udp_open(crdp_client_t* client) {
+    char port[8];
+    snprintf(port, sizeof(port), "%u", client->config.port ? client->config.port : 3389);
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM };
+    struct addrinfo* addrs = NULL;
+    int rc = getaddrinfo(client->config.host, port, &hints, &addrs);
+    if (rc != 0) {
+        WLog_WARN(CRDP_TAG, "RDP-UDP: failed to resolve %s: %s", client->config.host, gai_strerror(rc));
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo* ai = addrs; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        // Connected, so an ICMP port unreachable shows up as ECONNREFUSED
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addrs);
+    return fd;
+}
+
+// SYN+ACK acknowledging our initial sequence number
+static bool crdp_udp_is_syn_ack(const uint8_t* data, ssize_t len, uint32_t isn) {
+    if (len < 16) return false;
+    uint16_t flags = crdp_read_u16_be(data + 6);
+    return (flags & (CRDP_UDP_FLAG_SYN | CRDP_UDP_FLAG_ACK)) == (CRDP_UDP_FLAG_SYN | CRDP_UDP_FLAG_ACK) &&
+           crdp_read_u32_be(data) == isn;
+}
+
+static void* crdp_udp_probe_run(void* arg) {
+    crdp_udp_probe_t* probe = (crdp_udp_probe_t*)arg;
+    crdp_multitransport_t* mt = &probe->client->multitransport;
+    const char* name = probe->lossy ? "lossy" : "reliable";
+    int state = CRDP_UDP_BLOCKED;
+    bool refused = false;
+
+    int fd = crdp_udp_open(probe->client);
+    if (fd >= 0) {
+        uint32_t isn = (uint32_t)crdp_hash64(&probe, sizeof(probe), crdp_time_ms());
+        uint8_t syn[CRDP_UDP_MTU] = { 0 };
+        uint8_t* p = crdp_put_be(syn, 0xFFFFFFFF, 4);  // snSourceAck: nothing received yet
+        p = crdp_put_be(p, CRDP_UDP_RECEIVE_WINDOW, 2);
+        p = crdp_put_be(p, CRDP_UDP_FLAG_SYN | (probe->lossy ? CRDP_UDP_FLAG_SYNLOSSY : 0), 2);
+        p = crdp_put_be(p, isn, 4);
+        p = crdp_put_be(p, CRDP_UDP_MTU, 2);           // Upstream MTU
+        crdp_put_be(p, CRDP_UDP_MTU, 2);               // Downstream MTU
+
+        uint32_t timeout = CRDP_UDP_SYN_TIMEOUT_MS;
+        for (int attempt = 0; attempt < CRDP_UDP_SYN_ATTEMPTS && state == CRDP_UDP_BLOCKED && !refused &&
+                              !atomic_load(&mt->stop);
+             attempt++, timeout *= 2) {
+            // Retransmissions repeat the SYN unchanged, so an answer can't be
+            // matched to an attempt; the round trip counts from the last one
+            uint64_t sent = crdp_time_ms();
+            if (send(fd, syn, sizeof(syn), 0) < 0) {
+                refused = errno == ECONNREFUSED;
+                continue;
+            }
+            atomic_fetch_add(&probe->syns_sent, 1);
+            while (!atomic_load(&mt->stop)) {
+                uint64_t elapsed = crdp_time_ms() - sent;
+                if (elapsed >= timeout) break;
+                uint64_t left = timeout - elapsed;
+                struct pollfd pfd = { .fd = fd, .events = POLLIN };
+                if (poll(&pfd, 1, left < CRDP_UDP_POLL_MS ? (int)left : CRDP_UDP_POLL_MS) <= 0) continue;
+                uint8_t reply[CRDP_UDP_MTU];
+                ssize_t len = recv(fd, reply, sizeof(reply), 0);
+                if (len < 0) {
+                    refused = errno == ECONNREFUSED;
+                    if (refused) break;
+                } else if (crdp_udp_is_syn_ack(reply, len, isn)) {
+                    atomic_store(&probe->rtt_ms, (uint32_t)(crdp_time_ms() - sent));
+                    state = CRDP_UDP_REACHABLE;
+                    break;
+                }
+            }
+        }
+        close(fd);
+    }
+
+    if (state == CRDP_UDP_REACHABLE) {
+        WLog_INFO(CRDP_TAG, "RDP-UDP %s: server answered in %u ms; the session stays on TCP", name,
+                  atomic_load(&probe->rtt_ms));
+    } else if (refused) {
+        WLog_INFO(CRDP_TAG, "RDP-UDP %s: the server's UDP port is closed; TCP only", name);
+    } else if (!atomic_load(&mt->stop)) {
+        WLog_INFO(CRDP_TAG, "RDP-UDP %s: no answer after %u attempts; TCP only", name,
+                  atomic_load(&probe->syns_sent));
+    }
+    atomic_store(&probe->state, state);
+    return NULL;
+}
+
+void crdp_multitransport_observe(crdp_client_t* client, const uint8_t* payload, size_t len) {
+    // Security headers are only present on a few PDUs, so this is the exact size
+    if (len != CRDP_MT_REQUEST_LEN || crdp_read_u16_le(payload) != CRDP_SEC_TRANSPORT_REQ) return;
+    crdp_multitransport_t* mt = &client->multitransport;
+    uint16_t protocol = crdp_read_u16_le(payload + 8);
+    crdp_udp_probe_t* probe = protocol == CRDP_MT_PROTOCOL_UDP_FECR   ? &mt->reliable
+                              : protocol == CRDP_MT_PROTOCOL_UDP_FECL ? &mt->lossy
+                                                                      : NULL;
+    if (!probe) return;
+    atomic_fetch_add(&mt->udp_requests, 1);
+    WLog_INFO(CRDP_TAG, "Server offers RDP-UDP %s", probe->lossy ? "lossy" : "reliable");
+    // A repeated offer (e.g. after a reconnect) doesn't probe again
+    if (probe->started) return;
+
+    atomic_store(&probe->state, CRDP_UDP_PROBING);
+    probe->started = pthread_create(&probe->thread, NULL, crdp_udp_probe_run, probe) == 0;
+    if (!probe->started) {
+        WLog_WARN(CRDP_TAG, "Failed to start the RDP-UDP probe");
+        atomic_store(&probe->state, CRDP_UDP_NOT_OFFERED);
+    }
+}
+
+void crdp_multitransport_stop(crdp_client_t* client) {
+    crdp_multitransport_t* mt = &client->multitransport;
+    atomic_store(&mt->stop, true);
+    crdp_udp_probe_t* probes[] = { &mt->reliable, &mt->lossy };
+    for (int i = 0; i < 2; i++) {
+        if (!probes[i]->started) continue;
+        pthread_join(probes[i]->thread, NULL);
+        probes[i]->started = false;
+    }
+}
+
+static void crdp_udp_probe_reset(crdp_udp_probe_t* probe, crdp_client_t* client, bool lossy) {
+    probe->client = client;
+    probe->lossy = lossy;
+    atomic_store(&probe->state, CRDP_UDP_NOT_OFFERED);
+    atomic_store(&probe->syns_sent, 0);
+    atomic_store(&probe->rtt_ms, 0);
+}
+
+void crdp_multitransport_reset(crdp_client_t* client) {
+    crdp_multitransport_t* mt = &client->multitransport;
+    // Probes of a connection that ended on its own may still be running
+    crdp_multitransport_stop(client);
+    atomic_store(&mt->stop, false);
+    atomic_store(&mt->udp_requests, 0);
+    atomic_store(&mt->connect_rtt_ms, 0);
+    atomic_store(&mt->connect_tier, CRDP_LINK_LAN);
+    crdp_udp_probe_reset(&mt->reliable, client, false);
+    crdp_udp_probe_reset(&mt->lossy, client, true);
+}
+
+static void crdp_udp_probe_stats(crdp_udp_probe_t* probe, crdp_udp_transport_stats_t* stats) {
+    stats->state = (crdp_udp_state_t)atomic_load(&probe->state);
+    stats->syns_sent = atomic_load(&probe->syns_sent);
+    stats->rtt_ms = atomic_load(&probe->rtt_ms);
+}
+
+int crdp_get_transport_stats(crdp_client_t* client, crdp_transport_stats_t* stats) {
+    if (!client || !stats) return -1;
+    crdp_multitransport_t* mt = &client->multitransport;
+    memset(stats, 0, sizeof(*stats));
+    stats->pdus_received = crdp_metrics_counter(client, CRDP_COUNTER_PDUS_RECEIVED);
+    stats->bytes_received = crdp_metrics_counter(client, CRDP_COUNTER_BYTES_RECEIVED);
+    stats->pdus_sent = crdp_metrics_counter(client, CRDP_COUNTER_PDUS_SENT);
+    stats->bytes_sent = crdp_metrics_counter(client, CRDP_COUNTER_BYTES_SENT);
+    // Same source as crdp_get_rtt_ms, without its frame-timing fallback
+    rdpContext* context = client->connected && client->instance ? client->instance->context : NULL;
+    if (context && context->autodetect) stats->tcp_rtt_ms = context->autodetect->netCharAverageRTT;
+    stats->connect_rtt_ms = atomic_load(&mt->connect_rtt_ms);
+    stats->connect_tier = (crdp_link_tier_t)atomic_load(&mt->connect_tier);
+    stats->udp_requests = atomic_load(&mt->udp_requests);
+    crdp_udp_probe_stats(&mt->reliable, &stats->udp_reliable);
+    crdp_udp_probe_stats(&mt->lossy, &stats->udp_lossy);
+    return 0;
+}
@@ -0,0 +1,434 @@
+#include "crdp_internal.h"
+
+#include <winpr/wlog.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Session recording player. Opening a recording indexes its segments from
+// the chunk headers alone; a seek decodes from the last segment that starts
+// at or before the time asked for. Format in crdp_internal.h.
+
+typedef struct {
+    long offset;             // Chunk header
+    uint64_t time_ms;
+    uint64_t session_ms;     // Timeline time the segment's session started
+} crdp_player_segment_t;
+
+// Tile stored in the current segment
+typedef struct {
+    uint64_t hash;           // 0 = free slot
+    size_t offset;           // Into the arena
+    uint8_t w;
+    uint8_t h;
+} crdp_player_tile_t;
+
+// Header of a record, read ahead of what follows it
+typedef struct {
+    crdp_rec_type_t type;
+    uint64_t time_ms;        // Timeline time, for FRAME, POINTER and KEY
+    uint32_t count;
+    uint16_t flags;
+    uint16_t x;
+    uint16_t y;
+} crdp_player_record_t;
+
+struct crdp_recording {
+    FILE* file;
+    crdp_player_segment_t* segments;
+    uint32_t segment_count;
+    uint32_t sessions;
+    uint64_t duration_ms;
+    // Session the stream is in; the first session's start is time 0
+    uint64_t first_start;
+    uint64_t last_ms;
+    uint64_t session_ms;
+    // Record stream
+    uint8_t* block;
+    size_t block_len;
+    size_t block_pos;
+    uint8_t* packed;
+    crdp_player_record_t peeked;
+    bool have_peeked;
+    // Screen
+    uint8_t* screen;
+    uint32_t width;
+    uint32_t height;
+    int32_t pointer_x;
+    int32_t pointer_y;
+    uint64_t frame_ms;
+    bool shown;              // A frame was decoded since the last seek
+    crdp_player_tile_t* tiles;
+    uint32_t tile_cap;
+    uint32_t tile_count;
+    uint8_t* arena;
+    size_t arena_len;
+    size_t arena_cap;
+};
+
+static uint64_t crdp_player_get_le(const uint8_t* p, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) value |= (uint64_t)p[i] << (8 * i);
+    return value;
+}
+
+// A session header's Unix start time onto the timeline; never backwards,
+// even if the clock was
+static uint64_t crdp_player_session_start(crdp_recording_t* rec, const uint8_t* header) {
+    uint64_t start = crdp_player_get_le(header + 16, 8);
+    if (rec->sessions++ == 0) rec->first_start = start;
+    uint64_t ms = start > rec->first_start ? start - rec->first_start : 0;
+    return ms > rec->last_ms ? ms : rec->last_ms;
+}
+
+static bool crdp_player_header_ok(const uint8_t* header) {
+    return crdp_player_get_le(header + 8, 4) == CRDP_RECORDING_VERSION &&
+           crdp_player_get_le(header + 12, 4) == CRDP_RECORDING_TILE;
+}
+
+static bool crdp_player_index(crdp_recording_t* rec) {
+    for (;;) {
+        long offset = ftell(rec->file);
+        uint8_t header[CRDP_RECORDING_HEADER_SIZE];
+        if (fread(header, 1, 8, rec->file) != 8) break;
+        if (memcmp(header, CRDP_RECORDING_MAGIC, 8) == 0) {
+            if (fread(header + 8, 1, CRDP_RECORDING_HEADER_SIZE - 8, rec->file) != CRDP_RECORDING_HEADER_SIZE - 8)
+                break;
+            if (!crdp_player_header_ok(header)) return false;
+            rec->session_ms = crdp_player_session_start(rec, header);
+            continue;
+        }
+        if (rec->sessions == 0) return false;
+        if (fread(header + 8, 1, CRDP_RECORDING_CHUNK_HEADER_SIZE - 8, rec->file) !=
+            CRDP_RECORDING_CHUNK_HEADER_SIZE - 8)
+            break;
+        uint32_t stored = (uint32_t)crdp_player_get_le(header + 4, 4) & ~CRDP_RECORDING_STORED;
+        uint64_t ms = rec->session_ms + crdp_player_get_le(header + 8, 4);
+        if (crdp_player_get_le(header + 12, 4) & CRDP_RECORDING_SEGMENT) {
+            if ((rec->segment_count & (rec->segment_count + 1)) == 0) {
+                crdp_player_segment_t* segments =
+                    realloc(rec->segments, (rec->segment_count * 2 + 1) * sizeof(*segments));
+                if (!segments) return false;
+                rec->segments = segments;
+            }
+            rec->segments[rec->segment_count++] = (crdp_player_segment_t){ offset, ms, rec->session_ms };
+        }
+        if (ms > rec->last_ms) rec->last_ms = ms;
+        if (fseek(rec->file, stored, SEEK_CUR) != 0) break;
+    }
+    rec->duration_ms = rec->last_ms;
+    return true;
+}
+
+// Record stream
+
+// Loads the next chunk, stepping over session headers; false at the end
+static bool crdp_player_next_block(crdp_recording_t* rec) {
+    uint8_t header[CRDP_RECORDING_HEADER_SIZE];
+    for (;;) {
+        if (fread(header, 1, 8, rec->file) != 8) return false;
+        if (memcmp(header, CRDP_RECORDING_MAGIC, 8) != 0) break;
+        if (fread(header + 8, 1, CRDP_RECORDING_HEADER_SIZE - 8, rec->file) != CRDP_RECORDING_HEADER_SIZE - 8)
+            return false;
+        // Only reached playing on from one session into the next, whose
+        // segments were all indexed: take its start from there
+        long offset = ftell(rec->file);
+        for (uint32_t i = 0; i < rec->segment_count; i++) {
+            if (rec->segments[i].offset >= offset) {
+                rec->session_ms = rec->segments[i].session_ms;
+                break;
+            }
+        }
+    }
+    if (fread(header + 8, 1, CRDP_RECORDING_CHUNK_HEADER_SIZE - 8, rec->file) != CRDP_RECORDING_CHUNK_HEADER_SIZE - 8)
+        return false;
+    size_t raw = (size_t)crdp_player_get_le(header, 4);
+    uint32_t stored = (uint32_t)crdp_player_get_le(header + 4, 4);
+    bool plain = (stored & CRDP_RECORDING_STORED) != 0;
+    stored &= ~CRDP_RECORDING_STORED;
+    if (raw == 0 || raw > CRDP_RECORDING_CHUNK_SIZE || (plain ? stored != raw : stored >= raw)) return false;
+    if (plain) {
+        if (fread(rec->block, 1, raw, rec->file) != raw) return false;
+    } else if (fread(rec->packed, 1, stored, rec->file) != stored ||
+               crdp_lz4_decompress(rec->packed, stored, rec->block, raw) != raw) {
+        return false;
+    }
+    rec->block_len = raw;
+    rec->block_pos = 0;
+    return true;
+}
+
+static bool crdp_player_read(crdp_recording_t* rec, uint8_t* dst, size_t len) {
+    while (len > 0) {
+        if (rec->block_pos == rec->block_len && !crdp_player_next_block(rec)) return false;
+        size_t n = rec->block_len - rec->block_pos;
+        if (n > len) n = len;
+        memcpy(dst, rec->block + rec->block_pos, n);
+        rec->block_pos += n;
+        dst += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Reads a record's fixed part. Returns 1, 0 at the end, -1 if damaged.
+static int crdp_player_read_record(crdp_recording_t* rec, crdp_player_record_t* r) {
+    if (rec->have_peeked) {
+        *r = rec->peeked;
+        rec->have_peeked = false;
+        return 1;
+    }
+    uint8_t p[11];
+    if (!crdp_player_read(rec, p, 1)) return 0;
+    r->type = (crdp_rec_type_t)p[0];
+    size_t len;
+    switch (r->type) {
+        case CRDP_REC_SIZE: len = 5; break;
+        case CRDP_REC_FRAME: len = 9; break;
+        case CRDP_REC_POINTER: len = 11; break;
+        case CRDP_REC_KEY: len = 9; break;
+        default: return -1;
+    }
+    if (!crdp_player_read(rec, p + 1, len - 1)) return 0;
+    if (r->type == CRDP_REC_SIZE) {
+        r->x = (uint16_t)crdp_player_get_le(p + 1, 2);
+        r->y = (uint16_t)crdp_player_get_le(p + 3, 2);
+        return 1;
+    }
+    r->time_ms = rec->session_ms + crdp_player_get_le(p + 1, 4);
+    r->count = (uint32_t)crdp_player_get_le(p + 5, 4);
+    r->flags = (uint16_t)crdp_player_get_le(p + 5, 2);
+    r->x = (uint16_t)crdp_player_get_le(p + 7, 2);
+    if (r->type == CRDP_REC_POINTER) r->y = (uint16_t)crdp_player_get_le(p + 9, 2);
+    return 1;
+}
+
+// Screen
+
+static bool crdp_player_resize(crdp_recording_t* rec, uint32_t width, uint32_t height) {
+    uint8_t* screen = realloc(rec->screen, (size_t)width * height * 4);
+    if (!screen) return false;
+    rec->screen = screen;
+    rec->width = width;
+    rec->height = height;
+    memset(rec->screen, 0, (size_t)width * height * 4);
+    // A new segment: the tiles it refers to are all in it
+    if (rec->tiles) memset(rec->tiles, 0, rec->tile_cap * sizeof(*rec->tiles));
+    rec->tile_count = 0;
+    rec->arena_len = 0;
+    return true;
+}
+
+static crdp_player_tile_t* crdp_player_find(crdp_recording_t* rec, uint64_t hash) {
+    if (!rec->tiles) return NULL;
+    uint32_t mask = rec->tile_cap - 1;
+    for (uint32_t i = (uint32_t)hash & mask;; i = (i + 1) & mask) {
+        if (rec->tiles[i].hash == hash || rec->tiles[i].hash == 0) return &rec->tiles[i];
+    }
+}
+
+static crdp_player_tile_t* crdp_player_add(crdp_recording_t* rec, uint64_t hash) {
+    if ((rec->tile_count + 1) * 2 > rec->tile_cap) {
+        uint32_t cap = rec->tile_cap ? rec->tile_cap * 2 : 1024;
+        crdp_player_tile_t* old = rec->tiles;
+        uint32_t old_cap = rec->tile_cap;
+        rec->tiles = calloc(cap, sizeof(*rec->tiles));
+        if (!rec->tiles) {
+            rec->tiles = old;
+            return NULL;
+        }
+        rec->tile_cap = cap;
+        for (uint32_t i = 0; i < old_cap; i++) {
+            if (old[i].hash) *crdp_player_find(rec, old[i].hash) = old[i];
+        }
+        free(old);
+    }
+    crdp_player_tile_t* tile = crdp_player_find(rec, hash);
+    if (tile->hash == 0) rec->tile_count++;
+    tile->hash = hash;
+    return tile;
+}
+
+static void crdp_player_blit(crdp_recording_t* rec, uint32_t col, uint32_t row, const crdp_player_tile_t* tile) {
+    uint32_t x0 = col * CRDP_RECORDING_TILE;
+    uint32_t y0 = row * CRDP_RECORDING_TILE;
+    if (x0 >= rec->width || y0 >= rec->height) return;
+    uint32_t w = tile->w < rec->width - x0 ? tile->w : rec->width - x0;
+    uint32_t h = tile->h < rec->height - y0 ? tile->h : rec->height - y0;
+    const uint8_t* src = rec->arena + tile->offset;
+    for (uint32_t y = 0; y < h; y++) {
+        memcpy(rec->screen + ((size_t)(y0 + y) * rec->width + x0) * 4, src + (size_t)y * tile->w * 4, (size_t)w * 4);
+    }
+}
+
+// Applies the tile records of a frame
+static int crdp_player_apply(crdp_recording_t* rec, uint32_t count) {
+    for (uint32_t n = 0; n < count; n++) {
+        uint8_t p[15];
+        if (!crdp_player_read(rec, p, 13)) return 0;
+        uint32_t col = (uint32_t)crdp_player_get_le(p + 1, 2);
+        uint32_t row = (uint32_t)crdp_player_get_le(p + 3, 2);
+        if (p[0] == CRDP_REC_TILE_REF) {
+            crdp_player_tile_t* tile = crdp_player_find(rec, crdp_player_get_le(p + 5, 8));
+            if (!tile || tile->hash == 0) return -1;
+            crdp_player_blit(rec, col, row, tile);
+            continue;
+        }
+        if (p[0] != CRDP_REC_TILE || !crdp_player_read(rec, p + 13, 2)) return p[0] == CRDP_REC_TILE ? 0 : -1;
+        uint8_t w = p[5];
+        uint8_t h = p[6];
+        size_t bytes = (size_t)w * h * 4;
+        if (w == 0 || h == 0 || w > CRDP_RECORDING_TILE || h > CRDP_RECORDING_TILE) return -1;
+        if (rec->arena_len + bytes > rec->arena_cap) {
+            size_t cap = rec->arena_cap ? rec->arena_cap * 2 : 4 * 1024 * 1024;
+            uint8_t* arena = realloc(rec->arena, cap);
+            if (!arena) return -1;
+            rec->arena = arena;
+            rec->arena_cap = cap;
+        }
+        if (!crdp_player_read(rec, rec->arena + rec->arena_len, bytes)) return 0;
+        crdp_player_tile_t* tile = crdp_player_add(rec, crdp_player_get_le(p + 7, 8));
+        if (!tile) return -1;
+        tile->offset = rec->arena_len;
+        tile->w = w;
+        tile->h = h;
+        rec->arena_len += bytes;
+        crdp_player_blit(rec, col, row, tile);
+    }
+    return 1;
+}
+
+static void crdp_player_item(crdp_recording_t* rec, crdp_recording_item_type_t type, uint64_t time_ms,
+                             crdp_recording_item_t* item) {
+    memset(item, 0, sizeof(*item));
+    item->type = type;
+    item->time_ms = time_ms;
+    item->data = rec->screen;
+    item->width = rec->width;
+    item->height = rec->height;
+    item->stride = rec->width * 4;
+    item->pointer_x = rec->pointer_x;
+    item->pointer_y = rec->pointer_y;
+}
+
+// Applies the next record; returns 1 with an item for FRAME, POINTER and KEY
+static int crdp_player_step(crdp_recording_t* rec, crdp_recording_item_t* item) {
+    for (;;) {
+        crdp_player_record_t r;
+        int rc = crdp_player_read_record(rec, &r);
+        if (rc <= 0) return rc;
+        switch (r.type) {
+            case CRDP_REC_SIZE:
+                if (r.x == 0 || r.y == 0 || !crdp_player_resize(rec, r.x, r.y)) return -1;
+                continue;
+            case CRDP_REC_FRAME:
+                if (!rec->screen) return -1;
+                rc = crdp_player_apply(rec, r.count);
+                if (rc <= 0) return rc;
+                rec->frame_ms = r.time_ms;
+                rec->shown = true;
+                crdp_player_item(rec, CRDP_RECORDING_FRAME, r.time_ms, item);
+                return 1;
+            case CRDP_REC_POINTER:
+                rec->pointer_x = r.x;
+                rec->pointer_y = r.y;
+                crdp_player_item(rec, CRDP_RECORDING_POINTER, r.time_ms, item);
+                item->flags = r.flags;
+                return 1;
+            case CRDP_REC_KEY:
+                crdp_player_item(rec, CRDP_RECORDING_KEY, r.time_ms, item);
+                item->flags = r.flags;
+                item->scancode = r.x;
+                return 1;
+            default:
+                return -1;
+        }
+    }
+}
+
+// Decodes from the start of a segment on
+static bool crdp_player_rewind(crdp_recording_t* rec, uint32_t segment) {
+    if (fseek(rec->file, rec->segments[segment].offset, SEEK_SET) != 0) return false;
+    rec->session_ms = rec->segments[segment].session_ms;
+    rec->block_len = rec->block_pos = 0;
+    rec->have_peeked = false;
+    rec->shown = false;
+    rec->pointer_x = rec->pointer_y = -1;
+    rec->frame_ms = 0;
+    return true;
+}
+
+crdp_recording_t* crdp_recording_open(const char* path) {
+    if (!path) return NULL;
+    crdp_recording_t* rec = calloc(1, sizeof(*rec));
+    if (!rec) return NULL;
+    rec->file = fopen(path, "rb");
+    rec->block = malloc(CRDP_RECORDING_CHUNK_SIZE);
+    rec->packed = malloc(crdp_lz4_bound(CRDP_RECORDING_CHUNK_SIZE));
+    if (!rec->file || !rec->block || !rec->packed || !crdp_player_index(rec) || rec->segment_count == 0) {
+        WLog_ERR(CRDP_TAG, "%s is not a CRDP session recording%s", path, rec->file ? "" : " or can't be read");
+        crdp_recording_close(rec);
+        return NULL;
+    }
+    if (!crdp_player_rewind(rec, 0)) {
+        crdp_recording_close(rec);
+        return NULL;
+    }
+    return rec;
+}
+
+void crdp_recording_close(crdp_recording_t* rec) {
+    if (!rec) return;
+    if (rec->file) fclose(rec->file);
+    free(rec->segments);
+    free(rec->block);
+    free(rec->packed);
+    free(rec->screen);
+    free(rec->tiles);
+    free(rec->arena);
+    free(rec);
+}
+
+int crdp_recording_get_info(crdp_recording_t* rec, crdp_recording_info_t* info) {
+    if (!rec || !info) return -1;
+    memset(info, 0, sizeof(*info));
+    info->duration_ms = rec->duration_ms;
+    info->segments = rec->segment_count;
+    info->sessions = rec->sessions;
+    return 0;
+}
+
+int crdp_recording_seek(crdp_recording_t* rec, uint64_t time_ms, crdp_recording_item_t* item) {
+    if (!rec || !item) return -1;
+    uint32_t i = 0;
+    while (i + 1 < rec->segment_count && rec->segments[i + 1].time_ms <= time_ms) i++;
+    if (!crdp_player_rewind(rec, i)) return -1;
+
+    // Up to the last record at or before the time; the one after it is
+    // where crdp_recording_next() goes on
+    for (;;) {
+        crdp_player_record_t r;
+        int rc = crdp_player_read_record(rec, &r);
+        if (rc < 0) return -1;
+        if (rc == 0) break;
+        if (r.type == CRDP_REC_SIZE) {
+            if (r.x == 0 || r.y == 0 || !crdp_player_resize(rec, r.x, r.y)) return -1;
+            continue;
+        }
+        rec->peeked = r;
+        rec->have_peeked = true;
+        if (r.time_ms > time_ms) break;
+        crdp_recording_item_t skipped;
+        if (crdp_player_step(rec, &skipped) < 0) return -1;
+    }
+    if (!rec->shown) return 0;
+    crdp_player_item(rec, CRDP_RECORDING_FRAME, rec->frame_ms, item);
+    return 1;
+}
+
+int crdp_recording_next(crdp_recording_t* rec, crdp_recording_item_t* item) {
+    if (!rec || !item) return -1;
+    return crdp_player_step(rec, item);
+}
@@ -0,0 +1,181 @@
+#include "crdp_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+// PNG encoder for framebuffer snapshots: 8-bit RGB (the framebuffer's alpha
+// is unused), one IDAT. ImageIO (clipboard_mac.m) has no control over the
+// filter or the zlib level, and at its settings a desktop screenshot takes
+// several times longer to encode.
+
+typedef struct {
+    uint8_t* data;
+    size_t len;
+    size_t cap;
+} crdp_png_buf_t;
+
+static bool crdp_png_reserve(crdp_png_buf_t* buf, size_t len) {
+    if (buf->len + len <= buf->cap) return true;
+    size_t cap = buf->cap ? buf->cap : 64 * 1024;
+    while (cap < buf->len + len) cap *= 2;
+    uint8_t* data = realloc(buf->data, cap);
+    if (!data) return false;
+    buf->data = data;
+    buf->cap = cap;
+    return true;
+}
+
+static void crdp_png_put32(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+// Chunk around data already in the buffer at offset start + 8
+static void crdp_png_seal(crdp_png_buf_t* buf, size_t start, const char* type) {
+    uint32_t len = (uint32_t)(buf->len - start - 8);
+    crdp_png_put32(buf->data + start, len);
+    memcpy(buf->data + start + 4, type, 4);
+    uint32_t crc = (uint32_t)crc32(0, buf->data + start + 4, len + 4);
+    crdp_png_put32(buf->data + buf->len, crc);
+    buf->len += 4;
+}
+
+static inline uint8_t crdp_png_paeth(uint8_t a, uint8_t b, uint8_t c) {
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    return pb <= pc ? b : c;
+}
+
+// PNG filter types
+enum { CRDP_PNG_NONE = 0, CRDP_PNG_SUB = 1, CRDP_PNG_UP = 2, CRDP_PNG_AVERAGE = 3, CRDP_PNG_PAETH = 4 };
+
+// One filtered row, type byte first; prev is NULL for the first. Returns the
+// sum of the bytes as signed values, the usual estimate of how well a row
+// will compress.
+static uint32_t crdp_png_filter_row(int type, const uint8_t* row, const uint8_t* prev, size_t len, uint8_t* out) {
+    out[0] = (uint8_t)type;
+    uint8_t* dst = out + 1;
+    if (!prev && (type == CRDP_PNG_UP || type == CRDP_PNG_PAETH)) {
+        // Above the first row is zero: UP is NONE and PAETH is SUB
+        type = type == CRDP_PNG_UP ? CRDP_PNG_NONE : CRDP_PNG_SUB;
+    }
+    size_t i = 0;
+    switch (type) {
+        case CRDP_PNG_SUB:
+            for (; i < 3 && i < len; i++) dst[i] = row[i];
+            for (; i < len; i++) dst[i] = (uint8_t)(row[i] - row[i - 3]);
+            break;
+        case CRDP_PNG_UP:
+            for (; i < len; i++) dst[i] = (uint8_t)(row[i] - prev[i]);
+            break;
+        case CRDP_PNG_AVERAGE:
+            for (; i < 3 && i < len; i++) dst[i] = (uint8_t)(row[i] - (prev ? prev[i] >> 1 : 0));
+            for (; i < len; i++) dst[i] = (uint8_t)(row[i] - ((row[i - 3] + (prev ? prev[i] : 0)) >> 1));
+            break;
+        case CRDP_PNG_PAETH:
+            for (; i < 3 && i < len; i++) dst[i] = (uint8_t)(row[i] - prev[i]);
+            for (; i < len; i++) dst[i] = (uint8_t)(row[i] - crdp_png_paeth(row[i - 3], prev[i], prev[i - 3]));
+            break;
+        default:
+            memcpy(dst, row, len);
+            break;
+    }
+    uint32_t cost = 0;
+    for (i = 0; i < len; i++) cost += dst[i] < 128 ? dst[i] : 256 - dst[i];
+    return cost;
+}
+
+int crdp_png_encode(const uint8_t* bgra, uint32_t width, uint32_t height, uint32_t stride, int level,
+                    crdp_png_filter_t filter, uint8_t** out, size_t* out_len) {
+    if (!bgra || width == 0 || height == 0 || !out || !out_len) return -1;
+    size_t row_len = (size_t)width * 3;
+    crdp_png_buf_t buf = { 0 };
+    // Two RGB rows, then one filtered row per filter type
+    uint8_t* rows = malloc(row_len * 2 + (row_len + 1) * 5);
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (!rows || deflateInit(&zs, level) != Z_OK) {
+        free(rows);
+        return -1;
+    }
+    int rc = -1;
+
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    if (!crdp_png_reserve(&buf, sizeof(signature) + 25)) goto out;
+    memcpy(buf.data, signature, sizeof(signature));
+    buf.len = sizeof(signature);
+    size_t start = buf.len;
+    buf.len += 8;
+    crdp_png_put32(buf.data + buf.len, width);
+    crdp_png_put32(buf.data + buf.len + 4, height);
+    // 8 bits per sample, RGB, deflate, adaptive filtering, no interlace
+    memcpy(buf.data + buf.len + 8, "\x08\x02\x00\x00\x00", 5);
+    buf.len += 13;
+    crdp_png_seal(&buf, start, "IHDR");
+
+    size_t idat = buf.len;
+    buf.len += 8;
+    uint8_t* rgb[2] = { rows, rows + row_len };
+    uint8_t* filtered = rows + row_len * 2;
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t* src = bgra + (size_t)y * stride;
+        uint8_t* row = rgb[y & 1];
+        const uint8_t* prev = y > 0 ? rgb[(y - 1) & 1] : NULL;
+        for (uint32_t x = 0; x < width; x++) {
+            row[x * 3] = src[x * 4 + 2];
+            row[x * 3 + 1] = src[x * 4 + 1];
+            row[x * 3 + 2] = src[x * 4];
+        }
+
+        uint8_t* best = filtered;
+        if (filter == CRDP_PNG_FILTER_ADAPTIVE) {
+            uint32_t best_cost = UINT32_MAX;
+            for (int type = CRDP_PNG_NONE; type <= CRDP_PNG_PAETH; type++) {
+                uint8_t* candidate = filtered + (size_t)type * (row_len + 1);
+                uint32_t cost = crdp_png_filter_row(type, row, prev, row_len, candidate);
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best = candidate;
+                }
+            }
+        } else {
+            crdp_png_filter_row((int)filter - CRDP_PNG_FILTER_NONE, row, prev, row_len, best);
+        }
+
+        zs.next_in = best;
+        zs.avail_in = (uInt)(row_len + 1);
+        int flush = y + 1 == height ? Z_FINISH : Z_NO_FLUSH;
+        for (;;) {
+            // Room for the IDAT CRC stays free
+            if (!crdp_png_reserve(&buf, 64 * 1024 + 4)) goto out;
+            zs.next_out = buf.data + buf.len;
+            zs.avail_out = (uInt)(buf.cap - buf.len - 4);
+            int zrc = deflate(&zs, flush);
+            if (zrc == Z_STREAM_ERROR) goto out;
+            buf.len = (size_t)(zs.next_out - buf.data);
+            if (flush == Z_FINISH ? zrc == Z_STREAM_END : zs.avail_in == 0) break;
+        }
+    }
+    crdp_png_seal(&buf, idat, "IDAT");
+
+    if (!crdp_png_reserve(&buf, 12)) goto out;
+    start = buf.len;
+    buf.len += 8;
+    crdp_png_seal(&buf, start, "IEND");
+    *out = buf.data;
+    *out_len = buf.len;
+    buf.data = NULL;
+    rc = 0;
+
+out:
+    deflateEnd(&zs);
+    free(rows);
+    free(buf.data);
+    return rc;
+}
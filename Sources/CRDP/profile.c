@@ -0,0 +1,232 @@
+#include "crdp_internal.h"
+
+#include <winpr/wlog.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Span profiler. Every thread that records a span gets a ring of the most
+// recent CRDP_PROFILE_RING spans, written only by that thread and read by
+// crdp_profile_stop through a sequence number per slot, so neither side ever
+// waits for the other. Rings are never freed: a thread's ring is retired
+// when it exits and handed to a new thread at the next crdp_profile_start.
+
+#define CRDP_PROFILE_RING (1u << 14)
+
+_Atomic bool crdp_profiling;
+
+typedef struct {
+    // 2 * span + 1 while being written, 2 * span + 2 once written
+    _Atomic uint64_t seq;
+    const char* name;
+    const char* arg_name;
+    uint64_t start_ns;
+    uint64_t dur_ns;
+    int64_t arg;
+} crdp_profile_slot_t;
+
+enum { CRDP_RING_FREE = 0, CRDP_RING_OWNED = 1, CRDP_RING_RETIRED = 2 };
+
+typedef struct crdp_profile_ring {
+    struct crdp_profile_ring* next;
+    _Atomic int state;
+    uint32_t tid;
+    char name[32];
+    _Atomic uint32_t generation;   // Profiling run the spans belong to
+    _Atomic uint64_t head;         // Spans written
+    crdp_profile_slot_t slots[CRDP_PROFILE_RING];
+} crdp_profile_ring_t;
+
+static _Atomic(crdp_profile_ring_t*) crdp_profile_rings;
+static _Atomic uint32_t crdp_profile_tids;
+static _Atomic uint32_t crdp_profile_generation;
+static uint64_t crdp_profile_epoch_ns;
+static pthread_mutex_t crdp_profile_lock = PTHREAD_MUTEX_INITIALIZER;  // Start and stop
+static pthread_once_t crdp_profile_once = PTHREAD_ONCE_INIT;
+static pthread_key_t crdp_profile_key;
+static _Thread_local crdp_profile_ring_t* crdp_profile_ring;
+static _Thread_local const char* crdp_profile_thread;
+
+uint64_t crdp_profile_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void crdp_profile_retire(void* ring) {
+    atomic_store(&((crdp_profile_ring_t*)ring)->state, CRDP_RING_RETIRED);
+}
+
+static void crdp_profile_key_init(void) {
+    pthread_key_create(&crdp_profile_key, crdp_profile_retire);
+}
+
+void crdp_profile_thread_name(const char* name) {
+    crdp_profile_thread = name;
+}
+
+static crdp_profile_ring_t* crdp_profile_attach(void) {
+    pthread_once(&crdp_profile_once, crdp_profile_key_init);
+    crdp_profile_ring_t* ring = NULL;
+    for (crdp_profile_ring_t* r = atomic_load(&crdp_profile_rings); r; r = r->next) {
+        int expected = CRDP_RING_FREE;
+        if (atomic_compare_exchange_strong(&r->state, &expected, CRDP_RING_OWNED)) {
+            ring = r;
+            break;
+        }
+    }
+    if (!ring) {
+        ring = calloc(1, sizeof(*ring));
+        if (!ring) return NULL;
+        atomic_init(&ring->state, CRDP_RING_OWNED);
+        ring->next = atomic_load(&crdp_profile_rings);
+        while (!atomic_compare_exchange_weak(&crdp_profile_rings, &ring->next, ring)) {}
+    }
+    ring->tid = atomic_fetch_add(&crdp_profile_tids, 1) + 1;
+    if (crdp_profile_thread) {
+        snprintf(ring->name, sizeof(ring->name), "%s", crdp_profile_thread);
+    } else {
+        snprintf(ring->name, sizeof(ring->name), "thread %u", ring->tid);
+    }
+    atomic_store_explicit(&ring->generation, 0, memory_order_relaxed);
+    pthread_setspecific(crdp_profile_key, ring);
+    return ring;
+}
+
+void crdp_profile_span(const char* name, uint64_t start_ns, const char* arg_name, int64_t arg) {
+    uint64_t end_ns = crdp_profile_now();
+    crdp_profile_ring_t* ring = crdp_profile_ring;
+    if (!ring) {
+        ring = crdp_profile_ring = crdp_profile_attach();
+        if (!ring) return;
+    }
+    uint32_t generation = atomic_load_explicit(&crdp_profile_generation, memory_order_acquire);
+    if (atomic_load_explicit(&ring->generation, memory_order_relaxed) != generation) {
+        // First span of this run: the old ones were written out already
+        atomic_store_explicit(&ring->head, 0, memory_order_relaxed);
+        atomic_store_explicit(&ring->generation, generation, memory_order_release);
+    }
+
+    uint64_t i = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    crdp_profile_slot_t* slot = &ring->slots[i & (CRDP_PROFILE_RING - 1)];
+    atomic_store_explicit(&slot->seq, 2 * i + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->name = name;
+    slot->arg_name = arg_name;
+    slot->start_ns = start_ns;
+    slot->dur_ns = end_ns - start_ns;
+    slot->arg = arg;
+    atomic_store_explicit(&slot->seq, 2 * i + 2, memory_order_release);
+    atomic_store_explicit(&ring->head, i + 1, memory_order_release);
+}
+
+int crdp_profile_start(void) {
+    pthread_mutex_lock(&crdp_profile_lock);
+    if (atomic_load(&crdp_profiling)) {
+        pthread_mutex_unlock(&crdp_profile_lock);
+        return -1;
+    }
+    // Rings of threads gone since the last run can be reused now
+    for (crdp_profile_ring_t* r = atomic_load(&crdp_profile_rings); r; r = r->next) {
+        int expected = CRDP_RING_RETIRED;
+        atomic_compare_exchange_strong(&r->state, &expected, CRDP_RING_FREE);
+    }
+    crdp_profile_epoch_ns = crdp_profile_now();
+    atomic_fetch_add_explicit(&crdp_profile_generation, 1, memory_order_release);
+    atomic_store(&crdp_profiling, true);
+    pthread_mutex_unlock(&crdp_profile_lock);
+    WLog_INFO(CRDP_TAG, "Profiling started");
+    return 0;
+}
+
+static void crdp_profile_json_string(FILE* file, const char* s) {
+    fputc('"', file);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(file, "\\%c", *s);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(file, "\\u%04x", *s);
+        } else {
+            fputc(*s, file);
+        }
+    }
+    fputc('"', file);
+}
+
+// Complete ("X") events, timestamps in microseconds since the start
+static uint64_t crdp_profile_write_ring(FILE* file, crdp_profile_ring_t* ring) {
+    uint64_t written = 0;
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t i = head > CRDP_PROFILE_RING ? head - CRDP_PROFILE_RING : 0;
+    for (; i < head; i++) {
+        crdp_profile_slot_t* slot = &ring->slots[i & (CRDP_PROFILE_RING - 1)];
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq != 2 * i + 2) continue;
+        crdp_profile_slot_t span;
+        span.name = slot->name;
+        span.arg_name = slot->arg_name;
+        span.start_ns = slot->start_ns;
+        span.dur_ns = slot->dur_ns;
+        span.arg = slot->arg;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) continue;
+        if (span.start_ns < crdp_profile_epoch_ns) continue;
+
+        uint64_t ts = span.start_ns - crdp_profile_epoch_ns;
+        fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"crdp\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                      "\"ts\":%llu.%03llu,\"dur\":%llu.%03llu",
+                span.name, ring->tid, (unsigned long long)(ts / 1000),
+                (unsigned long long)(ts % 1000), (unsigned long long)(span.dur_ns / 1000),
+                (unsigned long long)(span.dur_ns % 1000));
+        if (span.arg_name) fprintf(file, ",\"args\":{\"%s\":%lld}", span.arg_name, (long long)span.arg);
+        fputc('}', file);
+        written++;
+    }
+    return written;
+}
+
+int crdp_profile_stop(const char* path) {
+    pthread_mutex_lock(&crdp_profile_lock);
+    if (!atomic_exchange(&crdp_profiling, false)) {
+        pthread_mutex_unlock(&crdp_profile_lock);
+        return -1;
+    }
+    if (!path) {
+        pthread_mutex_unlock(&crdp_profile_lock);
+        return 0;
+    }
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        WLog_ERR(CRDP_TAG, "Failed to write profile %s: %s", path, strerror(errno));
+        pthread_mutex_unlock(&crdp_profile_lock);
+        return -1;
+    }
+
+    uint32_t generation = atomic_load(&crdp_profile_generation);
+    uint64_t spans = 0;
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", file);
+    fputs("\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"CRDP\"}}", file);
+    for (crdp_profile_ring_t* r = atomic_load(&crdp_profile_rings); r; r = r->next) {
+        // A ring taken over by a new thread since keeps its old generation
+        // until the first span
+        if (atomic_load_explicit(&r->generation, memory_order_acquire) != generation) continue;
+        fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":", r->tid);
+        crdp_profile_json_string(file, r->name);
+        fputs("}}", file);
+        spans += crdp_profile_write_ring(file, r);
+    }
+    fputs("\n]}\n", file);
+    bool ok = !ferror(file);
+    if (fclose(file) != 0) ok = false;
+    pthread_mutex_unlock(&crdp_profile_lock);
+
+    if (!ok) {
+        WLog_ERR(CRDP_TAG, "Failed to write profile %s", path);
+        return -1;
+    }
+    WLog_INFO(CRDP_TAG, "Profile with %llu spans written to %s", (unsigned long long)spans, path);
+    return 0;
+}
@@ -0,0 +1,244 @@
+#include "crdp_internal.h"
+
+#include <freerdp/freerdp.h>
+#include <winpr/wlog.h>
+
+#include <string.h>
+
+// Adaptive quality controller.
+//
+// Once a second the protocol thread samples RTT and bandwidth from FreeRDP's
+// network auto-detection, the measured receive rate and the frame queue depth,
+// and classifies the link into a tier. Moving to a worse tier needs a few bad
+// samples in a row; moving to a better one needs a longer run of samples that
+// clear the target tier's thresholds with margin, and every tier is held for
+// a minimum time. That keeps the controller from flapping on a noisy link.
+// The tier outlives the connection: a reconnect negotiates the codec and color
+// depth it chose and resumes from it. A host that makes a new client per
+// connection seeds it with crdp_set_link_tier.
+
+#define CRDP_QUALITY_SAMPLE_MS 1000
+#define CRDP_QUALITY_DOWNGRADE_SAMPLES 3
+#define CRDP_QUALITY_UPGRADE_SAMPLES 10
+#define CRDP_QUALITY_MIN_DWELL_MS 5000
+
+typedef struct {
+    uint32_t max_rtt_ms;
+    uint32_t min_bandwidth_kbps;
+} crdp_tier_threshold_t;
+
+// A link belongs to the best tier whose thresholds it meets
+static const crdp_tier_threshold_t crdp_tier_thresholds[] = {
+    [CRDP_LINK_LAN] = { 10, 50000 },
+    [CRDP_LINK_BROADBAND] = { 50, 10000 },
+    [CRDP_LINK_WAN] = { 150, 2000 },
+    [CRDP_LINK_CONSTRAINED] = { UINT32_MAX, 0 },
+};
+
+typedef struct {
+    uint32_t frame_interval_ms; // Foreground frame-rate cap (0 = uncapped)
+    uint32_t color_depth;
+    bool prefer_h264;           // AVC420/444 over RemoteFX/planar
+    bool progressive;           // Progressive refinement of RemoteFX tiles
+} crdp_tier_policy_t;
+
+static const crdp_tier_policy_t crdp_tier_policies[] = {
+    [CRDP_LINK_LAN] = { 0, 32, false, false },
+    [CRDP_LINK_BROADBAND] = { 16, 32, false, true },
+    [CRDP_LINK_WAN] = { 33, 32, true, true },
+    [CRDP_LINK_CONSTRAINED] = { 66, 16, true, true },
+};
+
+const char* crdp_quality_tier_name(crdp_link_tier_t tier) {
+    switch (tier) {
+        case CRDP_LINK_LAN: return "lan";
+        case CRDP_LINK_BROADBAND: return "broadband";
+        case CRDP_LINK_WAN: return "wan";
+        default: return "constrained";
+    }
+}
+
+// Best tier the sample qualifies for. margin_pct tightens the thresholds, used
+// when deciding whether the link is good enough to upgrade.
+static crdp_link_tier_t crdp_quality_classify(uint32_t rtt_ms, uint32_t bandwidth_kbps, uint32_t margin_pct) {
+    for (int tier = CRDP_LINK_LAN; tier < CRDP_LINK_CONSTRAINED; tier++) {
+        const crdp_tier_threshold_t* t = &crdp_tier_thresholds[tier];
+        uint64_t max_rtt = (uint64_t)t->max_rtt_ms * (100 - margin_pct) / 100;
+        uint64_t min_bw = (uint64_t)t->min_bandwidth_kbps * (100 + margin_pct) / 100;
+        // Bandwidth is only known once the server has run a measurement
+        if (rtt_ms <= max_rtt && (bandwidth_kbps == 0 || bandwidth_kbps >= min_bw)) {
+            return (crdp_link_tier_t)tier;
+        }
+    }
+    return CRDP_LINK_CONSTRAINED;
+}
+
+crdp_link_tier_t crdp_quality_tier_for_rtt(uint32_t rtt_ms) {
+    return crdp_quality_classify(rtt_ms, 0, 0);
+}
+
+static void crdp_quality_apply(crdp_client_t* client, crdp_link_tier_t previous, crdp_link_tier_t tier,
+                               const char* reason) {
+    crdp_quality_t* q = &client->quality;
+    const crdp_tier_policy_t* old_policy = &crdp_tier_policies[previous];
+    const crdp_tier_policy_t* policy = &crdp_tier_policies[tier];
+
+    // Takes effect immediately: caps delivery, and through withheld GFX acks
+    // also the server's encode rate. Codec and color depth are negotiated at
+    // connect, so crdp_quality_configure applies them on the next one.
+    atomic_store(&client->frame_cap_ms, policy->frame_interval_ms);
+
+    q->tier = tier;
+    q->tier_since = q->last_sample;
+    q->worse_samples = 0;
+    q->better_samples = 0;
+
+    crdp_quality_event_t event = {
+        .previous_tier = previous,
+        .tier = tier,
+        .rtt_ms = q->rtt_ms,
+        .bandwidth_kbps = q->bandwidth_kbps,
+        .receive_kbps = q->receive_kbps,
+        .queue_depth = q->queue_depth,
+        .frame_interval_ms = policy->frame_interval_ms,
+        .color_depth = policy->color_depth,
+        .prefer_h264 = policy->prefer_h264,
+        .progressive = policy->progressive,
+        .requires_reconnect = old_policy->color_depth != policy->color_depth ||
+                              old_policy->prefer_h264 != policy->prefer_h264 ||
+                              old_policy->progressive != policy->progressive,
+        .reason = reason,
+    };
+
+    WLog_INFO(CRDP_TAG, "Link tier %s -> %s (%s): rtt=%ums bw=%ukbps rx=%ukbps queue=%u cap=%ums",
+              crdp_quality_tier_name(previous), crdp_quality_tier_name(tier), reason, event.rtt_ms,
+              event.bandwidth_kbps, event.receive_kbps, event.queue_depth, event.frame_interval_ms);
+
+    pthread_mutex_lock(&q->cb_lock);
+    crdp_quality_cb cb = q->cb;
+    void* user = q->cb_user;
+    pthread_mutex_unlock(&q->cb_lock);
+    if (cb) cb(&event, user);
+}
+
+// Protocol thread, once per loop iteration
+void crdp_quality_tick(crdp_client_t* client) {
+    crdp_quality_t* q = &client->quality;
+    if (!client->config.adaptive_quality || !client->instance || !client->instance->context) return;
+
+    uint64_t now = crdp_time_ms();
+    if (q->last_sample != 0 && now - q->last_sample < CRDP_QUALITY_SAMPLE_MS) return;
+    uint64_t elapsed = q->last_sample ? now - q->last_sample : 0;
+    q->last_sample = now;
+
+    rdpContext* context = client->instance->context;
+    rdpAutoDetect* autodetect = context->autodetect;
+    q->rtt_ms = autodetect ? autodetect->netCharAverageRTT : 0;
+    if (q->rtt_ms == 0 && autodetect) q->rtt_ms = autodetect->netCharBaseRTT;
+    q->bandwidth_kbps = autodetect ? autodetect->netCharBandwidth : 0;
+
+    UINT64 in_bytes = 0, out_bytes = 0, in_packets = 0, out_packets = 0;
+    if (context->rdp && freerdp_get_stats(context->rdp, &in_bytes, &out_bytes, &in_packets, &out_packets)) {
+        if (elapsed > 0 && in_bytes >= q->last_in_bytes) {
+            q->receive_kbps = (uint32_t)((in_bytes - q->last_in_bytes) * 8 / elapsed);
+        }
+        q->last_in_bytes = in_bytes;
+    }
+
+    int held = atomic_load(&client->frames_in_flight);
+    q->queue_depth = (uint32_t)(held > 0 ? held : 0);
+
+    if (!q->started) {
+        // Start from the tier the last connection ended in (the best one the
+        // first time) and let the samples move it
+        q->started = true;
+        q->tier_since = now;
+        if (q->rtt_ms == 0) return;
+    }
+    if (q->rtt_ms == 0) return; // Nothing measured yet
+
+    crdp_link_tier_t measured = crdp_quality_classify(q->rtt_ms, q->bandwidth_kbps, 0);
+    crdp_link_tier_t comfortable = crdp_quality_classify(q->rtt_ms, q->bandwidth_kbps, 20);
+
+    // A host that keeps hitting its frame limit is a congestion signal even
+    // when RTT looks fine
+    uint32_t limit = client->config.max_frames_in_flight;
+    bool congested = limit > 0 && q->queue_depth >= limit;
+    if (congested && measured <= q->tier && q->tier < CRDP_LINK_CONSTRAINED) {
+        measured = (crdp_link_tier_t)(q->tier + 1);
+    }
+
+    bool dwell_done = now - q->tier_since >= CRDP_QUALITY_MIN_DWELL_MS;
+    if (measured > q->tier) {
+        q->better_samples = 0;
+        if (++q->worse_samples >= CRDP_QUALITY_DOWNGRADE_SAMPLES && dwell_done) {
+            crdp_quality_apply(client, q->tier, measured, congested ? "frame queue saturated" : "link degraded");
+        }
+    } else if (comfortable < q->tier && !congested) {
+        q->worse_samples = 0;
+        if (++q->better_samples >= CRDP_QUALITY_UPGRADE_SAMPLES && dwell_done) {
+            // Step up one tier at a time
+            crdp_quality_apply(client, q->tier, (crdp_link_tier_t)(q->tier - 1), "link improved");
+        }
+    } else {
+        q->worse_samples = 0;
+        q->better_samples = 0;
+    }
+}
+
+// Called at connect, with the new config in place. Keeps the tier.
+void crdp_quality_reset(crdp_client_t* client) {
+    crdp_quality_t* q = &client->quality;
+    q->started = false;
+    q->last_sample = 0;
+    q->last_in_bytes = 0;
+    q->worse_samples = 0;
+    q->better_samples = 0;
+    if (!client->config.adaptive_quality) q->tier = CRDP_LINK_LAN;
+    atomic_store(&client->frame_cap_ms, crdp_tier_policies[q->tier].frame_interval_ms);
+}
+
+// Called from PreConnect: the codec and color depth of the current tier
+void crdp_quality_configure(crdp_client_t* client, rdpSettings* settings) {
+    if (!client->config.adaptive_quality) return;
+    crdp_link_tier_t tier = client->quality.tier;
+    const crdp_tier_policy_t* policy = &crdp_tier_policies[tier];
+    freerdp_settings_set_bool(settings, FreeRDP_GfxH264, policy->prefer_h264);
+    freerdp_settings_set_bool(settings, FreeRDP_GfxAVC444, policy->prefer_h264);
+    freerdp_settings_set_bool(settings, FreeRDP_GfxAVC444v2, policy->prefer_h264);
+    freerdp_settings_set_bool(settings, FreeRDP_GfxProgressive, policy->progressive);
+    freerdp_settings_set_bool(settings, FreeRDP_GfxProgressiveV2, policy->progressive);
+    freerdp_settings_set_uint32(settings, FreeRDP_ColorDepth, policy->color_depth);
+    if (tier != CRDP_LINK_LAN) {
+        WLog_INFO(CRDP_TAG, "Connecting with the %s tier's codec settings (%u bpp%s%s)",
+                  crdp_quality_tier_name(tier), policy->color_depth, policy->prefer_h264 ? ", H.264" : "",
+                  policy->progressive ? ", progressive" : "");
+    }
+}
+
+void crdp_quality_init(crdp_client_t* client) {
+    pthread_mutex_init(&client->quality.cb_lock, NULL);
+    atomic_init(&client->frame_cap_ms, 0);
+    client->quality.tier = CRDP_LINK_LAN;
+    crdp_quality_reset(client);
+}
+
+void crdp_quality_free(crdp_client_t* client) {
+    pthread_mutex_destroy(&client->quality.cb_lock);
+}
+
+void crdp_set_quality_callback(crdp_client_t* client, crdp_quality_cb cb, void* user) {
+    if (!client) return;
+    pthread_mutex_lock(&client->quality.cb_lock);
+    client->quality.cb = cb;
+    client->quality.cb_user = user;
+    pthread_mutex_unlock(&client->quality.cb_lock);
+}
+
+int crdp_set_link_tier(crdp_client_t* client, crdp_link_tier_t tier) {
+    if (!client || tier < CRDP_LINK_LAN || tier > CRDP_LINK_CONSTRAINED) return -1;
+    // The protocol thread owns the tier while connected
+    if (client->connected) return -2;
+    client->quality.tier = tier;
+    return 0;
+}
@@ -0,0 +1,535 @@
+#include "crdp_internal.h"
+
+#include <freerdp/gdi/gdi.h>
+#include <winpr/wlog.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Session recording.
+//
+// The screen is sampled every CRDP_RECORD_INTERVAL_MS, and only tiles the
+// GDI reported as damaged are looked at. A damaged tile is recorded if its
+// content changed, as a reference when the same content was already stored
+// in the current segment (windows moving back, blinking cursors, scrolling
+// back and forth). The protocol thread only copies and hashes tiles; a
+// writer thread compresses and appends. Every CRDP_RECORD_SEGMENT_MS a new
+// segment starts from a full screen, so a player can seek to it without
+// reading what came before. Painting only waits while tiles are copied out;
+// they are hashed and stored after paint_lock is released. The full screen
+// a segment starts from is copied a few rows at a time over several samples,
+// which also copy whatever was damaged in the rows already taken, so what is
+// stored is the screen as of the last of them. Format in crdp_internal.h.
+
+#define CRDP_RECORD_INTERVAL_MS 100
+#define CRDP_RECORD_SEGMENT_MS 30000
+// Samples the full screen of a new segment is copied over
+#define CRDP_RECORD_FILL_SAMPLES 4
+// Hand recorded data to the writer at least this often
+#define CRDP_RECORD_FLUSH_MS 1000
+// Data waiting for the writer before sampling pauses (damage keeps
+// accumulating, so nothing is lost but time resolution)
+#define CRDP_RECORD_MAX_QUEUED (64 * 1024 * 1024)
+// Distinct tiles per segment, twice over; a half-full table starts the next
+// segment early, which bounds what a player has to hold on to
+#define CRDP_RECORD_SEEN_LOG 13
+#define CRDP_RECORD_TILE_BYTES (CRDP_RECORDING_TILE * CRDP_RECORDING_TILE * 4)
+
+typedef struct crdp_record_chunk {
+    struct crdp_record_chunk* next;
+    uint32_t time_ms;
+    bool segment;
+    size_t len;
+    size_t cap;
+    uint8_t* data;
+} crdp_record_chunk_t;
+
+struct crdp_recorder {
+    FILE* file;
+    uint64_t start_ms;
+    // Screen state; protocol thread. dirty, all_dirty and the sizes
+    // crdp_record_mark reads change under the client's paint_lock.
+    uint32_t width;
+    uint32_t height;
+    uint32_t tiles_x;
+    uint32_t tiles_y;
+    uint64_t* dirty;
+    bool all_dirty;
+    uint64_t* sampling;      // The dirty bits being sampled
+    uint8_t* copies;         // Pixels as of each tile's last copy, CRDP_RECORD_TILE_BYTES each
+    uint32_t fill_row;       // Tile rows copied for the next segment; tiles_y when none is due
+    uint64_t* tile_hashes;   // What each tile position shows in the recording
+    uint64_t* seen;          // Tiles stored in this segment; 0 = free slot
+    uint32_t seen_count;
+    uint64_t segment_ms;
+    uint64_t last_sample_ms;
+    // Record stream; guarded by lock
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    crdp_record_chunk_t* pending;
+    crdp_record_chunk_t* head;
+    crdp_record_chunk_t* tail;
+    size_t queued;
+    uint64_t last_flush_ms;
+    bool closing;
+    bool failed;
+    pthread_t thread;
+    // Totals, for the closing log line
+    uint64_t frames;
+    uint64_t tiles;
+    uint64_t tile_refs;
+    uint64_t skipped;
+    uint64_t file_bytes;
+    uint64_t holds;
+    uint64_t hold_us;
+    uint64_t hold_max_us;
+};
+
+static void crdp_record_put_le(uint8_t* p, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) p[i] = (uint8_t)(value >> (8 * i));
+}
+
+static crdp_record_chunk_t* crdp_record_chunk_new(uint32_t time_ms, bool segment) {
+    crdp_record_chunk_t* chunk = calloc(1, sizeof(*chunk));
+    if (!chunk) return NULL;
+    chunk->time_ms = time_ms;
+    chunk->segment = segment;
+    return chunk;
+}
+
+static void crdp_record_chunk_free(crdp_record_chunk_t* chunk) {
+    if (!chunk) return;
+    free(chunk->data);
+    free(chunk);
+}
+
+// Writer thread
+
+static bool crdp_record_write_chunk(crdp_recorder_t* rec, const crdp_record_chunk_t* chunk, uint8_t* packed) {
+    for (size_t off = 0; off < chunk->len; off += CRDP_RECORDING_CHUNK_SIZE) {
+        size_t raw = chunk->len - off < CRDP_RECORDING_CHUNK_SIZE ? chunk->len - off : CRDP_RECORDING_CHUNK_SIZE;
+        const uint8_t* src = chunk->data + off;
+        size_t stored = crdp_lz4_compress(src, raw, packed, crdp_lz4_bound(CRDP_RECORDING_CHUNK_SIZE));
+        const uint8_t* out = packed;
+        uint8_t header[CRDP_RECORDING_CHUNK_HEADER_SIZE];
+        crdp_record_put_le(header, raw, 4);
+        if (stored == 0 || stored >= raw) {
+            crdp_record_put_le(header + 4, raw | CRDP_RECORDING_STORED, 4);
+            out = src;
+            stored = raw;
+        } else {
+            crdp_record_put_le(header + 4, stored, 4);
+        }
+        crdp_record_put_le(header + 8, chunk->time_ms, 4);
+        // Only the first piece starts the segment
+        crdp_record_put_le(header + 12, chunk->segment && off == 0 ? CRDP_RECORDING_SEGMENT : 0, 4);
+        if (fwrite(header, 1, sizeof(header), rec->file) != sizeof(header) ||
+            fwrite(out, 1, stored, rec->file) != stored) {
+            return false;
+        }
+        rec->file_bytes += sizeof(header) + stored;
+    }
+    // An audit trail should survive a crash of the host
+    return fflush(rec->file) == 0;
+}
+
+static void* crdp_record_run(void* arg) {
+    crdp_recorder_t* rec = (crdp_recorder_t*)arg;
+    uint8_t* packed = malloc(crdp_lz4_bound(CRDP_RECORDING_CHUNK_SIZE));
+    pthread_mutex_lock(&rec->lock);
+    for (;;) {
+        while (!rec->head && !rec->closing) pthread_cond_wait(&rec->cond, &rec->lock);
+        crdp_record_chunk_t* chunk = rec->head;
+        if (!chunk) break;
+        rec->head = chunk->next;
+        if (!rec->head) rec->tail = NULL;
+        bool failed = rec->failed;
+        pthread_mutex_unlock(&rec->lock);
+
+        if (!failed && (!packed || !crdp_record_write_chunk(rec, chunk, packed))) {
+            WLog_ERR(CRDP_TAG, "Failed to write the session recording: %s", strerror(errno));
+            failed = true;
+        }
+        size_t len = chunk->len;
+        crdp_record_chunk_free(chunk);
+
+        pthread_mutex_lock(&rec->lock);
+        rec->failed = rec->failed || failed;
+        rec->queued -= len;
+    }
+    pthread_mutex_unlock(&rec->lock);
+    free(packed);
+    return NULL;
+}
+
+// Record stream; rec->lock held
+
+static void crdp_record_hand_off(crdp_recorder_t* rec, uint64_t now) {
+    crdp_record_chunk_t* chunk = rec->pending;
+    rec->last_flush_ms = now;
+    if (!chunk || chunk->len == 0) return;
+    rec->pending = NULL;
+    if (rec->tail) {
+        rec->tail->next = chunk;
+    } else {
+        rec->head = chunk;
+    }
+    rec->tail = chunk;
+    rec->queued += chunk->len;
+    pthread_cond_signal(&rec->cond);
+}
+
+static uint8_t* crdp_record_reserve(crdp_recorder_t* rec, size_t len, uint64_t now) {
+    crdp_record_chunk_t* chunk = rec->pending;
+    if (!chunk) chunk = rec->pending = crdp_record_chunk_new((uint32_t)(now - rec->start_ms), false);
+    if (!chunk) return NULL;
+    if (chunk->len + len > chunk->cap) {
+        size_t cap = chunk->cap ? chunk->cap * 2 : 64 * 1024;
+        while (cap < chunk->len + len) cap *= 2;
+        uint8_t* data = realloc(chunk->data, cap);
+        if (!data) return NULL;
+        chunk->data = data;
+        chunk->cap = cap;
+    }
+    uint8_t* p = chunk->data + chunk->len;
+    chunk->len += len;
+    return p;
+}
+
+static void crdp_record_event(crdp_recorder_t* rec, crdp_rec_type_t type, uint16_t a, uint16_t b, uint16_t c,
+                              int values) {
+    uint64_t now = crdp_time_ms();
+    pthread_mutex_lock(&rec->lock);
+    uint8_t* p = crdp_record_reserve(rec, 5 + 2 * values, now);
+    if (p) {
+        p[0] = (uint8_t)type;
+        crdp_record_put_le(p + 1, now - rec->start_ms, 4);
+        uint16_t v[3] = { a, b, c };
+        for (int i = 0; i < values; i++) crdp_record_put_le(p + 5 + 2 * i, v[i], 2);
+    }
+    pthread_mutex_unlock(&rec->lock);
+}
+
+// Host threads
+void crdp_record_pointer(crdp_client_t* client, uint16_t flags, uint16_t x, uint16_t y) {
+    if (client->recorder) crdp_record_event(client->recorder, CRDP_REC_POINTER, flags, x, y, 3);
+}
+
+void crdp_record_key(crdp_client_t* client, uint16_t flags, uint16_t scancode) {
+    if (client->recorder) crdp_record_event(client->recorder, CRDP_REC_KEY, flags, scancode, 0, 2);
+}
+
+// Screen state; paint_lock held
+
+void crdp_record_mark(crdp_client_t* client, int32_t x, int32_t y, int32_t w, int32_t h) {
+    crdp_recorder_t* rec = client->recorder;
+    if (!rec || rec->all_dirty) return;
+    if (!rec->dirty || w <= 0 || h <= 0) {
+        rec->all_dirty = true;
+        return;
+    }
+    int64_t left = x < 0 ? 0 : x;
+    int64_t top = y < 0 ? 0 : y;
+    int64_t right = (int64_t)x + w > rec->width ? rec->width : (int64_t)x + w;
+    int64_t bottom = (int64_t)y + h > rec->height ? rec->height : (int64_t)y + h;
+    if (left >= right || top >= bottom) return;
+
+    for (uint32_t ty = (uint32_t)(top / CRDP_RECORDING_TILE); ty <= (uint32_t)((bottom - 1) / CRDP_RECORDING_TILE);
+         ty++) {
+        for (uint32_t tx = (uint32_t)(left / CRDP_RECORDING_TILE);
+             tx <= (uint32_t)((right - 1) / CRDP_RECORDING_TILE); tx++) {
+            uint32_t bit = ty * rec->tiles_x + tx;
+            rec->dirty[bit / 64] |= (uint64_t)1 << (bit % 64);
+        }
+    }
+}
+
+static bool crdp_record_resize(crdp_recorder_t* rec, uint32_t width, uint32_t height) {
+    uint32_t tiles_x = (width + CRDP_RECORDING_TILE - 1) / CRDP_RECORDING_TILE;
+    uint32_t tiles_y = (height + CRDP_RECORDING_TILE - 1) / CRDP_RECORDING_TILE;
+    size_t tiles = (size_t)tiles_x * tiles_y;
+    uint64_t* dirty = realloc(rec->dirty, (tiles + 63) / 64 * sizeof(uint64_t));
+    if (!dirty) return false;
+    rec->dirty = dirty;
+    uint64_t* sampling = realloc(rec->sampling, (tiles + 63) / 64 * sizeof(uint64_t));
+    if (!sampling) return false;
+    rec->sampling = sampling;
+    uint8_t* copies = realloc(rec->copies, tiles * CRDP_RECORD_TILE_BYTES);
+    if (!copies) return false;
+    rec->copies = copies;
+    uint64_t* hashes = realloc(rec->tile_hashes, tiles * sizeof(uint64_t));
+    if (!hashes) return false;
+    rec->tile_hashes = hashes;
+    rec->width = width;
+    rec->height = height;
+    rec->tiles_x = tiles_x;
+    rec->tiles_y = tiles_y;
+    rec->fill_row = 0;
+    return true;
+}
+
+// True if the tile was already stored in this segment; adds it otherwise
+static bool crdp_record_seen(crdp_recorder_t* rec, uint64_t hash) {
+    uint32_t mask = (1u << CRDP_RECORD_SEEN_LOG) - 1;
+    for (uint32_t i = (uint32_t)hash & mask;; i = (i + 1) & mask) {
+        if (rec->seen[i] == hash) return true;
+        if (rec->seen[i] == 0) {
+            rec->seen[i] = hash;
+            rec->seen_count++;
+            return false;
+        }
+    }
+}
+
+static void crdp_record_begin_segment(crdp_recorder_t* rec, uint64_t now) {
+    crdp_record_hand_off(rec, now);
+    rec->pending = crdp_record_chunk_new((uint32_t)(now - rec->start_ms), true);
+    rec->segment_ms = now;
+    memset(rec->seen, 0, sizeof(uint64_t) << CRDP_RECORD_SEEN_LOG);
+    rec->seen_count = 0;
+    memset(rec->tile_hashes, 0, (size_t)rec->tiles_x * rec->tiles_y * sizeof(uint64_t));
+    uint8_t* p = crdp_record_reserve(rec, 5, now);
+    if (p) {
+        p[0] = CRDP_REC_SIZE;
+        crdp_record_put_le(p + 1, rec->width, 2);
+        crdp_record_put_le(p + 3, rec->height, 2);
+    }
+}
+
+static void crdp_record_tile_size(const crdp_recorder_t* rec, uint32_t tx, uint32_t ty, uint32_t* w, uint32_t* h) {
+    uint32_t x0 = tx * CRDP_RECORDING_TILE;
+    uint32_t y0 = ty * CRDP_RECORDING_TILE;
+    *w = rec->width - x0 < CRDP_RECORDING_TILE ? rec->width - x0 : CRDP_RECORDING_TILE;
+    *h = rec->height - y0 < CRDP_RECORDING_TILE ? rec->height - y0 : CRDP_RECORDING_TILE;
+}
+
+// paint_lock held
+static void crdp_record_copy(crdp_recorder_t* rec, const rdpGdi* gdi, uint32_t tx, uint32_t ty) {
+    uint32_t w, h;
+    crdp_record_tile_size(rec, tx, ty, &w, &h);
+    uint8_t* tile = rec->copies + ((size_t)ty * rec->tiles_x + tx) * CRDP_RECORD_TILE_BYTES;
+    const uint8_t* src = gdi->primary_buffer + (size_t)ty * CRDP_RECORDING_TILE * gdi->stride +
+                         (size_t)tx * CRDP_RECORDING_TILE * 4;
+    for (uint32_t row = 0; row < h; row++) {
+        memcpy(tile + (size_t)row * w * 4, src + (size_t)row * gdi->stride, (size_t)w * 4);
+    }
+}
+
+static void crdp_record_tile(crdp_recorder_t* rec, uint32_t tx, uint32_t ty, uint64_t now) {
+    uint32_t w, h;
+    crdp_record_tile_size(rec, tx, ty, &w, &h);
+    const uint8_t* tile = rec->copies + ((size_t)ty * rec->tiles_x + tx) * CRDP_RECORD_TILE_BYTES;
+    size_t bytes = (size_t)w * h * 4;
+    uint64_t hash = crdp_hash64(tile, bytes, 0);
+    if (hash == 0) hash = 1;
+    uint64_t* shown = &rec->tile_hashes[ty * rec->tiles_x + tx];
+    if (*shown == hash) return;
+    *shown = hash;
+
+    bool seen = crdp_record_seen(rec, hash);
+    uint8_t* p = crdp_record_reserve(rec, seen ? 13 : 15 + bytes, now);
+    if (!p) return;
+    p[0] = seen ? CRDP_REC_TILE_REF : CRDP_REC_TILE;
+    crdp_record_put_le(p + 1, tx, 2);
+    crdp_record_put_le(p + 3, ty, 2);
+    if (seen) {
+        crdp_record_put_le(p + 5, hash, 8);
+        rec->tile_refs++;
+        return;
+    }
+    p[5] = (uint8_t)w;
+    p[6] = (uint8_t)h;
+    crdp_record_put_le(p + 7, hash, 8);
+    memcpy(p + 15, tile, bytes);
+    rec->tiles++;
+}
+
+// How long a sample kept painting waiting, for the closing log line
+static void crdp_record_held(crdp_recorder_t* rec, uint64_t from_us) {
+    uint64_t held = crdp_time_us() - from_us;
+    rec->holds++;
+    rec->hold_us += held;
+    if (held > rec->hold_max_us) rec->hold_max_us = held;
+}
+
+// Protocol thread, between event checks
+void crdp_record_tick(crdp_client_t* client) {
+    crdp_recorder_t* rec = client->recorder;
+    rdpContext* context = client->instance ? client->instance->context : NULL;
+    rdpGdi* gdi = context ? context->gdi : NULL;
+    if (!rec || !gdi) return;
+    uint64_t now = crdp_time_ms();
+    if (now - rec->last_sample_ms < CRDP_RECORD_INTERVAL_MS) return;
+    rec->last_sample_ms = now;
+
+    pthread_mutex_lock(&client->paint_lock);
+    uint64_t held_from = crdp_time_us();
+    pthread_mutex_lock(&rec->lock);
+    bool sample = client->gdi_ready && gdi->primary_buffer;
+    if (sample && rec->queued > CRDP_RECORD_MAX_QUEUED) {
+        rec->skipped++;
+        sample = false;
+    }
+    if (sample && (rec->width != (uint32_t)gdi->width || rec->height != (uint32_t)gdi->height || !rec->dirty)) {
+        sample = crdp_record_resize(rec, (uint32_t)gdi->width, (uint32_t)gdi->height);
+        rec->segment_ms = 0;
+    }
+    uint32_t fill_rows = 0;
+    if (sample) {
+        if (rec->fill_row == rec->tiles_y && (now - rec->segment_ms >= CRDP_RECORD_SEGMENT_MS ||
+                                              rec->seen_count > (1u << CRDP_RECORD_SEEN_LOG) / 2)) {
+            rec->fill_row = 0;
+        }
+        if (rec->fill_row < rec->tiles_y) {
+            fill_rows = (rec->tiles_y + CRDP_RECORD_FILL_SAMPLES - 1) / CRDP_RECORD_FILL_SAMPLES;
+            if (fill_rows > rec->tiles_y - rec->fill_row) fill_rows = rec->tiles_y - rec->fill_row;
+            // The rows left are the last ones it needs
+            if (rec->fill_row + fill_rows == rec->tiles_y) crdp_record_begin_segment(rec, now);
+        }
+    }
+    // The frame record goes first and counts the tile records after it,
+    // so a player can skip to a time without applying later tiles. Before
+    // the first segment there is nothing to add frames to.
+    uint8_t* p = sample && rec->segment_ms != 0 ? crdp_record_reserve(rec, 9, now) : NULL;
+    size_t frame = 0;
+    if (p) {
+        p[0] = CRDP_REC_FRAME;
+        crdp_record_put_le(p + 1, now - rec->start_ms, 4);
+        frame = rec->pending->len - 9;
+    }
+    size_t tiles = (size_t)rec->tiles_x * rec->tiles_y;
+    size_t words = (tiles + 63) / 64;
+    if (p || (sample && rec->segment_ms == 0)) {
+        // Painting marks the next sample's damage while this one is encoded
+        uint64_t* sampling = rec->dirty;
+        rec->dirty = rec->sampling;
+        rec->sampling = sampling;
+        if (rec->all_dirty) memset(sampling, 0xff, words * sizeof(uint64_t));
+        memset(rec->dirty, 0, words * sizeof(uint64_t));
+        rec->all_dirty = false;
+        for (size_t word = 0; word < words; word++) {
+            for (uint64_t bits = sampling[word]; bits; bits &= bits - 1) {
+                size_t i = word * 64 + (size_t)__builtin_ctzll(bits);
+                if (i >= tiles) break;
+                crdp_record_copy(rec, gdi, (uint32_t)(i % rec->tiles_x), (uint32_t)(i / rec->tiles_x));
+            }
+        }
+        for (uint32_t ty = rec->fill_row; ty < rec->fill_row + fill_rows; ty++) {
+            for (uint32_t tx = 0; tx < rec->tiles_x; tx++) crdp_record_copy(rec, gdi, tx, ty);
+        }
+        rec->fill_row += fill_rows;
+        // A segment just begun stores all of it
+        if (fill_rows > 0 && rec->fill_row == rec->tiles_y) memset(sampling, 0xff, words * sizeof(uint64_t));
+    }
+    crdp_record_held(rec, held_from);
+    pthread_mutex_unlock(&client->paint_lock);
+
+    if (p) {
+        uint64_t before = rec->tiles + rec->tile_refs;
+        for (size_t word = 0; word < words; word++) {
+            for (uint64_t bits = rec->sampling[word]; bits; bits &= bits - 1) {
+                size_t i = word * 64 + (size_t)__builtin_ctzll(bits);
+                if (i >= tiles) break;
+                crdp_record_tile(rec, (uint32_t)(i % rec->tiles_x), (uint32_t)(i / rec->tiles_x), now);
+            }
+        }
+        uint64_t count = rec->tiles + rec->tile_refs - before;
+        if (count > 0) {
+            crdp_record_put_le(rec->pending->data + frame + 5, count, 4);
+            rec->frames++;
+        } else {
+            // Damaged, but nothing changed
+            rec->pending->len = frame;
+        }
+    }
+
+    if ((rec->pending && rec->pending->len >= CRDP_RECORDING_CHUNK_SIZE) ||
+        now - rec->last_flush_ms >= CRDP_RECORD_FLUSH_MS) {
+        crdp_record_hand_off(rec, now);
+    }
+    pthread_mutex_unlock(&rec->lock);
+}
+
+static void crdp_record_free(crdp_recorder_t* rec) {
+    if (rec->file) fclose(rec->file);
+    crdp_record_chunk_free(rec->pending);
+    while (rec->head) {
+        crdp_record_chunk_t* next = rec->head->next;
+        crdp_record_chunk_free(rec->head);
+        rec->head = next;
+    }
+    free(rec->dirty);
+    free(rec->tile_hashes);
+    free(rec->seen);
+    free(rec->sampling);
+    free(rec->copies);
+    pthread_cond_destroy(&rec->cond);
+    pthread_mutex_destroy(&rec->lock);
+    free(rec);
+}
+
+bool crdp_record_open(crdp_client_t* client) {
+    const char* path = client->config.record_path;
+    crdp_recorder_t* rec = calloc(1, sizeof(*rec));
+    if (!rec) return false;
+    pthread_mutex_init(&rec->lock, NULL);
+    pthread_cond_init(&rec->cond, NULL);
+    rec->seen = calloc((size_t)1 << CRDP_RECORD_SEEN_LOG, sizeof(uint64_t));
+    // Appended to: a reconnect continues the same recording in new segments.
+    // Owner-only, as it holds everything that was on the remote screen.
+    int fd = rec->seen ? open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600) : -1;
+    rec->file = fd >= 0 ? fdopen(fd, "ab") : NULL;
+    if (!rec->file) {
+        int err = rec->seen ? errno : ENOMEM;
+        if (fd >= 0) close(fd);
+        WLog_ERR(CRDP_TAG, "Failed to open %s for recording: %s", path, strerror(err));
+        crdp_record_free(rec);
+        return false;
+    }
+
+    // Every session in the file starts with its own header
+    uint8_t header[CRDP_RECORDING_HEADER_SIZE];
+    memcpy(header, CRDP_RECORDING_MAGIC, 8);
+    crdp_record_put_le(header + 8, CRDP_RECORDING_VERSION, 4);
+    crdp_record_put_le(header + 12, CRDP_RECORDING_TILE, 4);
+    crdp_record_put_le(header + 16, (uint64_t)time(NULL) * 1000, 8);
+    if (fwrite(header, 1, sizeof(header), rec->file) != sizeof(header) || fflush(rec->file) != 0 ||
+        pthread_create(&rec->thread, NULL, crdp_record_run, rec) != 0) {
+        WLog_ERR(CRDP_TAG, "Failed to start recording to %s", path);
+        crdp_record_free(rec);
+        return false;
+    }
+    rec->file_bytes = sizeof(header);
+    rec->start_ms = crdp_time_ms();
+    rec->last_flush_ms = rec->start_ms;
+    client->recorder = rec;
+    WLog_INFO(CRDP_TAG, "Recording the session to %s", path);
+    return true;
+}
+
+// After the protocol thread has stopped
+void crdp_record_close(crdp_client_t* client) {
+    crdp_recorder_t* rec = client->recorder;
+    if (!rec) return;
+    client->recorder = NULL;
+    pthread_mutex_lock(&rec->lock);
+    crdp_record_hand_off(rec, crdp_time_ms());
+    rec->closing = true;
+    pthread_cond_signal(&rec->cond);
+    pthread_mutex_unlock(&rec->lock);
+    pthread_join(rec->thread, NULL);
+    WLog_INFO(CRDP_TAG,
+              "Session recording %s: %llu frames, %llu tiles stored, %llu repeated, %llu KB, "
+              "painting held up %llu us per sample, %llu us at most%s%s",
+              client->config.record_path, (unsigned long long)rec->frames, (unsigned long long)rec->tiles,
+              (unsigned long long)rec->tile_refs, (unsigned long long)(rec->file_bytes / 1024),
+              (unsigned long long)(rec->holds ? rec->hold_us / rec->holds : 0),
+              (unsigned long long)rec->hold_max_us, rec->skipped ? ", sampling paused while the disk caught up" : "",
+              rec->failed ? " (incomplete)" : "");
+    crdp_record_free(rec);
+}
@@ -0,0 +1,96 @@
+#include "crdp_internal.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CRDP_SCALE_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define CRDP_SCALE_SSE2 1
+#endif
+
+// Sums each channel of a cols x rows block of BGRA pixels into sum[4]. Four
+// pixels are folded per vector step; channel sums stay in 32-bit lanes so any
+// realistic box size fits without overflow.
+static inline void crdp_box_sum(const uint8_t* p, uint32_t stride, uint32_t cols, uint32_t rows, uint32_t sum[4]) {
+    uint32_t vcols = cols & ~3u;
+#if defined(CRDP_SCALE_NEON)
+    uint32x4_t acc = vdupq_n_u32(0);
+    for (uint32_t y = 0; y < rows; y++) {
+        const uint8_t* row = p + (size_t)y * stride;
+        for (uint32_t x = 0; x < vcols; x += 4) {
+            uint8x16_t v = vld1q_u8(row + x * 4);
+            // px0+px2 | px1+px3 as 16-bit lanes, then widen and fold both halves
+            uint16x8_t s16 = vaddl_u8(vget_low_u8(v), vget_high_u8(v));
+            acc = vaddq_u32(acc, vaddl_u16(vget_low_u16(s16), vget_high_u16(s16)));
+        }
+    }
+    vst1q_u32(sum, acc);
+#elif defined(CRDP_SCALE_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    for (uint32_t y = 0; y < rows; y++) {
+        const uint8_t* row = p + (size_t)y * stride;
+        for (uint32_t x = 0; x < vcols; x += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(row + x * 4));
+            __m128i s16 = _mm_add_epi16(_mm_unpacklo_epi8(v, zero), _mm_unpackhi_epi8(v, zero));
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(s16, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(s16, zero));
+        }
+    }
+    _mm_storeu_si128((__m128i*)sum, acc);
+#else
+    vcols = 0;
+    sum[0] = sum[1] = sum[2] = sum[3] = 0;
+#endif
+
+    // Columns left over after the vector loop (and everything on other targets)
+    if (vcols == cols) return;
+    for (uint32_t y = 0; y < rows; y++) {
+        const uint8_t* px = p + (size_t)y * stride + (size_t)vcols * 4;
+        for (uint32_t x = vcols; x < cols; x++, px += 4) {
+            sum[0] += px[0];
+            sum[1] += px[1];
+            sum[2] += px[2];
+            sum[3] += px[3];
+        }
+    }
+}
+
+// Box-filter downscale: every destination pixel is the average of the source
+// pixels it covers. Source spans are computed with integer arithmetic so each
+// source pixel contributes to exactly one destination pixel, which also means a
+// destination sub-rectangle can be refreshed on its own.
+void crdp_downscale_bgra_rect(const uint8_t* src, uint32_t src_w, uint32_t src_h, uint32_t src_stride,
+                              uint8_t* dst, uint32_t dst_w, uint32_t dst_h, uint32_t dst_stride,
+                              uint32_t rect_x, uint32_t rect_y, uint32_t rect_w, uint32_t rect_h) {
+    if (!src || !dst || dst_w == 0 || dst_h == 0 || dst_w > src_w || dst_h > src_h) return;
+    if (rect_x >= dst_w || rect_y >= dst_h) return;
+    if (rect_w > dst_w - rect_x) rect_w = dst_w - rect_x;
+    if (rect_h > dst_h - rect_y) rect_h = dst_h - rect_y;
+
+    for (uint32_t dy = rect_y; dy < rect_y + rect_h; dy++) {
+        uint32_t y0 = (uint32_t)((uint64_t)dy * src_h / dst_h);
+        uint32_t y1 = (uint32_t)((uint64_t)(dy + 1) * src_h / dst_h);
+        uint8_t* out = dst + (size_t)dy * dst_stride;
+
+        for (uint32_t dx = rect_x; dx < rect_x + rect_w; dx++) {
+            uint32_t x0 = (uint32_t)((uint64_t)dx * src_w / dst_w);
+            uint32_t x1 = (uint32_t)((uint64_t)(dx + 1) * src_w / dst_w);
+            uint32_t sum[4];
+
+            crdp_box_sum(src + (size_t)y0 * src_stride + (size_t)x0 * 4, src_stride, x1 - x0, y1 - y0, sum);
+
+            uint32_t count = (x1 - x0) * (y1 - y0);
+            out[dx * 4 + 0] = (uint8_t)(sum[0] / count);
+            out[dx * 4 + 1] = (uint8_t)(sum[1] / count);
+            out[dx * 4 + 2] = (uint8_t)(sum[2] / count);
+            out[dx * 4 + 3] = (uint8_t)(sum[3] / count);
+        }
+    }
+}
+
+void crdp_downscale_bgra(const uint8_t* src, uint32_t src_w, uint32_t src_h, uint32_t src_stride,
+                         uint8_t* dst, uint32_t dst_w, uint32_t dst_h, uint32_t dst_stride) {
+    crdp_downscale_bgra_rect(src, src_w, src_h, src_stride, dst, dst_w, dst_h, dst_stride,
+                             0, 0, dst_w, dst_h);
+}
@@ -0,0 +1,93 @@
+#include "crdp_internal.h"
+
+#include <winpr/wlog.h>
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+
+// Session socket tuning.
+//
+// FreeRDP connects the socket (and sets its own keepalive options); CRDP
+// tunes it right after, from the TCPConnect hook in transport.c. Defaults
+// depend on the link: the kernel's RTT estimate straight after the handshake
+// is classified like the adaptive quality controller does, and slower links
+// get more patience before the peer is declared dead. Send and receive
+// buffers are left alone unless configured, since fixing their size turns
+// off the kernel's automatic sizing, which does better on every link type.
+
+typedef struct {
+    uint32_t keepalive_interval_s;  // Also the idle time before the first probe
+    uint32_t keepalive_count;
+    uint32_t ack_timeout_ms;
+} crdp_socket_defaults_t;
+
+static const crdp_socket_defaults_t crdp_socket_defaults[] = {
+    [CRDP_LINK_LAN] = { 2, 3, 10000 },
+    [CRDP_LINK_BROADBAND] = { 5, 3, 15000 },
+    [CRDP_LINK_WAN] = { 5, 4, 20000 },
+    [CRDP_LINK_CONSTRAINED] = { 10, 4, 30000 },
+};
+
+// Smoothed RTT of a connected socket in ms, 0 if unknown
+static uint32_t crdp_socket_rtt_ms(int fd) {
+#if defined(__APPLE__)
+    struct tcp_connection_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_CONNECTION_INFO, &info, &len) == 0) return info.tcpi_srtt;
+#elif defined(TCP_INFO)
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) return (info.tcpi_rtt + 999) / 1000;
+#endif
+    return 0;
+}
+
+static bool crdp_socket_set(int fd, int level, int name, int value, const char* what) {
+    if (setsockopt(fd, level, name, &value, sizeof(value)) == 0) return true;
+    WLog_WARN(CRDP_TAG, "Failed to set %s on the session socket: %s", what, strerror(errno));
+    return false;
+}
+
+void crdp_socket_tune(crdp_client_t* client, int fd, uint32_t connect_ms) {
+    const crdp_config_t* cfg = &client->config;
+    // The whole connect, name lookup included, if the kernel doesn't say
+    uint32_t rtt = crdp_socket_rtt_ms(fd);
+    if (rtt == 0) rtt = connect_ms;
+    crdp_link_tier_t tier = crdp_quality_tier_for_rtt(rtt);
+    const crdp_socket_defaults_t* d = &crdp_socket_defaults[tier];
+    atomic_store(&client->multitransport.connect_rtt_ms, rtt);
+    atomic_store(&client->multitransport.connect_tier, tier);
+
+    uint32_t interval = cfg->tcp_keepalive_interval_s ? cfg->tcp_keepalive_interval_s : d->keepalive_interval_s;
+    uint32_t count = cfg->tcp_keepalive_count ? cfg->tcp_keepalive_count : d->keepalive_count;
+    uint32_t ack_timeout = cfg->tcp_ack_timeout_ms ? cfg->tcp_ack_timeout_ms : d->ack_timeout_ms;
+
+    crdp_socket_set(fd, IPPROTO_TCP, TCP_NODELAY, !cfg->tcp_nagle, "TCP_NODELAY");
+    crdp_socket_set(fd, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+#if defined(__APPLE__)
+    crdp_socket_set(fd, IPPROTO_TCP, TCP_KEEPALIVE, (int)interval, "TCP_KEEPALIVE");
+#else
+    crdp_socket_set(fd, IPPROTO_TCP, TCP_KEEPIDLE, (int)interval, "TCP_KEEPIDLE");
+#endif
+    crdp_socket_set(fd, IPPROTO_TCP, TCP_KEEPINTVL, (int)interval, "TCP_KEEPINTVL");
+    crdp_socket_set(fd, IPPROTO_TCP, TCP_KEEPCNT, (int)count, "TCP_KEEPCNT");
+    // How long sent data may go unacknowledged before the connection drops
+#if defined(__APPLE__)
+    crdp_socket_set(fd, IPPROTO_TCP, TCP_RXT_CONNDROPTIME, (int)((ack_timeout + 999) / 1000),
+                    "TCP_RXT_CONNDROPTIME");
+#elif defined(TCP_USER_TIMEOUT)
+    crdp_socket_set(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, (int)ack_timeout, "TCP_USER_TIMEOUT");
+#endif
+    if (cfg->tcp_send_buffer) {
+        crdp_socket_set(fd, SOL_SOCKET, SO_SNDBUF, (int)cfg->tcp_send_buffer, "SO_SNDBUF");
+    }
+    if (cfg->tcp_receive_buffer) {
+        crdp_socket_set(fd, SOL_SOCKET, SO_RCVBUF, (int)cfg->tcp_receive_buffer, "SO_RCVBUF");
+    }
+
+    WLog_INFO(CRDP_TAG, "Session socket: RTT %u ms (%s link), nodelay %s, keepalive %u s x %u, ack timeout %u ms",
+              rtt, crdp_quality_tier_name(tier), cfg->tcp_nagle ? "off" : "on", interval, count, ack_timeout);
+}
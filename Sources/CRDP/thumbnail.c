@@ -0,0 +1,234 @@
+#include "crdp_internal.h"
+
+#include <winpr/wlog.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CRDP_THUMBNAIL_DEFAULT_WIDTH 256
+#define CRDP_THUMBNAIL_DEFAULT_INTERVAL_MS 2000
+#define CRDP_THUMBNAIL_MIN_INTERVAL_MS 100
+// Dirty tracking granularity, in thumbnail pixels
+#define CRDP_THUMBNAIL_TILE 16
+
+static void crdp_thumbnail_mark_all(crdp_thumbnailer_t* t) {
+    t->all_dirty = true;
+}
+
+// Called by the protocol thread with paint_lock held, for every damaged rect
+void crdp_thumbnail_mark(crdp_client_t* client, int32_t x, int32_t y, int32_t w, int32_t h) {
+    crdp_thumbnailer_t* t = &client->thumbs;
+    if (!atomic_load(&t->active) || t->all_dirty) return;
+    if (!t->dirty || t->src_w == 0 || t->src_h == 0 || w <= 0 || h <= 0) {
+        crdp_thumbnail_mark_all(t);
+        return;
+    }
+
+    // Clamp to the framebuffer the thumbnail was sized for
+    int64_t left = x < 0 ? 0 : x;
+    int64_t top = y < 0 ? 0 : y;
+    int64_t right = (int64_t)x + w > t->src_w ? t->src_w : (int64_t)x + w;
+    int64_t bottom = (int64_t)y + h > t->src_h ? t->src_h : (int64_t)y + h;
+    if (left >= right || top >= bottom) return;
+
+    // Map into thumbnail space, rounding outwards so box edges are covered
+    uint32_t dx0 = (uint32_t)(left * t->w / t->src_w);
+    uint32_t dy0 = (uint32_t)(top * t->h / t->src_h);
+    uint32_t dx1 = (uint32_t)((right * t->w + t->src_w - 1) / t->src_w);
+    uint32_t dy1 = (uint32_t)((bottom * t->h + t->src_h - 1) / t->src_h);
+
+    uint32_t tx1 = (dx1 + CRDP_THUMBNAIL_TILE - 1) / CRDP_THUMBNAIL_TILE;
+    uint32_t ty1 = (dy1 + CRDP_THUMBNAIL_TILE - 1) / CRDP_THUMBNAIL_TILE;
+    if (tx1 > t->tiles_x) tx1 = t->tiles_x;
+    if (ty1 > t->tiles_y) ty1 = t->tiles_y;
+
+    for (uint32_t ty = dy0 / CRDP_THUMBNAIL_TILE; ty < ty1; ty++) {
+        for (uint32_t tx = dx0 / CRDP_THUMBNAIL_TILE; tx < tx1; tx++) {
+            uint32_t bit = ty * t->tiles_x + tx;
+            t->dirty[bit / 64] |= (uint64_t)1 << (bit % 64);
+        }
+    }
+}
+
+// (Re)size the thumbnail for the current framebuffer; paint_lock held
+static bool crdp_thumbnail_resize(crdp_thumbnailer_t* t, uint32_t src_w, uint32_t src_h, uint32_t width) {
+    uint32_t tw = width < src_w ? width : src_w;
+    uint32_t th = (uint32_t)((uint64_t)src_h * tw / src_w);
+    if (th == 0) th = 1;
+    if (t->buf && t->w == tw && t->h == th && t->src_w == src_w && t->src_h == src_h) return true;
+
+    uint32_t tiles_x = (tw + CRDP_THUMBNAIL_TILE - 1) / CRDP_THUMBNAIL_TILE;
+    uint32_t tiles_y = (th + CRDP_THUMBNAIL_TILE - 1) / CRDP_THUMBNAIL_TILE;
+    size_t words = ((size_t)tiles_x * tiles_y + 63) / 64;
+
+    uint8_t* buf = realloc(t->buf, (size_t)tw * th * 4);
+    if (!buf) return false;
+    t->buf = buf;
+    uint64_t* dirty = realloc(t->dirty, words * sizeof(uint64_t));
+    if (!dirty) return false;
+    t->dirty = dirty;
+    memset(t->dirty, 0, words * sizeof(uint64_t));
+
+    t->w = tw;
+    t->h = th;
+    t->src_w = src_w;
+    t->src_h = src_h;
+    t->tiles_x = tiles_x;
+    t->tiles_y = tiles_y;
+    t->all_dirty = true;
+    return true;
+}
+
+// Downscale the dirty tiles into the thumbnail. Returns true if anything changed.
+static bool crdp_thumbnail_refresh(crdp_client_t* client, uint32_t width) {
+    crdp_thumbnailer_t* t = &client->thumbs;
+    bool changed = false;
+
+    pthread_mutex_lock(&client->paint_lock);
+    rdpGdi* gdi = (client->gdi_ready && client->instance && client->instance->context)
+                      ? client->instance->context->gdi : NULL;
+    if (!gdi || !gdi->primary_buffer || gdi->width <= 0 || gdi->height <= 0) goto out;
+    if (!crdp_thumbnail_resize(t, (uint32_t)gdi->width, (uint32_t)gdi->height, width)) goto out;
+
+    for (uint32_t ty = 0; ty < t->tiles_y; ty++) {
+        for (uint32_t tx = 0; tx < t->tiles_x; tx++) {
+            uint32_t bit = ty * t->tiles_x + tx;
+            uint64_t mask = (uint64_t)1 << (bit % 64);
+            if (!t->all_dirty && !(t->dirty[bit / 64] & mask)) continue;
+            crdp_downscale_bgra_rect(gdi->primary_buffer, t->src_w, t->src_h, gdi->stride,
+                                     t->buf, t->w, t->h, t->w * 4,
+                                     tx * CRDP_THUMBNAIL_TILE, ty * CRDP_THUMBNAIL_TILE,
+                                     CRDP_THUMBNAIL_TILE, CRDP_THUMBNAIL_TILE);
+            changed = true;
+        }
+    }
+    memset(t->dirty, 0, ((size_t)t->tiles_x * t->tiles_y + 63) / 64 * sizeof(uint64_t));
+    t->all_dirty = false;
+
+out:
+    pthread_mutex_unlock(&client->paint_lock);
+    return changed;
+}
+
+static void* crdp_thumbnail_thread(void* arg) {
+    crdp_client_t* client = (crdp_client_t*)arg;
+    crdp_thumbnailer_t* t = &client->thumbs;
+
+    pthread_mutex_lock(&t->lock);
+    while (!t->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += t->interval_ms / 1000;
+        deadline.tv_nsec += (long)(t->interval_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!t->stop) {
+            if (pthread_cond_timedwait(&t->cond, &t->lock, &deadline) == ETIMEDOUT) break;
+        }
+        if (t->stop) break;
+
+        crdp_thumbnail_cb cb = t->cb;
+        void* user = t->user;
+        uint32_t width = t->width;
+        pthread_mutex_unlock(&t->lock);
+
+        // Only this thread writes the thumbnail buffer, so it can be handed
+        // out without holding paint_lock
+        if (crdp_thumbnail_refresh(client, width) && cb) {
+            cb(t->buf, t->w, t->h, t->w * 4, user);
+        }
+
+        pthread_mutex_lock(&t->lock);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+void crdp_thumbnail_init(crdp_client_t* client) {
+    crdp_thumbnailer_t* t = &client->thumbs;
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->cond, NULL);
+    atomic_init(&t->active, false);
+}
+
+void crdp_thumbnail_stop(crdp_client_t* client) {
+    crdp_thumbnailer_t* t = &client->thumbs;
+    pthread_mutex_lock(&t->lock);
+    bool running = t->running;
+    t->stop = true;
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+
+    if (running) pthread_join(t->thread, NULL);
+
+    pthread_mutex_lock(&client->paint_lock);
+    atomic_store(&t->active, false);
+    pthread_mutex_unlock(&client->paint_lock);
+
+    pthread_mutex_lock(&t->lock);
+    t->running = false;
+    t->cb = NULL;
+    t->user = NULL;
+    pthread_mutex_unlock(&t->lock);
+}
+
+void crdp_thumbnail_free(crdp_client_t* client) {
+    crdp_thumbnailer_t* t = &client->thumbs;
+    crdp_thumbnail_stop(client);
+    free(t->buf);
+    free(t->dirty);
+    t->buf = NULL;
+    t->dirty = NULL;
+    pthread_cond_destroy(&t->cond);
+    pthread_mutex_destroy(&t->lock);
+}
+
+int crdp_set_thumbnail_callback(crdp_client_t* client, uint32_t width, uint32_t interval_ms,
+                                crdp_thumbnail_cb cb, void* user) {
+    if (!client) return -1;
+    crdp_thumbnailer_t* t = &client->thumbs;
+
+    if (!cb) {
+        crdp_thumbnail_stop(client);
+        return 0;
+    }
+
+    if (width == 0) width = CRDP_THUMBNAIL_DEFAULT_WIDTH;
+    if (interval_ms == 0) interval_ms = CRDP_THUMBNAIL_DEFAULT_INTERVAL_MS;
+    if (interval_ms < CRDP_THUMBNAIL_MIN_INTERVAL_MS) interval_ms = CRDP_THUMBNAIL_MIN_INTERVAL_MS;
+
+    pthread_mutex_lock(&t->lock);
+    t->cb = cb;
+    t->user = user;
+    t->width = width;
+    t->interval_ms = interval_ms;
+    if (t->running) {
+        pthread_mutex_unlock(&t->lock);
+        return 0;
+    }
+    t->stop = false;
+    pthread_mutex_unlock(&t->lock);
+
+    // First refresh after (re)starting covers the whole framebuffer
+    pthread_mutex_lock(&client->paint_lock);
+    t->all_dirty = true;
+    atomic_store(&t->active, true);
+    pthread_mutex_unlock(&client->paint_lock);
+
+    pthread_mutex_lock(&t->lock);
+    if (pthread_create(&t->thread, NULL, crdp_thumbnail_thread, client) != 0) {
+        t->cb = NULL;
+        t->user = NULL;
+        pthread_mutex_unlock(&t->lock);
+        atomic_store(&t->active, false);
+        WLog_WARN(CRDP_TAG, "Failed to start thumbnail thread");
+        return -2;
+    }
+    t->running = true;
+    pthread_mutex_unlock(&t->lock);
+    return 0;
+}
@@ -0,0 +1,545 @@
+#include "crdp_internal.h"
+
+#include <freerdp/freerdp.h>
+#include <winpr/stream.h>
+#include <winpr/wlog.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// Protocol traces.
+//
+// Recording keeps every PDU the server sends, as the transport hands it over
+// (after TLS), with the time it arrived. Replay feeds a trace back through
+// FreeRDP's transport callbacks in place of the network, so the connection
+// sequence, decoders and frame delivery run exactly as in the recorded
+// session, under a profiler or debugger and without a server.
+//
+// File: a fixed header, then blocks of up to CRDP_TRACE_BLOCK_SIZE bytes,
+// each LZ4-compressed (or stored when that doesn't help) behind a
+// {raw length, stored length} pair. Concatenated, the blocks are a stream of
+// records {varint µs since the previous record, varint length, PDU}.
+//
+// What the client sends isn't recorded: replay only needs it to be
+// accepted, so it is dropped.
+
+#define CRDP_TRACE_MAGIC "CRDPTRC1"
+#define CRDP_TRACE_VERSION 1
+#define CRDP_TRACE_HEADER_SIZE 40
+#define CRDP_TRACE_BLOCK_SIZE (256 * 1024)
+// Filled blocks waiting for the writer before recording has to wait too
+#define CRDP_TRACE_BLOCKS 4
+#define CRDP_TRACE_STORED 0x80000000u
+
+// What the recording client asked for. The server's answers depend on it,
+// so the replay client asks for the same: same channels, joined in the
+// same order.
+#define CRDP_TRACE_GFX 0x01
+#define CRDP_TRACE_RDPDR 0x02
+#define CRDP_TRACE_RDPSND 0x04
+#define CRDP_TRACE_AUDIN 0x08
+#define CRDP_TRACE_MULTITRANSPORT 0x10
+#define CRDP_TRACE_AUTODETECT 0x20
+
+// Connection Confirm with an RDP Negotiation Response
+#define CRDP_X224_CONNECTION_CONFIRM 0xD0
+#define CRDP_NEG_RESPONSE 0x02
+#define CRDP_PROTOCOL_RDP 0x00
+#define CRDP_PROTOCOL_SSL 0x01
+
+struct crdp_trace {
+    FILE* file;
+    // Ring of blocks: recording fills blocks[head % CRDP_TRACE_BLOCKS] and
+    // the writer thread drains [tail, head)
+    uint8_t* blocks[CRDP_TRACE_BLOCKS];
+    size_t lengths[CRDP_TRACE_BLOCKS];
+    uint32_t head;
+    uint32_t tail;
+    size_t used;
+    uint8_t* packed;  // Writer only
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool closing;
+    bool failed;
+    uint64_t last_us;
+    uint64_t records;
+    uint64_t raw_bytes;
+    uint64_t file_bytes;
+};
+
+struct crdp_replay {
+    FILE* file;
+    uint32_t flags;
+    uint8_t* block;
+    size_t block_len;
+    size_t block_pos;
+    uint8_t* packed;
+    bool fast;
+    // The next record, read ahead so its due time is known
+    uint8_t* pdu;
+    size_t pdu_len;
+    size_t pdu_cap;
+    uint64_t pdu_us;
+    bool have_pdu;
+    bool finished;
+    // Trace time + offset = monotonic time the record is due
+    bool clock_started;
+    int64_t clock_offset_us;
+    // Past the Connection Confirm, which is the first PDU
+    bool negotiated;
+    // Dropping the records of a security handshake the replay doesn't do
+    bool in_nla;
+    int fds[2];
+    uint64_t pdus;
+    uint64_t start_ms;
+};
+
+static uint64_t crdp_trace_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void crdp_trace_put_le(uint8_t* p, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) p[i] = (uint8_t)(value >> (8 * i));
+}
+
+static uint64_t crdp_trace_get_le(const uint8_t* p, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) value |= (uint64_t)p[i] << (8 * i);
+    return value;
+}
+
+static size_t crdp_trace_put_varint(uint8_t* p, uint64_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        p[n++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    p[n++] = (uint8_t)value;
+    return n;
+}
+
+// Recording
+
+static void* crdp_trace_run(void* arg) {
+    crdp_trace_t* trace = (crdp_trace_t*)arg;
+    pthread_mutex_lock(&trace->lock);
+    for (;;) {
+        while (trace->tail == trace->head && !trace->closing) pthread_cond_wait(&trace->cond, &trace->lock);
+        if (trace->tail == trace->head) break;
+        uint32_t slot = trace->tail % CRDP_TRACE_BLOCKS;
+        const uint8_t* block = trace->blocks[slot];
+        size_t len = trace->lengths[slot];
+        bool failed = trace->failed;
+        pthread_mutex_unlock(&trace->lock);
+
+        if (!failed) {
+            size_t packed = crdp_lz4_compress(block, len, trace->packed, crdp_lz4_bound(CRDP_TRACE_BLOCK_SIZE));
+            uint8_t header[8];
+            crdp_trace_put_le(header, len, 4);
+            const uint8_t* out = trace->packed;
+            if (packed == 0 || packed >= len) {
+                out = block;
+                packed = len;
+                crdp_trace_put_le(header + 4, packed | CRDP_TRACE_STORED, 4);
+            } else {
+                crdp_trace_put_le(header + 4, packed, 4);
+            }
+            failed = fwrite(header, 1, sizeof(header), trace->file) != sizeof(header) ||
+                     fwrite(out, 1, packed, trace->file) != packed;
+            if (failed) WLog_ERR(CRDP_TAG, "Failed to write the protocol trace: %s", strerror(errno));
+            trace->file_bytes += sizeof(header) + packed;
+        }
+
+        pthread_mutex_lock(&trace->lock);
+        trace->failed = trace->failed || failed;
+        trace->tail++;
+        pthread_cond_broadcast(&trace->cond);
+    }
+    pthread_mutex_unlock(&trace->lock);
+    return NULL;
+}
+
+// Hands the block being filled to the writer; waits for a free one
+static void crdp_trace_submit(crdp_trace_t* trace) {
+    pthread_mutex_lock(&trace->lock);
+    trace->lengths[trace->head % CRDP_TRACE_BLOCKS] = trace->used;
+    trace->head++;
+    pthread_cond_broadcast(&trace->cond);
+    while (trace->head - trace->tail >= CRDP_TRACE_BLOCKS) pthread_cond_wait(&trace->cond, &trace->lock);
+    pthread_mutex_unlock(&trace->lock);
+    trace->used = 0;
+}
+
+static void crdp_trace_append(crdp_trace_t* trace, const uint8_t* data, size_t len) {
+    while (len > 0) {
+        size_t n = CRDP_TRACE_BLOCK_SIZE - trace->used;
+        if (n > len) n = len;
+        memcpy(trace->blocks[trace->head % CRDP_TRACE_BLOCKS] + trace->used, data, n);
+        trace->used += n;
+        data += n;
+        len -= n;
+        if (trace->used == CRDP_TRACE_BLOCK_SIZE) crdp_trace_submit(trace);
+    }
+}
+
+// Protocol thread
+void crdp_trace_record(crdp_trace_t* trace, const uint8_t* data, size_t len) {
+    uint64_t now = crdp_trace_now_us();
+    uint8_t header[20];
+    size_t n = crdp_trace_put_varint(header, now - trace->last_us);
+    n += crdp_trace_put_varint(header + n, len);
+    trace->last_us = now;
+    crdp_trace_append(trace, header, n);
+    crdp_trace_append(trace, data, len);
+    trace->records++;
+    trace->raw_bytes += len;
+}
+
+static void crdp_trace_free(crdp_trace_t* trace) {
+    if (trace->file) fclose(trace->file);
+    for (int i = 0; i < CRDP_TRACE_BLOCKS; i++) free(trace->blocks[i]);
+    free(trace->packed);
+    pthread_cond_destroy(&trace->cond);
+    pthread_mutex_destroy(&trace->lock);
+    free(trace);
+}
+
+bool crdp_trace_open(crdp_client_t* client) {
+    const crdp_config_t* cfg = &client->config;
+    crdp_trace_t* trace = calloc(1, sizeof(*trace));
+    if (!trace) return false;
+    pthread_mutex_init(&trace->lock, NULL);
+    pthread_cond_init(&trace->cond, NULL);
+    bool ok = (trace->packed = malloc(crdp_lz4_bound(CRDP_TRACE_BLOCK_SIZE))) != NULL;
+    for (int i = 0; i < CRDP_TRACE_BLOCKS && ok; i++) ok = (trace->blocks[i] = malloc(CRDP_TRACE_BLOCK_SIZE)) != NULL;
+    if (!ok) {
+        crdp_trace_free(trace);
+        return false;
+    }
+    // Owner-only: it holds what the server sent, decrypted, clipboard included
+    int fd = open(cfg->trace_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    trace->file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (!trace->file) {
+        int err = errno;
+        if (fd >= 0) close(fd);
+        WLog_ERR(CRDP_TAG, "Failed to create %s: %s", cfg->trace_path, strerror(err));
+        crdp_trace_free(trace);
+        return false;
+    }
+
+    uint32_t flags = 0;
+    if (cfg->allow_gfx) flags |= CRDP_TRACE_GFX;
+    if (client->drive_count > 0) flags |= CRDP_TRACE_RDPDR;
+    if (cfg->audio_output != CRDP_AUDIO_OFF) flags |= CRDP_TRACE_RDPSND;
+    if (cfg->mic_input != CRDP_MIC_OFF) flags |= CRDP_TRACE_AUDIN;
+    if (cfg->udp_transport) flags |= CRDP_TRACE_MULTITRANSPORT;
+    if (cfg->adaptive_quality) flags |= CRDP_TRACE_AUTODETECT;
+    uint8_t header[CRDP_TRACE_HEADER_SIZE];
+    memcpy(header, CRDP_TRACE_MAGIC, 8);
+    crdp_trace_put_le(header + 8, CRDP_TRACE_VERSION, 4);
+    crdp_trace_put_le(header + 12, CRDP_TRACE_BLOCK_SIZE, 4);
+    crdp_trace_put_le(header + 16, (uint64_t)time(NULL) * 1000, 8);
+    crdp_trace_put_le(header + 24, cfg->width ? cfg->width : 1280, 4);
+    crdp_trace_put_le(header + 28, cfg->height ? cfg->height : 720, 4);
+    crdp_trace_put_le(header + 32, flags, 4);
+    crdp_trace_put_le(header + 36, cfg->compression, 4);
+    if (fwrite(header, 1, sizeof(header), trace->file) != sizeof(header) ||
+        pthread_create(&trace->thread, NULL, crdp_trace_run, trace) != 0) {
+        WLog_ERR(CRDP_TAG, "Failed to start the protocol trace %s", cfg->trace_path);
+        crdp_trace_free(trace);
+        return false;
+    }
+    trace->file_bytes = sizeof(header);
+    trace->last_us = crdp_trace_now_us();
+    client->trace = trace;
+    WLog_INFO(CRDP_TAG, "Recording a protocol trace to %s", cfg->trace_path);
+    return true;
+}
+
+// After the protocol thread has stopped
+void crdp_trace_close(crdp_client_t* client) {
+    crdp_trace_t* trace = client->trace;
+    if (!trace) return;
+    client->trace = NULL;
+    if (trace->used > 0) crdp_trace_submit(trace);
+    pthread_mutex_lock(&trace->lock);
+    trace->closing = true;
+    pthread_cond_broadcast(&trace->cond);
+    pthread_mutex_unlock(&trace->lock);
+    pthread_join(trace->thread, NULL);
+    if (fflush(trace->file) != 0) trace->failed = true;
+    WLog_INFO(CRDP_TAG, "Protocol trace %s: %llu PDUs, %llu KB in %llu KB%s", client->config.trace_path,
+              (unsigned long long)trace->records, (unsigned long long)(trace->raw_bytes / 1024),
+              (unsigned long long)(trace->file_bytes / 1024), trace->failed ? " (incomplete)" : "");
+    crdp_trace_free(trace);
+}
+
+// Replay
+
+static crdp_replay_t* crdp_replay_of(rdpTransport* transport) {
+    crdp_context* ctx = (crdp_context*)transport_get_context(transport);
+    return ctx && ctx->client ? ctx->client->replay : NULL;
+}
+
+// Loads the next block; false at the end of the file or on a bad block
+static bool crdp_replay_next_block(crdp_replay_t* replay) {
+    uint8_t header[8];
+    if (fread(header, 1, sizeof(header), replay->file) != sizeof(header)) return false;
+    size_t raw = (size_t)crdp_trace_get_le(header, 4);
+    size_t stored = (size_t)crdp_trace_get_le(header + 4, 4);
+    bool plain = (stored & CRDP_TRACE_STORED) != 0;
+    stored &= ~(size_t)CRDP_TRACE_STORED;
+    bool ok = raw > 0 && raw <= CRDP_TRACE_BLOCK_SIZE && (plain ? stored == raw : stored < raw);
+    if (ok && plain) {
+        ok = fread(replay->block, 1, raw, replay->file) == raw;
+    } else if (ok) {
+        ok = fread(replay->packed, 1, stored, replay->file) == stored &&
+             crdp_lz4_decompress(replay->packed, stored, replay->block, raw) == raw;
+    }
+    if (!ok) {
+        WLog_WARN(CRDP_TAG, "Protocol trace is truncated or damaged; replaying what was read");
+        return false;
+    }
+    replay->block_len = raw;
+    replay->block_pos = 0;
+    return true;
+}
+
+static bool crdp_replay_read(crdp_replay_t* replay, uint8_t* dst, size_t len) {
+    while (len > 0) {
+        if (replay->block_pos == replay->block_len && !crdp_replay_next_block(replay)) return false;
+        size_t n = replay->block_len - replay->block_pos;
+        if (n > len) n = len;
+        memcpy(dst, replay->block + replay->block_pos, n);
+        replay->block_pos += n;
+        dst += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool crdp_replay_read_varint(crdp_replay_t* replay, uint64_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        uint8_t b;
+        if (!crdp_replay_read(replay, &b, 1)) return false;
+        *value |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+static bool crdp_replay_next_pdu(crdp_replay_t* replay) {
+    uint64_t delta, len;
+    if (!crdp_replay_read_varint(replay, &delta) || !crdp_replay_read_varint(replay, &len)) return false;
+    if (len == 0 || len > 16 * 1024 * 1024) return false;
+    if (len > replay->pdu_cap) {
+        uint8_t* pdu = realloc(replay->pdu, len);
+        if (!pdu) return false;
+        replay->pdu = pdu;
+        replay->pdu_cap = len;
+    }
+    if (!crdp_replay_read(replay, replay->pdu, len)) return false;
+    replay->pdu_len = len;
+    replay->pdu_us += delta;
+    replay->have_pdu = true;
+    return true;
+}
+
+// The replay client only offers TLS, and TLS itself is skipped: a server
+// that chose NLA is made to have chosen TLS, and its half of the CredSSP
+// exchange dropped. Returns 1 to deliver the PDU, 0 to skip it, -1 if the
+// trace can't be replayed.
+static int crdp_replay_fixup(crdp_replay_t* replay) {
+    uint8_t* p = replay->pdu;
+    size_t len = replay->pdu_len;
+    bool tpkt = len >= 4 && p[0] == CRDP_TPKT_VERSION;
+    if (replay->in_nla) {
+        if (!tpkt) return 0;
+        replay->in_nla = false;
+    }
+    if (!tpkt || replay->negotiated) return 1;
+    replay->negotiated = true;
+    if (len < 7 || p[5] != CRDP_X224_CONNECTION_CONFIRM) return 1;
+
+    uint32_t protocol = len >= 19 && p[11] == CRDP_NEG_RESPONSE ? (uint32_t)crdp_trace_get_le(p + 15, 4)
+                                                                 : CRDP_PROTOCOL_RDP;
+    if (protocol == CRDP_PROTOCOL_RDP) {
+        WLog_ERR(CRDP_TAG, "The trace is of a session with standard RDP security; its PDUs are encrypted "
+                           "with keys the replay doesn't have");
+        return -1;
+    }
+    replay->in_nla = protocol != CRDP_PROTOCOL_SSL;
+    crdp_trace_put_le(p + 15, CRDP_PROTOCOL_SSL, 4);
+    return 1;
+}
+
+// Protocol thread. Replaces the transport's own ReadPdu.
+static int crdp_replay_read_pdu(rdpTransport* transport, wStream* s) {
+    crdp_context* ctx = (crdp_context*)transport_get_context(transport);
+    crdp_replay_t* replay = crdp_replay_of(transport);
+    if (!replay) return -1;
+
+    for (;;) {
+        if (!replay->have_pdu && (replay->finished || !crdp_replay_next_pdu(replay))) {
+            // The connection sequence is fed as fast as it is read; the
+            // trace has to get at least that far
+            if (!ctx->client->connected) return -1;
+            if (!replay->finished) {
+                WLog_INFO(CRDP_TAG, "Replay finished: %llu PDUs in %llu ms", (unsigned long long)replay->pdus,
+                          (unsigned long long)(crdp_time_ms() - replay->start_ms));
+                replay->finished = true;
+                freerdp_abort_connect_context(&ctx->_p);
+            }
+            return 0;
+        }
+        if (ctx->client->connected && !replay->fast) {
+            int64_t now = (int64_t)crdp_trace_now_us();
+            if (!replay->clock_started) {
+                replay->clock_offset_us = now - (int64_t)replay->pdu_us;
+                replay->clock_started = true;
+            }
+            if ((int64_t)replay->pdu_us + replay->clock_offset_us > now) return 0;
+        }
+        replay->have_pdu = false;
+        int rc = crdp_replay_fixup(replay);
+        if (rc < 0) return -1;
+        if (rc > 0) break;
+    }
+
+    Stream_SetPosition(s, 0);
+    if (!Stream_EnsureCapacity(s, replay->pdu_len)) return -1;
+    Stream_Write(s, replay->pdu, replay->pdu_len);
+    replay->pdus++;
+    return (int)replay->pdu_len;
+}
+
+// What the client sends goes nowhere
+static int crdp_replay_write_pdu(rdpTransport* transport, wStream* s) {
+    (void)transport;
+    (void)s;
+    return 0;
+}
+
+// A socket that never becomes readable, so the transport has something to
+// wait on; the protocol loop's timeout paces the replay instead
+static int crdp_replay_tcp_connect(rdpContext* context, rdpSettings* settings, const char* hostname, int port,
+                                   DWORD timeout) {
+    (void)settings;
+    (void)hostname;
+    (void)port;
+    (void)timeout;
+    crdp_replay_t* replay = ((crdp_context*)context)->client->replay;
+    if (!replay || socketpair(AF_UNIX, SOCK_STREAM, 0, replay->fds) != 0) return -1;
+    return replay->fds[0];
+}
+
+static BOOL crdp_replay_tls_connect(rdpTransport* transport) {
+    (void)transport;
+    return TRUE;
+}
+
+bool crdp_replay_open(crdp_client_t* client) {
+    crdp_config_t* cfg = &client->config;
+    crdp_replay_t* replay = calloc(1, sizeof(*replay));
+    if (!replay) return false;
+    replay->fds[0] = replay->fds[1] = -1;
+    replay->fast = cfg->replay_fast;
+    replay->block = malloc(CRDP_TRACE_BLOCK_SIZE);
+    replay->packed = malloc(crdp_lz4_bound(CRDP_TRACE_BLOCK_SIZE));
+    replay->file = fopen(cfg->replay_path, "rb");
+    uint8_t header[CRDP_TRACE_HEADER_SIZE];
+    bool ok = replay->block && replay->packed && replay->file &&
+              fread(header, 1, sizeof(header), replay->file) == sizeof(header) &&
+              memcmp(header, CRDP_TRACE_MAGIC, 8) == 0 &&
+              crdp_trace_get_le(header + 8, 4) == CRDP_TRACE_VERSION &&
+              crdp_trace_get_le(header + 12, 4) <= CRDP_TRACE_BLOCK_SIZE;
+    if (!ok) {
+        WLog_ERR(CRDP_TAG, "%s is not a CRDP protocol trace", cfg->replay_path);
+        client->replay = replay;
+        crdp_replay_close(client);
+        return false;
+    }
+
+    // Ask for what the recording client asked for. Drives and the
+    // microphone only need their channels: what comes through them is
+    // answered with errors, without touching the disk or the microphone.
+    replay->flags = (uint32_t)crdp_trace_get_le(header + 32, 4);
+    cfg->width = (uint32_t)crdp_trace_get_le(header + 24, 4);
+    cfg->height = (uint32_t)crdp_trace_get_le(header + 28, 4);
+    cfg->compression = (crdp_compression_t)crdp_trace_get_le(header + 36, 4);
+    cfg->allow_gfx = (replay->flags & CRDP_TRACE_GFX) != 0;
+    cfg->audio_output = (replay->flags & CRDP_TRACE_RDPSND) ? CRDP_AUDIO_NULL : CRDP_AUDIO_OFF;
+    cfg->mic_input = CRDP_MIC_OFF;
+    cfg->udp_transport = (replay->flags & CRDP_TRACE_MULTITRANSPORT) != 0;
+    cfg->adaptive_quality = (replay->flags & CRDP_TRACE_AUTODETECT) != 0;
+    cfg->enable_nla = false;
+    crdp_drive_clear(client);
+    if (!cfg->host) cfg->host = strdup("replay");
+
+    replay->start_ms = crdp_time_ms();
+    client->replay = replay;
+    WLog_INFO(CRDP_TAG, "Replaying %s (%ux%u)%s", cfg->replay_path, cfg->width, cfg->height,
+              replay->fast ? " as fast as it decodes" : "");
+    return true;
+}
+
+// Called from PreConnect, before crdp_transport_install wraps the callbacks
+bool crdp_replay_configure(crdp_context* ctx, rdpSettings* settings) {
+    crdp_replay_t* replay = ctx->client->replay;
+    freerdp_settings_set_bool(settings, FreeRDP_NlaSecurity, FALSE);
+    freerdp_settings_set_bool(settings, FreeRDP_TlsSecurity, TRUE);
+    freerdp_settings_set_bool(settings, FreeRDP_RdpSecurity, FALSE);
+    if (replay->flags & CRDP_TRACE_RDPDR) {
+        freerdp_settings_set_bool(settings, FreeRDP_DeviceRedirection, TRUE);
+        const char* rdpdr_params[] = { "rdpdr" };
+        freerdp_client_add_static_channel(settings, 1, rdpdr_params);
+    }
+    if (replay->flags & CRDP_TRACE_AUDIN) {
+        freerdp_settings_set_bool(settings, FreeRDP_SupportDynamicChannels, TRUE);
+    }
+
+    const rdpTransportIo* io = freerdp_get_io_callbacks(&ctx->_p);
+    if (!io) return false;
+    rdpTransportIo replayed = *io;
+    replayed.TCPConnect = crdp_replay_tcp_connect;
+    replayed.TLSConnect = crdp_replay_tls_connect;
+    replayed.ReadPdu = crdp_replay_read_pdu;
+    replayed.WritePdu = crdp_replay_write_pdu;
+    if (!freerdp_set_io_callbacks(&ctx->_p, &replayed)) {
+        WLog_ERR(CRDP_TAG, "Failed to install the replay transport");
+        return false;
+    }
+    return true;
+}
+
+// How long the protocol thread may sleep before the next record is due
+DWORD crdp_replay_timeout_ms(crdp_client_t* client) {
+    crdp_replay_t* replay = client->replay;
+    if (replay->fast || !replay->have_pdu || !replay->clock_started) return 0;
+    int64_t due = (int64_t)replay->pdu_us + replay->clock_offset_us - (int64_t)crdp_trace_now_us();
+    return due > 0 ? (DWORD)((due + 999) / 1000) : 0;
+}
+
+// After the protocol thread has stopped
+void crdp_replay_close(crdp_client_t* client) {
+    crdp_replay_t* replay = client->replay;
+    if (!replay) return;
+    client->replay = NULL;
+    if (replay->file) fclose(replay->file);
+    // fds[0] belongs to the transport, which closed it
+    if (replay->fds[1] >= 0) close(replay->fds[1]);
+    free(replay->block);
+    free(replay->packed);
+    free(replay->pdu);
+    free(replay);
+}
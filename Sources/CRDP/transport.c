@@ -0,0 +1,134 @@
+#include "crdp_internal.h"
+
+#include <freerdp/freerdp.h>
+#include <winpr/stream.h>
+#include <winpr/wlog.h>
+
+// Transport I/O hooks.
+//
+// FreeRDP lets a client replace the callbacks its transport uses to connect
+// and to move whole PDUs. CRDP wraps them to tune the socket once it is
+// connected and to look at the traffic on the way through; the originals
+// still do all of the actual I/O (a replay's, from trace.c, included).
+
+// Slow-path framing
+#define CRDP_X224_DATA 0xF0
+#define CRDP_MCS_SEND_DATA_INDICATION 26
+
+static inline uint16_t crdp_read_u16_be(const uint8_t* p) { return (uint16_t)((p[0] << 8) | p[1]); }
+
+bool crdp_transport_channel_payload(const uint8_t* data, size_t len, uint16_t* channel_id,
+                                    const uint8_t** payload, size_t* payload_len) {
+    // TPKT (4) + X.224 data (3) + MCS SendDataIndication header (6) + PER length
+    if (len < 14 || data[0] != CRDP_TPKT_VERSION || crdp_read_u16_be(data + 2) != len ||
+        data[5] != CRDP_X224_DATA || (data[7] >> 2) != CRDP_MCS_SEND_DATA_INDICATION) {
+        return false;
+    }
+
+    size_t off = 13;
+    size_t n = data[off++];
+    if (n & 0x80) {
+        if (off >= len) return false;
+        n = ((n & 0x7F) << 8) | data[off++];
+    }
+    if (off + n != len) return false;
+
+    *channel_id = crdp_read_u16_be(data + 10);
+    *payload = data + off;
+    *payload_len = n;
+    return true;
+}
+
+static crdp_client_t* crdp_transport_client(rdpTransport* transport) {
+    crdp_context* ctx = (crdp_context*)transport_get_context(transport);
+    return ctx ? ctx->client : NULL;
+}
+
+// Protocol thread. Returns the PDU length once a complete PDU is in s.
+static int crdp_transport_read_pdu(rdpTransport* transport, wStream* s) {
+    crdp_client_t* client = crdp_transport_client(transport);
+    if (!client || !client->prev_io.ReadPdu) return -1;
+
+    uint64_t span = crdp_span_begin();
+    int rc = client->prev_io.ReadPdu(transport, s);
+    crdp_span_end(span, "socket read", "bytes", rc > 0 ? (int64_t)Stream_GetPosition(s) : 0);
+    if (rc <= 0) return rc;
+
+    // transport_check_fds seals the stream at the current position
+    const uint8_t* data = Stream_Buffer(s);
+    size_t len = Stream_GetPosition(s);
+    crdp_metrics_add(client, CRDP_COUNTER_PDUS_RECEIVED, 1);
+    crdp_metrics_add(client, CRDP_COUNTER_BYTES_RECEIVED, len);
+    if (client->trace) crdp_trace_record(client->trace, data, len);
+    if (client->config.compression_stats) {
+        crdp_compression_inspect(client, data, len);
+    }
+    if (atomic_load(&client->clip_xfer.receiving)) {
+        uint16_t channel_id;
+        const uint8_t* payload;
+        size_t payload_len;
+        if (crdp_transport_channel_payload(data, len, &channel_id, &payload, &payload_len)) {
+            crdp_cliprdr_observe(client, channel_id, payload, payload_len);
+        }
+    }
+    if (client->config.udp_transport && !client->replay) {
+        uint16_t channel_id;
+        const uint8_t* payload;
+        size_t payload_len;
+        if (crdp_transport_channel_payload(data, len, &channel_id, &payload, &payload_len)) {
+            crdp_multitransport_observe(client, payload, payload_len);
+        }
+    }
+    return rc;
+}
+
+// Any thread that sends: the protocol thread and channel threads
+static int crdp_transport_write_pdu(rdpTransport* transport, wStream* s) {
+    crdp_client_t* client = crdp_transport_client(transport);
+    if (!client || !client->prev_io.WritePdu) return -1;
+
+    // The PDU ends at the current position
+    size_t len = Stream_GetPosition(s);
+    uint64_t span = crdp_span_begin();
+    int rc = client->prev_io.WritePdu(transport, s);
+    crdp_span_end(span, "socket write", "bytes", (int64_t)len);
+    if (rc >= 0) {
+        // Channel threads send too; each adds to its own shard
+        crdp_metrics_add(client, CRDP_COUNTER_PDUS_SENT, 1);
+        crdp_metrics_add(client, CRDP_COUNTER_BYTES_SENT, len);
+    }
+    return rc;
+}
+
+// Protocol thread, while connecting. Returns the connected socket.
+static int crdp_transport_tcp_connect(rdpContext* context, rdpSettings* settings, const char* hostname, int port,
+                                      DWORD timeout) {
+    crdp_client_t* client = ((crdp_context*)context)->client;
+    if (!client || !client->prev_io.TCPConnect) return -1;
+
+    uint64_t start = crdp_time_ms();
+    int fd = client->prev_io.TCPConnect(context, settings, hostname, port, timeout);
+    if (fd >= 0 && !client->replay) crdp_socket_tune(client, fd, (uint32_t)(crdp_time_ms() - start));
+    return fd;
+}
+
+// Called from PreConnect, before the transport connects
+bool crdp_transport_install(crdp_context* ctx) {
+    crdp_client_t* client = ctx->client;
+    const rdpTransportIo* io = freerdp_get_io_callbacks(&ctx->_p);
+    if (!io) {
+        WLog_WARN(CRDP_TAG, "Transport callbacks unavailable");
+        return false;
+    }
+
+    client->prev_io = *io;
+    rdpTransportIo hooked = *io;
+    hooked.ReadPdu = crdp_transport_read_pdu;
+    hooked.WritePdu = crdp_transport_write_pdu;
+    hooked.TCPConnect = crdp_transport_tcp_connect;
+    if (!freerdp_set_io_callbacks(&ctx->_p, &hooked)) {
+        WLog_WARN(CRDP_TAG, "Failed to install transport callbacks");
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,272 @@
+#include "crdp_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CRDP_UTF_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define CRDP_UTF_SSE2 1
+#endif
+#endif
+
+// UTF-8 <-> UTF-16LE transcoding for the clipboard.
+//
+// Every conversion is two passes: one that validates and measures, and one
+// that writes into a buffer of exactly that size. Both passes skip runs of
+// ASCII 16 bytes (or 8 code units) at a time, which covers most clipboard text.
+
+#define CRDP_UTF_REPLACEMENT 0xFFFD
+
+// Length of the ASCII run at the start of src, in whole 16-byte blocks
+static inline size_t crdp_utf8_ascii_prefix(const uint8_t* src, size_t len) {
+    size_t i = 0;
+#if defined(CRDP_UTF_NEON)
+    for (; i + 16 <= len; i += 16) {
+        if (vmaxvq_u8(vld1q_u8(src + i)) >= 0x80) break;
+    }
+#elif defined(CRDP_UTF_SSE2)
+    for (; i + 16 <= len; i += 16) {
+        if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(src + i))) != 0) break;
+    }
+#endif
+    return i;
+}
+
+// Length of the ASCII run at the start of src (little-endian units), in whole
+// blocks of 8 units
+static inline size_t crdp_utf16_ascii_prefix(const uint8_t* src, size_t units) {
+    size_t i = 0;
+#if defined(CRDP_UTF_NEON)
+    for (; i + 8 <= units; i += 8) {
+        if (vmaxvq_u16(vld1q_u16((const uint16_t*)(src + i * 2))) >= 0x80) break;
+    }
+#elif defined(CRDP_UTF_SSE2)
+    const __m128i high = _mm_set1_epi16((short)0xFF80);
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 8 <= units; i += 8) {
+        __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*)(src + i * 2)), high);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(v, zero)) != 0xFFFF) break;
+    }
+#endif
+    return i;
+}
+
+// Number of units before the first null unit (or units if there is none)
+static size_t crdp_utf16_strnlen(const uint8_t* src, size_t units) {
+    size_t i = 0;
+#if defined(CRDP_UTF_NEON)
+    for (; i + 8 <= units; i += 8) {
+        if (vminvq_u16(vld1q_u16((const uint16_t*)(src + i * 2))) == 0) break;
+    }
+#elif defined(CRDP_UTF_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 8 <= units; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i * 2));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(v, zero)) != 0) break;
+    }
+#endif
+    for (; i < units; i++) {
+        if (src[i * 2] == 0 && src[i * 2 + 1] == 0) return i;
+    }
+    return units;
+}
+
+// Decodes one scalar value at src[*i], rejecting overlong forms, encoded
+// surrogates, values above U+10FFFF and truncated sequences
+static inline bool crdp_utf8_next(const uint8_t* src, size_t len, size_t* i, uint32_t* out) {
+    uint8_t b = src[*i];
+    uint32_t cp;
+    size_t n;
+    if (b < 0x80) {
+        *out = b;
+        (*i)++;
+        return true;
+    } else if (b >= 0xC2 && b <= 0xDF) {
+        cp = b & 0x1F;
+        n = 2;
+    } else if (b >= 0xE0 && b <= 0xEF) {
+        cp = b & 0x0F;
+        n = 3;
+    } else if (b >= 0xF0 && b <= 0xF4) {
+        cp = b & 0x07;
+        n = 4;
+    } else {
+        return false;
+    }
+    if (len - *i < n) return false;
+
+    for (size_t k = 1; k < n; k++) {
+        uint8_t c = src[*i + k];
+        if ((c & 0xC0) != 0x80) return false;
+        cp = (cp << 6) | (c & 0x3F);
+    }
+    if ((n == 3 && (cp < 0x800 || (cp >= 0xD800 && cp <= 0xDFFF))) ||
+        (n == 4 && (cp < 0x10000 || cp > 0x10FFFF))) {
+        return false;
+    }
+    *out = cp;
+    *i += n;
+    return true;
+}
+
+// Decodes one scalar value at unit *i; unpaired surrogates become U+FFFD
+static inline uint32_t crdp_utf16_next(const uint8_t* src, size_t units, size_t* i) {
+    uint32_t u = (uint32_t)src[*i * 2] | ((uint32_t)src[*i * 2 + 1] << 8);
+    (*i)++;
+    if (u < 0xD800 || u > 0xDFFF) return u;
+    if (u >= 0xDC00 || *i >= units) return CRDP_UTF_REPLACEMENT;
+
+    uint32_t lo = (uint32_t)src[*i * 2] | ((uint32_t)src[*i * 2 + 1] << 8);
+    if (lo < 0xDC00 || lo > 0xDFFF) return CRDP_UTF_REPLACEMENT;
+    (*i)++;
+    return 0x10000 + ((u - 0xD800) << 10) + (lo - 0xDC00);
+}
+
+int64_t crdp_utf8_to_utf16le_length(const uint8_t* src, size_t len) {
+    size_t i = 0;
+    int64_t units = 0;
+    while (i < len) {
+        size_t ascii = crdp_utf8_ascii_prefix(src + i, len - i);
+        i += ascii;
+        units += (int64_t)ascii;
+        // Scalar until the next block boundary that might be ASCII again
+        size_t stop = i + 16 < len ? i + 16 : len;
+        while (i < stop) {
+            uint32_t cp;
+            if (!crdp_utf8_next(src, len, &i, &cp)) return -1;
+            units += cp >= 0x10000 ? 2 : 1;
+        }
+    }
+    return units;
+}
+
+size_t crdp_utf8_to_utf16le(const uint8_t* src, size_t len, uint8_t* dst) {
+    size_t i = 0;
+    uint8_t* out = dst;
+    while (i < len) {
+        size_t ascii = crdp_utf8_ascii_prefix(src + i, len - i);
+#if defined(CRDP_UTF_NEON)
+        for (size_t k = 0; k < ascii; k += 16) {
+            uint8x16_t v = vld1q_u8(src + i + k);
+            vst1q_u16((uint16_t*)(out + k * 2), vmovl_u8(vget_low_u8(v)));
+            vst1q_u16((uint16_t*)(out + k * 2 + 16), vmovl_u8(vget_high_u8(v)));
+        }
+#elif defined(CRDP_UTF_SSE2)
+        const __m128i zero = _mm_setzero_si128();
+        for (size_t k = 0; k < ascii; k += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(src + i + k));
+            _mm_storeu_si128((__m128i*)(out + k * 2), _mm_unpacklo_epi8(v, zero));
+            _mm_storeu_si128((__m128i*)(out + k * 2 + 16), _mm_unpackhi_epi8(v, zero));
+        }
+#endif
+        i += ascii;
+        out += ascii * 2;
+
+        size_t stop = i + 16 < len ? i + 16 : len;
+        while (i < stop) {
+            uint32_t cp;
+            // Input was validated by the length pass
+            if (!crdp_utf8_next(src, len, &i, &cp)) return (size_t)(out - dst) / 2;
+            if (cp >= 0x10000) {
+                cp -= 0x10000;
+                uint32_t hi = 0xD800 | (cp >> 10), lo = 0xDC00 | (cp & 0x3FF);
+                *out++ = (uint8_t)hi;
+                *out++ = (uint8_t)(hi >> 8);
+                *out++ = (uint8_t)lo;
+                *out++ = (uint8_t)(lo >> 8);
+            } else {
+                *out++ = (uint8_t)cp;
+                *out++ = (uint8_t)(cp >> 8);
+            }
+        }
+    }
+    return (size_t)(out - dst) / 2;
+}
+
+size_t crdp_utf16le_to_utf8_length(const uint8_t* src, size_t units) {
+    size_t i = 0, bytes = 0;
+    while (i < units) {
+        size_t ascii = crdp_utf16_ascii_prefix(src + i * 2, units - i);
+        i += ascii;
+        bytes += ascii;
+        size_t stop = i + 8 < units ? i + 8 : units;
+        while (i < stop) {
+            uint32_t cp = crdp_utf16_next(src, units, &i);
+            bytes += cp < 0x80 ? 1 : cp < 0x800 ? 2 : cp < 0x10000 ? 3 : 4;
+        }
+    }
+    return bytes;
+}
+
+size_t crdp_utf16le_to_utf8(const uint8_t* src, size_t units, uint8_t* dst) {
+    size_t i = 0;
+    uint8_t* out = dst;
+    while (i < units) {
+        size_t ascii = crdp_utf16_ascii_prefix(src + i * 2, units - i);
+#if defined(CRDP_UTF_NEON)
+        for (size_t k = 0; k < ascii; k += 8) {
+            vst1_u8(out + k, vmovn_u16(vld1q_u16((const uint16_t*)(src + (i + k) * 2))));
+        }
+#elif defined(CRDP_UTF_SSE2)
+        for (size_t k = 0; k < ascii; k += 8) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(src + (i + k) * 2));
+            _mm_storel_epi64((__m128i*)(out + k), _mm_packus_epi16(v, v));
+        }
+#endif
+        i += ascii;
+        out += ascii;
+
+        size_t stop = i + 8 < units ? i + 8 : units;
+        while (i < stop) {
+            uint32_t cp = crdp_utf16_next(src, units, &i);
+            if (cp < 0x80) {
+                *out++ = (uint8_t)cp;
+            } else if (cp < 0x800) {
+                *out++ = (uint8_t)(0xC0 | (cp >> 6));
+                *out++ = (uint8_t)(0x80 | (cp & 0x3F));
+            } else if (cp < 0x10000) {
+                *out++ = (uint8_t)(0xE0 | (cp >> 12));
+                *out++ = (uint8_t)(0x80 | ((cp >> 6) & 0x3F));
+                *out++ = (uint8_t)(0x80 | (cp & 0x3F));
+            } else {
+                *out++ = (uint8_t)(0xF0 | (cp >> 18));
+                *out++ = (uint8_t)(0x80 | ((cp >> 12) & 0x3F));
+                *out++ = (uint8_t)(0x80 | ((cp >> 6) & 0x3F));
+                *out++ = (uint8_t)(0x80 | (cp & 0x3F));
+            }
+        }
+    }
+    return (size_t)(out - dst);
+}
+
+uint8_t* crdp_utf8_to_utf16le_alloc(const char* text, size_t len, size_t* out_bytes) {
+    int64_t units = crdp_utf8_to_utf16le_length((const uint8_t*)text, len);
+    if (units < 0) return NULL;
+
+    // Plus the null terminator clipboard formats expect
+    size_t bytes = ((size_t)units + 1) * 2;
+    uint8_t* utf16 = malloc(bytes);
+    if (!utf16) return NULL;
+    size_t written = crdp_utf8_to_utf16le((const uint8_t*)text, len, utf16);
+    utf16[written * 2] = 0;
+    utf16[written * 2 + 1] = 0;
+    if (out_bytes) *out_bytes = bytes;
+    return utf16;
+}
+
+char* crdp_utf16le_to_utf8_alloc(const uint8_t* data, size_t bytes, size_t* out_len) {
+    // Up to the null terminator, if there is one
+    size_t units = crdp_utf16_strnlen(data, bytes / 2);
+
+    size_t len = crdp_utf16le_to_utf8_length(data, units);
+    char* utf8 = malloc(len + 1);
+    if (!utf8) return NULL;
+    size_t written = crdp_utf16le_to_utf8(data, units, (uint8_t*)utf8);
+    utf8[written] = '\0';
+    if (out_len) *out_len = written;
+    return utf8;
+}
@@ -147,6 +147,11 @@ struct ContentView: View {
         .onReceive(NotificationCenter.default.publisher(for: .importConnections)) { _ in
             importConnectionsFromFile()
         }
+        .onReceive(NotificationCenter.default.publisher(for: NSApplication.didChangeOcclusionStateNotification)) { _ in
+            // Nobody can see the session: let CRDP coalesce frames until it is visible again
+            let visible = NSApp.occlusionState.contains(.visible)
+            session.setPriority(visible ? CRDP_PRIORITY_FOREGROUND : CRDP_PRIORITY_BACKGROUND)
+        }
         .onReceive(NotificationCenter.default.publisher(for: NSWindow.willEnterFullScreenNotification)) { _ in
             isFullscreen = true
             sidebarHoverArea = false
@@ -727,6 +732,7 @@ struct ContentView: View {
                 ForEach(connectionStore.connections.prefix(5)) { conn in
                     RecentConnectionRow(
                         connection: conn,
+                        thumbnail: isConnected && session.endpoint == "\(conn.host):\(conn.port)" ? session.thumbnail : nil,
                         onSelect: { loadConnection(conn) },
                         onDelete: { connectionStore.delete(conn) }
                     )
@@ -1555,6 +1561,7 @@ struct AnyShape: Shape {
 
 struct RecentConnectionRow: View {
     let connection: SavedConnection
+    var thumbnail: CGImage? = nil
     let onSelect: () -> Void
     let onDelete: () -> Void
 
@@ -1562,10 +1569,19 @@ struct RecentConnectionRow: View {
 
     var body: some View {
         HStack(spacing: 10) {
-            Image(systemName: "desktopcomputer")
-                .font(.system(size: 14))
-                .foregroundStyle(.secondary)
-                .frame(width: 20)
+            if let thumbnail {
+                // Live preview of the connected session
+                Image(decorative: thumbnail, scale: 1.0)
+                    .resizable()
+                    .aspectRatio(contentMode: .fit)
+                    .frame(width: 64)
+                    .clipShape(RoundedRectangle(cornerRadius: 3))
+            } else {
+                Image(systemName: "desktopcomputer")
+                    .font(.system(size: 14))
+                    .foregroundStyle(.secondary)
+                    .frame(width: 20)
+            }
 
             VStack(alignment: .leading, spacing: 2) {
                 Text(connection.name)
@@ -54,10 +54,14 @@ final class RdpSession: ObservableObject {
     @Published var remoteSize: CGSize = .zero
     @Published var pendingCertificate: CertificateInfo?
     @Published var rttMs: Int32 = -1  // Round-trip time in ms, -1 if unavailable
+    @Published var thumbnail: CGImage?  // Small live preview for the connection list
+    private(set) var endpoint: String?  // "host:port" of the current session
     
     private var client: OpaquePointer?
     private var rttTimer: Timer?
     private var userRef: UnsafeMutableRawPointer?
+    // Link tier the last session ended in, so a new client for the same host resumes from it
+    private var lastTier: (endpoint: String, tier: crdp_link_tier_t)?
     private let frameQueue = DispatchQueue(label: "macrdp.frame", qos: .userInitiated)
     
     // Semaphore to block FreeRDP thread while waiting for cert decision
@@ -80,6 +84,8 @@ final class RdpSession: ObservableObject {
                  sharedFolderName: String? = nil,
                  timeoutSeconds: UInt32 = 30) {
         disconnect()
+        endpoint = "\(host):\(port)"
+        let startTier = lastTier?.endpoint == endpoint ? lastTier?.tier : nil
         
         DispatchQueue.main.async {
             self.state = .connecting
@@ -98,6 +104,10 @@ final class RdpSession: ObservableObject {
                 return
             }
             self.client = handle
+            crdp_set_quality_callback(handle, RdpSession.qualityThunk, user)
+            if let startTier {
+                crdp_set_link_tier(handle, startTier)
+            }
 
             let hostC = strdup(host)
             let userC = username.isEmpty ? nil : strdup(username)
@@ -120,18 +130,24 @@ final class RdpSession: ObservableObject {
                 }
             }
 
-            var cfg = crdp_config_t(host: hostC,
-                                    port: port,
-                                    username: userC,
-                                    password: passC,
-                                    domain: domainC,
-                                    width: UInt32(size.width),
-                                    height: UInt32(size.height),
-                                    enable_nla: enableNLA,
-                                    allow_gfx: allowGFX,
-                                    drive_path: drivePathC,
-                                    drive_name: driveNameC,
-                                    timeout_seconds: timeoutSeconds)
+            var cfg = crdp_config_t()
+            cfg.host = UnsafePointer(hostC)
+            cfg.port = port
+            cfg.username = UnsafePointer(userC)
+            cfg.password = UnsafePointer(passC)
+            cfg.domain = UnsafePointer(domainC)
+            cfg.width = UInt32(size.width)
+            cfg.height = UInt32(size.height)
+            cfg.enable_nla = enableNLA
+            cfg.allow_gfx = allowGFX
+            cfg.drive_path = UnsafePointer(drivePathC)
+            cfg.drive_name = UnsafePointer(driveNameC)
+            cfg.timeout_seconds = timeoutSeconds
+            // Frames queued for the main thread before the server is asked to slow down
+            cfg.max_frames_in_flight = 2
+            cfg.adaptive_quality = true
+            // Refuse clipboard copies that would hold up the connection for too long
+            cfg.clipboard_max_bytes = 64 * 1024 * 1024
 
             let result = crdp_client_connect(handle, &cfg)
             free(hostC)
@@ -149,6 +165,8 @@ final class RdpSession: ObservableObject {
                 self.client = nil
                 return
             }
+
+            crdp_set_thumbnail_callback(handle, 256, 2000, RdpSession.thumbnailThunk, user)
         }
     }
 
@@ -165,11 +183,18 @@ final class RdpSession: ObservableObject {
         DispatchQueue.main.async {
             self.state = .disconnected
             self.frame = nil
+            self.thumbnail = nil
             self.remoteSize = .zero
             self.rttMs = -1
         }
     }
 
+    /// Lower the frame delivery rate while the session is not being looked at
+    func setPriority(_ priority: crdp_session_priority_t) {
+        guard let client = client else { return }
+        crdp_set_session_priority(client, priority)
+    }
+
     func sendPointer(flags: UInt16, x: UInt16, y: UInt16) {
         guard let client = client else { return }
         crdp_send_pointer_event(client, flags, x, y)
@@ -180,28 +205,38 @@ final class RdpSession: ObservableObject {
         crdp_send_keyboard_event(client, flags, scancode)
     }
 
+    private static func makeImage(_ buffer: Data, width: UInt32, height: UInt32, stride: UInt32) -> CGImage? {
+        guard let provider = CGDataProvider(data: buffer as CFData) else { return nil }
+        let colorSpace = CGColorSpaceCreateDeviceRGB()
+        let alpha = CGImageAlphaInfo.premultipliedFirst.rawValue
+        let bitmapInfo = CGBitmapInfo(rawValue: CGBitmapInfo.byteOrder32Little.rawValue | alpha)
+        return CGImage(width: Int(width),
+                       height: Int(height),
+                       bitsPerComponent: 8,
+                       bitsPerPixel: 32,
+                       bytesPerRow: Int(stride),
+                       space: colorSpace,
+                       bitmapInfo: bitmapInfo,
+                       provider: provider,
+                       decode: nil,
+                       shouldInterpolate: true,
+                       intent: .defaultIntent)
+    }
+
     private func handleFrame(data: UnsafePointer<UInt8>?, width: UInt32, height: UInt32, stride: UInt32) {
-        guard let data else { return }
+        guard let client, let data else { return }
         let byteCount = Int(stride * height)
         let buffer = Data(bytes: data, count: byteCount)
         frameQueue.async {
-            guard let provider = CGDataProvider(data: buffer as CFData) else { return }
-            let colorSpace = CGColorSpaceCreateDeviceRGB()
-            let alpha = CGImageAlphaInfo.premultipliedFirst.rawValue
-            let bitmapInfo = CGBitmapInfo(rawValue: CGBitmapInfo.byteOrder32Little.rawValue | alpha)
-            guard let image = CGImage(width: Int(width),
-                                      height: Int(height),
-                                      bitsPerComponent: 8,
-                                      bitsPerPixel: 32,
-                                      bytesPerRow: Int(stride),
-                                      space: colorSpace,
-                                      bitmapInfo: bitmapInfo,
-                                      provider: provider,
-                                      decode: nil,
-                                      shouldInterpolate: true,
-                                      intent: .defaultIntent) else { return }
+            let image = RdpSession.makeImage(buffer, width: width, height: height, stride: stride)
 
             DispatchQueue.main.async {
+                // Presented (or dropped): let CRDP acknowledge more frames to the server.
+                // disconnect() runs on the main thread, so the handle is still alive here.
+                if self.client == client {
+                    crdp_frame_release(client)
+                }
+                guard let image else { return }
                 self.remoteSize = CGSize(width: Int(width), height: Int(height))
                 self.frame = image
                 if case .connecting = self.state {
@@ -212,6 +247,15 @@ final class RdpSession: ObservableObject {
         }
     }
 
+    private func handleThumbnail(data: UnsafePointer<UInt8>?, width: UInt32, height: UInt32, stride: UInt32) {
+        guard let data else { return }
+        let buffer = Data(bytes: data, count: Int(stride * height))
+        guard let image = RdpSession.makeImage(buffer, width: width, height: height, stride: stride) else { return }
+        DispatchQueue.main.async {
+            self.thumbnail = image
+        }
+    }
+
     private func handleDisconnected(reason: Int32) {
         // Clean up client resources on remote disconnect
         // Only free if client hasn't been cleared by disconnect() already
@@ -226,6 +270,7 @@ final class RdpSession: ObservableObject {
         DispatchQueue.main.async {
             self.stopRttTimer()
             self.frame = nil
+            self.thumbnail = nil
             self.remoteSize = .zero
             self.rttMs = -1
             
@@ -310,6 +355,28 @@ private extension RdpSession {
         session.handleFrame(data: data, width: width, height: height, stride: stride)
     }
 
+    static let thumbnailThunk: @convention(c) (UnsafePointer<UInt8>?, UInt32, UInt32, UInt32, UnsafeMutableRawPointer?) -> Void = { data, width, height, stride, user in
+        guard let user else { return }
+        let session = Unmanaged<RdpSession>.fromOpaque(user).takeUnretainedValue()
+        session.handleThumbnail(data: data, width: width, height: height, stride: stride)
+    }
+
+    static let qualityThunk: @convention(c) (UnsafePointer<crdp_quality_event_t>?, UnsafeMutableRawPointer?) -> Void = { event, user in
+        guard let e = event?.pointee, let user else { return }
+        let session = Unmanaged<RdpSession>.fromOpaque(user).takeUnretainedValue()
+        let reason = e.reason != nil ? String(cString: e.reason) : ""
+        print("[RdpSession] Link tier \(e.previous_tier.rawValue) -> \(e.tier.rawValue) (\(reason)): " +
+              "rtt=\(e.rtt_ms)ms bw=\(e.bandwidth_kbps)kbps queue=\(e.queue_depth) cap=\(e.frame_interval_ms)ms" +
+              (e.requires_reconnect ? " codec/depth change applies on the next connect" : ""))
+        let tier = e.tier
+        DispatchQueue.main.async {
+            // Seeded into the next client connect() makes for this host
+            if let endpoint = session.endpoint {
+                session.lastTier = (endpoint, tier)
+            }
+        }
+    }
+
     static let disconnectThunk: @convention(c) (crdp_disconnect_reason_t, UnsafeMutableRawPointer?) -> Void = { reason, user in
         guard let user else { return }
         let session = Unmanaged<RdpSession>.fromOpaque(user).takeUnretainedValue()
@@ -0,0 +1,645 @@
+// crdp-clipfile-check: checks CRDP's clipboard file download (clipfile.c)
+// against a synthetic server with no network. The server answers the ranged
+// FileContents requests out of order, gives short answers now and then, and
+// serves a file over 4 GB; every file is then compared with what it served
+// byte for byte. Names that would land outside the target folder must be
+// refused without creating anything there.
+//
+// A tree of a thousand files then goes both ways with the open file limit
+// at 256, which is what macOS gives GUI apps: downloaded, downloaded again
+// with the server failing partway (every file left behind must be whole),
+// and read back the way the server reads files it is sent.
+//
+//   crdp-clipfile-check --size 4200 --short 5 --files 1000
+
+#include "crdp_internal.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHECK_CHUNK (1024 * 1024)
+
+// A file the synthetic server offers
+typedef struct {
+    const char* name;               // Server-side, backslash separated
+    bool dir;
+    bool send_size;                 // Listed with FD_FILESIZE; asked for otherwise
+    uint64_t size;
+} check_file_t;
+
+typedef struct check_request {
+    struct check_request* next;
+    CLIPRDR_FILE_CONTENTS_REQUEST req;
+} check_request_t;
+
+static struct {
+    CliprdrClientContext cliprdr;
+    const check_file_t* files;
+    uint32_t count;
+    uint32_t short_every;           // Answer every Nth range short, 0 = never
+    uint32_t fail_index;            // Fail every range of this file, UINT32_MAX = none
+    // Requests waiting for the server thread
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    check_request_t* queue;
+    uint32_t queued;
+    bool stop;
+    uint64_t seed;
+    // Tallies, guarded by lock
+    uint64_t ranges;
+    uint64_t shorts;
+    uint64_t sizes;
+    uint64_t answered;              // Bytes of file data sent
+    uint64_t bad_requests;
+} server = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER, .seed = 0x9E3779B97F4A7C15ull };
+
+static int failures;
+
+static double check_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Contents of file index: eight bytes at a time from a mix of the index and
+// the word's offset, so a byte written anywhere else doesn't match
+static uint64_t check_word(uint32_t index, uint64_t word) {
+    uint64_t x = (word + 1) * 0x9E3779B97F4A7C15ull ^ ((uint64_t)index << 56);
+    x ^= x >> 31;
+    x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 29;
+    return x;
+}
+
+static void check_fill(uint8_t* out, uint32_t index, uint64_t offset, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        uint64_t pos = offset + done;
+        uint64_t word = check_word(index, pos >> 3);
+        size_t skip = (size_t)(pos & 7);
+        size_t n = 8 - skip < len - done ? 8 - skip : len - done;
+        for (size_t k = 0; k < n; k++) out[done + k] = (uint8_t)(word >> ((skip + k) * 8));
+        done += n;
+    }
+}
+
+static UINT check_send_request(CliprdrClientContext* cliprdr, const CLIPRDR_FILE_CONTENTS_REQUEST* req) {
+    (void)cliprdr;
+    check_request_t* item = malloc(sizeof(*item));
+    if (!item) return CHANNEL_RC_NO_MEMORY;
+    item->req = *req;
+    pthread_mutex_lock(&server.lock);
+    item->next = server.queue;
+    server.queue = item;
+    server.queued++;
+    pthread_cond_signal(&server.cond);
+    pthread_mutex_unlock(&server.lock);
+    return CHANNEL_RC_OK;
+}
+
+// Server thread: answers queued requests in random order, as the channel
+// thread would deliver them
+static void* check_server(void* arg) {
+    (void)arg;
+    uint8_t* buf = malloc(CHECK_CHUNK);
+    if (!buf) return NULL;
+    pthread_mutex_lock(&server.lock);
+    for (;;) {
+        while (!server.queue && !server.stop) pthread_cond_wait(&server.cond, &server.lock);
+        if (!server.queue) break;
+        server.seed ^= server.seed >> 12;
+        server.seed ^= server.seed << 25;
+        server.seed ^= server.seed >> 27;
+        uint32_t pick = (uint32_t)((server.seed * 0x2545F4914F6CDD1Dull >> 32) % server.queued);
+        check_request_t** link = &server.queue;
+        for (uint32_t i = 0; i < pick; i++) link = &(*link)->next;
+        check_request_t* item = *link;
+        *link = item->next;
+        server.queued--;
+
+        const CLIPRDR_FILE_CONTENTS_REQUEST* req = &item->req;
+        CLIPRDR_FILE_CONTENTS_RESPONSE resp = { 0 };
+        resp.streamId = req->streamId;
+        resp.common.msgFlags = CB_RESPONSE_FAIL;
+        uint8_t size_le[8];
+        const check_file_t* file = req->listIndex < server.count ? &server.files[req->listIndex] : NULL;
+        if (file && (req->dwFlags & FILECONTENTS_SIZE)) {
+            for (int i = 0; i < 8; i++) size_le[i] = (uint8_t)(file->size >> (8 * i));
+            resp.common.msgFlags = CB_RESPONSE_OK;
+            resp.cbRequested = sizeof(size_le);
+            resp.requestedData = size_le;
+            server.sizes++;
+        } else if (file && (req->dwFlags & FILECONTENTS_RANGE)) {
+            uint64_t offset = ((uint64_t)req->nPositionHigh << 32) | req->nPositionLow;
+            uint32_t n = req->cbRequested < CHECK_CHUNK ? req->cbRequested : CHECK_CHUNK;
+            server.ranges++;
+            if (offset + n > file->size || n == 0) {
+                fprintf(stderr, "FAIL request for %s at %llu, %u bytes, past its end\n", file->name,
+                        (unsigned long long)offset, req->cbRequested);
+                server.bad_requests++;
+            } else if (req->listIndex == server.fail_index) {
+                // Refused on purpose
+            } else {
+                if (server.short_every && server.ranges % server.short_every == 0 && n > 1) {
+                    n /= 2;
+                    server.shorts++;
+                }
+                check_fill(buf, req->listIndex, offset, n);
+                resp.common.msgFlags = CB_RESPONSE_OK;
+                resp.cbRequested = n;
+                resp.requestedData = buf;
+                server.answered += n;
+            }
+        } else {
+            server.bad_requests++;
+        }
+        free(item);
+
+        pthread_mutex_unlock(&server.lock);
+        crdp_clipfile_contents_response(&server.cliprdr, &resp);
+        pthread_mutex_lock(&server.lock);
+    }
+    pthread_mutex_unlock(&server.lock);
+    free(buf);
+    return NULL;
+}
+
+static void check_reset(void) {
+    pthread_mutex_lock(&server.lock);
+    server.ranges = server.shorts = server.sizes = server.answered = server.bad_requests = 0;
+    pthread_mutex_unlock(&server.lock);
+}
+
+static FILEDESCRIPTORW* check_descriptors(const check_file_t* files, uint32_t count) {
+    FILEDESCRIPTORW* descriptors = calloc(count, sizeof(*descriptors));
+    if (!descriptors) return NULL;
+    for (uint32_t i = 0; i < count; i++) {
+        FILEDESCRIPTORW* d = &descriptors[i];
+        size_t len = strlen(files[i].name);
+        size_t units = (size_t)crdp_utf8_to_utf16le_length((const uint8_t*)files[i].name, len);
+        if (units < 260) crdp_utf8_to_utf16le((const uint8_t*)files[i].name, len, (uint8_t*)d->cFileName);
+        d->dwFlags = FD_ATTRIBUTES;
+        d->dwFileAttributes = files[i].dir ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_NORMAL;
+        if (files[i].send_size) {
+            d->dwFlags |= FD_FILESIZE;
+            d->nFileSizeHigh = (DWORD)(files[i].size >> 32);
+            d->nFileSizeLow = (DWORD)files[i].size;
+        }
+    }
+    return descriptors;
+}
+
+// Downloads files into dir; the server refuses every range of fail_index
+static int check_download(crdp_client_t* client, const char* dir, const check_file_t* files, uint32_t count,
+                          uint32_t fail_index) {
+    FILEDESCRIPTORW* descriptors = check_descriptors(files, count);
+    if (!descriptors) return -3;
+    pthread_mutex_lock(&server.lock);
+    server.files = files;
+    server.count = count;
+    server.fail_index = fail_index;
+    pthread_mutex_unlock(&server.lock);
+    check_reset();
+    int status = crdp_clipfile_download(client, dir, descriptors, count);
+    free(descriptors);
+    return status;
+}
+
+// Compares the file at path with what the server sent for index
+static bool check_contents(const char* path, uint32_t index, uint64_t size) {
+    struct stat st;
+    if (stat(path, &st) != 0 || (uint64_t)st.st_size != size) {
+        fprintf(stderr, "FAIL %s: size %lld, expected %llu\n", path, (long long)st.st_size,
+                (unsigned long long)size);
+        return false;
+    }
+    int fd = open(path, O_RDONLY);
+    uint8_t* got = malloc(CHECK_CHUNK);
+    uint8_t* want = malloc(CHECK_CHUNK);
+    bool ok = fd >= 0 && got && want;
+    for (uint64_t offset = 0; ok && offset < size; offset += CHECK_CHUNK) {
+        size_t n = size - offset < CHECK_CHUNK ? (size_t)(size - offset) : CHECK_CHUNK;
+        ok = pread(fd, got, n, (off_t)offset) == (ssize_t)n;
+        check_fill(want, index, offset, n);
+        if (ok && memcmp(got, want, n) != 0) {
+            size_t k = 0;
+            while (got[k] == want[k]) k++;
+            fprintf(stderr, "FAIL %s: differs at byte %llu\n", path, (unsigned long long)(offset + k));
+            ok = false;
+        }
+    }
+    if (fd >= 0) close(fd);
+    free(got);
+    free(want);
+    return ok;
+}
+
+static void check_progress(const crdp_clipboard_progress_t* progress, void* user) {
+    (void)user;
+    if (progress->done && !progress->failed && progress->total >= 64 * 1024 * 1024) {
+        printf("  %.1f MB at %.1f MB/s\n", progress->transferred / 1e6, progress->bytes_per_second / 1e6);
+    }
+}
+
+// Removes path and everything below it
+static void check_remove(const char* path) {
+    DIR* dir = opendir(path);
+    if (dir) {
+        struct dirent* entry;
+        while ((entry = readdir(dir))) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+            char child[4096];
+            snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+            check_remove(child);
+        }
+        closedir(dir);
+        rmdir(path);
+    } else {
+        unlink(path);
+    }
+}
+
+// Whether dir holds nothing but an entry called only
+static bool check_only(const char* dir, const char* only) {
+    DIR* d = opendir(dir);
+    if (!d) return false;
+    bool ok = true;
+    struct dirent* entry;
+    while ((entry = readdir(d))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        if (strcmp(entry->d_name, only) != 0) {
+            fprintf(stderr, "FAIL %s/%s was created\n", dir, entry->d_name);
+            ok = false;
+        }
+    }
+    closedir(d);
+    return ok;
+}
+
+// A tree of count entries: a folder per hundred files, mostly small files,
+// some empty and some several ranges long. Names are malloc'd.
+static check_file_t* check_many(uint32_t count) {
+    check_file_t* files = calloc(count, sizeof(*files));
+    if (!files) return NULL;
+    for (uint32_t i = 0; i < count; i++) {
+        char* name = NULL;
+        files[i].send_size = true;
+        if (i % 100 == 0) {
+            files[i].dir = true;
+            if (asprintf(&name, "many\\d%02u", i / 100) < 0) name = NULL;
+        } else {
+            files[i].size = i % 97 == 0 ? 0 : i % 50 == 1 ? 2 * CHECK_CHUNK + i : (uint64_t)i * 7919 % 20000 + 1;
+            if (asprintf(&name, "many\\d%02u\\f%04u.bin", i / 100, i) < 0) name = NULL;
+        }
+        files[i].name = name;
+    }
+    return files;
+}
+
+static void check_many_free(check_file_t* files, uint32_t count) {
+    for (uint32_t i = 0; files && i < count; i++) free((char*)files[i].name);
+    free(files);
+}
+
+// Local path of tree entry index below dir
+static void check_path(char* path, size_t size, const char* dir, const check_file_t* file) {
+    snprintf(path, size, "%s/%s", dir, file->name);
+    for (char* p = path; *p; p++) {
+        if (*p == '\\') *p = '/';
+    }
+}
+
+// Compares every file of the tree that should be (or, with partial, may be)
+// below dir; returns how many are wrong
+static int check_tree(const char* dir, const check_file_t* files, uint32_t count, bool partial,
+                      uint32_t* present) {
+    int wrong = 0;
+    *present = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        char path[8192];
+        check_path(path, sizeof(path), dir, &files[i]);
+        struct stat st;
+        if (stat(path, &st) != 0) {
+            if (!partial) {
+                fprintf(stderr, "FAIL %s is missing\n", path);
+                wrong++;
+            }
+        } else if (files[i].dir) {
+            if (!S_ISDIR(st.st_mode)) {
+                fprintf(stderr, "FAIL %s is not a folder\n", path);
+                wrong++;
+            }
+        } else if (!check_contents(path, i, files[i].size)) {
+            wrong++;
+        } else {
+            (*present)++;
+        }
+    }
+    return wrong;
+}
+
+// Upload side: what the server received, checked as it arrives
+static struct {
+    const check_file_t* files;
+    uint32_t index;                 // File the pending request is for
+    uint64_t offset;
+    uint64_t bytes;
+    uint32_t bad;
+    uint8_t want[CHECK_CHUNK];
+} upload;
+
+static UINT check_upload_response(CliprdrClientContext* cliprdr, const CLIPRDR_FILE_CONTENTS_RESPONSE* resp) {
+    (void)cliprdr;
+    if (!(resp->common.msgFlags & CB_RESPONSE_OK)) {
+        fprintf(stderr, "FAIL reading %s at %llu failed\n", upload.files[upload.index].name,
+                (unsigned long long)upload.offset);
+        upload.bad++;
+        return CHANNEL_RC_OK;
+    }
+    check_fill(upload.want, upload.index, upload.offset, resp->cbRequested);
+    if (memcmp(resp->requestedData, upload.want, resp->cbRequested) != 0) {
+        fprintf(stderr, "FAIL %s at %llu read wrong data\n", upload.files[upload.index].name,
+                (unsigned long long)upload.offset);
+        upload.bad++;
+    }
+    upload.bytes += resp->cbRequested;
+    return CHANNEL_RC_OK;
+}
+
+// Offers the files below dir the way crdp_clipfile_build_list lists them,
+// then reads them as a server pasting them would: every file's first half,
+// then every file's second half, so each is still unfinished when the next
+// is opened. Returns how many reads failed or went wrong.
+static uint32_t check_upload(crdp_client_t* client, const char* dir, const check_file_t* files, uint32_t count,
+                             uint32_t* peak_open) {
+    crdp_clip_files_t* f = &client->clip_files;
+    crdp_clip_local_file_t* local = calloc(count, sizeof(*local));
+    if (!local) return count;
+    for (uint32_t i = 0; i < count; i++) {
+        char path[8192];
+        check_path(path, sizeof(path), dir, &files[i]);
+        local[i].path = strdup(path);
+        local[i].size = files[i].size;
+        local[i].fd = -1;
+    }
+    pthread_mutex_lock(&f->lock);
+    f->local = local;
+    f->local_count = count;
+    f->local_open = 0;
+    f->served_bytes = f->served_total = f->served_reported = 0;
+    f->served_files = 0;
+    pthread_mutex_unlock(&f->lock);
+
+    upload.files = files;
+    upload.bytes = 0;
+    upload.bad = 0;
+    *peak_open = 0;
+    for (int half = 0; half < 2; half++) {
+        for (uint32_t i = 0; i < count; i++) {
+            if (files[i].dir || files[i].size < 2) continue;
+            uint64_t mid = files[i].size / 2;
+            for (uint64_t offset = half ? mid : 0; offset < (half ? files[i].size : mid); offset += CHECK_CHUNK) {
+                uint64_t end = half ? files[i].size : mid;
+                CLIPRDR_FILE_CONTENTS_REQUEST req = { 0 };
+                req.listIndex = i;
+                req.dwFlags = FILECONTENTS_RANGE;
+                req.nPositionLow = (UINT32)offset;
+                req.nPositionHigh = (UINT32)(offset >> 32);
+                req.cbRequested = end - offset < CHECK_CHUNK ? (UINT32)(end - offset) : CHECK_CHUNK;
+                upload.index = i;
+                upload.offset = offset;
+                crdp_clipfile_contents_request(&server.cliprdr, &req);
+                pthread_mutex_lock(&f->lock);
+                if (f->local_open > *peak_open) *peak_open = f->local_open;
+                pthread_mutex_unlock(&f->lock);
+            }
+        }
+    }
+    return upload.bad;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: crdp-clipfile-check [options]\n"
+            "  --dir DIR     where to download (default: a new folder under /tmp)\n"
+            "  --size MB     size of the large file (default 4200, over 4 GB)\n"
+            "  --short N     answer every Nth range short (default 5, 0 = never)\n"
+            "  --files N     entries in the many-files tree (default 1000)\n"
+            "  --fd-limit N  open file limit to run under (default 256, 0 = leave it)\n"
+            "  --keep        leave the downloaded files behind\n");
+}
+
+int main(int argc, char** argv) {
+    static const struct option options[] = {
+        { "dir", required_argument, NULL, 'd' },
+        { "size", required_argument, NULL, 's' },
+        { "short", required_argument, NULL, 'n' },
+        { "files", required_argument, NULL, 'f' },
+        { "fd-limit", required_argument, NULL, 'l' },
+        { "keep", no_argument, NULL, 'k' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    const char* base = NULL;
+    long size_mb = 4200, short_every = 5, many_count = 1000, fd_limit = 256;
+    bool keep = false;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "d:s:n:f:l:kh", options, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            base = optarg;
+            break;
+        case 's':
+            size_mb = atol(optarg);
+            break;
+        case 'n':
+            short_every = atol(optarg);
+            break;
+        case 'f':
+            many_count = atol(optarg);
+            break;
+        case 'l':
+            fd_limit = atol(optarg);
+            break;
+        case 'k':
+            keep = true;
+            break;
+        default:
+            usage();
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (optind != argc || size_mb < 1 || short_every < 0 || many_count < 2 || fd_limit < 0) {
+        usage();
+        return 2;
+    }
+
+    struct rlimit limit;
+    if (fd_limit > 0 && getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = (rlim_t)fd_limit;
+        if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+            fprintf(stderr, "crdp-clipfile-check: can't lower the open file limit: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+
+    char temp[] = "/tmp/crdp-clipfile-check.XXXXXX";
+    bool own_dir = !base;
+    if (own_dir && !(base = mkdtemp(temp))) {
+        fprintf(stderr, "crdp-clipfile-check: can't create a folder: %s\n", strerror(errno));
+        return 1;
+    }
+
+    crdp_client_t* client = crdp_client_new(NULL, NULL, NULL, NULL, NULL, NULL);
+    crdp_context* ctx = calloc(1, sizeof(*ctx));
+    if (!client || !ctx) return 1;
+    ctx->client = client;
+    server.cliprdr.custom = ctx;
+    server.cliprdr.ClientFileContentsRequest = check_send_request;
+    server.cliprdr.ClientFileContentsResponse = check_upload_response;
+    server.short_every = (uint32_t)short_every;
+    crdp_clipfile_attach(ctx, &server.cliprdr);
+    crdp_set_clipboard_progress_callback(client, check_progress, NULL);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, check_server, NULL) != 0) return 1;
+
+    // A tree with a file over 4 GB, files of odd sizes and one whose size
+    // has to be asked for
+    uint64_t big = (uint64_t)size_mb * 1024 * 1024 + 4093;
+    const check_file_t tree[] = {
+        { "big.bin", false, true, big },
+        { "folder", true, true, 0 },
+        { "folder\\small.txt", false, true, 1000 },
+        { "folder\\empty", false, true, 0 },
+        { "folder\\deeper\\unsized.bin", false, false, 3 * 1024 * 1024 + 17 },
+        { "folder\\one", false, true, 1 },
+    };
+    const uint32_t tree_count = sizeof(tree) / sizeof(tree[0]);
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s/tree", base);
+    printf("tree: %u entries, %.1f MB, 1 in %ld ranges answered short\n", tree_count, big / 1e6, short_every);
+    double start = check_now();
+    int status = check_download(client, dir, tree, tree_count, UINT32_MAX);
+    double seconds = check_now() - start;
+    uint64_t expected = 0;
+    for (uint32_t i = 0; i < tree_count; i++) expected += tree[i].size;
+    printf("  status %d in %.2f s: %llu ranges, %llu answered short, %llu size queries\n", status, seconds,
+           (unsigned long long)server.ranges, (unsigned long long)server.shorts, (unsigned long long)server.sizes);
+    if (status != 0) {
+        fprintf(stderr, "FAIL download returned %d\n", status);
+        failures++;
+    }
+    // Every byte asked for exactly once, short answers included
+    if (server.answered != expected || server.bad_requests) {
+        fprintf(stderr, "FAIL server sent %llu bytes for %llu, %llu bad requests\n",
+                (unsigned long long)server.answered, (unsigned long long)expected,
+                (unsigned long long)server.bad_requests);
+        failures++;
+    }
+    if (short_every > 0 && server.shorts == 0) {
+        fprintf(stderr, "FAIL no short answers were given\n");
+        failures++;
+    }
+    if (server.sizes != 1) {
+        fprintf(stderr, "FAIL %llu size queries, expected 1\n", (unsigned long long)server.sizes);
+        failures++;
+    }
+    uint32_t present = 0;
+    if (status == 0) failures += check_tree(dir, tree, tree_count, false, &present);
+    if (!keep) check_remove(dir);
+
+    // Many files with few descriptors, both ways
+    uint32_t many_total = (uint32_t)many_count;
+    check_file_t* many = check_many(many_total);
+    if (!many) return 1;
+    snprintf(dir, sizeof(dir), "%s/many", base);
+    printf("many: %u entries, open file limit %ld\n", many_total, fd_limit);
+    start = check_now();
+    status = check_download(client, dir, many, many_total, UINT32_MAX);
+    printf("  download: status %d in %.2f s, %llu ranges\n", status, check_now() - start,
+           (unsigned long long)server.ranges);
+    if (status != 0) {
+        fprintf(stderr, "FAIL download of many files returned %d\n", status);
+        failures++;
+    } else {
+        failures += check_tree(dir, many, many_total, false, &present);
+        uint32_t peak = 0;
+        uint32_t bad = check_upload(client, dir, many, many_total, &peak);
+        printf("  upload: %.1f MB read back, at most %u files open, %u bad reads\n", upload.bytes / 1e6, peak,
+               bad);
+        if (bad) failures++;
+    }
+    if (!keep) check_remove(dir);
+
+    // The server fails halfway: whatever is left must be whole
+    snprintf(dir, sizeof(dir), "%s/failed", base);
+    status = check_download(client, dir, many, many_total, many_total / 2 + 1);
+    int wrong = check_tree(dir, many, many_total, true, &present);
+    printf("  failed at entry %u: status %d, %u whole files left, %d cut off\n", many_total / 2 + 1, status,
+           present, wrong);
+    if (status != -4 || wrong) {
+        fprintf(stderr, "FAIL a failed download left %d unfinished files (status %d)\n", wrong, status);
+        failures++;
+    }
+    check_remove(dir);
+    check_many_free(many, many_total);
+
+    // Names that leave the folder: each download must fail without writing
+    // anything next to it
+    char absolute[4096];
+    snprintf(absolute, sizeof(absolute), "%s/absolute.txt", base);
+    for (char* p = absolute; *p; p++) {
+        if (*p == '/') *p = '\\';
+    }
+    const char* bad_names[] = {
+        "..\\escape.txt", "..", "folder\\..\\..\\escape.txt", "folder\\.\\file.txt", ".",
+        "\\rooted.txt", "/rooted.txt", absolute, "folder\\\\file.txt", "",
+    };
+    const uint32_t bad_count = sizeof(bad_names) / sizeof(bad_names[0]);
+    uint32_t refused = 0;
+    for (uint32_t i = 0; i < bad_count; i++) {
+        char outer[4096];
+        snprintf(outer, sizeof(outer), "%s/bad%u", base, i);
+        snprintf(dir, sizeof(dir), "%s/bad%u/inner", base, i);
+        if (mkdir(outer, 0755) != 0) {
+            fprintf(stderr, "crdp-clipfile-check: can't create %s: %s\n", outer, strerror(errno));
+            return 1;
+        }
+        const check_file_t files[] = {
+            { "ok.txt", false, true, 10 },
+            { bad_names[i], false, true, 10 },
+        };
+        status = check_download(client, dir, files, 2, UINT32_MAX);
+        bool ok = status == -4 && server.ranges == 0 && check_only(outer, "inner");
+        if (!ok) {
+            fprintf(stderr, "FAIL name \"%s\" was not refused (status %d)\n", bad_names[i], status);
+            failures++;
+        } else {
+            refused++;
+        }
+        check_remove(outer);
+    }
+    printf("unsafe names: %u of %u refused\n", refused, bad_count);
+
+    pthread_mutex_lock(&server.lock);
+    server.stop = true;
+    pthread_cond_signal(&server.cond);
+    pthread_mutex_unlock(&server.lock);
+    pthread_join(thread, NULL);
+    crdp_clipfile_detach(ctx);
+    crdp_client_free(client);
+    free(ctx);
+    if (own_dir && !keep) rmdir(base);
+
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
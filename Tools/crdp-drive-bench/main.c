@@ -0,0 +1,500 @@
+// crdp-drive-bench: measures CRDP's drive redirection device (drive.c) with
+// no server. Loads the device the way rdpdr does, then copies many small
+// files and a few large ones into and back out of a directory through it,
+// keeping several IRPs in flight like a server copying a tree, and reports
+// MB/s and IRPs/s for each pass.
+//
+//   crdp-drive-bench --small-files 5000 --large-files 2 --large-size 4096 --depth 16
+
+#include "crdp_internal.h"
+
+#include <freerdp/channels/rdpdr.h>
+#include <winpr/file.h>
+#include <winpr/stream.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Room rdpdr leaves for the DR_DEVICE_IOCOMPLETION header
+#define BENCH_HEADER_BYTES 16
+#define BENCH_MAX_DEPTH 256
+
+enum { BENCH_OPENING, BENCH_OPEN, BENCH_CLOSING };
+
+// One file being copied; up to depth data IRPs on it at once
+typedef struct {
+    bool active;
+    int state;
+    uint32_t index;
+    uint32_t file_id;
+    uint64_t next;                  // Next offset to request
+    uint32_t pending;               // Data IRPs in flight
+} bench_file_t;
+
+typedef struct bench_req {
+    IRP irp;                        // First: the device hands this back
+    struct bench_req* next;
+    wStream* control;               // Input for creates and closes
+    wStream* data;                  // Input for reads and writes, the pattern after the header
+    bench_file_t* file;
+    uint64_t offset;
+    uint32_t length;
+} bench_req_t;
+
+static struct {
+    DEVICE* device;
+    const char* dir;
+    size_t io;                      // Bytes per read or write IRP
+    uint8_t* pattern;               // What writes carry after their stamp, io bytes
+    bool verify;
+    uint32_t depth;
+    bench_req_t reqs[BENCH_MAX_DEPTH];
+    bench_req_t* idle;
+    // Completed IRPs, pushed by the device's workers
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bench_req_t* done;
+    bool failed;
+} bench = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static UINT bench_complete(IRP* irp) {
+    bench_req_t* req = (bench_req_t*)irp;
+    pthread_mutex_lock(&bench.lock);
+    req->next = bench.done;
+    bench.done = req;
+    pthread_cond_signal(&bench.cond);
+    pthread_mutex_unlock(&bench.lock);
+    return CHANNEL_RC_OK;
+}
+
+// Nothing the bench sends should be discarded
+static UINT bench_discard(IRP* irp) {
+    fprintf(stderr, "crdp-drive-bench: IRP 0x%X discarded\n", irp->MajorFunction);
+    irp->IoStatus = STATUS_CANCELLED;
+    return bench_complete(irp);
+}
+
+static UINT bench_register(DEVMAN* devman, DEVICE* device) {
+    (void)devman;
+    bench.device = device;
+    return CHANNEL_RC_OK;
+}
+
+static bool bench_load(const char* dir) {
+    PDEVICE_SERVICE_ENTRY entry = (PDEVICE_SERVICE_ENTRY)crdp_drive_addin_entry("drive", "DeviceServiceEntry");
+    RDPDR_DRIVE drive = { 0 };
+    drive.device.Type = RDPDR_DTYP_FILESYSTEM;
+    drive.device.Name = (char*)"Bench";
+    drive.Path = (char*)dir;
+    DEVICE_SERVICE_ENTRY_POINTS points = { 0 };
+    points.RegisterDevice = bench_register;
+    points.device = &drive.device;
+    return entry && entry(&points) == CHANNEL_RC_OK && bench.device;
+}
+
+// Start of every block written: which file and offset it belongs at, so a
+// block landing in the wrong place doesn't read back as a match
+static size_t bench_stamp(uint8_t* out, uint32_t index, uint64_t offset, uint32_t length) {
+    uint8_t stamp[16];
+    for (int i = 0; i < 8; i++) stamp[i] = (uint8_t)(offset >> (i * 8));
+    for (int i = 0; i < 4; i++) stamp[8 + i] = (uint8_t)(index >> (i * 8));
+    for (int i = 0; i < 4; i++) stamp[12 + i] = (uint8_t)~stamp[8 + i];
+    size_t n = length < sizeof(stamp) ? length : sizeof(stamp);
+    memcpy(out, stamp, n);
+    return n;
+}
+
+static bool bench_matches(const uint8_t* data, uint32_t index, uint64_t offset, uint32_t length) {
+    uint8_t stamp[16];
+    size_t n = bench_stamp(stamp, index, offset, length);
+    return memcmp(data, stamp, n) == 0 && memcmp(data + n, bench.pattern + n, length - n) == 0;
+}
+
+static void bench_path(char* out, size_t size, bool small, uint32_t index) {
+    snprintf(out, size, small ? "\\small\\file%06u.bin" : "\\large%u.bin", index);
+}
+
+// Starts req on the device with input, written from position 0
+static void bench_submit(bench_req_t* req, wStream* input, UINT32 major, UINT32 file_id) {
+    req->irp.input = input;
+    Stream_SealLength(req->irp.input);
+    Stream_SetPosition(req->irp.input, 0);
+    Stream_SetPosition(req->irp.output, BENCH_HEADER_BYTES);
+    req->irp.MajorFunction = major;
+    req->irp.MinorFunction = 0;
+    req->irp.FileId = file_id;
+    req->irp.IoStatus = 0;
+    UINT rc = bench.device->IRPRequest(bench.device, &req->irp);
+    if (rc != CHANNEL_RC_OK) {
+        fprintf(stderr, "crdp-drive-bench: IRP refused: %u\n", rc);
+        bench.failed = true;
+        bench_complete(&req->irp);
+    }
+}
+
+static void bench_create(bench_req_t* req, bench_file_t* file, bool small, bool writing) {
+    char name[64];
+    bench_path(name, sizeof(name), small, file->index);
+    size_t path_bytes = 0;
+    uint8_t* path = crdp_utf8_to_utf16le_alloc(name, strlen(name), &path_bytes);
+    wStream* s = req->control;
+    Stream_SetPosition(s, 0);
+    req->file = file;
+    if (!path || !Stream_EnsureCapacity(s, 32 + path_bytes)) {
+        free(path);
+        req->irp.MajorFunction = IRP_MJ_CREATE;
+        req->irp.IoStatus = STATUS_NO_MEMORY;
+        bench_complete(&req->irp);
+        return;
+    }
+    Stream_Write_UINT32(s, writing ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ);
+    Stream_Write_UINT64(s, 0);                  // AllocationSize
+    Stream_Write_UINT32(s, FILE_ATTRIBUTE_NORMAL);
+    Stream_Write_UINT32(s, FILE_SHARE_READ);
+    Stream_Write_UINT32(s, writing ? FILE_OVERWRITE_IF : FILE_OPEN);
+    Stream_Write_UINT32(s, FILE_NON_DIRECTORY_FILE | FILE_SEQUENTIAL_ONLY);
+    Stream_Write_UINT32(s, (UINT32)path_bytes);
+    Stream_Write(s, path, path_bytes);
+    free(path);
+    bench_submit(req, s, IRP_MJ_CREATE, 0);
+}
+
+static void bench_transfer(bench_req_t* req, bench_file_t* file, uint64_t size, bool writing) {
+    uint64_t left = size - file->next;
+    req->file = file;
+    req->offset = file->next;
+    req->length = (uint32_t)(left < bench.io ? left : bench.io);
+    file->next += req->length;
+    file->pending++;
+
+    wStream* s = req->data;
+    Stream_SetPosition(s, 0);
+    Stream_Write_UINT32(s, req->length);
+    Stream_Write_UINT64(s, req->offset);
+    Stream_Zero(s, 20);                         // Padding
+    if (writing) {
+        // The pattern is already there past the stamp
+        bench_stamp(Stream_Pointer(s), file->index, req->offset, req->length);
+        Stream_Seek(s, req->length);
+    }
+    bench_submit(req, s, writing ? IRP_MJ_WRITE : IRP_MJ_READ, file->file_id);
+}
+
+static void bench_close(bench_req_t* req, bench_file_t* file) {
+    wStream* s = req->control;
+    Stream_SetPosition(s, 0);
+    Stream_Zero(s, 32);                         // Padding
+    file->state = BENCH_CLOSING;
+    req->file = file;
+    bench_submit(req, s, IRP_MJ_CLOSE, file->file_id);
+}
+
+static bool bench_check(bench_req_t* req, const char* what) {
+    if (req->irp.IoStatus == STATUS_SUCCESS) return true;
+    fprintf(stderr, "crdp-drive-bench: %s failed: 0x%08X\n", what, req->irp.IoStatus);
+    bench.failed = true;
+    return false;
+}
+
+// Handles a completed IRP; returns true once its file is closed
+static bool bench_finish(bench_req_t* req) {
+    bench_file_t* file = req->file;
+    wStream* out = req->irp.output;
+    Stream_SetPosition(out, BENCH_HEADER_BYTES);
+    switch (req->irp.MajorFunction) {
+        case IRP_MJ_CREATE:
+            if (bench_check(req, "create")) {
+                Stream_Read_UINT32(out, file->file_id);
+                file->state = BENCH_OPEN;
+            }
+            return false;
+        case IRP_MJ_WRITE: {
+            file->pending--;
+            UINT32 written;
+            Stream_Read_UINT32(out, written);
+            if (bench_check(req, "write") && written != req->length) {
+                fprintf(stderr, "crdp-drive-bench: wrote %u of %u bytes\n", written, req->length);
+                bench.failed = true;
+            }
+            return false;
+        }
+        case IRP_MJ_READ: {
+            file->pending--;
+            UINT32 read;
+            Stream_Read_UINT32(out, read);
+            if (!bench_check(req, "read")) return false;
+            if (read != req->length ||
+                (bench.verify && !bench_matches(Stream_Pointer(out), file->index, req->offset, read))) {
+                fprintf(stderr, "crdp-drive-bench: file %u at %llu: bad data (%u of %u bytes)\n", file->index,
+                        (unsigned long long)req->offset, read, req->length);
+                bench.failed = true;
+            }
+            return false;
+        }
+        default:
+            bench_check(req, "close");
+            file->active = false;
+            return true;
+    }
+}
+
+// Copies count files of size bytes each through the device, writing or
+// reading them, with up to depth IRPs in flight
+static bool bench_pass(const char* name, bool small, bool writing, uint32_t count, uint64_t size) {
+    bench_file_t files[BENCH_MAX_DEPTH];
+    memset(files, 0, sizeof(files));
+    uint32_t started = 0, closed = 0, in_flight = 0;
+    uint64_t irps = 0;
+
+    double start = bench_now();
+    while (closed < count && !bench.failed) {
+        // Keep every idle IRP busy: data for open files first, oldest first,
+        // then closes, then new files
+        while (bench.idle && !bench.failed) {
+            bench_req_t* req = bench.idle;
+            bench_file_t* pick = NULL;
+            bool close = false;
+            for (uint32_t i = 0; i < bench.depth && !pick; i++) {
+                bench_file_t* f = &files[i];
+                if (!f->active || f->state != BENCH_OPEN) continue;
+                if (f->next < size) {
+                    pick = f;
+                } else if (f->pending == 0) {
+                    pick = f;
+                    close = true;
+                }
+            }
+            bool open = false;
+            if (!pick && started < count) {
+                for (uint32_t i = 0; i < bench.depth && !pick; i++) {
+                    if (!files[i].active) pick = &files[i];
+                }
+                open = pick != NULL;
+            }
+            if (!pick) break;
+
+            bench.idle = req->next;
+            in_flight++;
+            irps++;
+            if (open) {
+                memset(pick, 0, sizeof(*pick));
+                pick->active = true;
+                pick->index = started++;
+                bench_create(req, pick, small, writing);
+            } else if (close) {
+                bench_close(req, pick);
+            } else {
+                bench_transfer(req, pick, size, writing);
+            }
+        }
+
+        pthread_mutex_lock(&bench.lock);
+        while (!bench.done) pthread_cond_wait(&bench.cond, &bench.lock);
+        bench_req_t* done = bench.done;
+        bench.done = NULL;
+        pthread_mutex_unlock(&bench.lock);
+        while (done) {
+            bench_req_t* req = done;
+            done = req->next;
+            in_flight--;
+            if (bench_finish(req)) closed++;
+            req->next = bench.idle;
+            bench.idle = req;
+        }
+    }
+
+    // Let a failed pass drain before the IRPs are reused
+    pthread_mutex_lock(&bench.lock);
+    while (in_flight > 0) {
+        while (!bench.done) pthread_cond_wait(&bench.cond, &bench.lock);
+        while (bench.done) {
+            bench_req_t* req = bench.done;
+            bench.done = req->next;
+            req->next = bench.idle;
+            bench.idle = req;
+            in_flight--;
+        }
+    }
+    pthread_mutex_unlock(&bench.lock);
+    if (bench.failed) return false;
+
+    double seconds = bench_now() - start;
+    double bytes = (double)count * (double)size;
+    printf("%-12s %6u files %10.1f MB %9llu IRPs %8.2f s %9.1f MB/s %10.0f IRPs/s\n", name, count, bytes / 1e6,
+           (unsigned long long)irps, seconds, seconds > 0 ? bytes / 1e6 / seconds : 0.0,
+           seconds > 0 ? irps / seconds : 0.0);
+    return true;
+}
+
+static void bench_remove(bool small, uint32_t count) {
+    char name[64];
+    char path[4096];
+    for (uint32_t i = 0; i < count; i++) {
+        bench_path(name, sizeof(name), small, i);
+        for (char* p = name; *p; p++) {
+            if (*p == '\\') *p = '/';
+        }
+        snprintf(path, sizeof(path), "%s%s", bench.dir, name);
+        unlink(path);
+    }
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: crdp-drive-bench [options]\n"
+            "  --dir DIR          directory to share (default: a new one under /tmp)\n"
+            "  --small-files N    small files to copy (default 2000)\n"
+            "  --small-size KB    size of each (default 16)\n"
+            "  --large-files N    large files to copy (default 2)\n"
+            "  --large-size MB    size of each (default 2048)\n"
+            "  --io KB            bytes per read or write IRP (default 1024)\n"
+            "  --depth N          IRPs in flight (default 16, at most 256)\n"
+            "  --no-verify        don't compare what is read back\n"
+            "  --keep             leave the files behind\n");
+}
+
+int main(int argc, char** argv) {
+    static const struct option options[] = {
+        { "dir", required_argument, NULL, 'd' },
+        { "small-files", required_argument, NULL, 's' },
+        { "small-size", required_argument, NULL, 'S' },
+        { "large-files", required_argument, NULL, 'l' },
+        { "large-size", required_argument, NULL, 'L' },
+        { "io", required_argument, NULL, 'i' },
+        { "depth", required_argument, NULL, 'q' },
+        { "no-verify", no_argument, NULL, 'n' },
+        { "keep", no_argument, NULL, 'k' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    const char* dir = NULL;
+    long small_files = 2000, small_kb = 16, large_files = 2, large_mb = 2048, io_kb = 1024, depth = 16;
+    bool keep = false;
+    bench.verify = true;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "d:s:S:l:L:i:q:nkh", options, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            dir = optarg;
+            break;
+        case 's':
+            small_files = atol(optarg);
+            break;
+        case 'S':
+            small_kb = atol(optarg);
+            break;
+        case 'l':
+            large_files = atol(optarg);
+            break;
+        case 'L':
+            large_mb = atol(optarg);
+            break;
+        case 'i':
+            io_kb = atol(optarg);
+            break;
+        case 'q':
+            depth = atol(optarg);
+            break;
+        case 'n':
+            bench.verify = false;
+            break;
+        case 'k':
+            keep = true;
+            break;
+        default:
+            usage();
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (optind != argc || small_files < 0 || small_kb < 1 || large_files < 0 || large_mb < 1 || io_kb < 1 ||
+        io_kb > 16 * 1024 || depth < 1 || depth > BENCH_MAX_DEPTH) {
+        usage();
+        return 2;
+    }
+
+    char temp[] = "/tmp/crdp-drive-bench.XXXXXX";
+    bool own_dir = !dir;
+    if (own_dir && !(dir = mkdtemp(temp))) {
+        fprintf(stderr, "crdp-drive-bench: can't create a directory: %s\n", strerror(errno));
+        return 1;
+    }
+    char small_dir[4096];
+    snprintf(small_dir, sizeof(small_dir), "%s/small", dir);
+    if (mkdir(small_dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "crdp-drive-bench: can't create %s: %s\n", small_dir, strerror(errno));
+        return 1;
+    }
+    bench.dir = dir;
+    bench.io = (size_t)io_kb * 1024;
+    bench.depth = (uint32_t)depth;
+    if (!bench_load(dir)) {
+        fprintf(stderr, "crdp-drive-bench: can't load the drive device\n");
+        return 1;
+    }
+
+    bench.pattern = malloc(bench.io);
+    if (!bench.pattern) return 1;
+    // xorshift64*, so the data doesn't compress or dedupe
+    uint64_t x = 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; i < bench.io; i++) {
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        bench.pattern[i] = (uint8_t)((x * 0x2545F4914F6CDD1Dull) >> 56);
+    }
+    for (uint32_t i = 0; i < bench.depth; i++) {
+        bench_req_t* req = &bench.reqs[i];
+        req->irp.device = bench.device;
+        req->irp.CompletionId = i;
+        req->irp.Complete = bench_complete;
+        req->irp.Discard = bench_discard;
+        req->control = Stream_New(NULL, 256);
+        req->data = Stream_New(NULL, 32 + bench.io);
+        req->irp.output = Stream_New(NULL, BENCH_HEADER_BYTES + 5 + bench.io);
+        if (!req->control || !req->data || !req->irp.output) return 1;
+        Stream_SetPosition(req->data, 32);
+        Stream_Write(req->data, bench.pattern, bench.io);
+        req->next = bench.idle;
+        bench.idle = req;
+    }
+
+    printf("%s: %u IRPs in flight, %zu KB per read or write\n", dir, bench.depth, bench.io / 1024);
+    uint64_t small_size = (uint64_t)small_kb * 1024, large_size = (uint64_t)large_mb * 1024 * 1024;
+    bool ok = true;
+    if (small_files > 0) {
+        ok = ok && bench_pass("small write", true, true, (uint32_t)small_files, small_size);
+        ok = ok && bench_pass("small read", true, false, (uint32_t)small_files, small_size);
+    }
+    if (large_files > 0) {
+        ok = ok && bench_pass("large write", false, true, (uint32_t)large_files, large_size);
+        ok = ok && bench_pass("large read", false, false, (uint32_t)large_files, large_size);
+    }
+
+    bench.device->Free(bench.device);
+    for (uint32_t i = 0; i < bench.depth; i++) {
+        Stream_Free(bench.reqs[i].control, TRUE);
+        Stream_Free(bench.reqs[i].data, TRUE);
+        Stream_Free(bench.reqs[i].irp.output, TRUE);
+    }
+    free(bench.pattern);
+    if (!keep) {
+        bench_remove(true, (uint32_t)small_files);
+        bench_remove(false, (uint32_t)large_files);
+        rmdir(small_dir);
+        if (own_dir) rmdir(dir);
+    }
+    return ok ? 0 : 1;
+}
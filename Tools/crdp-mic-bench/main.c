@@ -0,0 +1,281 @@
+// crdp-mic-bench: runs CRDP's microphone pipeline (mic.c) with no server
+// and no microphone. Loads the audin device the way audin does, with the
+// WAV file source looping a recording in real time, and takes the packets
+// in place of audin. Prints the capture-to-send latency crdp_get_mic_stats
+// reports, the packet rate and the drops, and fails if latency goes over
+// --max-latency. --stall-ms holds the send stage up once halfway, like a
+// congested channel; the pipeline must drop audio and recover rather than
+// fall behind or stop.
+//
+//   crdp-mic-bench --seconds 10 --rate 44100 --channels 2 --packet-ms 20 --stall-ms 300
+
+#include "crdp_internal.h"
+
+#include <freerdp/client/audin.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// How often latency is sampled
+#define BENCH_SAMPLE_MS 50
+#define BENCH_MAX_SAMPLES 100000
+// After a stall, time allowed for latency to come back down
+#define BENCH_RECOVERY_MS 1000
+
+static struct {
+    IAudinDevice* device;
+    double start;
+    double stall_at;                // Seconds into the run
+    long stall_ms;
+    _Atomic bool stalled;
+    _Atomic uint64_t packets;
+    _Atomic uint64_t bytes;
+} bench;
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_sleep_ms(long ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+}
+
+static UINT bench_register(IWTSPlugin* plugin, IAudinDevice* device) {
+    (void)plugin;
+    bench.device = device;
+    return CHANNEL_RC_OK;
+}
+
+// Stands in for audin; called on the send stage's thread
+static UINT bench_receive(const AUDIO_FORMAT* format, const BYTE* data, size_t size, void* user) {
+    (void)format;
+    (void)data;
+    (void)user;
+    atomic_fetch_add(&bench.packets, 1);
+    atomic_fetch_add(&bench.bytes, size);
+    if (bench.stall_ms > 0 && !atomic_load(&bench.stalled) && bench_now() - bench.start >= bench.stall_at) {
+        atomic_store(&bench.stalled, true);
+        bench_sleep_ms(bench.stall_ms);
+    }
+    return CHANNEL_RC_OK;
+}
+
+static void bench_put_le(uint8_t* p, uint32_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) p[i] = (uint8_t)(value >> (8 * i));
+}
+
+// Writes one second of a 440 Hz tone at 48 kHz, mono, as a WAV file
+static bool bench_write_tone(const char* path) {
+    const uint32_t rate = 48000;
+    int16_t* samples = malloc(rate * sizeof(int16_t));
+    FILE* file = fopen(path, "wb");
+    bool ok = samples && file;
+    if (ok) {
+        for (uint32_t i = 0; i < rate; i++) samples[i] = (int16_t)(8000 * sin(2 * M_PI * 440 * i / rate));
+        uint8_t header[44];
+        memcpy(header, "RIFF", 4);
+        bench_put_le(header + 4, 36 + rate * 2, 4);
+        memcpy(header + 8, "WAVEfmt ", 8);
+        bench_put_le(header + 16, 16, 4);
+        bench_put_le(header + 20, 1, 2);
+        bench_put_le(header + 22, 1, 2);
+        bench_put_le(header + 24, rate, 4);
+        bench_put_le(header + 28, rate * 2, 4);
+        bench_put_le(header + 32, 2, 2);
+        bench_put_le(header + 34, 16, 2);
+        memcpy(header + 36, "data", 4);
+        bench_put_le(header + 40, rate * 2, 4);
+        ok = fwrite(header, 1, sizeof(header), file) == sizeof(header) &&
+             fwrite(samples, sizeof(int16_t), rate, file) == rate;
+    }
+    if (file && fclose(file) != 0) ok = false;
+    free(samples);
+    return ok;
+}
+
+static int bench_compare(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: crdp-mic-bench [options]\n"
+            "  --wav PATH          16-bit PCM WAV to capture from (default: a generated tone)\n"
+            "  --seconds N         how long to run (default 10)\n"
+            "  --rate HZ           sample rate the server asks for (default 44100)\n"
+            "  --channels N        channels the server asks for (default 2)\n"
+            "  --packet-ms MS      packet length the server asks for (default 20)\n"
+            "  --stall-ms MS       hold the send stage up this long once, halfway (default 0)\n"
+            "  --max-latency MS    fail above this capture-to-send latency (default 100)\n");
+}
+
+int main(int argc, char** argv) {
+    static const struct option options[] = {
+        { "wav", required_argument, NULL, 'w' },
+        { "seconds", required_argument, NULL, 's' },
+        { "rate", required_argument, NULL, 'r' },
+        { "channels", required_argument, NULL, 'c' },
+        { "packet-ms", required_argument, NULL, 'p' },
+        { "stall-ms", required_argument, NULL, 't' },
+        { "max-latency", required_argument, NULL, 'm' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    const char* wav = NULL;
+    long seconds = 10, rate = 44100, channels = 2, packet_ms = 20, stall_ms = 0, max_latency = 100;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "w:s:r:c:p:t:m:h", options, NULL)) != -1) {
+        switch (opt) {
+        case 'w':
+            wav = optarg;
+            break;
+        case 's':
+            seconds = atol(optarg);
+            break;
+        case 'r':
+            rate = atol(optarg);
+            break;
+        case 'c':
+            channels = atol(optarg);
+            break;
+        case 'p':
+            packet_ms = atol(optarg);
+            break;
+        case 't':
+            stall_ms = atol(optarg);
+            break;
+        case 'm':
+            max_latency = atol(optarg);
+            break;
+        default:
+            usage();
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (optind != argc || seconds < 1 || rate < 8000 || rate > 48000 || channels < 1 || channels > 2 ||
+        packet_ms < 1 || packet_ms > 1000 || stall_ms < 0 || max_latency < 1) {
+        usage();
+        return 2;
+    }
+
+    char tone[] = "/tmp/crdp-mic-bench.XXXXXX";
+    if (!wav) {
+        int fd = mkstemp(tone);
+        if (fd < 0 || close(fd) != 0 || !bench_write_tone(tone)) {
+            fprintf(stderr, "crdp-mic-bench: can't write a tone to %s: %s\n", tone, strerror(errno));
+            return 1;
+        }
+        wav = tone;
+    }
+
+    crdp_client_t* client = crdp_client_new(NULL, NULL, NULL, NULL, NULL, NULL);
+    crdp_context* ctx = calloc(1, sizeof(*ctx));
+    if (!client || !ctx) return 1;
+    ctx->client = client;
+    client->config.mic_input = CRDP_MIC_FILE;
+    client->config.mic_file_path = strdup(wav);  // Freed with the client
+
+    // Loaded as audin loads its devices
+    PFREERDP_AUDIN_DEVICE_ENTRY entry = (PFREERDP_AUDIN_DEVICE_ENTRY)crdp_mic_addin_entry("audin", "crdp");
+    FREERDP_AUDIN_DEVICE_ENTRY_POINTS points = { 0 };
+    points.pRegisterAudinDevice = bench_register;
+    points.rdpcontext = (rdpContext*)ctx;
+    if (!entry || entry(&points) != CHANNEL_RC_OK || !bench.device) {
+        fprintf(stderr, "crdp-mic-bench: can't load the microphone device\n");
+        if (wav == tone) unlink(tone);
+        return 1;
+    }
+    IAudinDevice* device = bench.device;
+
+    AUDIO_FORMAT format = { 0 };
+    format.wFormatTag = WAVE_FORMAT_PCM;
+    format.nChannels = (UINT16)channels;
+    format.nSamplesPerSec = (UINT32)rate;
+    format.wBitsPerSample = 16;
+    format.nBlockAlign = (UINT16)(channels * 2);
+    format.nAvgBytesPerSec = format.nSamplesPerSec * format.nBlockAlign;
+    UINT32 frames_per_packet = (UINT32)(rate * packet_ms / 1000);
+    bench.stall_ms = stall_ms;
+    bench.stall_at = seconds / 2.0;
+    bench.start = bench_now();
+    if (device->SetFormat(device, &format, frames_per_packet) != CHANNEL_RC_OK ||
+        device->Open(device, bench_receive, NULL) != CHANNEL_RC_OK) {
+        fprintf(stderr, "crdp-mic-bench: can't open the microphone device\n");
+        device->Free(device);
+        if (wav == tone) unlink(tone);
+        return 1;
+    }
+    printf("capturing %s, sending %ld Hz, %ld channels, %ld ms packets for %ld s\n", wav, rate, channels,
+           packet_ms, seconds);
+
+    // Latency of the last packet sent, sampled; samples from a stall until
+    // the pipeline has had time to recover are kept apart
+    static uint32_t steady[BENCH_MAX_SAMPLES];
+    uint32_t steady_count = 0, stall_max = 0;
+    uint64_t last_packets = 0, tail_packets = 0;
+    double tail_from = seconds - 1.0;
+    for (;;) {
+        bench_sleep_ms(BENCH_SAMPLE_MS);
+        double at = bench_now() - bench.start;
+        crdp_mic_stats_t stats;
+        crdp_get_mic_stats(client, &stats);
+        uint64_t packets = atomic_load(&bench.packets);
+        if (at >= tail_from && tail_packets == 0) tail_packets = packets;
+        if (stats.packets_sent > 0 && packets != last_packets) {
+            bool recovering = stall_ms > 0 && at >= bench.stall_at &&
+                              at < bench.stall_at + (stall_ms + BENCH_RECOVERY_MS) / 1000.0;
+            if (recovering) {
+                if (stats.latency_ms > stall_max) stall_max = stats.latency_ms;
+            } else if (steady_count < BENCH_MAX_SAMPLES) {
+                steady[steady_count++] = stats.latency_ms;
+            }
+        }
+        last_packets = packets;
+        if (at >= seconds) break;
+    }
+    uint64_t final_packets = atomic_load(&bench.packets);
+    crdp_mic_stats_t stats;
+    crdp_get_mic_stats(client, &stats);
+    device->Close(device);
+    device->Free(device);
+    crdp_client_free(client);
+    free(ctx);
+    if (wav == tone) unlink(tone);
+
+    int failures = 0;
+    qsort(steady, steady_count, sizeof(steady[0]), bench_compare);
+    uint32_t p50 = steady_count ? steady[steady_count / 2] : 0;
+    uint32_t p99 = steady_count ? steady[steady_count * 99 / 100] : 0;
+    uint32_t worst = steady_count ? steady[steady_count - 1] : 0;
+    double expected = 1000.0 / packet_ms;
+    printf("  packets: %llu sent, %.1f/s (%.1f/s expected), %llu bytes\n",
+           (unsigned long long)stats.packets_sent, stats.packets_sent / (double)seconds, expected,
+           (unsigned long long)stats.bytes_sent);
+    printf("  latency: p50 %u ms, p99 %u ms, max %u ms over %u samples\n", p50, p99, worst, steady_count);
+    if (stall_ms > 0) printf("  stall of %ld ms: latency up to %u ms while recovering\n", stall_ms, stall_max);
+    printf("  dropped: %llu frames\n", (unsigned long long)stats.dropped_frames);
+
+    if (steady_count == 0 || worst > (uint32_t)max_latency) {
+        fprintf(stderr, "FAIL latency %u ms is over %ld ms\n", worst, max_latency);
+        failures++;
+    }
+    // Still flowing at full rate at the end, stall or not
+    double tail_rate = (double)(final_packets - tail_packets) / (seconds - tail_from);
+    if (tail_rate < expected * 0.9) {
+        fprintf(stderr, "FAIL %.1f packets/s in the last second, %.1f expected\n", tail_rate, expected);
+        failures++;
+    }
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
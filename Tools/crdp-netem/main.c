@@ -0,0 +1,565 @@
+// crdp-netem: a TCP/UDP proxy that impairs the link between CRDP and an RDP
+// server, so slow networks can be reproduced on one machine.
+//
+//   crdp-netem --listen 127.0.0.1:13389 --target 127.0.0.1:3389 --profile hotel-wifi
+//
+// Each direction is impaired on its own: serialization at a capped rate with a
+// bounded queue in front of it, a one-way delay with jitter, and random loss.
+// Lost UDP datagrams are dropped. TCP can't lose bytes, so a lost TCP segment
+// arrives a retransmission timeout late and holds back everything behind it,
+// as it would on a real link. Randomness comes from --seed, so a run repeats.
+
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NETEM_SEGMENT 1448          // TCP is forwarded in segment-sized chunks
+#define NETEM_DATAGRAM_MAX 65535
+#define NETEM_MIN_RTO_MS 200        // Linux's minimum retransmission timeout
+
+typedef struct {
+    const char* name;
+    const char* description;
+    uint32_t delay_ms;              // One way, so the RTT grows by twice this
+    uint32_t jitter_ms;
+    uint32_t rate_kbps;             // 0 = no cap
+    double loss_percent;
+} netem_profile_t;
+
+static const netem_profile_t netem_profiles[] = {
+    { "lan", "Wired LAN", 0, 0, 0, 0 },
+    { "broadband", "Home broadband, 30 ms RTT, 50 Mbit/s", 15, 2, 50000, 0.05 },
+    { "hotel-wifi", "Crowded Wi-Fi, 80 ms RTT with heavy jitter, 3 Mbit/s, 2% loss", 40, 25, 3000, 2.0 },
+    { "transatlantic-vpn", "VPN across the Atlantic, 90 ms RTT, 20 Mbit/s, 0.5% loss", 45, 5, 20000, 0.5 },
+    { "mobile", "Congested mobile data, 120 ms RTT, 1.5 Mbit/s, 1% loss", 60, 40, 1500, 1.0 },
+};
+
+static struct {
+    uint32_t delay_ms;
+    uint32_t jitter_ms;
+    uint32_t rate_kbps;
+    double loss;                    // Probability
+    size_t queue_bytes;             // Per direction
+    uint64_t seed;
+    bool verbose;
+} netem;
+
+// A chunk of data in flight; len 0 marks the end of a TCP stream
+typedef struct netem_packet {
+    struct netem_packet* next;
+    uint64_t due_us;
+    size_t len;
+    uint8_t data[];
+} netem_packet_t;
+
+typedef struct netem_conn netem_conn_t;
+
+// Client address for UDP replies, learned from the client's datagrams
+typedef struct {
+    pthread_mutex_t lock;
+    struct sockaddr_storage addr;
+    socklen_t len;
+} netem_peer_t;
+
+// One direction of a connection: a reader queues what arrives, a writer
+// sends each chunk once it is due
+typedef struct {
+    netem_conn_t* conn;
+    bool datagram;
+    int in_fd;
+    int out_fd;
+    netem_peer_t* learn_peer;       // UDP upstream: record the sender
+    netem_peer_t* to_peer;          // UDP downstream: send to the recorded sender
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    netem_packet_t* head;
+    size_t queued;
+    bool failed;
+    uint64_t link_free_us;          // When the capped link finishes its last chunk
+    uint64_t last_due_us;
+    uint64_t rng;
+    // Guarded by lock
+    uint64_t bytes;
+    uint64_t packets;
+    uint64_t lost;
+    uint64_t overflows;             // UDP dropped by a full queue
+} netem_pipe_t;
+
+struct netem_conn {
+    unsigned id;
+    int fds[2];
+    netem_pipe_t up;                // Client to server
+    netem_pipe_t down;
+    _Atomic int threads;
+};
+
+static _Atomic uint64_t netem_total_bytes[2];
+static _Atomic uint64_t netem_total_lost[2];
+static volatile sig_atomic_t netem_quit;
+
+static uint64_t netem_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// xorshift64*; one generator per direction keeps runs repeatable
+static double netem_random(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return (double)((x * 0x2545F4914F6CDD1DULL) >> 11) / (double)(1ULL << 53);
+}
+
+static void netem_pipe_init(netem_pipe_t* dir, netem_conn_t* conn, int in_fd, int out_fd, bool datagram,
+                            uint64_t seed) {
+    memset(dir, 0, sizeof(*dir));
+    dir->conn = conn;
+    dir->datagram = datagram;
+    dir->in_fd = in_fd;
+    dir->out_fd = out_fd;
+    // splitmix64, so neighbouring seeds give unrelated streams
+    uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    dir->rng = (z ^ (z >> 31)) | 1;
+    pthread_mutex_init(&dir->lock, NULL);
+    pthread_cond_init(&dir->cond, NULL);
+}
+
+static void netem_pipe_free(netem_pipe_t* dir) {
+    while (dir->head) {
+        netem_packet_t* next = dir->head->next;
+        free(dir->head);
+        dir->head = next;
+    }
+    pthread_mutex_destroy(&dir->lock);
+    pthread_cond_destroy(&dir->cond);
+}
+
+// Tears the whole TCP connection down; every thread of it then finishes
+static void netem_conn_fail(netem_conn_t* conn) {
+    netem_pipe_t* pipes[] = { &conn->up, &conn->down };
+    for (int i = 0; i < 2; i++) {
+        pthread_mutex_lock(&pipes[i]->lock);
+        pipes[i]->failed = true;
+        pthread_cond_broadcast(&pipes[i]->cond);
+        pthread_mutex_unlock(&pipes[i]->lock);
+    }
+    shutdown(conn->fds[0], SHUT_RDWR);
+    shutdown(conn->fds[1], SHUT_RDWR);
+}
+
+static void netem_conn_release(netem_conn_t* conn) {
+    if (atomic_fetch_sub(&conn->threads, 1) != 1) return;
+    printf("conn %u closed: up %llu bytes, %llu lost; down %llu bytes, %llu lost\n", conn->id,
+           (unsigned long long)conn->up.bytes, (unsigned long long)conn->up.lost,
+           (unsigned long long)conn->down.bytes, (unsigned long long)conn->down.lost);
+    close(conn->fds[0]);
+    close(conn->fds[1]);
+    netem_pipe_free(&conn->up);
+    netem_pipe_free(&conn->down);
+    free(conn);
+}
+
+// Decides when a chunk arriving now leaves the far end, or drops it
+static bool netem_enqueue(netem_pipe_t* dir, const uint8_t* data, size_t len) {
+    netem_packet_t* packet = malloc(sizeof(*packet) + len);
+    if (!packet) return false;
+    packet->next = NULL;
+    packet->len = len;
+    memcpy(packet->data, data, len);
+
+    pthread_mutex_lock(&dir->lock);
+    // A full queue pushes back on a TCP sender and drops datagrams, like a
+    // router's buffer
+    while (!dir->datagram && !dir->failed && dir->queued > 0 && dir->queued + len > netem.queue_bytes) {
+        pthread_cond_wait(&dir->cond, &dir->lock);
+    }
+    if (dir->failed || (dir->datagram && dir->queued + len > netem.queue_bytes)) {
+        if (!dir->failed) dir->overflows++;
+        bool failed = dir->failed;
+        pthread_mutex_unlock(&dir->lock);
+        free(packet);
+        return !failed;
+    }
+
+    uint64_t now = netem_now_us();
+    uint64_t start = now > dir->link_free_us ? now : dir->link_free_us;
+    dir->link_free_us = netem.rate_kbps ? start + (uint64_t)len * 8000 / netem.rate_kbps : start;
+    int64_t delay = (int64_t)netem.delay_ms * 1000;
+    if (netem.jitter_ms) delay += (int64_t)((netem_random(&dir->rng) * 2 - 1) * netem.jitter_ms * 1000);
+    uint64_t due = dir->link_free_us + (delay > 0 ? (uint64_t)delay : 0);
+
+    if (len > 0 && netem.loss > 0 && netem_random(&dir->rng) < netem.loss) {
+        dir->lost++;
+        atomic_fetch_add(&netem_total_lost[dir == &dir->conn->down], 1);
+        if (dir->datagram) {
+            pthread_mutex_unlock(&dir->lock);
+            free(packet);
+            return true;
+        }
+        uint64_t rto = 4ULL * netem.delay_ms;
+        due += (rto > NETEM_MIN_RTO_MS ? rto : NETEM_MIN_RTO_MS) * 1000;
+    }
+
+    netem_packet_t** at = &dir->head;
+    if (dir->datagram) {
+        // Jitter may reorder datagrams
+        while (*at && (*at)->due_us <= due) at = &(*at)->next;
+    } else {
+        // but never a byte stream
+        if (due < dir->last_due_us) due = dir->last_due_us;
+        while (*at) at = &(*at)->next;
+    }
+    dir->last_due_us = due;
+    packet->due_us = due;
+    packet->next = *at;
+    *at = packet;
+    dir->queued += len;
+    pthread_cond_broadcast(&dir->cond);
+    pthread_mutex_unlock(&dir->lock);
+    return true;
+}
+
+static bool netem_send(netem_pipe_t* dir, const netem_packet_t* packet) {
+    if (dir->datagram) {
+        netem_peer_t* peer = dir->to_peer;
+        struct sockaddr_storage addr;
+        socklen_t addr_len = 0;
+        if (peer) {
+            pthread_mutex_lock(&peer->lock);
+            addr = peer->addr;
+            addr_len = peer->len;
+            pthread_mutex_unlock(&peer->lock);
+            if (addr_len == 0) return true;
+        }
+        // Failures are loss as far as the endpoints can tell
+        if (peer) {
+            sendto(dir->out_fd, packet->data, packet->len, 0, (struct sockaddr*)&addr, addr_len);
+        } else {
+            send(dir->out_fd, packet->data, packet->len, 0);
+        }
+        return true;
+    }
+    for (size_t off = 0; off < packet->len;) {
+        ssize_t n = send(dir->out_fd, packet->data + off, packet->len - off, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        off += (size_t)n;
+    }
+    return true;
+}
+
+static void* netem_write_run(void* arg) {
+    netem_pipe_t* dir = (netem_pipe_t*)arg;
+    for (;;) {
+        pthread_mutex_lock(&dir->lock);
+        while (!dir->head && !dir->failed) pthread_cond_wait(&dir->cond, &dir->lock);
+        if (dir->failed) {
+            pthread_mutex_unlock(&dir->lock);
+            break;
+        }
+        netem_packet_t* packet = dir->head;
+        uint64_t now = netem_now_us();
+        if (packet->due_us > now) {
+            // Woken early if a datagram due sooner is queued in front
+            uint64_t wait = packet->due_us - now;
+            struct timeval tv;
+            gettimeofday(&tv, NULL);
+            uint64_t ns = (uint64_t)tv.tv_usec * 1000 + wait * 1000;
+            struct timespec deadline = { tv.tv_sec + (time_t)(ns / 1000000000), (long)(ns % 1000000000) };
+            pthread_cond_timedwait(&dir->cond, &dir->lock, &deadline);
+            pthread_mutex_unlock(&dir->lock);
+            continue;
+        }
+        dir->head = packet->next;
+        dir->queued -= packet->len;
+        dir->bytes += packet->len;
+        dir->packets++;
+        pthread_cond_broadcast(&dir->cond);
+        pthread_mutex_unlock(&dir->lock);
+
+        if (packet->len == 0) {
+            // End of stream: pass the FIN on
+            shutdown(dir->out_fd, SHUT_WR);
+            free(packet);
+            break;
+        }
+        atomic_fetch_add(&netem_total_bytes[dir == &dir->conn->down], packet->len);
+        bool ok = netem_send(dir, packet);
+        free(packet);
+        if (!ok) {
+            netem_conn_fail(dir->conn);
+            break;
+        }
+    }
+    netem_conn_release(dir->conn);
+    return NULL;
+}
+
+static void* netem_read_run(void* arg) {
+    netem_pipe_t* dir = (netem_pipe_t*)arg;
+    static _Thread_local uint8_t buf[NETEM_DATAGRAM_MAX];
+    for (;;) {
+        ssize_t n;
+        if (dir->learn_peer) {
+            struct sockaddr_storage addr;
+            socklen_t addr_len = sizeof(addr);
+            n = recvfrom(dir->in_fd, buf, sizeof(buf), 0, (struct sockaddr*)&addr, &addr_len);
+            if (n >= 0) {
+                pthread_mutex_lock(&dir->learn_peer->lock);
+                dir->learn_peer->addr = addr;
+                dir->learn_peer->len = addr_len;
+                pthread_mutex_unlock(&dir->learn_peer->lock);
+            }
+        } else {
+            n = recv(dir->in_fd, buf, dir->datagram ? sizeof(buf) : NETEM_SEGMENT, 0);
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (dir->datagram) {
+            // ECONNREFUSED: nothing listening on the server's UDP port yet
+            if (n < 0 && errno != ECONNREFUSED) break;
+            if (n >= 0) netem_enqueue(dir, buf, (size_t)n);
+            continue;
+        }
+        if (n <= 0) {
+            // The peer closed (or failed); its FIN follows the data in flight
+            netem_enqueue(dir, buf, 0);
+            break;
+        }
+        if (!netem_enqueue(dir, buf, (size_t)n)) break;
+    }
+    if (!dir->datagram) netem_conn_release(dir->conn);
+    return NULL;
+}
+
+static bool netem_spawn(void* (*run)(void*), void* arg) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run, arg) != 0) return false;
+    pthread_detach(thread);
+    return true;
+}
+
+// "host:port" or "[v6]:port"
+static struct addrinfo* netem_resolve(const char* spec, int socktype, bool passive) {
+    char host[256];
+    const char* colon = strrchr(spec, ':');
+    if (!colon || colon == spec || (size_t)(colon - spec) >= sizeof(host)) return NULL;
+    memcpy(host, spec, (size_t)(colon - spec));
+    host[colon - spec] = '\0';
+    char* h = host;
+    if (h[0] == '[' && h[strlen(h) - 1] == ']') {
+        h[strlen(h) - 1] = '\0';
+        h++;
+    }
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = socktype, .ai_flags = passive ? AI_PASSIVE : 0 };
+    struct addrinfo* ai = NULL;
+    int rc = getaddrinfo(h, colon + 1, &hints, &ai);
+    if (rc != 0) {
+        fprintf(stderr, "crdp-netem: %s: %s\n", spec, gai_strerror(rc));
+        return NULL;
+    }
+    return ai;
+}
+
+static int netem_socket(const char* spec, int socktype, bool listen_on) {
+    struct addrinfo* ai = netem_resolve(spec, socktype, listen_on);
+    if (!ai) return -1;
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    int one = 1;
+    if (fd >= 0 && listen_on) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    bool ok = fd >= 0 && (listen_on ? bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+                                          (socktype != SOCK_STREAM || listen(fd, 16) == 0)
+                                    : connect(fd, ai->ai_addr, ai->ai_addrlen) == 0);
+    if (!ok) {
+        fprintf(stderr, "crdp-netem: %s %s: %s\n", listen_on ? "listen on" : "connect to", spec, strerror(errno));
+        if (fd >= 0) close(fd);
+        fd = -1;
+    }
+    // The proxy shouldn't add Nagle delays of its own
+    if (fd >= 0 && socktype == SOCK_STREAM && !listen_on) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    freeaddrinfo(ai);
+    return fd;
+}
+
+static void netem_accept(int client_fd, const char* target, unsigned id) {
+    int one = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    int server_fd = netem_socket(target, SOCK_STREAM, false);
+    netem_conn_t* conn = server_fd >= 0 ? calloc(1, sizeof(*conn)) : NULL;
+    if (!conn) {
+        if (server_fd >= 0) close(server_fd);
+        close(client_fd);
+        return;
+    }
+    conn->id = id;
+    conn->fds[0] = client_fd;
+    conn->fds[1] = server_fd;
+    netem_pipe_init(&conn->up, conn, client_fd, server_fd, false, netem.seed + 2 * id);
+    netem_pipe_init(&conn->down, conn, server_fd, client_fd, false, netem.seed + 2 * id + 1);
+    atomic_init(&conn->threads, 4);
+    if (netem.verbose) printf("conn %u open\n", id);
+
+    netem_pipe_t* pipes[] = { &conn->up, &conn->down };
+    for (int i = 0; i < 2; i++) {
+        for (int writer = 0; writer < 2; writer++) {
+            if (!netem_spawn(writer ? netem_write_run : netem_read_run, pipes[i])) {
+                // Stand in for the thread that didn't start
+                netem_conn_fail(conn);
+                netem_conn_release(conn);
+            }
+        }
+    }
+}
+
+// UDP is one flow: datagrams from whoever last sent to the listening port
+// go to the server, and the server's go back to that sender
+static bool netem_start_udp(const char* listen_spec, const char* target) {
+    int listen_fd = netem_socket(listen_spec, SOCK_DGRAM, true);
+    int server_fd = listen_fd >= 0 ? netem_socket(target, SOCK_DGRAM, false) : -1;
+    netem_conn_t* flow = server_fd >= 0 ? calloc(1, sizeof(*flow)) : NULL;
+    netem_peer_t* peer = flow ? calloc(1, sizeof(*peer)) : NULL;
+    if (!peer) return false;
+    pthread_mutex_init(&peer->lock, NULL);
+    flow->fds[0] = listen_fd;
+    flow->fds[1] = server_fd;
+    netem_pipe_init(&flow->up, flow, listen_fd, server_fd, true, netem.seed ^ 0x5544);
+    netem_pipe_init(&flow->down, flow, server_fd, listen_fd, true, netem.seed ^ 0x5545);
+    flow->up.learn_peer = peer;
+    flow->down.to_peer = peer;
+    // Lives until exit, so nothing releases it
+    atomic_init(&flow->threads, 5);
+    return netem_spawn(netem_read_run, &flow->up) && netem_spawn(netem_write_run, &flow->up) &&
+           netem_spawn(netem_read_run, &flow->down) && netem_spawn(netem_write_run, &flow->down);
+}
+
+static void netem_on_signal(int sig) {
+    (void)sig;
+    netem_quit = 1;
+}
+
+static void netem_usage(FILE* out) {
+    fprintf(out,
+            "usage: crdp-netem --listen HOST:PORT --target HOST:PORT [options]\n"
+            "  --profile NAME    start from a preset (below)\n"
+            "  --delay MS        one-way delay in each direction\n"
+            "  --jitter MS       delay varies by up to this much either way\n"
+            "  --rate KBPS       bandwidth cap in each direction, kbit/s (0 = none)\n"
+            "  --loss PERCENT    segment/datagram loss in each direction\n"
+            "  --queue KB        queue in front of the capped link (default 256)\n"
+            "  --udp             also proxy UDP on the same ports (RDP-UDP)\n"
+            "  --seed N          random seed (default 1)\n"
+            "  --verbose\n"
+            "profiles:\n");
+    for (size_t i = 0; i < sizeof(netem_profiles) / sizeof(netem_profiles[0]); i++) {
+        fprintf(out, "  %-18s %s\n", netem_profiles[i].name, netem_profiles[i].description);
+    }
+}
+
+int main(int argc, char** argv) {
+    static const struct option options[] = {
+        { "listen", required_argument, NULL, 'l' }, { "target", required_argument, NULL, 't' },
+        { "profile", required_argument, NULL, 'p' }, { "delay", required_argument, NULL, 'd' },
+        { "jitter", required_argument, NULL, 'j' }, { "rate", required_argument, NULL, 'r' },
+        { "loss", required_argument, NULL, 'x' }, { "queue", required_argument, NULL, 'q' },
+        { "udp", no_argument, NULL, 'u' }, { "seed", required_argument, NULL, 's' },
+        { "verbose", no_argument, NULL, 'v' }, { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    const char* listen_spec = NULL;
+    const char* target = NULL;
+    bool udp = false;
+    netem.queue_bytes = 256 * 1024;
+    netem.seed = 1;
+
+    // Explicit settings override the profile wherever they appear
+    for (int i = 1; i < argc; i++) {
+        const char* name = NULL;
+        if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) name = argv[i + 1];
+        if (strncmp(argv[i], "--profile=", 10) == 0) name = argv[i] + 10;
+        if (!name) continue;
+        size_t n = 0;
+        while (n < sizeof(netem_profiles) / sizeof(netem_profiles[0]) && strcmp(netem_profiles[n].name, name) != 0) n++;
+        if (n == sizeof(netem_profiles) / sizeof(netem_profiles[0])) {
+            fprintf(stderr, "crdp-netem: unknown profile %s\n", name);
+            netem_usage(stderr);
+            return 2;
+        }
+        netem.delay_ms = netem_profiles[n].delay_ms;
+        netem.jitter_ms = netem_profiles[n].jitter_ms;
+        netem.rate_kbps = netem_profiles[n].rate_kbps;
+        netem.loss = netem_profiles[n].loss_percent / 100;
+    }
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+            case 'l': listen_spec = optarg; break;
+            case 't': target = optarg; break;
+            case 'p': break;
+            case 'd': netem.delay_ms = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'j': netem.jitter_ms = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'r': netem.rate_kbps = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'x': netem.loss = strtod(optarg, NULL) / 100; break;
+            case 'q': netem.queue_bytes = (size_t)strtoul(optarg, NULL, 10) * 1024; break;
+            case 'u': udp = true; break;
+            case 's': netem.seed = strtoull(optarg, NULL, 10); break;
+            case 'v': netem.verbose = true; break;
+            case 'h': netem_usage(stdout); return 0;
+            default: netem_usage(stderr); return 2;
+        }
+    }
+    if (!listen_spec || !target || netem.loss < 0 || netem.loss >= 1 || netem.queue_bytes == 0) {
+        netem_usage(stderr);
+        return 2;
+    }
+    if (netem.jitter_ms > netem.delay_ms) {
+        fprintf(stderr, "crdp-netem: note: jitter above the delay is clipped at zero delay\n");
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    // No SA_RESTART, so a signal interrupts accept()
+    struct sigaction sa = { .sa_handler = netem_on_signal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    int listen_fd = netem_socket(listen_spec, SOCK_STREAM, true);
+    if (listen_fd < 0) return 1;
+    if (udp && !netem_start_udp(listen_spec, target)) return 1;
+    printf("crdp-netem: %s -> %s, delay %u ms, jitter %u ms, rate %u kbit/s, loss %.2f%%%s\n", listen_spec, target,
+           netem.delay_ms, netem.jitter_ms, netem.rate_kbps, netem.loss * 100, udp ? ", with UDP" : "");
+    fflush(stdout);
+
+    unsigned next_id = 1;
+    while (!netem_quit) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("crdp-netem: accept");
+            break;
+        }
+        netem_accept(fd, target, next_id++);
+        fflush(stdout);
+    }
+    printf("crdp-netem: up %llu bytes, %llu lost; down %llu bytes, %llu lost\n",
+           (unsigned long long)atomic_load(&netem_total_bytes[0]), (unsigned long long)atomic_load(&netem_total_lost[0]),
+           (unsigned long long)atomic_load(&netem_total_bytes[1]), (unsigned long long)atomic_load(&netem_total_lost[1]));
+    return 0;
+}
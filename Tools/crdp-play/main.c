@@ -0,0 +1,268 @@
+// crdp-play: reads session recordings made with crdp_config_t.record_path.
+// Prints what is in them, exports the screen at a point in time, or converts
+// them to YUV4MPEG2 video, which ffmpeg and most players read directly.
+//
+//   crdp-play info session.crdprec
+//   crdp-play frame session.crdprec 95000 shot.ppm
+//   crdp-play convert --fps 10 session.crdprec - | ffmpeg -i - session.mp4
+
+#include <CRDP.h>
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: crdp-play info RECORDING\n"
+            "       crdp-play events RECORDING\n"
+            "       crdp-play frame RECORDING MS OUT.ppm\n"
+            "       crdp-play convert [--fps N] [--no-pointer] RECORDING OUT.y4m|-\n");
+}
+
+static FILE* play_output(const char* path) {
+    if (strcmp(path, "-") == 0) return stdout;
+    FILE* file = fopen(path, "wb");
+    if (!file) perror(path);
+    return file;
+}
+
+static int play_close(FILE* file, const char* path) {
+    int status = ferror(file) ? 1 : 0;
+    if (file != stdout && fclose(file) != 0) status = 1;
+    if (status) fprintf(stderr, "crdp-play: failed to write %s\n", path);
+    return status;
+}
+
+static int play_info(crdp_recording_t* rec) {
+    crdp_recording_info_t info;
+    if (crdp_recording_get_info(rec, &info) != 0) return 1;
+    printf("duration: %llu.%03llu s\nsessions: %u\nsegments: %u\n", (unsigned long long)(info.duration_ms / 1000),
+           (unsigned long long)(info.duration_ms % 1000), info.sessions, info.segments);
+    return 0;
+}
+
+static int play_events(crdp_recording_t* rec) {
+    crdp_recording_item_t item;
+    int rc;
+    while ((rc = crdp_recording_next(rec, &item)) == 1) {
+        switch (item.type) {
+        case CRDP_RECORDING_FRAME:
+            printf("%10llu frame %ux%u\n", (unsigned long long)item.time_ms, item.width, item.height);
+            break;
+        case CRDP_RECORDING_POINTER:
+            printf("%10llu pointer %d,%d flags 0x%04x\n", (unsigned long long)item.time_ms, item.pointer_x,
+                   item.pointer_y, item.flags);
+            break;
+        case CRDP_RECORDING_KEY:
+            printf("%10llu key 0x%02x flags 0x%04x\n", (unsigned long long)item.time_ms, item.scancode, item.flags);
+            break;
+        }
+    }
+    if (rc < 0) fprintf(stderr, "crdp-play: the recording is damaged past this point\n");
+    return rc < 0 ? 1 : 0;
+}
+
+static int play_frame(crdp_recording_t* rec, uint64_t time_ms, const char* path) {
+    crdp_recording_item_t item;
+    int rc = crdp_recording_seek(rec, time_ms, &item);
+    if (rc <= 0) {
+        fprintf(stderr, "crdp-play: %s\n", rc == 0 ? "nothing was on screen by then" : "can't read the recording");
+        return 1;
+    }
+    FILE* file = play_output(path);
+    if (!file) return 1;
+    fprintf(file, "P6\n%u %u\n255\n", item.width, item.height);
+    uint8_t* row = malloc((size_t)item.width * 3);
+    if (!row) return 1;
+    for (uint32_t y = 0; y < item.height; y++) {
+        const uint8_t* src = item.data + (size_t)y * item.stride;
+        for (uint32_t x = 0; x < item.width; x++) {
+            row[x * 3] = src[x * 4 + 2];
+            row[x * 3 + 1] = src[x * 4 + 1];
+            row[x * 3 + 2] = src[x * 4];
+        }
+        fwrite(row, 1, (size_t)item.width * 3, file);
+    }
+    free(row);
+    return play_close(file, path);
+}
+
+// Video conversion. The video keeps the size of the first frame; a session
+// at another size is cropped or padded with black.
+
+typedef struct {
+    uint32_t width;          // Even, as 4:2:0 wants
+    uint32_t height;
+    uint8_t* screen;         // BGRA32
+    uint8_t* yuv;
+    int32_t pointer_x;
+    int32_t pointer_y;
+} play_video_t;
+
+static void play_video_copy(play_video_t* video, const crdp_recording_item_t* item) {
+    memset(video->screen, 0, (size_t)video->width * video->height * 4);
+    uint32_t w = item->width < video->width ? item->width : video->width;
+    uint32_t h = item->height < video->height ? item->height : video->height;
+    for (uint32_t y = 0; y < h; y++) {
+        memcpy(video->screen + (size_t)y * video->width * 4, item->data + (size_t)y * item->stride, (size_t)w * 4);
+    }
+}
+
+// The recording has where the pointer was, not what it looked like: a
+// black-edged white arrow stands in for it
+static void play_video_pointer(play_video_t* video, uint8_t* frame) {
+    static const char* arrow[] = {
+        "X", "XX", "X.X", "X..X", "X...X", "X....X", "X.....X", "X......X", "X...XXXX", "X..X", "X.X", "XX",
+    };
+    for (int32_t row = 0; row < (int32_t)(sizeof(arrow) / sizeof(arrow[0])); row++) {
+        int32_t y = video->pointer_y + row;
+        if (y < 0 || y >= (int32_t)video->height) continue;
+        for (int32_t col = 0; arrow[row][col]; col++) {
+            int32_t x = video->pointer_x + col;
+            if (x < 0 || x >= (int32_t)video->width) continue;
+            memset(frame + ((size_t)y * video->width + (size_t)x) * 4, arrow[row][col] == 'X' ? 0 : 255, 3);
+        }
+    }
+}
+
+// Full range BT.601, which C420jpeg stands for
+static void play_video_convert(const play_video_t* video, const uint8_t* bgra) {
+    uint32_t cw = video->width / 2;
+    uint8_t* yp = video->yuv;
+    uint8_t* up = yp + (size_t)video->width * video->height;
+    uint8_t* vp = up + (size_t)cw * (video->height / 2);
+    for (uint32_t y = 0; y < video->height; y += 2) {
+        for (uint32_t x = 0; x < video->width; x += 2) {
+            int sr = 0, sg = 0, sb = 0;
+            for (uint32_t dy = 0; dy < 2; dy++) {
+                for (uint32_t dx = 0; dx < 2; dx++) {
+                    const uint8_t* p = bgra + ((size_t)(y + dy) * video->width + x + dx) * 4;
+                    int b = p[0], g = p[1], r = p[2];
+                    yp[(size_t)(y + dy) * video->width + x + dx] = (uint8_t)((77 * r + 150 * g + 29 * b + 128) >> 8);
+                    sr += r;
+                    sg += g;
+                    sb += b;
+                }
+            }
+            size_t c = (size_t)(y / 2) * cw + x / 2;
+            up[c] = (uint8_t)(((-43 * sr - 85 * sg + 128 * sb + 512) >> 10) + 128);
+            vp[c] = (uint8_t)(((128 * sr - 107 * sg - 21 * sb + 512) >> 10) + 128);
+        }
+    }
+}
+
+static int play_convert(crdp_recording_t* rec, uint32_t fps, bool pointer, const char* path) {
+    crdp_recording_item_t item;
+    int rc;
+    // The first frame sets the size; black until then
+    while ((rc = crdp_recording_next(rec, &item)) == 1 && item.type != CRDP_RECORDING_FRAME) {}
+    if (rc != 1) {
+        fprintf(stderr, "crdp-play: %s\n", rc == 0 ? "the recording has no frames" : "can't read the recording");
+        return 1;
+    }
+    play_video_t video = { 0 };
+    video.width = (item.width + 1) & ~1u;
+    video.height = (item.height + 1) & ~1u;
+    video.pointer_x = video.pointer_y = -1;
+    size_t pixels = (size_t)video.width * video.height;
+    video.screen = calloc(pixels, 4);
+    uint8_t* frame = malloc(pixels * 4);
+    video.yuv = malloc(pixels * 3 / 2);
+    FILE* file = video.screen && frame && video.yuv ? play_output(path) : NULL;
+    if (!file) {
+        free(video.screen);
+        free(frame);
+        free(video.yuv);
+        return 1;
+    }
+    fprintf(file, "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C420jpeg\n", video.width, video.height, fps);
+
+    uint64_t next_ms = 0;
+    uint64_t frames = 0;
+    for (;;) {
+        // Every video frame shows the last item at or before its time
+        uint64_t until = rc == 1 ? item.time_ms : next_ms + 1;
+        while (next_ms < until) {
+            memcpy(frame, video.screen, pixels * 4);
+            if (pointer) play_video_pointer(&video, frame);
+            play_video_convert(&video, frame);
+            fputs("FRAME\n", file);
+            if (fwrite(video.yuv, 1, pixels * 3 / 2, file) != pixels * 3 / 2) break;
+            frames++;
+            next_ms = frames * 1000 / fps;
+        }
+        if (rc != 1 || ferror(file)) break;
+        if (item.type == CRDP_RECORDING_FRAME) {
+            play_video_copy(&video, &item);
+        } else if (item.type == CRDP_RECORDING_POINTER) {
+            video.pointer_x = item.pointer_x;
+            video.pointer_y = item.pointer_y;
+        }
+        rc = crdp_recording_next(rec, &item);
+    }
+    if (rc < 0) fprintf(stderr, "crdp-play: the recording is damaged; converted up to there\n");
+    free(video.screen);
+    free(frame);
+    free(video.yuv);
+    int status = play_close(file, path);
+    if (status == 0 && file != stdout) {
+        fprintf(stderr, "%llu frames, %ux%u at %u fps\n", (unsigned long long)frames, video.width, video.height, fps);
+    }
+    return status;
+}
+
+int main(int argc, char** argv) {
+    static const struct option options[] = {
+        { "fps", required_argument, NULL, 'r' },
+        { "no-pointer", no_argument, NULL, 'p' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    int fps = 10;
+    bool pointer = true;
+    // The command comes first; its options follow it
+    const char* command = argc > 1 ? argv[1] : "";
+    argc--;
+    argv++;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "r:ph", options, NULL)) != -1) {
+        switch (opt) {
+        case 'r':
+            fps = atoi(optarg);
+            break;
+        case 'p':
+            pointer = false;
+            break;
+        default:
+            usage();
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    int args = argc - optind;
+    bool known = (strcmp(command, "info") == 0 && args == 1) || (strcmp(command, "events") == 0 && args == 1) ||
+                 (strcmp(command, "frame") == 0 && args == 3) || (strcmp(command, "convert") == 0 && args == 2);
+    if (!known || fps < 1 || fps > 120) {
+        usage();
+        return 2;
+    }
+
+    crdp_recording_t* rec = crdp_recording_open(argv[optind]);
+    if (!rec) {
+        fprintf(stderr, "crdp-play: can't read %s\n", argv[optind]);
+        return 1;
+    }
+    int status;
+    if (strcmp(command, "info") == 0) {
+        status = play_info(rec);
+    } else if (strcmp(command, "events") == 0) {
+        status = play_events(rec);
+    } else if (strcmp(command, "frame") == 0) {
+        status = play_frame(rec, strtoull(argv[optind + 1], NULL, 10), argv[optind + 2]);
+    } else {
+        status = play_convert(rec, (uint32_t)fps, pointer, argv[optind + 1]);
+    }
+    crdp_recording_close(rec);
+    return status;
+}
@@ -0,0 +1,135 @@
+// crdp-replay: plays a protocol trace recorded with crdp_config_t.trace_path
+// through CRDP, with no server and no network, and reports how long decoding
+// took. Meant to be run under a profiler or a memory checker. With --record,
+// the session is also recorded (crdp_config_t.record_path), to see what
+// recording costs against a run without it.
+//
+//   crdp-replay --fast --repeat 5 session.crdptrace
+//   crdp-replay --fast --repeat 5 --record /tmp/session.crdprec session.crdptrace
+
+#include <CRDP.h>
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool done;
+    _Atomic uint64_t frames;
+} replay = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false, 0 };
+
+static void replay_frame(const uint8_t* data, uint32_t width, uint32_t height, uint32_t stride, void* user) {
+    (void)data;
+    (void)width;
+    (void)height;
+    (void)stride;
+    (void)user;
+    atomic_fetch_add(&replay.frames, 1);
+}
+
+static void replay_disconnected(void* user) {
+    (void)user;
+    pthread_mutex_lock(&replay.lock);
+    replay.done = true;
+    pthread_cond_signal(&replay.cond);
+    pthread_mutex_unlock(&replay.lock);
+}
+
+static double replay_seconds(const struct timeval* tv) { return (double)tv->tv_sec + tv->tv_usec / 1e6; }
+
+static double replay_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: crdp-replay [options] TRACE\n"
+            "  --fast        decode as fast as possible instead of at the recorded pace\n"
+            "  --repeat N    play the trace N times (default 1)\n"
+            "  --record PATH also record the session to PATH, replaced on every run\n");
+}
+
+int main(int argc, char** argv) {
+    static const struct option options[] = {
+        { "fast", no_argument, NULL, 'f' },
+        { "repeat", required_argument, NULL, 'n' },
+        { "record", required_argument, NULL, 'r' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    bool fast = false;
+    int repeat = 1;
+    const char* record = NULL;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "fn:r:h", options, NULL)) != -1) {
+        switch (opt) {
+        case 'f':
+            fast = true;
+            break;
+        case 'n':
+            repeat = atoi(optarg);
+            break;
+        case 'r':
+            record = optarg;
+            break;
+        default:
+            usage();
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (optind != argc - 1 || repeat < 1) {
+        usage();
+        return 2;
+    }
+
+    crdp_client_t* client = crdp_client_new(replay_frame, NULL, replay_disconnected, NULL, NULL, NULL);
+    if (!client) return 1;
+    crdp_config_t config = { 0 };
+    config.replay_path = argv[optind];
+    config.replay_fast = fast;
+    config.compression_stats = true;
+    config.record_path = record;
+
+    int status = 0;
+    for (int run = 1; run <= repeat && status == 0; run++) {
+        replay.done = false;
+        atomic_store(&replay.frames, 0);
+        // Recordings are appended to; every run starts a new one
+        if (record) unlink(record);
+        struct rusage before, after;
+        getrusage(RUSAGE_SELF, &before);
+        double start = replay_now();
+        if (crdp_client_connect(client, &config) != 0) {
+            fprintf(stderr, "crdp-replay: can't replay %s\n", argv[optind]);
+            status = 1;
+            break;
+        }
+        pthread_mutex_lock(&replay.lock);
+        while (!replay.done) pthread_cond_wait(&replay.cond, &replay.lock);
+        pthread_mutex_unlock(&replay.lock);
+        double wall = replay_now() - start;
+        getrusage(RUSAGE_SELF, &after);
+
+        crdp_transport_stats_t stats = { 0 };
+        crdp_get_transport_stats(client, &stats);
+        crdp_client_disconnect(client);
+        double cpu = replay_seconds(&after.ru_utime) - replay_seconds(&before.ru_utime) +
+                     replay_seconds(&after.ru_stime) - replay_seconds(&before.ru_stime);
+        uint64_t frames = atomic_load(&replay.frames);
+        printf("run %d: %llu PDUs, %.1f MB, %llu frames in %.3f s (%.1f frames/s), %.3f s CPU\n", run,
+               (unsigned long long)stats.pdus_received, stats.bytes_received / 1e6, (unsigned long long)frames,
+               wall, wall > 0 ? frames / wall : 0.0, cpu);
+        if (stats.pdus_received == 0) status = 1;
+    }
+    crdp_client_free(client);
+    return status;
+}
@@ -0,0 +1,181 @@
+// crdp-stats-bench: measures what a crdp_get_stats snapshot costs (metrics.c)
+// while --threads threads count PDUs and bytes and record decode times into
+// the registry as fast as they can. Every snapshot is checked against the
+// one before it: counters and histogram counts never go back, and the
+// percentiles are in order and never above max_us. Each writer adds a PDU
+// and then its bytes, so the largest gap seen between bytes_received and
+// pdus_received shows how far apart two fields of one snapshot can be.
+// Once the writers stop, a snapshot must match what they added exactly.
+//
+//   crdp-stats-bench --threads 4 --seconds 5 --max-us 100
+
+#include "crdp_internal.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_PDU_BYTES 100
+#define BENCH_MAX_THREADS 64
+#define BENCH_MAX_SNAPSHOTS 1000000
+
+static struct {
+    crdp_client_t* client;
+    _Atomic bool stop;
+    uint64_t events[BENCH_MAX_THREADS];   // Per writer, read after join
+    uint64_t decode_sum[BENCH_MAX_THREADS];
+} bench;
+
+static double bench_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void* bench_write_run(void* arg) {
+    int index = (int)(intptr_t)arg;
+    uint64_t x = 0x9E3779B97F4A7C15ULL * (uint64_t)(index + 1);
+    uint64_t events = 0, sum = 0;
+    while (!atomic_load_explicit(&bench.stop, memory_order_relaxed)) {
+        crdp_metrics_add(bench.client, CRDP_COUNTER_PDUS_RECEIVED, 1);
+        crdp_metrics_add(bench.client, CRDP_COUNTER_BYTES_RECEIVED, BENCH_PDU_BYTES);
+        // Decode times spread over a few decades, like real ones
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        uint64_t us = ((x * 0x2545F4914F6CDD1DULL) >> 40) % (1u << (4 + events % 12));
+        crdp_metrics_record(bench.client, CRDP_HIST_DECODE_US, us);
+        events++;
+        sum += us;
+    }
+    bench.events[index] = events;
+    bench.decode_sum[index] = sum;
+    return NULL;
+}
+
+static int bench_compare(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: crdp-stats-bench [options]\n"
+            "  --threads N         threads writing to the registry (default 4)\n"
+            "  --seconds N         how long to run (default 5)\n"
+            "  --interval-us N     pause between snapshots (default 0: back to back)\n"
+            "  --max-us N          fail if the p99 snapshot takes longer (default 100)\n");
+}
+
+int main(int argc, char** argv) {
+    static const struct option options[] = {
+        { "threads", required_argument, NULL, 't' },
+        { "seconds", required_argument, NULL, 's' },
+        { "interval-us", required_argument, NULL, 'i' },
+        { "max-us", required_argument, NULL, 'm' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    long threads = 4, seconds = 5, interval_us = 0, max_us = 100;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "t:s:i:m:h", options, NULL)) != -1) {
+        switch (opt) {
+        case 't':
+            threads = atol(optarg);
+            break;
+        case 's':
+            seconds = atol(optarg);
+            break;
+        case 'i':
+            interval_us = atol(optarg);
+            break;
+        case 'm':
+            max_us = atol(optarg);
+            break;
+        default:
+            usage();
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (optind != argc || threads < 0 || threads > BENCH_MAX_THREADS || seconds < 1 || interval_us < 0 ||
+        max_us < 1) {
+        usage();
+        return 2;
+    }
+
+    bench.client = crdp_client_new(NULL, NULL, NULL, NULL, NULL, NULL);
+    if (!bench.client) return 1;
+    crdp_metrics_reset(bench.client);
+    pthread_t writers[BENCH_MAX_THREADS];
+    for (long i = 0; i < threads; i++) {
+        if (pthread_create(&writers[i], NULL, bench_write_run, (void*)(intptr_t)i) != 0) return 1;
+    }
+    printf("%ld writers, snapshots %s for %ld s\n", threads, interval_us ? "paced" : "back to back", seconds);
+
+    static double took[BENCH_MAX_SNAPSHOTS];
+    uint32_t snapshots = 0;
+    int failures = 0;
+    int64_t max_gap = 0;
+    crdp_stats_t prev = { 0 }, stats;
+    double end = bench_now_us() + seconds * 1e6;
+    while (bench_now_us() < end && snapshots < BENCH_MAX_SNAPSHOTS) {
+        double start = bench_now_us();
+        crdp_get_stats(bench.client, &stats);
+        took[snapshots++] = bench_now_us() - start;
+
+        const crdp_latency_stats_t* d = &stats.decode;
+        if (stats.pdus_received < prev.pdus_received || stats.bytes_received < prev.bytes_received ||
+            d->count < prev.decode.count) {
+            if (failures++ < 10) fprintf(stderr, "FAIL a counter went back between snapshots\n");
+        }
+        if (d->count && (d->p50_us > d->p90_us || d->p90_us > d->p99_us || d->p99_us > d->max_us)) {
+            if (failures++ < 10) {
+                fprintf(stderr, "FAIL percentiles out of order: p50 %llu, p90 %llu, p99 %llu, max %llu\n",
+                        (unsigned long long)d->p50_us, (unsigned long long)d->p90_us,
+                        (unsigned long long)d->p99_us, (unsigned long long)d->max_us);
+            }
+        }
+        int64_t gap = (int64_t)stats.bytes_received / BENCH_PDU_BYTES - (int64_t)stats.pdus_received;
+        if (gap < 0) gap = -gap;
+        if (gap > max_gap) max_gap = gap;
+        prev = stats;
+        if (interval_us) {
+            struct timespec ts = { interval_us / 1000000, (interval_us % 1000000) * 1000 };
+            nanosleep(&ts, NULL);
+        }
+    }
+    atomic_store(&bench.stop, true);
+    for (long i = 0; i < threads; i++) pthread_join(writers[i], NULL);
+
+    // Nothing is moving now, so the snapshot is exact
+    uint64_t events = 0, sum = 0;
+    for (long i = 0; i < threads; i++) {
+        events += bench.events[i];
+        sum += bench.decode_sum[i];
+    }
+    crdp_get_stats(bench.client, &stats);
+    uint64_t mean = events ? sum / events : 0;
+    if (stats.pdus_received != events || stats.bytes_received != events * BENCH_PDU_BYTES ||
+        stats.decode.count != events || stats.decode.mean_us != mean) {
+        fprintf(stderr, "FAIL final snapshot: %llu PDUs, %llu bytes, %llu decodes, mean %llu us; %llu events, mean %llu us added\n",
+                (unsigned long long)stats.pdus_received, (unsigned long long)stats.bytes_received,
+                (unsigned long long)stats.decode.count, (unsigned long long)stats.decode.mean_us,
+                (unsigned long long)events, (unsigned long long)mean);
+        failures++;
+    }
+    crdp_client_free(bench.client);
+
+    qsort(took, snapshots, sizeof(took[0]), bench_compare);
+    double p50 = took[snapshots / 2], p99 = took[snapshots * 99 / 100], worst = took[snapshots - 1];
+    printf("  snapshot: p50 %.1f us, p99 %.1f us, max %.1f us over %u snapshots\n", p50, p99, worst, snapshots);
+    printf("  writers: %.1f M events/s while polled\n", events / (seconds * 1e6));
+    printf("  largest gap between bytes and PDUs in one snapshot: %lld events\n", (long long)max_gap);
+    if (p99 > max_us) {
+        fprintf(stderr, "FAIL p99 snapshot %.1f us is over %ld us\n", p99, max_us);
+        failures++;
+    }
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,502 @@
+// crdp-udp-check: checks CRDP's RDP-UDP reachability probe (multitransport.c)
+// with no server. Responders on loopback answer the SYN handshake the way a
+// server's UDP port does, and each client is handed Initiate Multitransport
+// Requests as if they had come over TCP. The checks run side by side: a
+// server that answers at once, one that ignores the first SYNs, one that
+// never answers, a closed port, and --runs clients on a link that loses
+// --loss percent of the SYNs and SYN+ACKs. Every SYN must be the one
+// MS-RDPEUDP asks for, the lossy transport's flagged SYNLOSSY, and each
+// probe's state, attempts and round trip must match what its responder did.
+//
+// --via sends the probes through a proxy such as crdp-netem instead, to a
+// responder on --port, one at a time, and reports how many got through.
+//
+//   crdp-udp-check --loss 30 --runs 20
+//   crdp-udp-check --port 13390 --via 127.0.0.1:13389 --runs 20
+
+#include "crdp_internal.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Initiate Multitransport Request (MS-RDPBCGR 2.2.15.1)
+#define CHECK_SEC_TRANSPORT_REQ 0x0002
+#define CHECK_MT_REQUEST_LEN 28
+#define CHECK_PROTOCOL_RELIABLE 0x01
+#define CHECK_PROTOCOL_LOSSY 0x02
+// RDP-UDP SYN and SYN+ACK (MS-RDPEUDP 2.2.2.1, 2.2.2.5)
+#define CHECK_UDP_FLAG_SYN 0x0001
+#define CHECK_UDP_FLAG_ACK 0x0004
+#define CHECK_UDP_FLAG_SYNLOSSY 0x0200
+#define CHECK_UDP_MTU 1232
+#define CHECK_SYN_ATTEMPTS 4
+#define CHECK_MAX_RESPONDERS 256
+// A probe gives up 7.5 s after its first SYN
+#define CHECK_PROBE_TIMEOUT_MS 10000
+// The first retransmission timeout; a closed port must be noticed sooner
+#define CHECK_SYN_TIMEOUT_MS 500
+// Loopback answers come back well within this
+#define CHECK_LOCAL_RTT_MS 250
+
+// What a responder saw of one transport's probe. The SYNLOSSY flag tells
+// the two apart, so each client gets a responder of its own.
+typedef struct {
+    uint32_t syns;
+    uint32_t answers;               // SYN+ACKs sent and not lost
+    uint32_t bad;                   // Datagrams that aren't the SYN asked for
+} check_seen_t;
+
+typedef struct {
+    int fd;
+    uint16_t port;
+    uint32_t drop_first;            // SYNs ignored before answering
+    bool silent;                    // Never answers
+    bool lossy_link;                // Loses SYNs and SYN+ACKs at --loss
+    check_seen_t seen[2];           // Reliable, lossy; guarded by check.lock
+} check_responder_t;
+
+// A client and the responder its probes go to
+typedef struct {
+    const char* name;
+    crdp_client_t* client;
+    check_responder_t* responder;
+    uint64_t start_ms;
+    uint64_t done_ms[2];            // When each probe finished, 0 while running
+    crdp_transport_stats_t stats;
+} check_case_t;
+
+static struct {
+    pthread_mutex_t lock;
+    check_responder_t responders[CHECK_MAX_RESPONDERS];
+    uint32_t count;                 // Fixed before the responder thread starts
+    double loss;                    // Probability, each way
+    uint64_t rng;
+    _Atomic bool stop;
+} check = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static int failures;
+
+static uint16_t check_get_be16(const uint8_t* p) { return (uint16_t)((p[0] << 8) | p[1]); }
+static uint32_t check_get_be32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint8_t* check_put(uint8_t* p, uint32_t value, int bytes, bool big_endian) {
+    for (int i = 0; i < bytes; i++) *p++ = (uint8_t)(value >> (8 * (big_endian ? bytes - 1 - i : i)));
+    return p;
+}
+
+// xorshift64*, under check.lock
+static double check_random(void) {
+    uint64_t x = check.rng;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    check.rng = x;
+    return (double)((x * 0x2545F4914F6CDD1DULL) >> 11) / (double)(1ULL << 53);
+}
+
+// A loopback UDP socket on port (0 for any); returns -1 on failure
+static int check_bind(uint16_t port, uint16_t* bound) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) return -1;
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        getsockname(fd, (struct sockaddr*)&addr, &len) != 0) {
+        close(fd);
+        return -1;
+    }
+    *bound = ntohs(addr.sin_port);
+    return fd;
+}
+
+static check_responder_t* check_responder(uint16_t port) {
+    if (check.count == CHECK_MAX_RESPONDERS) return NULL;
+    check_responder_t* r = &check.responders[check.count];
+    r->fd = check_bind(port, &r->port);
+    if (r->fd < 0) {
+        fprintf(stderr, "crdp-udp-check: can't bind 127.0.0.1:%u: %s\n", port, strerror(errno));
+        return NULL;
+    }
+    check.count++;
+    return r;
+}
+
+static void check_answer(check_responder_t* r) {
+    uint8_t syn[CHECK_UDP_MTU + 1];
+    struct sockaddr_storage from;
+    socklen_t from_len = sizeof(from);
+    ssize_t len = recvfrom(r->fd, syn, sizeof(syn), 0, (struct sockaddr*)&from, &from_len);
+    if (len < 0) return;
+    uint16_t flags = len >= 8 ? check_get_be16(syn + 6) : 0;
+    bool lossy = (flags & CHECK_UDP_FLAG_SYNLOSSY) != 0;
+
+    pthread_mutex_lock(&check.lock);
+    check_seen_t* seen = &r->seen[lossy];
+    // Padded to the MTU, nothing acknowledged yet, a receive window, and the
+    // same MTU both ways
+    if (len != CHECK_UDP_MTU || check_get_be32(syn) != 0xFFFFFFFF || check_get_be16(syn + 4) == 0 ||
+        (flags & ~CHECK_UDP_FLAG_SYNLOSSY) != CHECK_UDP_FLAG_SYN || check_get_be16(syn + 12) != CHECK_UDP_MTU ||
+        check_get_be16(syn + 14) != CHECK_UDP_MTU) {
+        seen->bad++;
+        pthread_mutex_unlock(&check.lock);
+        return;
+    }
+    seen->syns++;
+    bool answer = !r->silent && seen->syns > r->drop_first;
+    if (answer && r->lossy_link) {
+        // The SYN lost on the way in, or the SYN+ACK on the way out
+        bool lost_in = check_random() < check.loss;
+        bool lost_out = check_random() < check.loss;
+        answer = !lost_in && !lost_out;
+    }
+    if (answer) seen->answers++;
+    uint32_t server_isn = (uint32_t)(check_random() * UINT32_MAX);
+    pthread_mutex_unlock(&check.lock);
+    if (!answer) return;
+
+    uint8_t reply[16];
+    uint8_t* p = check_put(reply, check_get_be32(syn + 8), 4, true);  // snSourceAck: the client's ISN
+    p = check_put(p, 64, 2, true);
+    p = check_put(p, CHECK_UDP_FLAG_SYN | CHECK_UDP_FLAG_ACK | (lossy ? CHECK_UDP_FLAG_SYNLOSSY : 0), 2, true);
+    p = check_put(p, server_isn, 4, true);
+    p = check_put(p, CHECK_UDP_MTU, 2, true);
+    check_put(p, CHECK_UDP_MTU, 2, true);
+    sendto(r->fd, reply, sizeof(reply), 0, (struct sockaddr*)&from, from_len);
+}
+
+static void* check_respond_run(void* arg) {
+    (void)arg;
+    struct pollfd fds[CHECK_MAX_RESPONDERS];
+    for (uint32_t i = 0; i < check.count; i++) fds[i] = (struct pollfd){ .fd = check.responders[i].fd, .events = POLLIN };
+    while (!atomic_load(&check.stop)) {
+        if (poll(fds, check.count, 100) <= 0) continue;
+        for (uint32_t i = 0; i < check.count; i++) {
+            if (fds[i].revents & POLLIN) check_answer(&check.responders[i]);
+        }
+    }
+    return NULL;
+}
+
+static crdp_client_t* check_client(const char* host, uint16_t port) {
+    crdp_client_t* client = crdp_client_new(NULL, NULL, NULL, NULL, NULL, NULL);
+    if (!client) return NULL;
+    client->config.host = strdup(host);
+    client->config.port = port;
+    client->config.udp_transport = true;
+    crdp_multitransport_reset(client);
+    return client;
+}
+
+// Hands the client a request as the transport hook would
+static void check_offer(crdp_client_t* client, uint16_t sec_flags, uint16_t protocol, size_t len) {
+    static uint32_t request_id;
+    uint8_t req[CHECK_MT_REQUEST_LEN] = { 0 };
+    check_put(req, sec_flags, 2, false);
+    check_put(req + 4, ++request_id, 4, false);
+    check_put(req + 8, protocol, 2, false);
+    for (int i = 12; i < CHECK_MT_REQUEST_LEN; i++) req[i] = (uint8_t)(request_id * 31 + i);
+    crdp_multitransport_observe(client, req, len);
+}
+
+// Polls until every probe of the cases has finished; false on a timeout
+static bool check_wait(check_case_t* cases, int count) {
+    uint64_t deadline = crdp_time_ms() + CHECK_PROBE_TIMEOUT_MS;
+    for (;;) {
+        bool running = false;
+        uint64_t now = crdp_time_ms();
+        for (int i = 0; i < count; i++) {
+            crdp_get_transport_stats(cases[i].client, &cases[i].stats);
+            crdp_udp_state_t states[2] = { cases[i].stats.udp_reliable.state, cases[i].stats.udp_lossy.state };
+            for (int t = 0; t < 2; t++) {
+                if (states[t] == CRDP_UDP_PROBING) {
+                    running = true;
+                } else if (!cases[i].done_ms[t]) {
+                    cases[i].done_ms[t] = now;
+                }
+            }
+        }
+        if (!running) return true;
+        if (now >= deadline) return false;
+        usleep(10000);
+    }
+}
+
+static const char* check_state_name(crdp_udp_state_t state) {
+    switch (state) {
+    case CRDP_UDP_NOT_OFFERED: return "not offered";
+    case CRDP_UDP_PROBING: return "probing";
+    case CRDP_UDP_BLOCKED: return "blocked";
+    case CRDP_UDP_REACHABLE: return "reachable";
+    }
+    return "?";
+}
+
+// Compares one probe with what was expected of it and with its responder
+static void check_expect(check_case_t* c, int t, crdp_udp_state_t state, uint32_t syns) {
+    const char* transport = t ? "lossy" : "reliable";
+    const crdp_udp_transport_stats_t* got = t ? &c->stats.udp_lossy : &c->stats.udp_reliable;
+    check_seen_t seen = { 0 };
+    if (c->responder) {
+        pthread_mutex_lock(&check.lock);
+        seen = c->responder->seen[t];
+        pthread_mutex_unlock(&check.lock);
+    }
+    if (got->state != state || got->syns_sent != syns) {
+        fprintf(stderr, "FAIL %s, %s: %s after %u SYNs, expected %s after %u\n", c->name, transport,
+                check_state_name(got->state), got->syns_sent, check_state_name(state), syns);
+        failures++;
+    }
+    if (c->responder && (seen.syns != got->syns_sent || seen.bad)) {
+        fprintf(stderr, "FAIL %s, %s: the responder got %u SYNs and %u malformed datagrams for %u sent\n", c->name,
+                transport, seen.syns, seen.bad, got->syns_sent);
+        failures++;
+    }
+    if (state == CRDP_UDP_REACHABLE && got->rtt_ms > CHECK_LOCAL_RTT_MS) {
+        fprintf(stderr, "FAIL %s, %s: round trip %u ms on loopback\n", c->name, transport, got->rtt_ms);
+        failures++;
+    }
+}
+
+// Through a proxy the loss isn't known, so only the outcome is counted
+static int check_via(const char* via, uint16_t port, int runs) {
+    char host[256];
+    const char* colon = strrchr(via, ':');
+    if (!colon || colon == via || (size_t)(colon - via) >= sizeof(host) || atoi(colon + 1) <= 0) {
+        fprintf(stderr, "crdp-udp-check: --via takes HOST:PORT\n");
+        return 2;
+    }
+    memcpy(host, via, (size_t)(colon - via));
+    host[colon - via] = '\0';
+    char* h = host;
+    if (h[0] == '[' && h[strlen(h) - 1] == ']') {
+        h[strlen(h) - 1] = '\0';
+        h++;
+    }
+    check_responder_t* responder = check_responder(port);
+    pthread_t thread;
+    if (!responder || pthread_create(&thread, NULL, check_respond_run, NULL) != 0) return 1;
+    check_case_t c = { .name = via, .client = check_client(h, (uint16_t)atoi(colon + 1)) };
+    if (!c.client) return 1;
+    printf("probing 127.0.0.1:%u through %s, %d runs\n", responder->port, via, runs);
+
+    // One probe at a time: a proxy may carry UDP as a single flow
+    uint32_t answered[2] = { 0 }, syns[2] = { 0 }, max_rtt[2] = { 0 }, bad = 0;
+    for (int run = 0; run < runs; run++) {
+        for (int t = 0; t < 2; t++) {
+            crdp_multitransport_reset(c.client);
+            check_offer(c.client, CHECK_SEC_TRANSPORT_REQ, t ? CHECK_PROTOCOL_LOSSY : CHECK_PROTOCOL_RELIABLE,
+                        CHECK_MT_REQUEST_LEN);
+            if (!check_wait(&c, 1)) {
+                fprintf(stderr, "FAIL a probe still running after %d ms\n", CHECK_PROBE_TIMEOUT_MS);
+                failures++;
+                continue;
+            }
+            const crdp_udp_transport_stats_t* got = t ? &c.stats.udp_lossy : &c.stats.udp_reliable;
+            if (got->syns_sent < 1 || got->syns_sent > CHECK_SYN_ATTEMPTS) {
+                fprintf(stderr, "FAIL %u SYNs sent\n", got->syns_sent);
+                failures++;
+            }
+            syns[t] += got->syns_sent;
+            if (got->state == CRDP_UDP_REACHABLE) {
+                answered[t]++;
+                if (got->rtt_ms > max_rtt[t]) max_rtt[t] = got->rtt_ms;
+            }
+        }
+    }
+    atomic_store(&check.stop, true);
+    pthread_join(thread, NULL);
+    for (int t = 0; t < 2; t++) bad += responder->seen[t].bad;
+    for (int t = 0; t < 2; t++) {
+        printf("  %-8s %u/%d answered, %.1f SYNs per probe, round trip up to %u ms\n", t ? "lossy" : "reliable",
+               answered[t], runs, syns[t] / (double)runs, max_rtt[t]);
+    }
+    if (bad) {
+        fprintf(stderr, "FAIL the responder got %u malformed datagrams\n", bad);
+        failures++;
+    }
+    crdp_client_free(c.client);
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: crdp-udp-check [options]\n"
+            "  --loss PERCENT      SYNs and SYN+ACKs lost each way on the lossy link (default 30)\n"
+            "  --runs N            probes on the lossy link, or through --via (default 20)\n"
+            "  --seed N            random seed for the loss (default 1)\n"
+            "  --via HOST:PORT     probe through a proxy forwarding to --port instead\n"
+            "  --port N            responder port for --via (default 13390)\n");
+}
+
+int main(int argc, char** argv) {
+    static const struct option options[] = {
+        { "loss", required_argument, NULL, 'l' },
+        { "runs", required_argument, NULL, 'r' },
+        { "seed", required_argument, NULL, 's' },
+        { "via", required_argument, NULL, 'v' },
+        { "port", required_argument, NULL, 'p' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    double loss_percent = 30;
+    int runs = 20;
+    long port = 13390;
+    unsigned long long seed = 1;
+    const char* via = NULL;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "l:r:s:v:p:h", options, NULL)) != -1) {
+        switch (opt) {
+        case 'l':
+            loss_percent = atof(optarg);
+            break;
+        case 'r':
+            runs = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'v':
+            via = optarg;
+            break;
+        case 'p':
+            port = atol(optarg);
+            break;
+        default:
+            usage();
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    // Six responders besides the lossy link's
+    if (optind != argc || loss_percent < 0 || loss_percent >= 100 || runs < 1 ||
+        runs > CHECK_MAX_RESPONDERS - 6 || port < 1 || port > 65535) {
+        usage();
+        return 2;
+    }
+    check.loss = loss_percent / 100;
+    check.rng = seed * 0x9E3779B97F4A7C15ULL | 1;
+    if (via) return check_via(via, (uint16_t)port, runs);
+
+    enum { CASE_ANSWERS, CASE_RETRY_1, CASE_RETRY_3, CASE_SILENT, CASE_CLOSED, CASE_FIXED };
+    static check_case_t cases[CASE_FIXED + CHECK_MAX_RESPONDERS];
+    static const char* names[CASE_FIXED] = { "answers", "ignores 1 SYN", "ignores 3 SYNs", "never answers",
+                                             "closed port" };
+    int count = CASE_FIXED + runs;
+    for (int i = 0; i < count; i++) {
+        check_case_t* c = &cases[i];
+        c->name = i < CASE_FIXED ? names[i] : "lossy link";
+        uint16_t to = 0;
+        if (i == CASE_CLOSED) {
+            // A port that was free a moment ago, with nothing on it now
+            int fd = check_bind(0, &to);
+            if (fd < 0) return 1;
+            close(fd);
+        } else {
+            c->responder = check_responder(0);
+            if (!c->responder) return 1;
+            c->responder->drop_first = i == CASE_RETRY_1 ? 1 : i == CASE_RETRY_3 ? 3 : 0;
+            c->responder->silent = i == CASE_SILENT;
+            c->responder->lossy_link = i >= CASE_FIXED;
+            to = c->responder->port;
+        }
+        c->client = check_client("127.0.0.1", to);
+        if (!c->client) return 1;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, check_respond_run, NULL) != 0) return 1;
+    printf("probing %d responders on loopback, %.1f%% loss each way on the lossy link\n", count - 1, loss_percent);
+
+    // Requests that aren't a UDP offer mustn't start anything
+    crdp_client_t* first = cases[CASE_ANSWERS].client;
+    check_offer(first, CHECK_SEC_TRANSPORT_REQ, 0x04, CHECK_MT_REQUEST_LEN);
+    check_offer(first, CHECK_SEC_TRANSPORT_REQ, CHECK_PROTOCOL_RELIABLE, CHECK_MT_REQUEST_LEN - 1);
+    check_offer(first, 0x0008, CHECK_PROTOCOL_LOSSY, CHECK_MT_REQUEST_LEN);
+    crdp_get_transport_stats(first, &cases[CASE_ANSWERS].stats);
+    if (cases[CASE_ANSWERS].stats.udp_requests != 0 || cases[CASE_ANSWERS].stats.udp_reliable.state ||
+        cases[CASE_ANSWERS].stats.udp_lossy.state) {
+        fprintf(stderr, "FAIL a request that isn't a UDP offer was taken for one\n");
+        failures++;
+    }
+
+    uint64_t start = crdp_time_ms();
+    for (int i = 0; i < count; i++) {
+        cases[i].start_ms = start;
+        check_offer(cases[i].client, CHECK_SEC_TRANSPORT_REQ, CHECK_PROTOCOL_RELIABLE, CHECK_MT_REQUEST_LEN);
+        check_offer(cases[i].client, CHECK_SEC_TRANSPORT_REQ, CHECK_PROTOCOL_LOSSY, CHECK_MT_REQUEST_LEN);
+    }
+    // A repeated offer is counted but not probed again
+    check_offer(first, CHECK_SEC_TRANSPORT_REQ, CHECK_PROTOCOL_RELIABLE, CHECK_MT_REQUEST_LEN);
+    if (!check_wait(cases, count)) {
+        fprintf(stderr, "FAIL probes still running after %d ms\n", CHECK_PROBE_TIMEOUT_MS);
+        failures++;
+    }
+    atomic_store(&check.stop, true);
+    pthread_join(thread, NULL);
+
+    if (cases[CASE_ANSWERS].stats.udp_requests != 3) {
+        fprintf(stderr, "FAIL %u UDP offers counted, 3 expected\n", cases[CASE_ANSWERS].stats.udp_requests);
+        failures++;
+    }
+    uint32_t answered[2] = { 0 }, syns[2] = { 0 };
+    for (int i = 0; i < count; i++) {
+        check_case_t* c = &cases[i];
+        for (int t = 0; t < 2; t++) {
+            switch (i) {
+            case CASE_ANSWERS:
+                check_expect(c, t, CRDP_UDP_REACHABLE, 1);
+                break;
+            case CASE_RETRY_1:
+                check_expect(c, t, CRDP_UDP_REACHABLE, 2);
+                break;
+            case CASE_RETRY_3:
+                check_expect(c, t, CRDP_UDP_REACHABLE, 4);
+                break;
+            case CASE_SILENT:
+                check_expect(c, t, CRDP_UDP_BLOCKED, CHECK_SYN_ATTEMPTS);
+                break;
+            case CASE_CLOSED:
+                check_expect(c, t, CRDP_UDP_BLOCKED, 1);
+                if (c->done_ms[t] - c->start_ms >= CHECK_SYN_TIMEOUT_MS) {
+                    fprintf(stderr, "FAIL closed port, %s: took %llu ms to notice\n", t ? "lossy" : "reliable",
+                            (unsigned long long)(c->done_ms[t] - c->start_ms));
+                    failures++;
+                }
+                break;
+            default: {
+                // Answered exactly when the responder's answer got through
+                const crdp_udp_transport_stats_t* got = t ? &c->stats.udp_lossy : &c->stats.udp_reliable;
+                bool through = c->responder->seen[t].answers > 0;
+                check_expect(c, t, through ? CRDP_UDP_REACHABLE : CRDP_UDP_BLOCKED,
+                             through ? got->syns_sent : CHECK_SYN_ATTEMPTS);
+                answered[t] += through;
+                syns[t] += got->syns_sent;
+                break;
+            }
+            }
+        }
+    }
+    for (int i = 0; i < CASE_FIXED; i++) {
+        check_case_t* c = &cases[i];
+        printf("  %-15s reliable %s in %llu ms, %u SYNs sent; lossy %s in %llu ms, %u SYNs sent\n", c->name,
+               check_state_name(c->stats.udp_reliable.state), (unsigned long long)(c->done_ms[0] - c->start_ms),
+               c->stats.udp_reliable.syns_sent, check_state_name(c->stats.udp_lossy.state),
+               (unsigned long long)(c->done_ms[1] - c->start_ms), c->stats.udp_lossy.syns_sent);
+    }
+    printf("  %-15s reliable %u/%d answered, %.1f SYNs per probe; lossy %u/%d, %.1f\n", "lossy link", answered[0], runs,
+           syns[0] / (double)runs, answered[1], runs, syns[1] / (double)runs);
+
+    for (int i = 0; i < count; i++) crdp_client_free(cases[i].client);
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,342 @@
+// crdp-utf-check: checks CRDP's UTF-8 <-> UTF-16LE clipboard transcoding
+// (utf.c) against fixed cases and a reference encoder, then measures its
+// throughput on large ASCII and mixed payloads.
+//
+//   crdp-utf-check --size 32 --runs 5
+
+#include "crdp_internal.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static int failures;
+
+static void fail(const char* what, const char* name) {
+    fprintf(stderr, "FAIL %s: %s\n", what, name);
+    failures++;
+}
+
+static double check_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Reference encoders, one scalar value at a time
+
+static size_t ref_utf8(uint32_t cp, uint8_t* out) {
+    if (cp < 0x80) {
+        out[0] = (uint8_t)cp;
+        return 1;
+    } else if (cp < 0x800) {
+        out[0] = (uint8_t)(0xC0 | (cp >> 6));
+        out[1] = (uint8_t)(0x80 | (cp & 0x3F));
+        return 2;
+    } else if (cp < 0x10000) {
+        out[0] = (uint8_t)(0xE0 | (cp >> 12));
+        out[1] = (uint8_t)(0x80 | ((cp >> 6) & 0x3F));
+        out[2] = (uint8_t)(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    out[0] = (uint8_t)(0xF0 | (cp >> 18));
+    out[1] = (uint8_t)(0x80 | ((cp >> 12) & 0x3F));
+    out[2] = (uint8_t)(0x80 | ((cp >> 6) & 0x3F));
+    out[3] = (uint8_t)(0x80 | (cp & 0x3F));
+    return 4;
+}
+
+static size_t ref_utf16(uint32_t cp, uint8_t* out) {
+    if (cp < 0x10000) {
+        out[0] = (uint8_t)cp;
+        out[1] = (uint8_t)(cp >> 8);
+        return 1;
+    }
+    cp -= 0x10000;
+    uint32_t hi = 0xD800 | (cp >> 10), lo = 0xDC00 | (cp & 0x3FF);
+    out[0] = (uint8_t)hi;
+    out[1] = (uint8_t)(hi >> 8);
+    out[2] = (uint8_t)lo;
+    out[3] = (uint8_t)(lo >> 8);
+    return 2;
+}
+
+// UTF-8 that must convert to exactly these UTF-16 units
+typedef struct {
+    const char* name;
+    const char* utf8;
+    uint16_t utf16[4];
+    size_t units;
+} valid_case_t;
+
+static const valid_case_t valid_cases[] = {
+    { "empty", "", { 0 }, 0 },
+    { "U+007F", "\x7F", { 0x007F }, 1 },
+    { "U+0080", "\xC2\x80", { 0x0080 }, 1 },
+    { "U+07FF", "\xDF\xBF", { 0x07FF }, 1 },
+    { "U+0800", "\xE0\xA0\x80", { 0x0800 }, 1 },
+    { "U+D7FF", "\xED\x9F\xBF", { 0xD7FF }, 1 },
+    { "U+E000", "\xEE\x80\x80", { 0xE000 }, 1 },
+    { "U+FFFF", "\xEF\xBF\xBF", { 0xFFFF }, 1 },
+    { "U+10000", "\xF0\x90\x80\x80", { 0xD800, 0xDC00 }, 2 },
+    { "U+1F600", "\xF0\x9F\x98\x80", { 0xD83D, 0xDE00 }, 2 },
+    { "U+10FFFF", "\xF4\x8F\xBF\xBF", { 0xDBFF, 0xDFFF }, 2 },
+};
+
+// UTF-8 that must be rejected
+typedef struct {
+    const char* name;
+    const char* utf8;
+    size_t len;
+} invalid_case_t;
+
+#define INVALID(name, bytes) { name, bytes, sizeof(bytes) - 1 }
+
+static const invalid_case_t invalid_cases[] = {
+    INVALID("overlong NUL", "\xC0\x80"),
+    INVALID("overlong U+007F", "\xC1\xBF"),
+    INVALID("overlong 3-byte", "\xE0\x80\x80"),
+    INVALID("overlong U+07FF", "\xE0\x9F\xBF"),
+    INVALID("overlong 4-byte", "\xF0\x80\x80\x80"),
+    INVALID("overlong U+FFFF", "\xF0\x8F\xBF\xBF"),
+    INVALID("encoded U+D800", "\xED\xA0\x80"),
+    INVALID("encoded U+DBFF", "\xED\xAF\xBF"),
+    INVALID("encoded U+DC00", "\xED\xB0\x80"),
+    INVALID("encoded U+DFFF", "\xED\xBF\xBF"),
+    INVALID("encoded surrogate pair", "\xED\xA0\xBD\xED\xB8\x80"),
+    INVALID("U+110000", "\xF4\x90\x80\x80"),
+    INVALID("F5 lead byte", "\xF5\x80\x80\x80"),
+    INVALID("F8 lead byte", "\xF8\x88\x80\x80\x80"),
+    INVALID("FF byte", "\xFF"),
+    INVALID("lone continuation", "\x80"),
+    INVALID("truncated 2-byte", "\xC3"),
+    INVALID("truncated 3-byte", "\xE2\x82"),
+    INVALID("truncated 4-byte", "\xF0\x9F\x98"),
+    INVALID("truncated before ASCII", "\xE2\x82\x41"),
+    INVALID("truncated after ASCII block", "0123456789abcdef0123\xF0\x9F"),
+    INVALID("surrogate after ASCII block", "0123456789abcdef\xED\xA0\x80xyz"),
+    INVALID("continuation after ASCII block", "0123456789abcdef0123456789abcdef\xBF"),
+};
+
+// UTF-16LE units and the UTF-8 they must decode to
+typedef struct {
+    const char* name;
+    uint16_t utf16[24];
+    size_t units;
+    const char* utf8;
+} utf16_case_t;
+
+static const utf16_case_t utf16_cases[] = {
+    { "pair", { 0xD83D, 0xDE00 }, 2, "\xF0\x9F\x98\x80" },
+    { "high surrogate at end", { 0x0041, 0xD800 }, 2, "A\xEF\xBF\xBD" },
+    { "high surrogate before ASCII", { 0xD800, 0x0041 }, 2, "\xEF\xBF\xBD" "A" },
+    { "two high surrogates", { 0xD800, 0xD800, 0xDC00 }, 3, "\xEF\xBF\xBD\xF0\x90\x80\x80" },
+    { "lone low surrogate", { 0xDC00, 0x0042 }, 2, "\xEF\xBF\xBD" "B" },
+    { "reversed pair", { 0xDC00, 0xD800 }, 2, "\xEF\xBF\xBD\xEF\xBF\xBD" },
+    { "two low surrogates", { 0xDC00, 0xDFFF }, 2, "\xEF\xBF\xBD\xEF\xBF\xBD" },
+    { "surrogate after ASCII block",
+      { '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 0xDFFF, 'x' }, 12, "0123456789\xEF\xBF\xBDx" },
+    { "stops at null", { 'a', 'b', 0, 'c' }, 4, "ab" },
+};
+
+static void check_valid(void) {
+    for (size_t c = 0; c < sizeof(valid_cases) / sizeof(valid_cases[0]); c++) {
+        const valid_case_t* t = &valid_cases[c];
+        size_t bytes = 0;
+        uint8_t* utf16 = crdp_utf8_to_utf16le_alloc(t->utf8, strlen(t->utf8), &bytes);
+        bool ok = utf16 && bytes == (t->units + 1) * 2;
+        for (size_t i = 0; ok && i < t->units; i++) {
+            ok = (uint16_t)(utf16[i * 2] | (utf16[i * 2 + 1] << 8)) == t->utf16[i];
+        }
+        if (!ok) fail("UTF-8 to UTF-16", t->name);
+
+        size_t len = 0;
+        char* back = utf16 ? crdp_utf16le_to_utf8_alloc(utf16, bytes, &len) : NULL;
+        if (!back || len != strlen(t->utf8) || memcmp(back, t->utf8, len) != 0) fail("round trip", t->name);
+        free(back);
+        free(utf16);
+    }
+}
+
+static void check_invalid(void) {
+    for (size_t c = 0; c < sizeof(invalid_cases) / sizeof(invalid_cases[0]); c++) {
+        const invalid_case_t* t = &invalid_cases[c];
+        if (crdp_utf8_to_utf16le_length((const uint8_t*)t->utf8, t->len) != -1) fail("rejects", t->name);
+        uint8_t* utf16 = crdp_utf8_to_utf16le_alloc(t->utf8, t->len, NULL);
+        if (utf16) fail("alloc rejects", t->name);
+        free(utf16);
+    }
+}
+
+static void check_utf16(void) {
+    for (size_t c = 0; c < sizeof(utf16_cases) / sizeof(utf16_cases[0]); c++) {
+        const utf16_case_t* t = &utf16_cases[c];
+        uint8_t data[48];
+        for (size_t i = 0; i < t->units; i++) {
+            data[i * 2] = (uint8_t)t->utf16[i];
+            data[i * 2 + 1] = (uint8_t)(t->utf16[i] >> 8);
+        }
+        size_t len = 0;
+        char* utf8 = crdp_utf16le_to_utf8_alloc(data, t->units * 2, &len);
+        if (!utf8 || len != strlen(t->utf8) || memcmp(utf8, t->utf8, len) != 0) fail("UTF-16 to UTF-8", t->name);
+        free(utf8);
+    }
+}
+
+static uint64_t check_random(uint64_t* state) {
+    // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+// Any scalar value, weighted towards ASCII runs so the block paths are hit
+static uint32_t check_scalar(uint64_t* state) {
+    uint64_t r = check_random(state);
+    switch (r % 8) {
+    case 0: return 0x80 + (uint32_t)(r >> 8) % 0x780;
+    case 1: {
+        uint32_t cp = 0x800 + (uint32_t)(r >> 8) % (0x10000 - 0x800 - 0x800);
+        return cp >= 0xD800 ? cp + 0x800 : cp;
+    }
+    case 2: return 0x10000 + (uint32_t)(r >> 8) % 0x100000;
+    default: return 0x20 + (uint32_t)(r >> 8) % 0x5F;
+    }
+}
+
+static void check_reference(int strings) {
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    uint8_t utf8[4096], expected[4096], utf16[4096];
+    for (int s = 0; s < strings; s++) {
+        size_t scalars = (size_t)(check_random(&state) % 600);
+        size_t len = 0, units = 0;
+        for (size_t i = 0; i < scalars; i++) {
+            uint32_t cp = check_scalar(&state);
+            len += ref_utf8(cp, utf8 + len);
+            units += ref_utf16(cp, expected + units * 2);
+        }
+        if (crdp_utf8_to_utf16le_length(utf8, len) != (int64_t)units ||
+            crdp_utf8_to_utf16le(utf8, len, utf16) != units || memcmp(utf16, expected, units * 2) != 0) {
+            fail("reference UTF-16", "random string");
+            return;
+        }
+        uint8_t back[4096];
+        if (crdp_utf16le_to_utf8_length(utf16, units) != len || crdp_utf16le_to_utf8(utf16, units, back) != len ||
+            memcmp(back, utf8, len) != 0) {
+            fail("reference UTF-8", "random string");
+            return;
+        }
+    }
+}
+
+// Best of runs, in MB/s of input
+static void bench(const char* name, const uint8_t* utf8, size_t len, int runs) {
+    int64_t units = crdp_utf8_to_utf16le_length(utf8, len);
+    uint8_t* utf16 = units >= 0 ? malloc((size_t)units * 2) : NULL;
+    uint8_t* back = malloc(len);
+    if (!utf16 || !back) {
+        fail("benchmark", name);
+        free(utf16);
+        free(back);
+        return;
+    }
+    double to16 = 0, to8 = 0;
+    for (int r = 0; r < runs; r++) {
+        double start = check_now();
+        int64_t n = crdp_utf8_to_utf16le_length(utf8, len);
+        crdp_utf8_to_utf16le(utf8, len, utf16);
+        double mid = check_now();
+        size_t m = crdp_utf16le_to_utf8_length(utf16, (size_t)n);
+        crdp_utf16le_to_utf8(utf16, (size_t)n, back);
+        double end = check_now();
+        if (m != len || memcmp(back, utf8, len) != 0) {
+            fail("benchmark round trip", name);
+            break;
+        }
+        double mb = (double)len / 1e6;
+        if (mb / (mid - start) > to16) to16 = mb / (mid - start);
+        if ((double)n * 2 / 1e6 / (end - mid) > to8) to8 = (double)n * 2 / 1e6 / (end - mid);
+    }
+    printf("%-6s %6.1f MB  UTF-8 -> UTF-16 %8.1f MB/s  UTF-16 -> UTF-8 %8.1f MB/s\n", name, (double)len / 1e6,
+           to16, to8);
+    free(utf16);
+    free(back);
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: crdp-utf-check [options]\n"
+            "  --size MB     benchmark payload size (default 32)\n"
+            "  --runs N      benchmark runs, the best one counts (default 5)\n"
+            "  --strings N   random strings checked against the reference (default 20000)\n");
+}
+
+int main(int argc, char** argv) {
+    static const struct option options[] = {
+        { "size", required_argument, NULL, 's' },
+        { "runs", required_argument, NULL, 'r' },
+        { "strings", required_argument, NULL, 'n' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    long size_mb = 32;
+    int runs = 5;
+    int strings = 20000;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:r:n:h", options, NULL)) != -1) {
+        switch (opt) {
+        case 's':
+            size_mb = atol(optarg);
+            break;
+        case 'r':
+            runs = atoi(optarg);
+            break;
+        case 'n':
+            strings = atoi(optarg);
+            break;
+        default:
+            usage();
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (optind != argc || size_mb < 1 || runs < 1 || strings < 0) {
+        usage();
+        return 2;
+    }
+
+    check_valid();
+    check_invalid();
+    check_utf16();
+    check_reference(strings);
+    printf("%zu valid, %zu invalid, %zu UTF-16 cases and %d random strings: %s\n",
+           sizeof(valid_cases) / sizeof(valid_cases[0]), sizeof(invalid_cases) / sizeof(invalid_cases[0]),
+           sizeof(utf16_cases) / sizeof(utf16_cases[0]), strings, failures ? "FAILED" : "ok");
+
+    // Plain ASCII, then text that is mostly ASCII with some of every width
+    size_t len = (size_t)size_mb * 1000 * 1000;
+    uint8_t* payload = malloc(len + 4);
+    if (!payload) {
+        fprintf(stderr, "crdp-utf-check: out of memory\n");
+        return 1;
+    }
+    uint64_t state = 1;
+    for (size_t i = 0; i < len; i++) payload[i] = (uint8_t)(0x20 + check_random(&state) % 0x5F);
+    bench("ascii", payload, len, runs);
+
+    size_t mixed = 0;
+    while (mixed < len) {
+        uint64_t r = check_random(&state);
+        uint32_t cp = r % 10 ? 0x20 + (uint32_t)(r >> 8) % 0x5F : check_scalar(&state);
+        if (cp < 0x80 || mixed + 4 <= len) {
+            mixed += ref_utf8(cp, payload + mixed);
+        } else {
+            payload[mixed++] = ' ';
+        }
+    }
+    bench("mixed", payload, mixed, runs);
+    free(payload);
+    return failures ? 1 : 0;
+}